@@ -46,6 +46,7 @@ public class PageKiteAPI extends Object
     public static final int PK_WITH_SYSLOG = 0x0200;
     public static final int PK_WITH_IPV4_DNS = 0x0400;
     public static final int PK_WITH_IPV6_DNS = 0x0800;
+    public static final int PK_WITH_IDLE_STREAMS = 0x2000;
     public static final int PK_LOG_TUNNEL_DATA = 0x000100;
     public static final int PK_LOG_TUNNEL_HEADERS = 0x000200;
     public static final int PK_LOG_TUNNEL_CONNS = 0x000400;
@@ -57,6 +58,7 @@ public class PageKiteAPI extends Object
     public static final int PK_LOG_MANAGER_DEBUG = 0x040000;
     public static final int PK_LOG_TRACE = 0x080000;
     public static final int PK_LOG_ERROR = 0x100000;
+    public static final int PK_LOG_ACCESS = 0x200000;
     public static final int PK_LOG_ERRORS = (PK_LOG_ERROR|PK_LOG_MANAGER_ERROR);
     public static final int PK_LOG_MANAGER = (PK_LOG_MANAGER_ERROR|PK_LOG_MANAGER_INFO);
     public static final int PK_LOG_CONNS = (PK_LOG_BE_CONNS|PK_LOG_TUNNEL_CONNS);
@@ -111,7 +113,13 @@ public class PageKiteAPI extends Object
     public static native int enableHttpForwardingHeaders(int enable);
     public static native int enableFakePing(int enable);
     public static native int enableWatchdog(int enable);
+    public static native int setStallThresholdMs(int ms);
+    public static native int setDdnsParallelism(int parallelism, int batch);
+    public static native int setDrainTimeout(int seconds);
+    public static native int setConnectorId(String id);
+    public static native int setTunnelCapture(String filename);
     public static native int enableTickTimer(int enable);
+    public static native int enablePowerSaving(int enable);
     public static native int setConnEvictionIdleS(int seconds);
     public static native int setOpensslCiphers(String ciphers);
     public static native int wantSpareFrontends(int spares);
@@ -123,13 +131,18 @@ public class PageKiteAPI extends Object
     public static native int awaitEvent(int timeout);
     public static native int getEventInt(int event_code);
     public static native String getEventStr(int event_code);
+    public static native int drainEvents(java.nio.ByteBuffer buffer, int length, int timeout);
     public static native int eventRespond(int event_code, int response_code);
     public static native int eventRespondWithData(int event_code, int response_code, int response_int, String response_str);
     public static native int getStatus();
     public static native String getLog();
+    public static native int drainLog(java.nio.ByteBuffer buffer, int length);
+    public static native String getStats(int reset);
+    public static native int drainStats(java.nio.ByteBuffer buffer, int length, int reset);
     public static native int dumpStateToLog();
     public static native int poll(int timeout);
     public static native int tick();
+    public static native int setDoze(int dozing);
     public static native int setBailOnErrors(int errors);
     public static native int perror(String prefix);
 
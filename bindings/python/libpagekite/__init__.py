@@ -44,6 +44,7 @@ PK_AS_FRONTEND_RELAY = 0x0100
 PK_WITH_SYSLOG = 0x0200
 PK_WITH_IPV4_DNS = 0x0400
 PK_WITH_IPV6_DNS = 0x0800
+PK_WITH_IDLE_STREAMS = 0x2000
 PK_LOG_TUNNEL_DATA = 0x000100
 PK_LOG_TUNNEL_HEADERS = 0x000200
 PK_LOG_TUNNEL_CONNS = 0x000400
@@ -55,6 +56,7 @@ PK_LOG_MANAGER_INFO = 0x020000
 PK_LOG_MANAGER_DEBUG = 0x040000
 PK_LOG_TRACE = 0x080000
 PK_LOG_ERROR = 0x100000
+PK_LOG_ACCESS = 0x200000
 PK_LOG_ERRORS = (PK_LOG_ERROR|PK_LOG_MANAGER_ERROR)
 PK_LOG_MANAGER = (PK_LOG_MANAGER_ERROR|PK_LOG_MANAGER_INFO)
 PK_LOG_CONNS = (PK_LOG_BE_CONNS|PK_LOG_TUNNEL_CONNS)
@@ -114,7 +116,13 @@ def get_libpagekite_cdll():
             (c_int, "enable_http_forwarding_headers", (c_void_p, c_int,)),
             (c_int, "enable_fake_ping", (c_void_p, c_int,)),
             (c_int, "enable_watchdog", (c_void_p, c_int,)),
+            (c_int, "set_stall_threshold_ms", (c_void_p, c_int,)),
+            (c_int, "set_ddns_parallelism", (c_void_p, c_int, c_int,)),
+            (c_int, "set_drain_timeout", (c_void_p, c_int,)),
+            (c_int, "set_connector_id", (c_void_p, c_char_p,)),
+            (c_int, "set_tunnel_capture", (c_void_p, c_char_p,)),
             (c_int, "enable_tick_timer", (c_void_p, c_int,)),
+            (c_int, "enable_power_saving", (c_void_p, c_int,)),
             (c_int, "set_conn_eviction_idle_s", (c_void_p, c_int,)),
             (c_int, "set_openssl_ciphers", (c_void_p, c_char_p,)),
             (c_int, "want_spare_frontends", (c_void_p, c_int,)),
@@ -126,13 +134,18 @@ def get_libpagekite_cdll():
             (c_int, "await_event", (c_void_p, c_int,)),
             (c_int, "get_event_int", (c_void_p, c_int,)),
             (c_char_p, "get_event_str", (c_void_p, c_int,)),
+            (c_int, "drain_events", (c_void_p, c_void_p, c_int, c_int,)),
             (c_int, "event_respond", (c_void_p, c_int, c_int,)),
             (c_int, "event_respond_with_data", (c_void_p, c_int, c_int, c_int, c_char_p,)),
             (c_int, "get_status", (c_void_p,)),
             (c_char_p, "get_log", (c_void_p,)),
+            (c_int, "drain_log", (c_void_p, c_void_p, c_int,)),
+            (c_char_p, "get_stats", (c_void_p, c_int,)),
+            (c_int, "drain_stats", (c_void_p, c_void_p, c_int, c_int,)),
             (c_int, "dump_state_to_log", (c_void_p,)),
             (c_int, "poll", (c_void_p, c_int,)),
             (c_int, "tick", (c_void_p,)),
+            (c_int, "set_doze", (c_void_p, c_int,)),
             (c_int, "set_bail_on_errors", (c_void_p, c_int,)),
             (c_int, "perror", (c_void_p, c_char_p,))):
         method = getattr(dll, "pagekite_%s" % func_name)
@@ -381,6 +394,11 @@ class PageKite(object):
         
         See the `PK_LOG_*` constants for options.
         
+        PK_LOG_ACCESS enables an access log: one JSON record per
+        stream, logged when it closes, with the remote address,
+        byte counts, setup and first-byte latency, total and blocked
+        time and close reason.
+        
         This function can be called at any time.
     
         Args:
@@ -551,6 +569,125 @@ class PageKite(object):
         assert(self.pkm is not None)
         return self.dll.pagekite_enable_watchdog(self.pkm, c_int(enable))
 
+    def set_stall_threshold_ms(self, ms):
+        """
+        Configure the event-loop stall threshold.
+        
+        Any event-loop iteration or individual callback which
+        runs for longer than this is logged (naming the callback,
+        file descriptor and stream ID where known) and counted
+        in the statistics. If the watchdog is enabled, it will
+        also report loops which remain stuck.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `int ms`: Threshold in milliseconds, 0 disables
+    
+        Returns:
+            Always returns 0.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_set_stall_threshold_ms(self.pkm, c_int(ms))
+
+    def set_ddns_parallelism(self, parallelism, batch):
+        """
+        Configure dynamic DNS update concurrency.
+        
+        Dynamic DNS updates for different domains are sent in
+        parallel, using up to this many concurrent requests (the
+        default is 4). Domains already published with the current
+        set of front-ends are not updated again.
+        
+        If the DDNS endpoint accepts a comma separated list of
+        hostnames and replies with one result per line, up to
+        `batch` domains sharing a secret are updated in a single
+        request. The default of 1 disables batching, as not all
+        endpoints support it.
+        
+        Per-domain results and latencies are included in the statistics.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `int parallelism`: Max concurrent requests
+           * `int batch`: Max domains per request
+    
+        Returns:
+            Always returns 0.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_set_ddns_parallelism(self.pkm, c_int(parallelism), c_int(batch))
+
+    def set_drain_timeout(self, seconds):
+        """
+        Configure how long unwanted relays are drained.
+        
+        When a faster relay is chosen, the old tunnel is not cut.
+        It is dropped from dynamic DNS and kept open until the
+        streams it carries have finished and DNS no longer points
+        at it. After this many seconds (the default is 900) it
+        is closed regardless, cutting any streams which remain.
+        
+        Draining progress is included in the statistics.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `int seconds`: Deadline for draining tunnels
+    
+        Returns:
+            Always returns 0.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_set_drain_timeout(self.pkm, c_int(seconds))
+
+    def set_connector_id(self, id):
+        """
+        Identify this connector when choosing relays.
+        
+        Relays of similar speed are ranked using a hash of this
+        ID, so a fleet of connectors spreads out over the available
+        relays instead of all choosing the one which answered
+        its ping fastest. The ID should be stable (a device or
+        installation ID is ideal) so each connector keeps making
+        the same choice. By default a random ID is chosen when
+        the manager is created.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `const char* id`: A stable identifier for this connector
+    
+        Returns:
+            Always returns 0.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_set_connector_id(self.pkm, c_char_p(id.encode("utf-8")))
+
+    def set_tunnel_capture(self, filename):
+        """
+        Record incoming tunnel traffic to a file.
+        
+        Everything read from the tunnels is appended to the named
+        file, with timestamps, in a compact format which can be
+        replayed later for profiling (see `benchmarks replay`).
+        Pass NULL to stop.
+        
+        The capture contains all tunneled data, in the clear,
+        so it should be treated with care. Capturing is process-wide.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `const char* filename`: File to write, NULL to stop capturing
+    
+        Returns:
+            0 on success, -1 if the file could not be created.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_set_tunnel_capture(self.pkm, c_char_p(filename.encode("utf-8")))
+
     def enable_tick_timer(self, enable):
         """
         Enable or disable tick event timer.
@@ -575,6 +712,29 @@ class PageKite(object):
         assert(self.pkm is not None)
         return self.dll.pagekite_enable_tick_timer(self.pkm, c_int(enable))
 
+    def enable_power_saving(self, enable):
+        """
+        Enable or disable mobile power saving.
+        
+        In power saving mode, periodic housekeeping is batched
+        so pings, tunnel checks and world checks share a single
+        wakeup, and the time between keepalive pings is learned
+        from how long idle tunnels survive the NATs along the
+        way, instead of being fixed.
+        
+        Apps should also report doze state using `pagekite_set_doze`.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `int enable`: 0 disables, any other value enables
+    
+        Returns:
+            Always returns 0.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_enable_power_saving(self.pkm, c_int(enable))
+
     def set_conn_eviction_idle_s(self, seconds):
         """
         Configure eviction of idle connections.
@@ -762,6 +922,39 @@ class PageKite(object):
         assert(self.pkm is not None)
         return self.dll.pagekite_get_event_str(self.pkm, c_int(event_code))
 
+    def drain_events(self, buffer, length, timeout):
+        """
+        Wait for events and fetch them in bulk.
+        
+        This is a batched alternative to `pagekite_await_event`
+        and friends, for apps where each call is costly (e.g.
+        over JNI). It blocks until an event is posted, then copies
+        it and any other pending events into the buffer, for as
+        long as they fit.
+        
+        Each event is a record of three 32-bit integers in native
+        byte order: the event code, the event's integer data and
+        the length of its string data. The string follows, NUL
+        terminated and padded to a multiple of 4 bytes. Non-blocking
+        events are considered handled once fetched, blocking events
+        still need a response.
+        
+        The buffer should be reused from one call to the next.
+        From Java, it must be a direct `ByteBuffer`.
+        
+        See also: doc/Event_API.md
+    
+        Args:
+           * `void* buffer`: Where to write the events
+           * `int length`: Size of the buffer, in bytes
+           * `int timeout`: Max seconds to wait for an event
+    
+        Returns:
+            Bytes used in the buffer, 0 on timeout or -1 on error.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_drain_events(self.pkm, buffer, c_int(length), c_int(timeout))
+
     def event_respond(self, event_code, response_code):
         """
         Respond to a pagekite event.
@@ -827,6 +1020,84 @@ class PageKite(object):
         assert(self.pkm is not None)
         return self.dll.pagekite_get_log(self.pkm, )
 
+    def drain_log(self, buffer, length):
+        """
+        Fetch new lines from the in-memory log buffer.
+        
+        Copies whatever was logged since the previous call into
+        the buffer, as much as fits. If a lot was logged in between,
+        the oldest data may be lost. The result is NUL terminated.
+        
+        The buffer should be reused from one call to the next.
+        From Java, it must be a direct `ByteBuffer`.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `void* buffer`: Where to write the log data
+           * `int length`: Size of the buffer, in bytes
+    
+        Returns:
+            Bytes copied (excluding the NUL), or -1 on error.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_drain_log(self.pkm, buffer, c_int(length))
+
+    def get_stats(self, reset):
+        """
+        Fetch a snapshot of the run-time statistics.
+        
+        The statistics are returned as text, one `name: key=value
+        ...` line per metric. Latencies are tracked in log-linear
+        histograms and reported in microseconds as a count, average,
+        p50, p99, p99.9 and maximum. Tracked latencies are: back-end
+        connection setup, time from the first chunk of a stream
+        to the first byte of the back-end reply, time spent flushing
+        buffers, time streams spend blocked waiting for the tunnel
+        and time the event loop spends busy in callbacks. Event-loop
+        stalls are counted by cause on the `stalls:` line.
+        
+        If `reset` is nonzero the statistics are cleared atomically
+        after taking the snapshot, so periodic callers get non-overlapping
+        windows.
+        
+        Note that the C-API version returns a pointer to a static
+        buffer. Subsequent calls will overwrite with new data.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `int reset`: Nonzero to reset the statistics (rotate)
+    
+        Returns:
+            A snapshot of the current statistics.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_get_stats(self.pkm, c_int(reset))
+
+    def drain_stats(self, buffer, length, reset):
+        """
+        Fetch the run-time statistics into a buffer.
+        
+        As `pagekite_get_stats`, but the text is copied into the
+        caller's buffer (NUL terminated), which should be reused
+        from one call to the next. From Java, it must be a direct
+        `ByteBuffer`. With `reset` set, each call reports only
+        what happened since the previous one.
+        
+        This function can be called at any time.
+    
+        Args:
+           * `void* buffer`: Where to write the statistics
+           * `int length`: Size of the buffer, in bytes
+           * `int reset`: Nonzero to reset the statistics afterwards
+    
+        Returns:
+            Bytes copied (excluding the NUL), or -1 on error.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_drain_stats(self.pkm, buffer, c_int(length), c_int(reset))
+
     def dump_state_to_log(self, ):
         """
         Dump summary of internal state to log.
@@ -879,6 +1150,27 @@ class PageKite(object):
         assert(self.pkm is not None)
         return self.dll.pagekite_tick(self.pkm, )
 
+    def set_doze(self, dozing):
+        """
+        Report whether the device is dozing.
+        
+        While dozing, the tick timer is stopped and all housekeeping
+        is deferred, except when the app calls `pagekite_tick`
+        (e.g. during a maintenance window). When the device wakes
+        up, everything that was put off is done in a single tick.
+        
+        This method can be called any time the main thread is
+        running.
+    
+        Args:
+           * `int dozing`: 1 if the device is dozing, 0 if awake
+    
+        Returns:
+            0 on success, -1 if unconfigured.
+        """
+        assert(self.pkm is not None)
+        return self.dll.pagekite_set_doze(self.pkm, c_int(dozing))
+
     def set_bail_on_errors(self, errors):
         """
         Enable or disable bailing out on errors.
@@ -29,6 +29,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pkhooks.h"
 #include "pkconn.h"
 #include "pkstate.h"
+#include "pkstats.h"
 #include "pkproto.h"
 #include "pkblocker.h"
 #include "pkmanager.h"
@@ -77,6 +78,7 @@ void handle_request(void* data, struct pk_chunk *chunk) {
 int main(int argc, char **argv) {
   char pbuffer[64000];
   struct pk_conn pkc;
+  struct pk_conn_buffers pkc_buffers;
   struct pk_parser* pkp;
   struct pk_pagekite kite;
   struct pk_kite_request kite_r;
@@ -102,6 +104,7 @@ int main(int argc, char **argv) {
   kite_rp = &kite_r;
 
   srand(time(0) ^ getpid());
+  pkc_set_buffers(&pkc, &pkc_buffers);
   if (0 > pk_connect(&pkc, argv[1], 443, 1, &kite_r, NULL, ctx)) {
     pk_perror(argv[1]);
     usage();
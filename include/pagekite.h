@@ -64,6 +64,7 @@ WARNING: This file is processed automatically to generate the JNI and API
 #define PK_WITH_SYSLOG               0x0200
 #define PK_WITH_IPV4_DNS             0x0400
 #define PK_WITH_IPV6_DNS             0x0800
+#define PK_WITH_IDLE_STREAMS         0x2000
 
 /* Constants: PageKite logging constants */
 #define PK_LOG_TUNNEL_DATA     0x000100
@@ -77,6 +78,7 @@ WARNING: This file is processed automatically to generate the JNI and API
 #define PK_LOG_MANAGER_DEBUG   0x040000
 #define PK_LOG_TRACE           0x080000
 #define PK_LOG_ERROR           0x100000
+#define PK_LOG_ACCESS          0x200000
 
 #define PK_LOG_ERRORS          (PK_LOG_ERROR|PK_LOG_MANAGER_ERROR)
 #define PK_LOG_MANAGER         (PK_LOG_MANAGER_ERROR|PK_LOG_MANAGER_INFO)
@@ -174,6 +176,11 @@ typedef void* pagekite_mgr;
  *    and will continue to use recommended settings even as new features are
  *    added to the library.
  *
+ *    Apps which keep many mostly idle connections open (WebSockets, SSH)
+ *    should add `PK_WITH_IDLE_STREAMS`: I/O buffers are then allocated for
+ *    only a fraction of `max_conns`, and lent to streams while they have
+ *    data in flight.
+ *
  *    The `verbosity` argument controls the internal logging. A small
  *    integer (-1, 0, 1, 2) can be used to choose from a predefined level,
  *    for more fine-grained control use the `PK_LOG_` constants bitwise
@@ -338,6 +345,10 @@ DECLSPEC_DLL int pagekite_add_frontend(
  *
  *    See the `PK_LOG_*` constants for options.
  *
+ *    PK_LOG_ACCESS enables an access log: one JSON record per stream,
+ *    logged when it closes, with the remote address, byte counts, setup
+ *    and first-byte latency, total and blocked time and close reason.
+ *
  *    This function can be called at any time.
  *
  * Returns: Always returns 0.
@@ -481,6 +492,103 @@ DECLSPEC_DLL int pagekite_enable_watchdog(
 );
 
 
+/* Initialization: Configure the event-loop stall threshold.
+ *
+ *    Any event-loop iteration or individual callback which runs for
+ *    longer than this is logged (naming the callback, file descriptor
+ *    and stream ID where known) and counted in the statistics. If the
+ *    watchdog is enabled, it will also report loops which remain stuck.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: Always returns 0.
+ */
+DECLSPEC_DLL int pagekite_set_stall_threshold_ms(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  int ms                /* Threshold in milliseconds, 0 disables */
+);
+
+
+/* Initialization: Configure dynamic DNS update concurrency.
+ *
+ *    Dynamic DNS updates for different domains are sent in parallel,
+ *    using up to this many concurrent requests (the default is 4).
+ *    Domains already published with the current set of front-ends are
+ *    not updated again.
+ *
+ *    If the DDNS endpoint accepts a comma separated list of hostnames
+ *    and replies with one result per line, up to `batch` domains sharing
+ *    a secret are updated in a single request. The default of 1 disables
+ *    batching, as not all endpoints support it.
+ *
+ *    Per-domain results and latencies are included in the statistics.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: Always returns 0.
+ */
+DECLSPEC_DLL int pagekite_set_ddns_parallelism(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  int parallelism,      /* Max concurrent requests */
+  int batch             /* Max domains per request */
+);
+
+/* Initialization: Configure how long unwanted relays are drained.
+ *
+ *    When a faster relay is chosen, the old tunnel is not cut. It is
+ *    dropped from dynamic DNS and kept open until the streams it carries
+ *    have finished and DNS no longer points at it. After this many
+ *    seconds (the default is 900) it is closed regardless, cutting any
+ *    streams which remain.
+ *
+ *    Draining progress is included in the statistics.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: Always returns 0.
+ */
+DECLSPEC_DLL int pagekite_set_drain_timeout(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  int seconds           /* Deadline for draining tunnels */
+);
+
+/* Initialization: Identify this connector when choosing relays.
+ *
+ *    Relays of similar speed are ranked using a hash of this ID, so a
+ *    fleet of connectors spreads out over the available relays instead
+ *    of all choosing the one which answered its ping fastest. The ID
+ *    should be stable (a device or installation ID is ideal) so each
+ *    connector keeps making the same choice. By default a random ID is
+ *    chosen when the manager is created.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: Always returns 0.
+ */
+DECLSPEC_DLL int pagekite_set_connector_id(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  const char* id        /* A stable identifier for this connector */
+);
+
+/* Debugging: Record incoming tunnel traffic to a file.
+ *
+ *    Everything read from the tunnels is appended to the named file,
+ *    with timestamps, in a compact format which can be replayed later
+ *    for profiling (see `benchmarks replay`). Pass NULL to stop.
+ *
+ *    The capture contains all tunneled data, in the clear, so it should
+ *    be treated with care. Capturing is process-wide.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: 0 on success, -1 if the file could not be created.
+ */
+DECLSPEC_DLL int pagekite_set_tunnel_capture(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  const char* filename  /* File to write, NULL to stop capturing */
+);
+
+
 /* Initialization: Enable or disable tick event timer.
  *
  *    This method can be used to toggle the tick event timer on or off
@@ -501,6 +609,25 @@ DECLSPEC_DLL int pagekite_enable_tick_timer(
 );
 
 
+/* Initialization: Enable or disable mobile power saving.
+ *
+ *    In power saving mode, periodic housekeeping is batched so pings,
+ *    tunnel checks and world checks share a single wakeup, and the time
+ *    between keepalive pings is learned from how long idle tunnels
+ *    survive the NATs along the way, instead of being fixed.
+ *
+ *    Apps should also report doze state using `pagekite_set_doze`.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: Always returns 0.
+ */
+DECLSPEC_DLL int pagekite_enable_power_saving(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  int enable            /* 0 disables, any other value enables */
+);
+
+
 /* Initialization: Configure eviction of idle connections.
  *
  *    As libpagekite works with a fixed pool of RAM, it may be unable to
@@ -660,6 +787,34 @@ DECLSPEC_DLL const char* pagekite_get_event_str(
 );
 
 
+/* Lifecycle: Wait for events and fetch them in bulk.
+ *
+ *    This is a batched alternative to `pagekite_await_event` and friends,
+ *    for apps where each call is costly (e.g. over JNI). It blocks until
+ *    an event is posted, then copies it and any other pending events into
+ *    the buffer, for as long as they fit.
+ *
+ *    Each event is a record of three 32-bit integers in native byte
+ *    order: the event code, the event's integer data and the length of
+ *    its string data. The string follows, NUL terminated and padded to a
+ *    multiple of 4 bytes. Non-blocking events are considered handled once
+ *    fetched, blocking events still need a response.
+ *
+ *    The buffer should be reused from one call to the next. From Java,
+ *    it must be a direct `ByteBuffer`.
+ *
+ *    See also: doc/Event_API.md
+ *
+ * Returns: Bytes used in the buffer, 0 on timeout or -1 on error.
+ */
+DECLSPEC_DLL int pagekite_drain_events(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  void* buffer,         /* Where to write the events */
+  int length,           /* Size of the buffer, in bytes */
+  int timeout           /* Max seconds to wait for an event */
+);
+
+
 /* Lifecycle: Respond to a pagekite event.
  *
  *    Post a response to an API event. 
@@ -717,6 +872,73 @@ DECLSPEC_DLL char* pagekite_get_log(
 );
 
 
+/* Lifecycle: Fetch new lines from the in-memory log buffer.
+ *
+ *    Copies whatever was logged since the previous call into the buffer,
+ *    as much as fits. If a lot was logged in between, the oldest data
+ *    may be lost. The result is NUL terminated.
+ *
+ *    The buffer should be reused from one call to the next. From Java,
+ *    it must be a direct `ByteBuffer`.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: Bytes copied (excluding the NUL), or -1 on error.
+ */
+DECLSPEC_DLL int pagekite_drain_log(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  void* buffer,         /* Where to write the log data */
+  int length            /* Size of the buffer, in bytes */
+);
+
+
+/* Lifecycle: Fetch a snapshot of the run-time statistics.
+ *
+ *    The statistics are returned as text, one `name: key=value ...` line
+ *    per metric. Latencies are tracked in log-linear histograms and
+ *    reported in microseconds as a count, average, p50, p99, p99.9 and
+ *    maximum. Tracked latencies are: back-end connection setup, time from
+ *    the first chunk of a stream to the first byte of the back-end reply,
+ *    time spent flushing buffers, time streams spend blocked waiting
+ *    for the tunnel and time the event loop spends busy in callbacks.
+ *    Event-loop stalls are counted by cause on the `stalls:` line.
+ *
+ *    If `reset` is nonzero the statistics are cleared atomically after
+ *    taking the snapshot, so periodic callers get non-overlapping windows.
+ *    Each manager keeps statistics of its own.
+ *
+ *    Note that the C-API version returns a pointer to a static
+ *    buffer. Subsequent calls will overwrite with new data.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: A snapshot of the current statistics.
+ */
+DECLSPEC_DLL char* pagekite_get_stats(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  int reset             /* Nonzero to reset the statistics (rotate) */
+);
+
+
+/* Lifecycle: Fetch the run-time statistics into a buffer.
+ *
+ *    As `pagekite_get_stats`, but the text is copied into the caller's
+ *    buffer (NUL terminated), which should be reused from one call to the
+ *    next. From Java, it must be a direct `ByteBuffer`. With `reset` set,
+ *    each call reports only what happened since the previous one.
+ *
+ *    This function can be called at any time.
+ *
+ * Returns: Bytes copied (excluding the NUL), or -1 on error.
+ */
+DECLSPEC_DLL int pagekite_drain_stats(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  void* buffer,         /* Where to write the statistics */
+  int length,           /* Size of the buffer, in bytes */
+  int reset             /* Nonzero to reset the statistics afterwards */
+);
+
+
 /* Lifecycle: Dump summary of internal state to log.
  *
  *    This function can be called at any time.
@@ -760,6 +982,23 @@ DECLSPEC_DLL int pagekite_tick(
 );
 
 
+/* Lifecycle: Report whether the device is dozing.
+ *
+ *    While dozing, the tick timer is stopped and all housekeeping is
+ *    deferred, except when the app calls `pagekite_tick` (e.g. during a
+ *    maintenance window). When the device wakes up, everything that was
+ *    put off is done in a single tick.
+ *
+ *    This method can be called any time the main thread is running.
+ *
+ * Returns: 0 on success, -1 if unconfigured.
+ */
+DECLSPEC_DLL int pagekite_set_doze(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  int dozing            /* 1 if the device is dozing, 0 if awake */
+);
+
+
 /* Lifecycle: Enable or disable bailing out on errors.
  *
  *    If enabled, the app will increase log verbosity and finally call
@@ -806,6 +1045,27 @@ DECLSPEC_DLL int pagekite_add_relay_listener(
   int flags             /* Flags, which features to enable */
 );
 
+/* Relays: Configure overload signalling
+ *
+ *    The relay tracks its own load: event loop utilisation, tunnels and
+ *    streams relative to the configured maximums, how full the buffers
+ *    of live connections are and (if a limit is given) the rate of new
+ *    connections. The load level is the worst of these, as a percentage.
+ *
+ *    At or above warn_level (the default is 75), pings and tunnel
+ *    handshakes are answered with an X-PageKite-Overloaded header, so
+ *    connectors prefer other relays. At or above refuse_level, new
+ *    tunnels are refused outright. Zero disables either.
+ *
+ * Returns: 0 on success, -1 on failure.
+ */
+DECLSPEC_DLL int pagekite_set_relay_overload(
+  pagekite_mgr,         /* A reference to the PageKite manager object */
+  int warn_level,       /* Load percentage to advertise overload at */
+  int refuse_level,     /* Load percentage to refuse tunnels at */
+  int accepts_per_second /* Connection rate considered 100% load */
+);
+
 #endif
 
 #ifdef __cplusplus
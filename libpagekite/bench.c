@@ -0,0 +1,597 @@
+/******************************************************************************
+bench.c - Micro-benchmarks for the pagekite protocol code.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************
+
+Usage: benchmarks [-t <ms>] [<corpus-file> ...]
+       benchmarks loopback [...]
+       benchmarks churn [...]
+       benchmarks failover [...]
+       benchmarks footprint [...]
+       benchmarks replay [...] <capture-file>
+       benchmarks sim [...] [<scenario>|all]
+       benchmarks wan [-p <port>] <spec> <target-ip>:<port>
+
+Each benchmark runs for at least the given time (default 250ms) and prints
+a single line of `key=value` pairs, so results can be diffed or graphed
+across changes. Corpus files are raw tunnel byte streams (as sent by a
+front-end), which are benchmarked through the parser alongside the
+built-in synthetic corpora.
+
+The named sub-commands run end-to-end harnesses against a stub relay
+instead, see bench_relay.c and friends. Captures of real traffic (see
+pagekite_set_tunnel_capture) can be replayed with bench_replay.c, and
+bench_sim.c simulates WAN links on virtual time, for reproducible
+flow-control experiments. For real-time measurements over a (fake) WAN,
+bench_wan.c provides a delaying, rate-limiting proxy.
+
+******************************************************************************/
+
+#include "pagekite.h"
+
+#include "pkcommon.h"
+#include <sys/resource.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "pkutils.h"
+#include "pkerror.h"
+#include "pkhooks.h"
+#include "pkconn.h"
+#include "pkstate.h"
+#include "pkstats.h"
+#include "pkproto.h"
+#include "pkblocker.h"
+#include "pkmanager.h"
+#include "pklogging.h"
+#include "bench.h"
+
+/* These are not in pkproto.h, but are exactly what we want to measure. */
+int parse_chunk_header(struct pk_frame*, struct pk_chunk*, size_t);
+
+#define BENCH_TINY_FRAMES      1024
+#define BENCH_DATA_FRAMES        32
+#define BENCH_DATA_BYTES  (16 * 1024)
+#define BENCH_DEFAULT_MS        250
+
+static uint64_t bench_min_ns = BENCH_DEFAULT_MS * 1000000;
+
+
+/*** Allocation counting *****************************************************/
+
+/* On glibc we can interpose the allocator and count calls; elsewhere
+ * allocations are reported as -1 (unknown). */
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+static volatile uint64_t bench_allocs = 0;
+void* malloc(size_t size) {
+  bench_allocs++;
+  return __libc_malloc(size);
+}
+void* calloc(size_t count, size_t size) {
+  bench_allocs++;
+  return __libc_calloc(count, size);
+}
+void* realloc(void* ptr, size_t size) {
+  bench_allocs++;
+  return __libc_realloc(ptr, size);
+}
+#define BENCH_ALLOCS bench_allocs
+#else
+#define BENCH_ALLOCS 0
+#endif
+
+
+/*** Timing and reporting ****************************************************/
+
+struct bench_result {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t ns;
+  uint64_t cycles;
+  uint64_t allocs;
+};
+
+uint64_t bench_ns(void)
+{
+  struct timespec tp;
+  pk_gettime(&tp);
+  return ((uint64_t) tp.tv_sec * 1000000000) + tp.tv_nsec;
+}
+
+/* Resident set size in KB, or 0 if unknown. */
+long bench_rss_kb(void)
+{
+  long pages = 0, rss = 0;
+  FILE* fd = fopen("/proc/self/statm", "r");
+  if (fd != NULL) {
+    if (2 != fscanf(fd, "%ld %ld", &pages, &rss)) rss = 0;
+    fclose(fd);
+  }
+  return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Anonymous (heap, stack and other private) part of the RSS in KB, or 0
+ * if unknown. Unlike the total this leaves out shared library text, which
+ * is shared and can be paged back in from flash. */
+long bench_rss_anon_kb(void)
+{
+  char line[128];
+  long rss = 0;
+  FILE* fd = fopen("/proc/self/status", "r");
+  if (fd != NULL) {
+    while ((NULL != fgets(line, sizeof(line), fd)) &&
+           (1 != sscanf(line, "RssAnon: %ld", &rss))) {
+      rss = 0;
+    }
+    fclose(fd);
+  }
+  return rss;
+}
+
+/* Parse the SIDs our stub relays hand out: a one letter kind followed by
+ * a hex index. Returns the index, or -1 if the SID looks like neither. */
+int bench_sid_index(const char* sid, char* kind)
+{
+  unsigned int i;
+  char k;
+  if ((NULL == sid) || (2 != sscanf(sid, "%c%x", &k, &i)) ||
+      (i > 0x7fffffff)) return -1;
+  if (kind != NULL) *kind = k;
+  return (int) i;
+}
+
+/* CPU time used by a thread, or the whole process if NULL. */
+double bench_cpu_s(pthread_t* thread)
+{
+  struct timespec tp;
+  clockid_t cid = CLOCK_PROCESS_CPUTIME_ID;
+  if ((thread != NULL) && (0 != pthread_getcpuclockid(*thread, &cid)))
+    return 0.0;
+  if (0 != clock_gettime(cid, &tp)) return 0.0;
+  return tp.tv_sec + (tp.tv_nsec / 1000000000.0);
+}
+
+/* Run a harness in a fresh process: libpagekite keeps some state in
+ * globals (and blocker-thread statics), and this also keeps the RSS
+ * figures of one run from polluting the next. */
+int bench_fork(bench_run_fn* run, void* data)
+{
+  int status;
+  pid_t pid;
+
+  fflush(stdout);
+  if (0 == (pid = fork())) exit(run(data));
+  if ((pid < 0) || (pid != waitpid(pid, &status, 0))) return 1;
+  return (!WIFEXITED(status) || (0 != WEXITSTATUS(status)));
+}
+
+/* Start a connector flying the benchmark kite to the echo back-end, via
+ * any of the given relays. The connector tells relays apart by IP alone,
+ * so each needs its own loopback address. Returns NULL on failure. */
+struct pk_manager* bench_connector_start(int use_tls, int max_conns,
+                                         int be_port, int relays,
+                                         struct bench_relay* relay,
+                                         const char* ddns_url)
+{
+  pagekite_mgr pkm;
+  int i;
+
+  /* Note: max_kites is one larger than needed, pkm_add_kite refuses to
+   *       fill the last slot. */
+  pkm = pagekite_init("bench", 2, relays, max_conns, ddns_url,
+                      PK_WITH_IPV4 | (use_tls ? PK_WITH_SSL : 0) |
+                      PK_WITHOUT_SERVICE_FRONTENDS,
+                      PK_LOG_ERRORS);
+  if ((NULL == pkm) ||
+      (0 > pagekite_add_kite(pkm, BENCH_KITE_PROTO, BENCH_KITE_DOMAIN,
+                             BENCH_KITE_PORT, "benchsecret",
+                             BENCH_LOOPBACK_IP, be_port))) {
+    if (pkm) pagekite_free(pkm);
+    return NULL;
+  }
+  /* Benchmarks must not depend on the outside world. */
+  pk_state.dns_check_name = BENCH_KITE_DOMAIN;
+  for (i = 0; i < relays; i++) {
+    if (1 > pagekite_add_frontend(pkm, relay[i].ip, relay[i].port)) {
+      pagekite_free(pkm);
+      return NULL;
+    }
+  }
+  if (0 > pagekite_thread_start(pkm)) {
+    pagekite_free(pkm);
+    return NULL;
+  }
+  return (struct pk_manager*) pkm;
+}
+
+/* Wait until the connector is flying and the relay has a tunnel.
+ * Returns 0 on success, -1 if the deadline passed first. */
+int bench_connector_wait(struct pk_manager* pkm, struct bench_relay* br,
+                         uint64_t deadline)
+{
+  while (!br->tunnel_up ||
+         (pagekite_get_status((pagekite_mgr) pkm) != PK_STATUS_FLYING)) {
+    if (bench_ns() > deadline) return -1;
+    usleep(1000);
+  }
+  return 0;
+}
+
+void bench_connector_stop(struct pk_manager* pkm)
+{
+  if (pkm) {
+    pagekite_thread_stop((pagekite_mgr) pkm);
+    pagekite_free((pagekite_mgr) pkm);
+  }
+}
+
+/* Stream-count benchmarks need two descriptors per stream. */
+static void bench_raise_fd_limit(void)
+{
+  struct rlimit rl;
+  if (0 == getrlimit(RLIMIT_NOFILE, &rl)) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+static uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+/* Run the body repeatedly until bench_min_ns has passed; the body must
+ * add the frames and bytes it processed to br. */
+#define BENCH_LOOP(br, body) { \
+          uint64_t _ns0, _cy0, _al0; \
+          memset(&(br), 0, sizeof(br)); \
+          _al0 = BENCH_ALLOCS; \
+          _cy0 = bench_cycles(); \
+          _ns0 = bench_ns(); \
+          do { body; } while ((br.ns = bench_ns() - _ns0) < bench_min_ns); \
+          br.cycles = bench_cycles() - _cy0; \
+          br.allocs = BENCH_ALLOCS - _al0; }
+
+static void bench_report(const char* name, struct bench_result* br)
+{
+  double frames = br->frames ? br->frames : 1;
+  printf("bench=%s frames=%llu bytes=%llu ns_per_frame=%.1f bytes_per_s=%.0f"
+         " allocs_per_frame=%.2f cycles_per_byte=%.2f\n",
+         name,
+         (unsigned long long) br->frames,
+         (unsigned long long) br->bytes,
+         br->ns / frames,
+         br->ns ? (1e9 * br->bytes / br->ns) : 0.0,
+         (BENCH_ALLOCS || !br->allocs) ? (br->allocs / frames) : -1.0,
+         br->bytes ? ((double) br->cycles / br->bytes) : 0.0);
+  fflush(stdout);
+}
+
+
+/*** Corpora *****************************************************************/
+
+struct bench_corpus {
+  char*  data;
+  size_t bytes;
+  size_t space;
+};
+
+static void bench_corpus_need(struct bench_corpus* bc, size_t bytes)
+{
+  if (bc->bytes + bytes > bc->space) {
+    bc->space = 2 * (bc->bytes + bytes);
+    bc->data = realloc(bc->data, bc->space);
+    assert(bc->data != NULL);
+  }
+}
+
+/* Keepalives, flow control and EOFs: tiny frames which are all header. */
+static void bench_make_tiny(struct bench_corpus* bc)
+{
+  struct pk_chunk chunk;
+  char sid[16];
+  int i;
+
+  for (i = 0; i < BENCH_TINY_FRAMES; i++) {
+    bench_corpus_need(bc, 256);
+    sprintf(sid, "%x", i % 97);
+    switch (i % 3) {
+      case 0:
+        bc->bytes += pk_format_pong(bc->data + bc->bytes);
+        break;
+      case 1:
+        bc->bytes += pk_format_eof(bc->data + bc->bytes, sid, PK_EOF);
+        break;
+      default:
+        pk_chunk_reset_values(&chunk);
+        chunk.sid = sid;
+        chunk.noop = "1";
+        chunk.remote_sent_kb = i;
+        bc->bytes += pk_format_chunk(bc->data + bc->bytes, 256, &chunk);
+    }
+  }
+}
+
+/* Bulk data: the first frame of each stream carries the request headers. */
+static void bench_make_data(struct bench_corpus* bc)
+{
+  struct pk_chunk chunk;
+  char* payload = malloc(BENCH_DATA_BYTES);
+  char sid[16];
+  int i;
+
+  memset(payload, 'x', BENCH_DATA_BYTES);
+  for (i = 0; i < BENCH_DATA_FRAMES; i++) {
+    bench_corpus_need(bc, BENCH_DATA_BYTES + 1024);
+    sprintf(sid, "%x", i % 4);
+    if (i < 4) {
+      pk_chunk_reset_values(&chunk);
+      chunk.sid = sid;
+      chunk.request_proto = "http";
+      chunk.request_host = "bench.example.com";
+      chunk.request_port = 80;
+      chunk.remote_ip = "::ffff:10.1.2.3";
+      chunk.remote_port = 54321;
+      chunk.data = payload;
+      chunk.length = BENCH_DATA_BYTES;
+      bc->bytes += pk_format_chunk(bc->data + bc->bytes,
+                                   BENCH_DATA_BYTES + 1024, &chunk);
+    }
+    else {
+      bc->bytes += pk_format_reply(bc->data + bc->bytes, sid,
+                                   BENCH_DATA_BYTES, payload);
+    }
+  }
+  free(payload);
+}
+
+static int bench_load_file(struct bench_corpus* bc, const char* path)
+{
+  FILE* fd;
+  size_t bytes;
+
+  if (NULL == (fd = fopen(path, "rb"))) return -1;
+  do {
+    bench_corpus_need(bc, 64 * 1024);
+    bytes = fread(bc->data + bc->bytes, 1, 64 * 1024, fd);
+    bc->bytes += bytes;
+  } while (bytes > 0);
+  fclose(fd);
+  return bc->bytes;
+}
+
+
+/*** Benchmarks **************************************************************/
+
+/* Fragmented frames are delivered in pieces; count each frame once. */
+static void bench_count_chunk(void* data, struct pk_chunk* chunk)
+{
+  if (chunk->offset >= chunk->total) (*((uint64_t*) data))++;
+}
+
+/* Feed a corpus to the parser, in fragments of `frag` bytes if nonzero.
+ * Fragment sizes cycle through small primes, to defeat any alignment
+ * luck when frag is 1. */
+static void bench_parser(const char* name, struct bench_corpus* bc, int frag)
+{
+  static const int primes[] = {1, 2, 3, 5, 7, 11, 13, 0};
+  struct bench_result br;
+  struct pk_parser* parser;
+  char* pbuf = malloc(PARSER_BYTES_MAX);
+  uint64_t frames = 0;
+  size_t offset, bytes;
+  int p, rv;
+
+  parser = pk_parser_init(PARSER_BYTES_MAX, pbuf, bench_count_chunk, &frames);
+  BENCH_LOOP(br, {
+    frames = 0;
+    for (p = offset = 0; offset < bc->bytes; offset += bytes) {
+      bytes = bc->bytes - offset;
+      if (frag) {
+        if (0 == primes[p]) p = 0;
+        if (bytes > (size_t) (frag * primes[p])) bytes = frag * primes[p];
+        p++;
+      }
+      if (0 > (rv = pk_parser_parse(parser, bytes, bc->data + offset))) {
+        fprintf(stderr, "%s: parse error %d at offset %zu\n",
+                        name, rv, offset);
+        exit(1);
+      }
+    }
+    br.frames += frames;
+    br.bytes += bc->bytes;
+  });
+  bench_report(name, &br);
+  free(pbuf);
+}
+
+static void bench_chunk_header(void)
+{
+  static const char header[] = "SID: 1a\r\nProto: http\r\nHost: bench.example"
+                               ".com\r\nPort: 80\r\nRIP: ::ffff:10.1.2.3\r\n"
+                               "RPort: 54321\r\nSKB: 1234\r\n\r\n";
+  struct bench_result br;
+  struct pk_chunk chunk;
+  char scratch[sizeof(header)];
+
+  pk_chunk_reset(&chunk);
+  chunk.frame.data = scratch;
+  chunk.frame.length = sizeof(header) - 1;
+  BENCH_LOOP(br, {
+    /* Parsing is destructive, so each round starts from a fresh copy. */
+    memcpy(scratch, header, sizeof(header));
+    if (0 > parse_chunk_header(&(chunk.frame), &chunk, sizeof(header) - 1))
+      exit(1);
+    br.frames += 1;
+    br.bytes += sizeof(header) - 1;
+  });
+  bench_report("parse_chunk_header", &br);
+}
+
+static void bench_zero_first_crlf(void)
+{
+  char line[] = "Host: bench.example.com\r\nPort: 80\r\n";
+  int len = strlen(line);
+  int pos;
+  struct bench_result br;
+
+  BENCH_LOOP(br, {
+    pos = zero_first_crlf(len, line);
+    line[pos-2] = '\r';
+    line[pos-1] = '\n';
+    br.frames += 1;
+    br.bytes += pos;
+  });
+  bench_report("zero_first_crlf", &br);
+}
+
+static void bench_format_reply(const char* name, size_t bytes)
+{
+  struct bench_result br;
+  char* payload = malloc(bytes);
+  char* output = malloc(bytes + 64);
+
+  memset(payload, 'x', bytes);
+  BENCH_LOOP(br, {
+    br.bytes += pk_format_reply(output, "1a", bytes, payload);
+    br.frames += 1;
+  });
+  bench_report(name, &br);
+  free(output);
+  free(payload);
+}
+
+static void bench_format_chunk(const char* name, size_t bytes)
+{
+  struct bench_result br;
+  struct pk_chunk chunk;
+  char* payload = malloc(bytes);
+  char* output = malloc(bytes + 1024);
+  ssize_t rv;
+
+  memset(payload, 'x', bytes);
+  pk_chunk_reset_values(&chunk);
+  chunk.sid = "1a";
+  chunk.request_proto = "http";
+  chunk.request_host = "bench.example.com";
+  chunk.request_port = 80;
+  chunk.remote_sent_kb = 1234;
+  chunk.data = payload;
+  chunk.length = bytes;
+  BENCH_LOOP(br, {
+    if (0 > (rv = pk_format_chunk(output, bytes + 1024, &chunk))) exit(1);
+    br.bytes += rv;
+    br.frames += 1;
+  });
+  bench_report(name, &br);
+  free(output);
+  free(payload);
+}
+
+static void bench_sign(void)
+{
+  struct bench_result br;
+  char signature[128];
+
+  BENCH_LOOP(br, {
+    pk_sign("12345678", "secret", 0, "http:bench.example.com:80:nonce", 36,
+            signature);
+    br.bytes += 36;
+    br.frames += 1;
+  });
+  bench_report("pk_sign", &br);
+}
+
+
+int main(int argc, char** argv) {
+  struct bench_corpus tiny, data, file;
+  char name[1024];
+  int i;
+
+  pks_global_init(PK_LOG_ERRORS);
+  bench_raise_fd_limit();
+
+  if ((argc > 1) && (0 == strcmp(argv[1], "loopback")))
+    return bench_loopback_main(argc - 1, argv + 1);
+  if ((argc > 1) && (0 == strcmp(argv[1], "churn")))
+    return bench_churn_main(argc - 1, argv + 1);
+  if ((argc > 1) && (0 == strcmp(argv[1], "failover")))
+    return bench_failover_main(argc - 1, argv + 1);
+  if ((argc > 1) && (0 == strcmp(argv[1], "footprint")))
+    return bench_footprint_main(argc - 1, argv + 1);
+  if ((argc > 1) && (0 == strcmp(argv[1], "replay")))
+    return bench_replay_main(argc - 1, argv + 1);
+  if ((argc > 1) && (0 == strcmp(argv[1], "sim")))
+    return bench_sim_main(argc - 1, argv + 1);
+  if ((argc > 1) && (0 == strcmp(argv[1], "wan")))
+    return bench_wan_main(argc - 1, argv + 1);
+
+  for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+    if ((0 == strcmp(argv[i], "-t")) && (i + 1 < argc)) {
+      bench_min_ns = (uint64_t) atoi(argv[++i]) * 1000000;
+    }
+    else {
+      fprintf(stderr, "Usage: %s [-t <ms>] [<corpus-file> ...]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  memset(&tiny, 0, sizeof(tiny));
+  memset(&data, 0, sizeof(data));
+  bench_make_tiny(&tiny);
+  bench_make_data(&data);
+
+  bench_parser("parse/tiny", &tiny, 0);
+  bench_parser("parse/data16k", &data, 0);
+  bench_parser("parse/tiny_frag1", &tiny, 1);
+  bench_parser("parse/data16k_frag7", &data, 7);
+  bench_parser("parse/data16k_frag1", &data, 1);
+  bench_chunk_header();
+  bench_zero_first_crlf();
+  bench_format_reply("format_reply/tiny", 16);
+  bench_format_reply("format_reply/data16k", BENCH_DATA_BYTES);
+  bench_format_chunk("format_chunk/tiny", 16);
+  bench_format_chunk("format_chunk/data16k", BENCH_DATA_BYTES);
+  bench_sign();
+
+  for (; i < argc; i++) {
+    memset(&file, 0, sizeof(file));
+    if (0 >= bench_load_file(&file, argv[i])) {
+      fprintf(stderr, "%s: Failed to read corpus\n", argv[i]);
+      return 1;
+    }
+    snprintf(name, sizeof(name), "parse/file:%s", argv[i]);
+    bench_parser(name, &file, 0);
+    snprintf(name, sizeof(name), "parse/file_frag1:%s", argv[i]);
+    bench_parser(name, &file, 1);
+    free(file.data);
+  }
+
+  free(tiny.data);
+  free(data.data);
+  return 0;
+}
@@ -0,0 +1,141 @@
+/******************************************************************************
+bench.h - Shared pieces of the pagekite benchmark harnesses.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************/
+
+#define BENCH_KITE_PROTO      "raw"
+#define BENCH_KITE_DOMAIN     "localhost"
+#define BENCH_KITE_PORT       8080
+#define BENCH_RELAY_OUT_MAX   (256 * 1024)
+#define BENCH_LOOPBACK_IP     "127.0.0.1"
+
+/* A stub front-end relay: it answers pings, accepts a single tunnel at a
+ * time and completes the handshake for any kite requested. Once the
+ * tunnel is up, the relay thread calls drive_cb on every iteration so
+ * the benchmark can queue frames with bench_relay_send(), and chunk_cb
+ * for every chunk received from the connector. */
+struct bench_relay;
+typedef void (bench_relay_cb)(struct bench_relay*, struct pk_chunk*);
+typedef void (bench_drive_cb)(struct bench_relay*);
+
+struct bench_relay {
+  char             ip[16];
+  int              listen_fd;
+  int              port;
+  SSL_CTX*         ssl_ctx;          /* NULL for plain TCP               */
+  pthread_t        thread;
+  volatile int     running;
+  volatile int     tunnel_up;
+  volatile int     blackhole;        /* Stop accepting, reading, writing */
+  volatile int     detach;           /* Exit, leaving the tunnel open     */
+  uint64_t         accept_ns;        /* When the tunnel was accepted     */
+  uint64_t         tls_ns;           /* ... TLS completed (or accept_ns) */
+  uint64_t         tunnel_up_ns;     /* ... the handshake completed      */
+  int              tunnel_fd;
+  SSL*             ssl;
+  struct pk_parser* parser;
+  char*            parser_buf;
+  char*            out_buf;
+  size_t           out_bytes;
+  bench_relay_cb*  chunk_cb;
+  bench_drive_cb*  drive_cb;
+  void*            data;
+};
+
+/* An echo server, standing in for the origin web server. */
+struct bench_backend {
+  int              listen_fd;
+  int              port;
+  pthread_t        thread;
+  int              running;
+  size_t           buffer_size;   /* Echo buffer per connection */
+  struct ev_loop*  loop;
+  ev_io            listener;
+  ev_async         quit;
+};
+
+/* A WAN-emulating TCP proxy, see bench_wan.c. The RTT is split evenly
+ * between the two directions, the rest applies to each. */
+struct bench_wan_params {
+  int              rtt_ms;
+  int              jitter_ms;
+  int              kbit;             /* 0 is unlimited                   */
+  int              loss_ppm;
+  int              queue_kb;
+  int              burst_kb;
+};
+
+struct bench_wan_conn;
+struct bench_wan {
+  char                    ip[16];
+  int                     listen_fd;
+  int                     port;
+  char                    target_ip[16];
+  int                     target_port;
+  struct bench_wan_params params;
+  uint64_t                rng;
+  pthread_t               thread;
+  int                     running;
+  struct ev_loop*         loop;
+  ev_io                   listener;
+  ev_timer                timer;
+  ev_async                quit;
+  struct bench_wan_conn*  conns;
+  uint64_t                bytes;
+  uint64_t                lost;
+};
+
+typedef int (bench_run_fn)(void*);
+
+uint64_t bench_ns(void);
+long     bench_rss_kb(void);
+long     bench_rss_anon_kb(void);
+double   bench_cpu_s(pthread_t*);
+int      bench_fork(bench_run_fn*, void*);
+int      bench_sid_index(const char*, char*);
+
+struct pk_manager* bench_connector_start(int, int, int,
+                                         int, struct bench_relay*,
+                                         const char*);
+int                bench_connector_wait(struct pk_manager*,
+                                        struct bench_relay*, uint64_t);
+void               bench_connector_stop(struct pk_manager*);
+
+int      bench_relay_start(struct bench_relay*, const char*, int,
+                           bench_relay_cb*, bench_drive_cb*, void*);
+void     bench_relay_stop(struct bench_relay*);
+int      bench_relay_detach(struct bench_relay*);
+int      bench_relay_send(struct bench_relay*, const char*, size_t);
+size_t   bench_relay_out_free(struct bench_relay*);
+
+int      bench_listen(const char*, int*);
+int      bench_backend_start(struct bench_backend*, size_t);
+void     bench_backend_stop(struct bench_backend*);
+
+int      bench_wan_parse(struct bench_wan_params*, const char*);
+int      bench_wan_start(struct bench_wan*, const char*, const char*, int,
+                         struct bench_wan_params*);
+void     bench_wan_stop(struct bench_wan*);
+
+int      bench_loopback_main(int, char**);
+int      bench_churn_main(int, char**);
+int      bench_footprint_main(int, char**);
+int      bench_failover_main(int, char**);
+int      bench_replay_main(int, char**);
+int      bench_sim_main(int, char**);
+int      bench_wan_main(int, char**);
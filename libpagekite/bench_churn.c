@@ -0,0 +1,394 @@
+/******************************************************************************
+bench_churn.c - Connection-churn benchmark for stream slot management.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************
+
+Usage: benchmarks churn [-r <sids/s>] [-d <seconds>] [-n <slots,...>]
+                        [-o <occupancy%,...>] [plain|tls]
+
+For each combination of slot count (`be_conn_max`) and occupancy, the
+stub relay first opens enough long-lived idle streams to fill that
+fraction of the connector's stream slots, then opens short-lived streams
+at a fixed rate of new SIDs per second for the given duration. Each
+short-lived stream sends a small request, waits for the echo and closes.
+
+At 100% occupancy every new stream has to evict an idle one, which is
+exactly the path (`pkm_alloc_be_conn`, `pkm_find_be_conn` going O(n))
+this benchmark exists to measure.
+
+Reported are: per-stream setup latency (first chunk sent to first byte
+echoed back) percentiles, streams completed, failed and evicted, CPU time
+per churned stream (process and connector thread), and memory: RSS per
+slot allocated and per idle stream held open.
+
+The defaults sweep 100, 1000 and 10000 slots; 100000 slots works too, but
+needs about 3.3GB of address space and a generous file descriptor limit.
+
+******************************************************************************/
+
+#define PAGEKITE_CONSTANTS_ONLY
+#include "pagekite.h"
+
+#include "pkcommon.h"
+#include <sys/resource.h>
+
+#include "pkutils.h"
+#include "pkerror.h"
+#include "pkhooks.h"
+#include "pkconn.h"
+#include "pkstate.h"
+#include "pkstats.h"
+#include "pkproto.h"
+#include "pkblocker.h"
+#include "pkmanager.h"
+#include "pklogging.h"
+#include "bench.h"
+
+#define BENCH_CH_RATE           1000
+#define BENCH_CH_SECONDS        2
+#define BENCH_CH_SLOTS          "100,1000,10000"
+#define BENCH_CH_OCCUPANCY      "10,50,90,100"
+#define BENCH_CH_PAYLOAD        64
+#define BENCH_CH_SETTLE_S       2
+#define BENCH_CH_TIMEOUT_S      300
+#define BENCH_CH_MAX_CONFIGS    64
+#define BENCH_CH_SPARE_FDS      64
+
+#define BENCH_CH_NEW            0
+#define BENCH_CH_OPEN           1
+#define BENCH_CH_ECHOED         2
+#define BENCH_CH_CLOSED         3
+#define BENCH_CH_FAILED         4
+
+struct bench_churn {
+  int                  slots;
+  int                  idle_count;
+  int                  churn_count;
+  int                  rate;
+  int                  use_tls;
+
+  /* Owned by the relay thread, read by the main thread. */
+  volatile int         churning;
+  volatile int         idle_opened;
+  volatile int         idle_ready;
+  volatile int         idle_failed;
+  volatile int         evicted;
+  volatile int         churn_opened;
+  volatile int         churn_done;
+  volatile int         churn_failed;
+  volatile int         eofs_pending;
+  uint64_t             churn_t0;
+  unsigned char*       idle_state;
+  unsigned char*       churn_state;
+  uint64_t*            churn_started_ns;
+  struct pk_histogram  setup;
+  char                 frame[BENCH_CH_PAYLOAD + 1024];
+  char                 payload[BENCH_CH_PAYLOAD];
+};
+
+static int bench_ch_open(struct bench_relay* br, struct bench_churn* bc,
+                         char kind, int i)
+{
+  struct pk_chunk chunk;
+  char sid[16];
+  ssize_t rv;
+
+  sprintf(sid, "%c%x", kind, i);
+  pk_chunk_reset_values(&chunk);
+  chunk.sid = sid;
+  chunk.request_proto = BENCH_KITE_PROTO;
+  chunk.request_host = BENCH_KITE_DOMAIN;
+  chunk.request_port = BENCH_KITE_PORT;
+  chunk.remote_ip = "127.0.0.1";
+  chunk.remote_port = 1024 + (i % 60000);
+  chunk.data = bc->payload;
+  chunk.length = BENCH_CH_PAYLOAD;
+  rv = pk_format_chunk(bc->frame, sizeof(bc->frame), &chunk);
+  return ((rv > 0) && (0 < bench_relay_send(br, bc->frame, rv)));
+}
+
+static int bench_ch_close(struct bench_relay* br, struct bench_churn* bc,
+                          int i)
+{
+  char sid[16];
+  sprintf(sid, "c%x", i);
+  return (0 < bench_relay_send(br, bc->frame,
+                               pk_format_eof(bc->frame, sid, PK_EOF)));
+}
+
+static void bench_ch_chunk(struct bench_relay* br, struct pk_chunk* chunk)
+{
+  struct bench_churn* bc = (struct bench_churn*) br->data;
+  char kind;
+  int i;
+
+  if (0 > (i = bench_sid_index(chunk->sid, &kind))) return;
+
+  if ((kind == 'i') && (i >= 0) && (i < bc->idle_count)) {
+    if (chunk->eof) {
+      if (bc->idle_state[i] == BENCH_CH_OPEN) bc->idle_failed++;
+      if (bc->idle_state[i] == BENCH_CH_ECHOED) bc->evicted++;
+      bc->idle_state[i] = BENCH_CH_FAILED;
+    }
+    else if ((chunk->length > 0) && (bc->idle_state[i] == BENCH_CH_OPEN)) {
+      bc->idle_state[i] = BENCH_CH_ECHOED;
+      bc->idle_ready++;
+    }
+  }
+  else if ((kind == 'c') && (i >= 0) && (i < bc->churn_count)) {
+    if (bc->churn_state[i] != BENCH_CH_OPEN) return;
+    if (chunk->eof) {
+      bc->churn_state[i] = BENCH_CH_FAILED;
+      bc->churn_failed++;
+    }
+    else if (chunk->length > 0) {
+      pk_histogram_record(&(bc->setup),
+                          (bench_ns() - bc->churn_started_ns[i]) / 1000);
+      if (bench_ch_close(br, bc, i)) {
+        bc->churn_state[i] = BENCH_CH_CLOSED;
+      }
+      else {
+        bc->churn_state[i] = BENCH_CH_ECHOED;
+        bc->eofs_pending++;
+      }
+      bc->churn_done++;
+    }
+  }
+}
+
+static void bench_ch_drive(struct bench_relay* br)
+{
+  struct bench_churn* bc = (struct bench_churn*) br->data;
+  uint64_t due;
+  int i;
+
+  if (!bc->churning) {
+    while ((bc->idle_opened < bc->idle_count) &&
+           bench_ch_open(br, bc, 'i', bc->idle_opened)) {
+      bc->idle_state[bc->idle_opened++] = BENCH_CH_OPEN;
+    }
+    return;
+  }
+
+  for (i = 0; (bc->eofs_pending > 0) && (i < bc->churn_opened); i++) {
+    if ((bc->churn_state[i] == BENCH_CH_ECHOED) && bench_ch_close(br, bc, i)) {
+      bc->churn_state[i] = BENCH_CH_CLOSED;
+      bc->eofs_pending--;
+    }
+  }
+
+  due = ((bench_ns() - bc->churn_t0) * bc->rate) / 1000000000;
+  if (due > (uint64_t) bc->churn_count) due = bc->churn_count;
+  while ((bc->churn_opened < (int) due) &&
+         bench_ch_open(br, bc, 'c', bc->churn_opened)) {
+    bc->churn_started_ns[bc->churn_opened] = bench_ns();
+    bc->churn_state[bc->churn_opened++] = BENCH_CH_OPEN;
+  }
+}
+
+static int bench_ch_run(void* data)
+{
+  struct bench_churn* bc = (struct bench_churn*) data;
+  struct bench_relay relay;
+  struct bench_backend backend;
+  struct pk_manager* pkm = NULL;
+  uint64_t t0, deadline;
+  double cpu0, pkm_cpu0, cpu, pkm_cpu;
+  long rss0, rss_slots, rss_idle;
+  struct rlimit rl;
+  int rv = 1;
+
+  /* Every stream costs two file descriptors: the connector's socket and
+   * the echo server's. */
+  if ((0 == getrlimit(RLIMIT_NOFILE, &rl)) &&
+      (rl.rlim_cur < (rlim_t) (2 * bc->slots + BENCH_CH_SPARE_FDS))) {
+    fprintf(stderr, "churn: slots=%d needs %d file descriptors, limit is %ld;"
+                    " skipped\n",
+                    bc->slots, 2 * bc->slots + BENCH_CH_SPARE_FDS,
+                    (long) rl.rlim_cur);
+    return 0;
+  }
+
+  bc->idle_state = calloc(bc->idle_count + 1, 1);
+  bc->churn_state = calloc(bc->churn_count + 1, 1);
+  bc->churn_started_ns = calloc(bc->churn_count + 1, sizeof(uint64_t));
+  if ((NULL == bc->idle_state) || (NULL == bc->churn_state) ||
+      (NULL == bc->churn_started_ns)) {
+    fprintf(stderr, "churn: Out of memory\n");
+    return 1;
+  }
+  memset(bc->payload, 'x', BENCH_CH_PAYLOAD);
+
+  if ((0 > bench_backend_start(&backend, 0)) ||
+      (0 > bench_relay_start(&relay, NULL, bc->use_tls, NULL, NULL, bc))) {
+    fprintf(stderr, "churn: Failed to start relay or back-end\n");
+    return 1;
+  }
+
+  deadline = bench_ns() + (uint64_t) BENCH_CH_TIMEOUT_S * 1000000000;
+  rss0 = bench_rss_kb();
+  if (NULL == (pkm = bench_connector_start(bc->use_tls, bc->slots,
+                                           backend.port, 1, &relay,
+                                           NULL))) {
+    fprintf(stderr, "churn: Failed to start the connector\n");
+    goto cleanup;
+  }
+  /* Evictions are logged as errors, and we expect plenty. */
+  pk_state.log_mask = 0;
+  if (0 > bench_connector_wait(pkm, &relay, deadline)) {
+    fprintf(stderr, "churn: Tunnel never came up\n");
+    goto cleanup;
+  }
+  rss_slots = bench_rss_kb();
+
+  /* Fill the slots to the requested occupancy. */
+  relay.chunk_cb = bench_ch_chunk;
+  relay.drive_cb = bench_ch_drive;
+  while ((bc->idle_ready + bc->idle_failed < bc->idle_count) &&
+         (bench_ns() < deadline)) {
+    usleep(1000);
+  }
+  if (bc->idle_ready + bc->idle_failed < bc->idle_count) {
+    fprintf(stderr, "churn: Only %d/%d idle streams opened\n",
+                    bc->idle_ready, bc->idle_count);
+    goto cleanup;
+  }
+  rss_idle = bench_rss_kb();
+
+  /* Only now allow eviction of streams idle for more than a second, so
+   * a slow prefill does not evict its own streams. */
+  pk_state.conn_eviction_idle_s = 1;
+  sleep(BENCH_CH_SETTLE_S);
+
+  /* Churn! */
+  cpu0 = bench_cpu_s(NULL);
+  pkm_cpu0 = bench_cpu_s(&(pkm->main_thread));
+  bc->churn_t0 = t0 = bench_ns();
+  bc->churning = 1;
+  while ((bc->churn_done + bc->churn_failed < bc->churn_count) &&
+         (bench_ns() < deadline)) {
+    usleep(1000);
+  }
+  cpu = bench_cpu_s(NULL) - cpu0;
+  pkm_cpu = bench_cpu_s(&(pkm->main_thread)) - pkm_cpu0;
+
+  printf("bench=churn/%s slots=%d occupancy=%d%% rate=%d"
+         " idle_failed=%d streams=%d done=%d failed=%d evicted=%d"
+         " achieved_rate=%.0f"
+         " setup_p50_us=%u setup_p99_us=%u setup_max_us=%u"
+         " cpu_us_per_stream=%.1f pkm_cpu_us_per_stream=%.1f"
+         " slot_bytes=%zu rss_kb_per_slot=%.2f rss_kb_per_idle=%.2f\n",
+         bc->use_tls ? "tls" : "plain",
+         bc->slots, (int) ((100LL * bc->idle_count) / bc->slots), bc->rate,
+         bc->idle_failed,
+         bc->churn_count, bc->churn_done, bc->churn_failed, bc->evicted,
+         (1e9 * bc->churn_done) / (double) (bench_ns() - t0),
+         pk_histogram_percentile(&(bc->setup), 500),
+         pk_histogram_percentile(&(bc->setup), 990), bc->setup.max_us,
+         (1e6 * cpu) / bc->churn_count, (1e6 * pkm_cpu) / bc->churn_count,
+         sizeof(struct pk_backend_conn),
+         (double) (rss_slots - rss0) / bc->slots,
+         bc->idle_count ? (double) (rss_idle - rss_slots) / bc->idle_count
+                        : 0.0);
+  rv = (bc->churn_done + bc->churn_failed < bc->churn_count);
+
+cleanup:
+  bench_connector_stop(pkm);
+  bench_relay_stop(&relay);
+  bench_backend_stop(&backend);
+  free(bc->idle_state);
+  free(bc->churn_state);
+  free(bc->churn_started_ns);
+  return rv;
+}
+
+static int bench_ch_parse_list(const char* arg, int* list, int max)
+{
+  int count = 0;
+  char* end;
+  while ((count < max) && (*arg != '\0')) {
+    list[count++] = strtol(arg, &end, 10);
+    if (*end == ',') end++;
+    else if (*end != '\0') return -1;
+    arg = end;
+  }
+  return count;
+}
+
+int bench_churn_main(int argc, char** argv)
+{
+  struct bench_churn bc;
+  int slots[BENCH_CH_MAX_CONFIGS], occupancy[BENCH_CH_MAX_CONFIGS];
+  int n_slots, n_occupancy;
+  int rate = BENCH_CH_RATE;
+  int seconds = BENCH_CH_SECONDS;
+  int use_tls = 0;
+  int i, j, ok = 1, rv = 0;
+
+  n_slots = bench_ch_parse_list(BENCH_CH_SLOTS, slots, BENCH_CH_MAX_CONFIGS);
+  n_occupancy = bench_ch_parse_list(BENCH_CH_OCCUPANCY, occupancy,
+                                    BENCH_CH_MAX_CONFIGS);
+  for (i = 1; ok && (i < argc); i++) {
+    if ((0 == strcmp(argv[i], "-r")) && (i + 1 < argc)) {
+      rate = atoi(argv[++i]);
+    }
+    else if ((0 == strcmp(argv[i], "-d")) && (i + 1 < argc)) {
+      seconds = atoi(argv[++i]);
+    }
+    else if ((0 == strcmp(argv[i], "-n")) && (i + 1 < argc)) {
+      n_slots = bench_ch_parse_list(argv[++i], slots, BENCH_CH_MAX_CONFIGS);
+    }
+    else if ((0 == strcmp(argv[i], "-o")) && (i + 1 < argc)) {
+      n_occupancy = bench_ch_parse_list(argv[++i], occupancy,
+                                        BENCH_CH_MAX_CONFIGS);
+    }
+    else if (0 == strcmp(argv[i], "plain")) {
+      use_tls = 0;
+    }
+    else if (0 == strcmp(argv[i], "tls")) {
+      use_tls = 1;
+    }
+    else {
+      ok = 0;
+    }
+  }
+  for (i = 0; ok && (i < n_slots); i++) ok = (slots[i] > 0);
+  for (i = 0; ok && (i < n_occupancy); i++) {
+    ok = ((occupancy[i] >= 0) && (occupancy[i] <= 100));
+  }
+  if (!ok || (rate < 1) || (seconds < 1) ||
+      (n_slots < 1) || (n_occupancy < 1)) {
+    fprintf(stderr, "Usage: benchmarks churn [-r <sids/s>] [-d <seconds>]"
+                    " [-n <slots,...>] [-o <occupancy%%,...>]"
+                    " [plain|tls]\n");
+    return 1;
+  }
+
+  for (i = 0; i < n_slots; i++) {
+    for (j = 0; j < n_occupancy; j++) {
+      memset(&bc, 0, sizeof(bc));
+      bc.slots = slots[i];
+      bc.idle_count = (int) (((long long) slots[i] * occupancy[j]) / 100);
+      bc.churn_count = rate * seconds;
+      bc.rate = rate;
+      bc.use_tls = use_tls;
+      rv |= bench_fork(bench_ch_run, &bc);
+    }
+  }
+  return rv;
+}
@@ -0,0 +1,354 @@
+/******************************************************************************
+bench_failover.c - Failover and reconnect latency benchmark.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************
+
+Usage: benchmarks failover [-f <relays>] [-t <trials>] [-w <seconds>]
+                           [-k <seconds>] [kill|blackhole] [plain|tls]
+
+A real pk_manager is configured with several stub relays (each on its
+own loopback address, 127.0.0.2 and up) and flies a tunnel to one of
+them. After the given number of seconds, that relay fails: either it is
+killed outright (the tunnel is closed, new connections are refused), or
+it is blackholed (it stops reading, writing and accepting but keeps all
+its sockets open, like a relay behind a dead link).
+
+We then measure how long the kite is offline, until the connector reports
+PK_STATUS_FLYING again on a tunnel to another relay and until the first
+stream over that tunnel has been echoed back. The offline time is broken
+down into phases:
+
+  detect     failure until the connector gives up on the old tunnel
+  select     ... until it starts connecting to the relay it ends up with
+                 (includes the tick and tunnel check scheduling, pings
+                 and any attempts made on relays which were also down)
+  connect    ... until the relay accepted the TCP connection
+  tls        ... until the TLS handshake completed (0 for plain)
+  handshake  ... until the relay accepted the kites
+  confirm    ... until the manager reports PK_STATUS_FLYING
+
+Also reported are the number of errors (failed pings and connection
+attempts) the connector ran into with the failed relay, and how many
+streams the new relay had to try before one got through.
+
+Detection and selection are mostly governed by the housekeeping intervals
+(pkm_tick_cb and the blocking thread's tunnel checks), which -k overrides,
+bypassing the lower bound pagekite_set_housekeeping_min_interval()
+enforces. Since the outcome depends on where in that cycle the failure
+lands, varying -w between runs is worthwhile. A blackholed relay is only
+detected by the keepalive pings, which with the default intervals takes
+well over two minutes.
+
+The kite's DNS is managed through dynamic DNS updates to a stub server
+which accepts everything, as it would be in production. This matters: a
+failed relay stays "in DNS" and keeps being retried until the next DNS
+update is allowed (PK_DDNS_UPDATE_INTERVAL_MIN after the previous one),
+and the connector will not report PK_STATUS_FLYING until then, even
+though traffic is flowing again. Expect each trial to take minutes.
+
+Each trial runs in its own process and prints a line of its own.
+
+******************************************************************************/
+
+#define PAGEKITE_CONSTANTS_ONLY
+#include "pagekite.h"
+
+#include "pkcommon.h"
+#include "pkutils.h"
+#include "pkerror.h"
+#include "pkhooks.h"
+#include "pkconn.h"
+#include "pkstate.h"
+#include "pkstats.h"
+#include "pkproto.h"
+#include "pkblocker.h"
+#include "pkmanager.h"
+#include "pklogging.h"
+#include "bench.h"
+
+#define BENCH_FO_RELAYS         3
+#define BENCH_FO_TRIALS         3
+#define BENCH_FO_WAIT_S         2
+#define BENCH_FO_MAX_RELAYS     16
+#define BENCH_FO_TIMEOUT_S      600
+#define BENCH_FO_POLL_US        200
+#define BENCH_FO_RETRY_MS       50
+#define BENCH_FO_PAYLOAD        "failover\n"
+
+struct bench_failover {
+  int                 relays;
+  int                 trial;
+  int                 blackhole;
+  int                 use_tls;
+  int                 wait_s;
+  int                 housekeeping_s;
+
+  struct bench_relay  relay[BENCH_FO_MAX_RELAYS];
+  struct bench_relay* failed;
+  volatile uint64_t   fail_ns;
+  volatile int        connector_ready;
+
+  /* Owned by the relay threads, read by the main thread. */
+  uint64_t            stream_sent_ns[BENCH_FO_MAX_RELAYS];
+  int                 streams_tried[BENCH_FO_MAX_RELAYS];
+  volatile uint64_t   stream_ns;
+};
+
+static double bench_fo_ms(uint64_t from_ns, uint64_t to_ns)
+{
+  if (!from_ns || !to_ns || (to_ns < from_ns)) return -1.0;
+  return (to_ns - from_ns) / 1e6;
+}
+
+/* Echoes from the back-end; the first one marks the end of the outage. */
+static void bench_fo_chunk(struct bench_relay* br, struct pk_chunk* chunk)
+{
+  struct bench_failover* fo = (struct bench_failover*) br->data;
+  size_t want = strlen(BENCH_FO_PAYLOAD);
+
+  if ((NULL == chunk->sid) || (chunk->sid[0] != 'f') || chunk->eof) return;
+  if ((chunk->length >= (ssize_t) want) &&
+      (0 == memcmp(chunk->data, BENCH_FO_PAYLOAD, want)) &&
+      (0 == fo->stream_ns)) {
+    fo->stream_ns = bench_ns();
+  }
+}
+
+/* As soon as the connector is done setting up a fresh tunnel after the
+ * failure, keep opening streams on it until one succeeds. Note that we
+ * must not send anything before then: pk_connect_ai discards whatever
+ * arrives along with the handshake reply. */
+static void bench_fo_drive(struct bench_relay* br)
+{
+  struct bench_failover* fo = (struct bench_failover*) br->data;
+  struct pk_chunk chunk;
+  char frame[1024], sid[16];
+  int i = br - fo->relay;
+  uint64_t now;
+  ssize_t rv;
+
+  if ((0 == fo->fail_ns) || (br == fo->failed) || (0 != fo->stream_ns) ||
+      !fo->connector_ready || (br->tunnel_up_ns < fo->fail_ns)) return;
+
+  now = bench_ns();
+  if (fo->stream_sent_ns[i] &&
+      (now < fo->stream_sent_ns[i] + BENCH_FO_RETRY_MS * 1000000ULL)) return;
+
+  sprintf(sid, "f%x", fo->streams_tried[i]);
+  pk_chunk_reset_values(&chunk);
+  chunk.sid = sid;
+  chunk.request_proto = BENCH_KITE_PROTO;
+  chunk.request_host = BENCH_KITE_DOMAIN;
+  chunk.request_port = BENCH_KITE_PORT;
+  chunk.remote_ip = "127.0.0.1";
+  chunk.remote_port = 1024 + fo->streams_tried[i];
+  chunk.data = BENCH_FO_PAYLOAD;
+  chunk.length = strlen(BENCH_FO_PAYLOAD);
+  rv = pk_format_chunk(frame, sizeof(frame), &chunk);
+  if ((rv > 0) && (0 < bench_relay_send(br, frame, rv))) {
+    fo->stream_sent_ns[i] = now;
+    fo->streams_tried[i]++;
+  }
+}
+
+static struct bench_relay* bench_fo_active(struct bench_failover* fo)
+{
+  int i;
+  for (i = 0; i < fo->relays; i++) {
+    if (fo->relay[i].tunnel_up && (&(fo->relay[i]) != fo->failed))
+      return &(fo->relay[i]);
+  }
+  return NULL;
+}
+
+static struct pk_tunnel* bench_fo_tunnel(struct pk_manager* pkm,
+                                         struct bench_relay* br)
+{
+  PK_TUNNEL_ITER(pkm, fe) {
+    if ((NULL != fe->fe_hostname) && (fe->fe_port == br->port)) return fe;
+  }
+  return NULL;
+}
+
+static int bench_fo_run(void* data)
+{
+  struct bench_failover* fo = (struct bench_failover*) data;
+  struct bench_backend backend;
+  struct bench_relay ddns;
+  struct bench_relay* winner = NULL;
+  struct pk_tunnel* failed_fe;
+  struct pk_tunnel* winner_fe;
+  struct pk_manager* pkm = NULL;
+  char ip[32], ddns_url[128];
+  uint64_t connect_ns[BENCH_FO_MAX_RELAYS];
+  char changing[BENCH_FO_MAX_RELAYS];
+  uint64_t deadline, now, detect_ns = 0, flying_ns = 0, start_ns = 0;
+  int i, old_fd, streams = 0, rv = 1;
+
+  memset(connect_ns, 0, sizeof(connect_ns));
+  memset(changing, 0, sizeof(changing));
+  if ((0 > bench_backend_start(&backend, 0)) ||
+      (0 > bench_relay_start(&ddns, NULL, 0, NULL, NULL, NULL))) {
+    fprintf(stderr, "failover: Failed to start the back-end\n");
+    return 1;
+  }
+  sprintf(ddns_url, "http://%s:%d/ddns?hostname=%%s&myip=%%s&sign=%%s",
+                    ddns.ip, ddns.port);
+  for (i = 0; i < fo->relays; i++) {
+    sprintf(ip, "127.0.0.%d", 2 + i);
+    if (0 > bench_relay_start(&(fo->relay[i]), ip, fo->use_tls,
+                              bench_fo_chunk, bench_fo_drive, fo)) {
+      fprintf(stderr, "failover: Failed to start relay %d\n", i);
+      return 1;
+    }
+  }
+
+  deadline = bench_ns() + (uint64_t) BENCH_FO_TIMEOUT_S * 1000000000;
+  if (NULL == (pkm = bench_connector_start(fo->use_tls, 16, backend.port,
+                                           fo->relays, fo->relay,
+                                           ddns_url))) {
+    fprintf(stderr, "failover: Failed to start the connector\n");
+    goto cleanup;
+  }
+  /* Connection errors are logged as errors, and we expect plenty. */
+  pk_state.log_mask = 0;
+  if (fo->housekeeping_s > 0)
+    pkm->housekeeping_interval_min = fo->housekeeping_s;
+
+  while ((NULL == bench_fo_active(fo)) || (pkm->status != PK_STATUS_FLYING)) {
+    if (bench_ns() > deadline) {
+      fprintf(stderr, "failover: Tunnel never came up\n");
+      goto cleanup;
+    }
+    usleep(1000);
+  }
+  sleep(fo->wait_s);
+
+  /* Pull the plug on whichever relay the connector chose. */
+  fo->failed = bench_fo_active(fo);
+  if (NULL == (failed_fe = bench_fo_tunnel(pkm, fo->failed))) goto cleanup;
+  old_fd = failed_fe->conn.sockfd;
+  fo->fail_ns = bench_ns();
+  if (fo->blackhole) {
+    fo->failed->blackhole = 1;
+  }
+  else {
+    bench_relay_stop(fo->failed);
+  }
+
+  /* Watch the connector's tunnels until the outage is over. Reading its
+   * state without locks is racy, but good enough for timestamps. */
+  while (!(flying_ns && fo->stream_ns) && ((now = bench_ns()) < deadline)) {
+    if (!detect_ns && (failed_fe->conn.sockfd != old_fd)) detect_ns = now;
+    if ((NULL != (winner = bench_fo_active(fo))) &&
+        (winner->tunnel_up_ns < fo->fail_ns)) winner = NULL;
+    for (i = 0; (NULL == winner) && (i < pkm->tunnel_max); i++) {
+      if (pkm->tunnels[i].conn.status & CONN_STATUS_CHANGING) {
+        if (!changing[i]) connect_ns[i] = now;
+        changing[i] = 1;
+      }
+      else {
+        changing[i] = 0;
+      }
+    }
+    if ((NULL != winner) && !fo->connector_ready &&
+        (NULL != (winner_fe = bench_fo_tunnel(pkm, winner))) &&
+        (winner_fe->conn.sockfd >= 0) &&
+        !(winner_fe->conn.status & CONN_STATUS_CHANGING)) {
+      fo->connector_ready = 1;
+    }
+    if (!flying_ns && (NULL != winner) && (pkm->status == PK_STATUS_FLYING))
+      flying_ns = now;
+    usleep(BENCH_FO_POLL_US);
+  }
+  for (i = 0; i < fo->relays; i++) streams += fo->streams_tried[i];
+
+  if ((NULL != winner) && (NULL != (winner_fe = bench_fo_tunnel(pkm, winner))))
+    start_ns = connect_ns[winner_fe - pkm->tunnels];
+
+  printf("bench=failover/%s/%s trial=%d relays=%d wait_s=%d"
+         " dead_errors=%d streams=%d"
+         " detect_ms=%.1f select_ms=%.1f connect_ms=%.1f tls_ms=%.1f"
+         " handshake_ms=%.1f confirm_ms=%.1f"
+         " offline_ms=%.1f first_stream_ms=%.1f\n",
+         fo->blackhole ? "blackhole" : "kill",
+         fo->use_tls ? "tls" : "plain",
+         fo->trial, fo->relays, fo->wait_s, failed_fe->error_count, streams,
+         bench_fo_ms(fo->fail_ns, detect_ns),
+         bench_fo_ms(detect_ns, start_ns),
+         bench_fo_ms(start_ns, winner ? winner->accept_ns : 0),
+         winner ? bench_fo_ms(winner->accept_ns, winner->tls_ns) : -1.0,
+         winner ? bench_fo_ms(winner->tls_ns, winner->tunnel_up_ns) : -1.0,
+         bench_fo_ms(winner ? winner->tunnel_up_ns : 0, flying_ns),
+         bench_fo_ms(fo->fail_ns, flying_ns),
+         bench_fo_ms(fo->fail_ns, fo->stream_ns));
+  rv = !(flying_ns && fo->stream_ns);
+  if (rv) fprintf(stderr, "failover: Timed out\n");
+
+cleanup:
+  bench_connector_stop(pkm);
+  for (i = 0; i < fo->relays; i++) bench_relay_stop(&(fo->relay[i]));
+  bench_relay_stop(&ddns);
+  bench_backend_stop(&backend);
+  return rv;
+}
+
+int bench_failover_main(int argc, char** argv)
+{
+  struct bench_failover fo;
+  int trials = BENCH_FO_TRIALS;
+  int i, rv = 0;
+
+  memset(&fo, 0, sizeof(fo));
+  fo.relays = BENCH_FO_RELAYS;
+  fo.wait_s = BENCH_FO_WAIT_S;
+  for (i = 1; i < argc; i++) {
+    if ((0 == strcmp(argv[i], "-f")) && (i + 1 < argc)) {
+      fo.relays = atoi(argv[++i]);
+    }
+    else if ((0 == strcmp(argv[i], "-t")) && (i + 1 < argc)) {
+      trials = atoi(argv[++i]);
+    }
+    else if ((0 == strcmp(argv[i], "-w")) && (i + 1 < argc)) {
+      fo.wait_s = atoi(argv[++i]);
+    }
+    else if ((0 == strcmp(argv[i], "-k")) && (i + 1 < argc)) {
+      fo.housekeeping_s = atoi(argv[++i]);
+    }
+    else if (0 == strcmp(argv[i], "kill")) fo.blackhole = 0;
+    else if (0 == strcmp(argv[i], "blackhole")) fo.blackhole = 1;
+    else if (0 == strcmp(argv[i], "plain")) fo.use_tls = 0;
+    else if (0 == strcmp(argv[i], "tls")) fo.use_tls = 1;
+    else {
+      trials = 0;
+      break;
+    }
+  }
+  if ((fo.relays < 2) || (fo.relays > BENCH_FO_MAX_RELAYS) ||
+      (trials < 1) || (fo.wait_s < 0)) {
+    fprintf(stderr, "Usage: benchmarks failover [-f <relays>] [-t <trials>]"
+                    " [-w <seconds>] [-k <seconds>]"
+                    " [kill|blackhole] [plain|tls]\n");
+    return 1;
+  }
+
+  for (fo.trial = 1; fo.trial <= trials; fo.trial++) {
+    rv |= bench_fork(bench_fo_run, &fo);
+  }
+  return rv;
+}
@@ -0,0 +1,266 @@
+/******************************************************************************
+bench_footprint.c - Memory footprint check for small devices.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************
+
+Usage: benchmarks footprint [-k <kites>] [-s <streams>] [-m <max-kb>] [-i]
+                            [plain|tls]
+
+A connector flies a handful of kites to the stub relay, which then opens
+a few streams to the echo back-end and waits until each has echoed its
+first chunk, so every buffer a typical router deployment would touch has
+been touched. The growth of the anonymous RSS (heap, stacks) since just
+before pagekite_init() is then compared against a target, which defaults
+to a budget for the footprint profile this was compiled with (see
+--with-footprint in configure.ac). Library text paged in along the way
+(mostly OpenSSL) is reported, but not counted against the target.
+
+Reported are: the profile and its main limits, the size of the manager
+and of a stream slot, total and anonymous RSS growth, and whether the
+latter stayed within the target. The exit code is non-zero if not, so
+this doubles as a test.
+
+With -i the connector is started with PK_WITH_IDLE_STREAMS, so the echoed
+streams sit idle without I/O buffers. Combine with a large -s (and -m) to
+check how many idle streams fit in a budget; anon_kb_per_stream helps.
+The target does not grow with -s, and the echo back-end runs in the same
+process, so each stream also counts its echo connection (about 1KB) and
+libev bookkeeping on both ends. With the default target that fits about
+200 idle streams; beyond that, raise -m by 2KB or so per stream.
+
+******************************************************************************/
+
+#include "pagekite.h"
+
+#include "pkcommon.h"
+#include "pkutils.h"
+#include "pkerror.h"
+#include "pkhooks.h"
+#include "pkconn.h"
+#include "pkstate.h"
+#include "pkstats.h"
+#include "pkproto.h"
+#include "pkblocker.h"
+#include "pkmanager.h"
+#include "pklogging.h"
+#include "bench.h"
+
+#define BENCH_FP_KITES          4
+#define BENCH_FP_STREAMS        8
+#define BENCH_FP_PAYLOAD        512
+#define BENCH_FP_TIMEOUT_S      30
+#if PK_FOOTPRINT_TINY
+#define BENCH_FP_MAX_KB         768
+#else
+#define BENCH_FP_MAX_KB         1536
+#endif
+
+struct bench_footprint {
+  int                  kites;
+  int                  streams;
+  int                  max_kb;
+  int                  use_tls;
+  int                  idle;
+
+  /* Owned by the relay thread, read by the main thread. */
+  volatile int         opened;
+  volatile int         echoed;
+  volatile int         failed;
+  unsigned char*       state;
+  char                 frame[BENCH_FP_PAYLOAD + 1024];
+  char                 payload[BENCH_FP_PAYLOAD];
+};
+
+static void bench_fp_chunk(struct bench_relay* br, struct pk_chunk* chunk)
+{
+  struct bench_footprint* bf = (struct bench_footprint*) br->data;
+  char kind;
+  int i;
+
+  i = bench_sid_index(chunk->sid, &kind);
+  if ((i < 0) || (kind != 'f') || (i >= bf->streams) || bf->state[i]) return;
+
+  if (chunk->eof) {
+    bf->state[i] = 1;
+    bf->failed++;
+  }
+  else if (chunk->length > 0) {
+    bf->state[i] = 1;
+    bf->echoed++;
+  }
+}
+
+static void bench_fp_drive(struct bench_relay* br)
+{
+  struct bench_footprint* bf = (struct bench_footprint*) br->data;
+  struct pk_chunk chunk;
+  char sid[16];
+  ssize_t rv;
+
+  while (bf->opened < bf->streams) {
+    sprintf(sid, "f%x", bf->opened);
+    pk_chunk_reset_values(&chunk);
+    chunk.sid = sid;
+    chunk.request_proto = BENCH_KITE_PROTO;
+    chunk.request_host = BENCH_KITE_DOMAIN;
+    chunk.request_port = BENCH_KITE_PORT;
+    chunk.remote_ip = "127.0.0.1";
+    chunk.remote_port = 1024 + bf->opened;
+    chunk.data = bf->payload;
+    chunk.length = BENCH_FP_PAYLOAD;
+    rv = pk_format_chunk(bf->frame, sizeof(bf->frame), &chunk);
+    if ((rv <= 0) || (0 >= bench_relay_send(br, bf->frame, rv))) return;
+    bf->opened++;
+  }
+}
+
+/* Like bench_connector_start, but with more than one kite. Only the first
+ * one gets any traffic, the rest are there to be paid for. */
+static struct pk_manager* bench_fp_start(struct bench_footprint* bf,
+                                         struct bench_relay* relay,
+                                         int be_port)
+{
+  pagekite_mgr pkm;
+  char domain[64];
+  int i;
+
+  pkm = pagekite_init("bench", bf->kites + 1, 1, bf->streams, NULL,
+                      PK_WITH_IPV4 | (bf->use_tls ? PK_WITH_SSL : 0) |
+                      (bf->idle ? PK_WITH_IDLE_STREAMS : 0) |
+                      PK_WITHOUT_SERVICE_FRONTENDS,
+                      PK_LOG_ERRORS);
+  if (NULL == pkm) return NULL;
+  for (i = 0; i < bf->kites; i++) {
+    if (i) sprintf(domain, "k%d.%s", i, BENCH_KITE_DOMAIN);
+    else strcpy(domain, BENCH_KITE_DOMAIN);
+    if (0 > pagekite_add_kite(pkm, BENCH_KITE_PROTO, domain,
+                              BENCH_KITE_PORT, "benchsecret",
+                              BENCH_LOOPBACK_IP, be_port)) {
+      pagekite_free(pkm);
+      return NULL;
+    }
+  }
+  pk_state.dns_check_name = BENCH_KITE_DOMAIN;
+  if ((1 > pagekite_add_frontend(pkm, relay->ip, relay->port)) ||
+      (0 > pagekite_thread_start(pkm))) {
+    pagekite_free(pkm);
+    return NULL;
+  }
+  return (struct pk_manager*) pkm;
+}
+
+static int bench_fp_run(void* data)
+{
+  struct bench_footprint* bf = (struct bench_footprint*) data;
+  struct bench_relay relay;
+  struct bench_backend backend;
+  struct pk_manager* pkm = NULL;
+  uint64_t deadline;
+  long rss0, rss, anon0, anon;
+  int rv = 1;
+
+  if (NULL == (bf->state = calloc(bf->streams + 1, 1))) return 1;
+  memset(bf->payload, 'x', BENCH_FP_PAYLOAD);
+
+  if ((0 > bench_backend_start(&backend, BENCH_FP_PAYLOAD)) ||
+      (0 > bench_relay_start(&relay, NULL, bf->use_tls, NULL, NULL, bf))) {
+    fprintf(stderr, "footprint: Failed to start relay or back-end\n");
+    return 1;
+  }
+
+  deadline = bench_ns() + (uint64_t) BENCH_FP_TIMEOUT_S * 1000000000;
+  rss0 = bench_rss_kb();
+  anon0 = bench_rss_anon_kb();
+  if (NULL == (pkm = bench_fp_start(bf, &relay, backend.port))) {
+    fprintf(stderr, "footprint: Failed to start the connector\n");
+    goto cleanup;
+  }
+  if (0 > bench_connector_wait(pkm, &relay, deadline)) {
+    fprintf(stderr, "footprint: Tunnel never came up\n");
+    goto cleanup;
+  }
+
+  relay.chunk_cb = bench_fp_chunk;
+  relay.drive_cb = bench_fp_drive;
+  while ((bf->echoed + bf->failed < bf->streams) && (bench_ns() < deadline))
+    usleep(1000);
+  rss = bench_rss_kb();
+  anon = bench_rss_anon_kb();
+
+  printf("bench=footprint/%s profile=%s kites=%d streams=%d echoed=%d"
+         " failed=%d parser_max=%d conn_buffer=%d log_ring=%d"
+         " manager_bytes=%zu slot_bytes=%zu conn_buffers=%d"
+         " rss_growth_kb=%ld anon_growth_kb=%ld anon_kb_per_stream=%.1f"
+         " max_kb=%d ok=%d\n",
+         bf->use_tls ? "tls" : "plain",
+         PK_FOOTPRINT_TINY ? "tiny" : "default",
+         bf->kites, bf->streams, bf->echoed, bf->failed,
+         PARSER_BYTES_MAX, CONN_IO_BUFFER_SIZE, PKS_LOG_DATA_MAX,
+         sizeof(struct pk_manager), sizeof(struct pk_backend_conn),
+         pkm->conn_buffers_max, rss - rss0, anon - anon0,
+         (double) (anon - anon0) / bf->streams, bf->max_kb,
+         (anon - anon0 <= bf->max_kb));
+  rv = ((bf->echoed < bf->streams) || (anon - anon0 > bf->max_kb));
+
+cleanup:
+  bench_connector_stop(pkm);
+  bench_relay_stop(&relay);
+  bench_backend_stop(&backend);
+  free(bf->state);
+  return rv;
+}
+
+int bench_footprint_main(int argc, char** argv)
+{
+  struct bench_footprint bf;
+  int i, ok = 1;
+
+  memset(&bf, 0, sizeof(bf));
+  bf.kites = BENCH_FP_KITES;
+  bf.streams = BENCH_FP_STREAMS;
+  bf.max_kb = BENCH_FP_MAX_KB;
+  for (i = 1; ok && (i < argc); i++) {
+    if ((0 == strcmp(argv[i], "-k")) && (i + 1 < argc)) {
+      bf.kites = atoi(argv[++i]);
+    }
+    else if ((0 == strcmp(argv[i], "-s")) && (i + 1 < argc)) {
+      bf.streams = atoi(argv[++i]);
+    }
+    else if ((0 == strcmp(argv[i], "-m")) && (i + 1 < argc)) {
+      bf.max_kb = atoi(argv[++i]);
+    }
+    else if (0 == strcmp(argv[i], "-i")) {
+      bf.idle = 1;
+    }
+    else if (0 == strcmp(argv[i], "plain")) {
+      bf.use_tls = 0;
+    }
+    else if (0 == strcmp(argv[i], "tls")) {
+      bf.use_tls = 1;
+    }
+    else {
+      ok = 0;
+    }
+  }
+  if (!ok || (bf.kites < 1) || (bf.streams < 1) || (bf.max_kb < 1)) {
+    fprintf(stderr, "Usage: benchmarks footprint [-k <kites>] [-s <streams>]"
+                    " [-m <max-kb>] [-i] [plain|tls]\n");
+    return 1;
+  }
+  return bench_fork(bench_fp_run, &bf);
+}
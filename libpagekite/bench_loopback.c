@@ -0,0 +1,356 @@
+/******************************************************************************
+bench_loopback.c - End-to-end throughput benchmark over loopback.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************
+
+Usage: benchmarks loopback [-n <streams>] [-b <bytes>] [-W <spec>]
+                           [plain|tls|both]
+
+A real pk_manager flies a tunnel to the stub relay (bench_relay.c), which
+then opens N concurrent streams and pushes B bytes down each one. The
+streams are connected to an echo back-end, so every byte makes a full
+round trip through the tunnel, the connector's event loop and back.
+With -W, the tunnel goes through a WAN-emulating proxy (see bench_wan.c
+for the spec), so we can see how the connector copes with latency,
+limited bandwidth and loss.
+
+Reported are: payload throughput (both directions), per-stream time to
+first echoed byte and completion time percentiles, CPU time per GB moved
+(for the whole process and for the connector's own thread) and memory
+per stream (static slot size and the measured RSS growth).
+
+******************************************************************************/
+
+#define PAGEKITE_CONSTANTS_ONLY
+#include "pagekite.h"
+
+#include "pkcommon.h"
+#include "pkutils.h"
+#include "pkerror.h"
+#include "pkhooks.h"
+#include "pkconn.h"
+#include "pkstate.h"
+#include "pkstats.h"
+#include "pkproto.h"
+#include "pkblocker.h"
+#include "pkmanager.h"
+#include "pklogging.h"
+#include "bench.h"
+
+#define BENCH_LB_STREAMS        64
+#define BENCH_LB_BYTES          (4 * 1024 * 1024)
+#define BENCH_LB_CHUNK          (16 * 1024)
+#define BENCH_LB_WINDOW         (64 * 1024)
+#define BENCH_LB_TIMEOUT_S      120
+
+struct bench_stream {
+  char     sid[16];
+  uint64_t sent;
+  uint64_t received;
+  uint64_t acked;
+  uint64_t started_ns;
+  uint64_t first_ns;
+  int      done;
+  int      eof_sent;
+};
+
+struct bench_loopback {
+  struct bench_stream* streams;
+  int                  count;
+  size_t               bytes;
+  volatile int         done;
+  volatile int         errors;
+  uint64_t             finished_ns;
+  struct pk_histogram  ttfb;
+  struct pk_histogram  complete;
+  char*                frame;
+  char*                payload;
+};
+
+/* Chunks from the connector: echoed data, acks and EOFs. */
+static void bench_lb_chunk(struct bench_relay* br, struct pk_chunk* chunk)
+{
+  struct bench_loopback* bl = (struct bench_loopback*) br->data;
+  struct bench_stream* s;
+  uint64_t now;
+  char kind;
+  int i;
+
+  i = bench_sid_index(chunk->sid, &kind);
+  if ((i < 0) || (kind != 'b') || (i >= bl->count)) return;
+  s = &(bl->streams[i]);
+  if (s->done) return;
+
+  if (chunk->eof) {
+    s->done = 1;
+    bl->errors++;
+    bl->done++;
+    return;
+  }
+  if ((NULL != chunk->noop) || (chunk->length <= 0)) return;
+
+  now = bench_ns();
+  if (0 == s->first_ns) {
+    s->first_ns = now;
+    pk_histogram_record(&(bl->ttfb), (now - s->started_ns) / 1000);
+  }
+  s->received += chunk->length;
+  if (s->received >= bl->bytes) {
+    s->done = 1;
+    pk_histogram_record(&(bl->complete), (now - s->started_ns) / 1000);
+    bl->finished_ns = now;
+    bl->done++;
+  }
+}
+
+/* Called on every relay loop iteration: give each stream a chance to
+ * send an ack, an EOF or another chunk of data, until the relay's output
+ * buffer is full. */
+static void bench_lb_drive(struct bench_relay* br)
+{
+  struct bench_loopback* bl = (struct bench_loopback*) br->data;
+  struct bench_stream* s;
+  struct pk_chunk chunk;
+  size_t len;
+  ssize_t rv;
+  int i;
+
+  for (i = 0; i < bl->count; i++) {
+    if (bench_relay_out_free(br) < BENCH_LB_CHUNK + 1024) return;
+    s = &(bl->streams[i]);
+
+    if (s->done) {
+      if (!s->eof_sent) {
+        bench_relay_send(br, bl->frame,
+                         pk_format_eof(bl->frame, s->sid, PK_EOF));
+        s->eof_sent = 1;
+      }
+      continue;
+    }
+
+    /* Ack every KB, the connector's window may shrink to just a few. */
+    if (s->received / 1024 > s->acked / 1024) {
+      s->acked = s->received;
+      bench_relay_send(br, bl->frame,
+                       pk_format_skb(bl->frame, s->sid, s->acked / 1024));
+    }
+
+    if ((s->sent >= bl->bytes) || (s->sent >= s->received + BENCH_LB_WINDOW))
+      continue;
+
+    len = bl->bytes - s->sent;
+    if (len > BENCH_LB_CHUNK) len = BENCH_LB_CHUNK;
+    if (0 == s->sent) {
+      pk_chunk_reset_values(&chunk);
+      chunk.sid = s->sid;
+      chunk.request_proto = BENCH_KITE_PROTO;
+      chunk.request_host = BENCH_KITE_DOMAIN;
+      chunk.request_port = BENCH_KITE_PORT;
+      chunk.remote_ip = "127.0.0.1";
+      chunk.remote_port = 1024 + i;
+      chunk.data = bl->payload;
+      chunk.length = len;
+      rv = pk_format_chunk(bl->frame, BENCH_LB_CHUNK + 1024, &chunk);
+      s->started_ns = bench_ns();
+    }
+    else {
+      rv = pk_format_reply(bl->frame, s->sid, len, bl->payload);
+    }
+    if ((rv > 0) && (0 < bench_relay_send(br, bl->frame, rv))) s->sent += len;
+  }
+}
+
+static void bench_lb_report(const char* name, struct bench_loopback* bl,
+                            uint64_t ns, double cpu_all, double cpu_pkm,
+                            long rss_kb)
+{
+  double bytes = 2.0 * bl->count * bl->bytes;
+  double gb = bytes / (1024.0 * 1024.0 * 1024.0);
+
+  printf("bench=%s streams=%d bytes_per_stream=%zu errors=%d"
+         " gbit_per_s=%.3f"
+         " ttfb_p50_us=%u ttfb_p99_us=%u ttfb_max_us=%u"
+         " done_p50_us=%u done_p99_us=%u done_max_us=%u"
+         " cpu_s_per_gb=%.3f pkm_cpu_s_per_gb=%.3f"
+         " slot_bytes=%zu rss_kb_per_stream=%.1f\n",
+         name, bl->count, bl->bytes, bl->errors,
+         (bytes * 8.0) / (double) ns,
+         pk_histogram_percentile(&(bl->ttfb), 500),
+         pk_histogram_percentile(&(bl->ttfb), 990), bl->ttfb.max_us,
+         pk_histogram_percentile(&(bl->complete), 500),
+         pk_histogram_percentile(&(bl->complete), 990), bl->complete.max_us,
+         cpu_all / gb, cpu_pkm / gb,
+         sizeof(struct pk_backend_conn), (double) rss_kb / bl->count);
+  fflush(stdout);
+}
+
+struct bench_lb_args {
+  int         use_tls;
+  int         streams;
+  size_t      bytes;
+  const char* wan;
+};
+
+static int bench_lb_run(void* data)
+{
+  struct bench_lb_args* args = (struct bench_lb_args*) data;
+  struct bench_loopback bl;
+  struct bench_relay relay, via;
+  struct bench_backend backend;
+  struct bench_wan_params wan_params;
+  struct bench_wan wan;
+  struct pk_manager* pkm = NULL;
+  char name[300];
+  uint64_t t0, deadline;
+  double cpu0, pkm_cpu0;
+  long rss0, rss;
+  int i, rv = 1;
+
+  memset(&bl, 0, sizeof(bl));
+  bl.count = args->streams;
+  bl.bytes = args->bytes;
+  bl.streams = calloc(bl.count, sizeof(struct bench_stream));
+  bl.frame = malloc(BENCH_LB_CHUNK + 1024);
+  bl.payload = malloc(BENCH_LB_CHUNK);
+  if ((NULL == bl.streams) || (NULL == bl.frame) || (NULL == bl.payload)) {
+    fprintf(stderr, "loopback: Out of memory\n");
+    return 1;
+  }
+  memset(bl.payload, 'x', BENCH_LB_CHUNK);
+  for (i = 0; i < bl.count; i++) sprintf(bl.streams[i].sid, "b%x", i);
+
+  if ((0 > bench_backend_start(&backend, 0)) ||
+      (0 > bench_relay_start(&relay, NULL, args->use_tls, NULL, NULL, &bl))) {
+    fprintf(stderr, "loopback: Failed to start relay or back-end\n");
+    return 1;
+  }
+
+  /* The connector only needs to know where to connect to. */
+  memset(&wan, 0, sizeof(wan));
+  memcpy(&via, &relay, sizeof(via));
+  if (NULL != args->wan) {
+    bench_wan_parse(&wan_params, args->wan);
+    if (0 > bench_wan_start(&wan, NULL, relay.ip, relay.port, &wan_params)) {
+      fprintf(stderr, "loopback: Failed to start WAN proxy\n");
+      return 1;
+    }
+    strcpy(via.ip, wan.ip);
+    via.port = wan.port;
+  }
+
+  deadline = bench_ns() + (uint64_t) BENCH_LB_TIMEOUT_S * 1000000000;
+  if (NULL == (pkm = bench_connector_start(args->use_tls, bl.count + 16,
+                                           backend.port, 1, &via,
+                                           NULL))) {
+    fprintf(stderr, "loopback: Failed to start the connector\n");
+    goto cleanup;
+  }
+  if (0 > bench_connector_wait(pkm, &relay, deadline)) {
+    fprintf(stderr, "loopback: Tunnel never came up\n");
+    goto cleanup;
+  }
+
+  rss0 = rss = bench_rss_kb();
+  cpu0 = bench_cpu_s(NULL);
+  pkm_cpu0 = bench_cpu_s(&(pkm->main_thread));
+  t0 = bench_ns();
+
+  /* Hand the tunnel over to our driver; this kicks off all the streams. */
+  relay.chunk_cb = bench_lb_chunk;
+  relay.drive_cb = bench_lb_drive;
+  while ((bl.done < bl.count) && (bench_ns() < deadline)) {
+    long now_kb = bench_rss_kb();
+    if (now_kb > rss) rss = now_kb;
+    usleep(10000);
+  }
+  if (bl.done < bl.count) {
+    fprintf(stderr, "loopback: Timed out, %d/%d streams done\n",
+                    bl.done, bl.count);
+  }
+  else {
+    snprintf(name, sizeof(name), "loopback/%s%s%s",
+             args->use_tls ? "tls" : "plain",
+             args->wan ? "/wan:" : "", args->wan ? args->wan : "");
+    bench_lb_report(name, &bl,
+                    bl.finished_ns - t0,
+                    bench_cpu_s(NULL) - cpu0,
+                    bench_cpu_s(&(pkm->main_thread)) - pkm_cpu0,
+                    rss - rss0);
+    rv = (bl.errors > 0);
+  }
+
+cleanup:
+  bench_connector_stop(pkm);
+  if (args->wan) bench_wan_stop(&wan);
+  bench_relay_stop(&relay);
+  bench_backend_stop(&backend);
+  free(bl.streams);
+  free(bl.frame);
+  free(bl.payload);
+  return rv;
+}
+
+int bench_loopback_main(int argc, char** argv)
+{
+  struct bench_lb_args args;
+  int streams = BENCH_LB_STREAMS;
+  size_t bytes = BENCH_LB_BYTES;
+  struct bench_wan_params wan_params;
+  const char* mode = "both";
+  const char* wan = NULL;
+  int i, rv = 0;
+
+  for (i = 1; i < argc; i++) {
+    if ((0 == strcmp(argv[i], "-n")) && (i + 1 < argc)) {
+      streams = atoi(argv[++i]);
+    }
+    else if ((0 == strcmp(argv[i], "-b")) && (i + 1 < argc)) {
+      bytes = strtoul(argv[++i], NULL, 0);
+    }
+    else if ((0 == strcmp(argv[i], "-W")) && (i + 1 < argc)) {
+      wan = argv[++i];
+      if (0 > bench_wan_parse(&wan_params, wan)) streams = 0;
+    }
+    else if (argv[i][0] != '-') {
+      mode = argv[i];
+    }
+    else {
+      streams = 0;
+      break;
+    }
+  }
+  if ((streams < 1) || (bytes < 1) ||
+      (strcmp(mode, "plain") && strcmp(mode, "tls") && strcmp(mode, "both"))) {
+    fprintf(stderr, "Usage: benchmarks loopback [-n <streams>] [-b <bytes>]"
+                    " [-W <spec>] [plain|tls|both]\n");
+    return 1;
+  }
+
+  args.streams = streams;
+  args.bytes = bytes;
+  args.wan = wan;
+  if (strcmp(mode, "tls")) {
+    args.use_tls = 0;
+    rv |= bench_fork(bench_lb_run, &args);
+  }
+  if (strcmp(mode, "plain")) {
+    args.use_tls = 1;
+    rv |= bench_fork(bench_lb_run, &args);
+  }
+  return rv;
+}
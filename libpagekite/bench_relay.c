@@ -0,0 +1,570 @@
+/******************************************************************************
+bench_relay.c - A stub front-end relay and echo back-end for benchmarks.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************
+
+The relay speaks just enough of the front-end protocol to get a real
+pk_manager to fly a tunnel to it: it answers pings, accepts any kite in
+the handshake (optionally over TLS, with a throw-away self-signed cert)
+and then exchanges chunks, leaving the content of the traffic to the
+benchmark driving it. It also plays dynamic DNS server, blindly
+accepting any update.
+
+Both servers are deliberately simple and single-threaded, so their own
+overhead is easy to reason about and stays out of the way of the code
+being measured.
+
+******************************************************************************/
+
+#define PAGEKITE_CONSTANTS_ONLY
+#include "pagekite.h"
+
+#include "pkcommon.h"
+#include <poll.h>
+#include <netinet/tcp.h>
+
+#include "pkutils.h"
+#include "pkerror.h"
+#include "pkconn.h"
+#include "pkproto.h"
+#include "bench.h"
+
+#define BENCH_HANDSHAKE_MAX   (16 * 1024)
+#define BENCH_ECHO_BUFSIZE    (16 * 1024)
+#define BENCH_POLL_MS         5
+
+
+/*** Shared helpers **********************************************************/
+
+int bench_listen(const char* ip, int* port)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd, one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  inet_pton(AF_INET, ip, &(addr.sin_addr));
+  addr.sin_port = htons(*port);
+
+  if ((0 > (fd = socket(AF_INET, SOCK_STREAM, 0))) ||
+      (0 > setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) ||
+      (0 > bind(fd, (struct sockaddr*) &addr, sizeof(addr))) ||
+      (0 > listen(fd, 1024)) ||
+      (0 > getsockname(fd, (struct sockaddr*) &addr, &len))) {
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  set_non_blocking(fd);
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+
+/*** TLS *********************************************************************/
+
+#ifdef HAVE_OPENSSL
+/* Generate a throw-away key and self-signed certificate. The connector
+ * does not verify front-end certificates, so anything will do. */
+static SSL_CTX* bench_ssl_ctx(void)
+{
+  SSL_CTX* ctx = NULL;
+  EVP_PKEY* key = NULL;
+  EVP_PKEY_CTX* kctx = NULL;
+  X509* cert = NULL;
+
+  if ((NULL == (kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL))) ||
+      (0 >= EVP_PKEY_keygen_init(kctx)) ||
+      (0 >= EVP_PKEY_CTX_set_rsa_keygen_bits(kctx, 2048)) ||
+      (0 >= EVP_PKEY_keygen(kctx, &key)) ||
+      (NULL == (cert = X509_new()))) goto cleanup;
+
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_get_notBefore(cert), 0);
+  X509_gmtime_adj(X509_get_notAfter(cert), 86400);
+  X509_set_pubkey(cert, key);
+  X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                             (unsigned char*) BENCH_KITE_DOMAIN, -1, -1, 0);
+  X509_set_issuer_name(cert, X509_get_subject_name(cert));
+  if ((0 >= X509_sign(cert, key, EVP_sha256())) ||
+      (NULL == (ctx = SSL_CTX_new(SSLv23_server_method())))) goto cleanup;
+
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                        SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  if ((1 != SSL_CTX_use_certificate(ctx, cert)) ||
+      (1 != SSL_CTX_use_PrivateKey(ctx, key))) {
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+  }
+
+cleanup:
+  if (cert) X509_free(cert);
+  if (key) EVP_PKEY_free(key);
+  if (kctx) EVP_PKEY_CTX_free(kctx);
+  return ctx;
+}
+#endif
+
+
+/*** Stub relay **************************************************************/
+
+static ssize_t bench_relay_read(struct bench_relay* br, char* buf, size_t len)
+{
+  ssize_t rv;
+#ifdef HAVE_OPENSSL
+  if (br->ssl) {
+    rv = SSL_read(br->ssl, buf, len);
+    if (rv > 0) return rv;
+    switch (SSL_get_error(br->ssl, rv)) {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+      case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    }
+    errno = EIO;
+    return -1;
+  }
+#endif
+  rv = read(br->tunnel_fd, buf, len);
+  return rv;
+}
+
+static ssize_t bench_relay_write(struct bench_relay* br,
+                                 const char* buf, size_t len)
+{
+#ifdef HAVE_OPENSSL
+  ssize_t rv;
+  if (br->ssl) {
+    rv = SSL_write(br->ssl, buf, len);
+    if (rv > 0) return rv;
+    switch (SSL_get_error(br->ssl, rv)) {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    }
+    errno = EIO;
+    return -1;
+  }
+#endif
+  return write(br->tunnel_fd, buf, len);
+}
+
+static void bench_relay_close(struct bench_relay* br)
+{
+#ifdef HAVE_OPENSSL
+  if (br->ssl) SSL_free(br->ssl);
+#endif
+  if (br->tunnel_fd >= 0) close(br->tunnel_fd);
+  br->ssl = NULL;
+  br->tunnel_fd = -1;
+  br->tunnel_up = 0;
+  br->out_bytes = 0;
+}
+
+static void bench_relay_chunk(void* data, struct pk_chunk* chunk)
+{
+  struct bench_relay* br = (struct bench_relay*) data;
+  char pong[256];
+
+  if (chunk->ping) {
+    bench_relay_send(br, pong, pk_format_pong(pong));
+  }
+  else if ((NULL == chunk->noop) && (NULL != br->chunk_cb)) {
+    br->chunk_cb(br, chunk);
+  }
+}
+
+/* Accept a new connection: either a ping, which we answer and close, or
+ * a tunnel handshake. The handshake is done blocking, which is fine as
+ * the connector does the same on its side. */
+static void bench_relay_accept(struct bench_relay* br)
+{
+  char buffer[BENCH_HANDSHAKE_MAX+1];
+  char reply[BENCH_HANDSHAKE_MAX+1];
+  char *p, *eol;
+  unsigned char first;
+  uint64_t accept_ns, tls_ns;
+  size_t got, rlen;
+  ssize_t rv;
+  SSL* ssl = NULL;
+  int fd, one = 1;
+
+  if (0 > (fd = accept(br->listen_fd, NULL, NULL))) return;
+  accept_ns = bench_ns();
+  set_blocking(fd);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (1 != recv(fd, &first, 1, MSG_PEEK)) goto fail;
+  if (first == 0x16) {
+#ifdef HAVE_OPENSSL
+    if ((NULL == br->ssl_ctx) ||
+        (NULL == (ssl = SSL_new(br->ssl_ctx))) ||
+        (1 != SSL_set_fd(ssl, fd)) ||
+        (1 != SSL_accept(ssl))) goto fail;
+#else
+    goto fail;
+#endif
+  }
+  tls_ns = bench_ns();
+
+  for (got = 0; got < BENCH_HANDSHAKE_MAX; got += rv) {
+#ifdef HAVE_OPENSSL
+    if (ssl) rv = SSL_read(ssl, buffer + got, BENCH_HANDSHAKE_MAX - got);
+    else
+#endif
+    rv = read(fd, buffer + got, BENCH_HANDSHAKE_MAX - got);
+    if (rv <= 0) goto fail;
+    buffer[got + rv] = '\0';
+    if (strstr(buffer, "\r\n\r\n")) break;
+  }
+  got = strlen(buffer);
+
+  if (0 == strncmp(buffer, "GET /ping", 9)) {
+    /* The connector insists on at least 120 bytes, see pkb_tunnel_ping. */
+    rlen = sprintf(reply, "%s\r\nX-PageKite-UUID: bench-%d\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Content-Length: 0\r\n%-40s\r\n\r\n",
+                          PK_FRONTEND_PONG, br->port, "X-Padding: 1");
+    if (write(fd, reply, rlen)) { /* Best effort */ }
+    goto fail;
+  }
+  if (0 == strncmp(buffer, "GET /", 5)) {
+    /* Anything else is a dynamic DNS update, see pkb_update_dns. */
+    rlen = sprintf(reply, "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: text/plain\r\n\r\ngood\n");
+    if (write(fd, reply, rlen)) { /* Best effort */ }
+    goto fail;
+  }
+  if (0 != strncmp(buffer, PK_HANDSHAKE_CONNECT, 17)) goto fail;
+
+  /* Accept every kite requested, by echoing its request line back. */
+  rlen = sprintf(reply, "HTTP/1.1 200 OK\r\n");
+  for (p = buffer; (p < buffer + got) && (*p != '\0'); p = eol + 1) {
+    if (NULL == (eol = strchr(p, '\n'))) break;
+    if ((0 == strncasecmp(p, "X-PageKite: ", 12)) &&
+        (rlen + (eol - p) + 64 < BENCH_HANDSHAKE_MAX)) {
+      rlen += sprintf(reply + rlen, "X-PageKite-OK: %.*s\n",
+                                    (int) (eol - p - 12), p + 12);
+    }
+  }
+  rlen += sprintf(reply + rlen, "X-PageKite-SessionID: bench%d\r\n\r\n",
+                                br->port);
+#ifdef HAVE_OPENSSL
+  if (ssl) rv = SSL_write(ssl, reply, rlen);
+  else
+#endif
+  rv = write(fd, reply, rlen);
+  if (rv != (ssize_t) rlen) goto fail;
+
+  /* Replace any previous tunnel, the connector has given up on it. */
+  bench_relay_close(br);
+  pk_parser_reset(br->parser);
+  set_non_blocking(fd);
+  br->tunnel_fd = fd;
+  br->ssl = ssl;
+  br->accept_ns = accept_ns;
+  br->tls_ns = tls_ns;
+  br->tunnel_up_ns = bench_ns();
+  br->tunnel_up = 1;
+  return;
+
+fail:
+#ifdef HAVE_OPENSSL
+  if (ssl) SSL_free(ssl);
+#endif
+  close(fd);
+}
+
+static void bench_relay_flush(struct bench_relay* br)
+{
+  ssize_t rv;
+  size_t done = 0;
+
+  while (done < br->out_bytes) {
+    rv = bench_relay_write(br, br->out_buf + done, br->out_bytes - done);
+    if (rv > 0) {
+      done += rv;
+    }
+    else {
+      if ((rv < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+        bench_relay_close(br);
+      break;
+    }
+  }
+  if (done && (br->tunnel_fd >= 0)) {
+    memmove(br->out_buf, br->out_buf + done, br->out_bytes - done);
+    br->out_bytes -= done;
+  }
+}
+
+static void* bench_relay_run(void* data)
+{
+  struct bench_relay* br = (struct bench_relay*) data;
+  struct pollfd pfd[2];
+  char buffer[64 * 1024];
+  ssize_t rv;
+  int i, n;
+
+  while (br->running) {
+    /* Play dead: the connector will only notice by timing out. */
+    if (br->blackhole) {
+      usleep(BENCH_POLL_MS * 1000);
+      continue;
+    }
+
+    n = 0;
+    pfd[n].fd = br->listen_fd;
+    pfd[n++].events = POLLIN;
+    if (br->tunnel_fd >= 0) {
+      pfd[n].fd = br->tunnel_fd;
+      pfd[n++].events = POLLIN | (br->out_bytes ? POLLOUT : 0);
+    }
+    poll(pfd, n, BENCH_POLL_MS);
+
+    if (pfd[0].revents & POLLIN) bench_relay_accept(br);
+
+    /* TLS may buffer records poll() cannot see, so always try to read. */
+    for (i = 0; (i < 16) && (br->tunnel_fd >= 0); i++) {
+      rv = bench_relay_read(br, buffer, sizeof(buffer));
+      if (rv > 0) {
+        if (0 > pk_parser_parse(br->parser, rv, buffer)) bench_relay_close(br);
+      }
+      else {
+        if ((rv == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+          bench_relay_close(br);
+        break;
+      }
+    }
+
+    if (br->tunnel_up && (NULL != br->drive_cb)) br->drive_cb(br);
+    if (br->tunnel_fd >= 0) bench_relay_flush(br);
+  }
+  if (!br->detach) bench_relay_close(br);
+  return NULL;
+}
+
+int bench_relay_send(struct bench_relay* br, const char* data, size_t len)
+{
+  if (bench_relay_out_free(br) < len) return -1;
+  memcpy(br->out_buf + br->out_bytes, data, len);
+  br->out_bytes += len;
+  return len;
+}
+
+size_t bench_relay_out_free(struct bench_relay* br)
+{
+  return BENCH_RELAY_OUT_MAX - br->out_bytes;
+}
+
+/* Start a relay on an ephemeral port of the given loopback IP (default
+ * 127.0.0.1), with TLS if use_tls. Returns the port number, or -1 on
+ * failure. */
+int bench_relay_start(struct bench_relay* br, const char* ip, int use_tls,
+                      bench_relay_cb* chunk_cb, bench_drive_cb* drive_cb,
+                      void* data)
+{
+  memset(br, 0, sizeof(struct bench_relay));
+  strncpy(br->ip, ip ? ip : BENCH_LOOPBACK_IP, sizeof(br->ip) - 1);
+  br->tunnel_fd = -1;
+  br->chunk_cb = chunk_cb;
+  br->drive_cb = drive_cb;
+  br->data = data;
+
+#ifdef HAVE_OPENSSL
+  if (use_tls && (NULL == (br->ssl_ctx = bench_ssl_ctx()))) return -1;
+#else
+  if (use_tls) return -1;
+#endif
+
+  br->parser_buf = malloc(PARSER_BYTES_MAX);
+  br->out_buf = malloc(BENCH_RELAY_OUT_MAX);
+  if ((NULL == br->parser_buf) || (NULL == br->out_buf)) return -1;
+  br->parser = pk_parser_init(PARSER_BYTES_MAX, br->parser_buf,
+                              bench_relay_chunk, br);
+
+  if (0 > (br->listen_fd = bench_listen(br->ip, &(br->port)))) return -1;
+  br->running = 1;
+  if (0 != pthread_create(&(br->thread), NULL, bench_relay_run, br)) {
+    br->running = 0;
+    return -1;
+  }
+  return br->port;
+}
+
+/* Stop the relay thread, but leave the tunnel up and hand its socket
+ * (non-blocking, plain TCP only) to the caller. Returns -1 if there is
+ * no such tunnel. */
+int bench_relay_detach(struct bench_relay* br)
+{
+  int fd;
+  if (br->running) {
+    br->detach = 1;
+    br->running = 0;
+    pthread_join(br->thread, NULL);
+  }
+  if (br->ssl || br->out_bytes) bench_relay_close(br);
+  fd = br->tunnel_fd;
+  br->tunnel_fd = -1;
+  br->tunnel_up = 0;
+  return fd;
+}
+
+void bench_relay_stop(struct bench_relay* br)
+{
+  if (br->running) {
+    br->running = 0;
+    pthread_join(br->thread, NULL);
+  }
+  if (br->listen_fd >= 0) close(br->listen_fd);
+#ifdef HAVE_OPENSSL
+  if (br->ssl_ctx) SSL_CTX_free(br->ssl_ctx);
+#endif
+  free(br->parser_buf);
+  free(br->out_buf);
+  br->ssl_ctx = NULL;
+  br->parser_buf = br->out_buf = NULL;
+  br->listen_fd = -1;
+}
+
+
+/*** Echo back-end ***********************************************************/
+
+/* The echo server may have to juggle 100k connections, so unlike the
+ * relay it uses its own libev loop rather than poll(). */
+struct bench_echo_conn {
+  ev_io  watcher;             /* Must be first, we cast watchers to conns */
+  int    events;
+  size_t bytes;
+  size_t size;
+  int    eof;
+  char   buffer[];
+};
+
+static void bench_echo_cb(EV_P_ ev_io* w, int revents)
+{
+  struct bench_echo_conn* ec = (struct bench_echo_conn*) w;
+  int events;
+  ssize_t rv;
+
+  if ((revents & EV_READ) && (ec->bytes < ec->size)) {
+    rv = read(w->fd, ec->buffer + ec->bytes, ec->size - ec->bytes);
+    if (rv > 0) ec->bytes += rv;
+    else if ((rv == 0) || (errno != EAGAIN)) ec->eof = 1;
+  }
+  if (ec->bytes) {
+    rv = write(w->fd, ec->buffer, ec->bytes);
+    if (rv > 0) {
+      memmove(ec->buffer, ec->buffer + rv, ec->bytes - rv);
+      ec->bytes -= rv;
+    }
+    else if (errno != EAGAIN) {
+      ec->eof = 1;
+      ec->bytes = 0;
+    }
+  }
+
+  ev_io_stop(EV_A_ w);
+  if (ec->eof && !ec->bytes) {
+    close(w->fd);
+    free(ec);
+    return;
+  }
+  events = (((!ec->eof) && (ec->bytes < ec->size)) ? EV_READ : 0)
+         | (ec->bytes ? EV_WRITE : 0);
+  ev_io_set(w, w->fd, events);
+  ev_io_start(EV_A_ w);
+}
+
+static void bench_echo_accept_cb(EV_P_ ev_io* w, int revents)
+{
+  struct bench_backend* bb = (struct bench_backend*) w->data;
+  struct bench_echo_conn* ec;
+  int fd, one = 1;
+
+  while (0 <= (fd = accept(w->fd, NULL, NULL))) {
+    ec = malloc(sizeof(struct bench_echo_conn) + bb->buffer_size);
+    if (NULL == ec) {
+      close(fd);
+      break;
+    }
+    set_non_blocking(fd);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ec->bytes = ec->eof = 0;
+    ec->size = bb->buffer_size;
+    ev_io_init(&(ec->watcher), bench_echo_cb, fd, EV_READ);
+    ev_io_start(EV_A_ &(ec->watcher));
+  }
+  (void) revents;
+}
+
+static void bench_echo_quit_cb(EV_P_ ev_async* w, int revents)
+{
+  ev_unloop(EV_A_ EVUNLOOP_ALL);
+  (void) w;
+  (void) revents;
+}
+
+static void* bench_backend_run(void* data)
+{
+  struct bench_backend* bb = (struct bench_backend*) data;
+  ev_loop(bb->loop, 0);
+  return NULL;
+}
+
+/* Start the echo server on an ephemeral loopback port, with buffer_size
+ * bytes of buffer per connection (0 for the default).
+ * Returns the port number, or -1 on failure. Connections still open when
+ * the server is stopped are leaked; it only lives as long as a benchmark.
+ */
+int bench_backend_start(struct bench_backend* bb, size_t buffer_size)
+{
+  memset(bb, 0, sizeof(struct bench_backend));
+  bb->buffer_size = buffer_size ? buffer_size : BENCH_ECHO_BUFSIZE;
+  if (0 > (bb->listen_fd = bench_listen(BENCH_LOOPBACK_IP, &(bb->port))))
+    return -1;
+  if (NULL == (bb->loop = ev_loop_new(0))) return -1;
+
+  ev_io_init(&(bb->listener), bench_echo_accept_cb, bb->listen_fd, EV_READ);
+  bb->listener.data = (void *) bb;
+  ev_io_start(bb->loop, &(bb->listener));
+  ev_async_init(&(bb->quit), bench_echo_quit_cb);
+  ev_async_start(bb->loop, &(bb->quit));
+
+  bb->running = 1;
+  if (0 != pthread_create(&(bb->thread), NULL, bench_backend_run, bb)) {
+    bb->running = 0;
+    return -1;
+  }
+  return bb->port;
+}
+
+void bench_backend_stop(struct bench_backend* bb)
+{
+  if (bb->running) {
+    ev_async_send(bb->loop, &(bb->quit));
+    pthread_join(bb->thread, NULL);
+    bb->running = 0;
+  }
+  if (bb->loop) ev_loop_destroy(bb->loop);
+  if (bb->listen_fd >= 0) close(bb->listen_fd);
+  bb->loop = NULL;
+  bb->listen_fd = -1;
+}
@@ -0,0 +1,503 @@
+/******************************************************************************
+bench_replay.c - Replay captured tunnel traffic through a real connector.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************
+
+Usage: benchmarks replay [-f] [plain|tls] <capture-file>
+
+Plays back a capture made with pagekite_set_tunnel_capture() (see
+pkcapture.c): the recorded bytes are cut into frames, any partial frames
+left by reconnects are discarded and the result is sent down a tunnel by
+the stub relay, to a real pk_manager. Every kite seen in the capture is
+configured on the connector and pointed at the echo back-end, so the
+traffic exercises pkc_read(), the parser, pkm_chunk_cb() and the back-end
+connection code just like it did in production.
+
+Frames are sent at their recorded times, or with -f as fast as the tunnel
+will take them, which is the mode to use under a profiler. If the capture
+covers multiple tunnels, they are merged into one in time order; stream
+IDs are assumed not to collide.
+
+Reported are: the volume replayed, recorded vs. replay duration, the
+connector's CPU time (total and per frame) and event-loop latency, and
+how much the back-ends sent back.
+
+******************************************************************************/
+
+#include "pagekite.h"
+
+#include "pkcommon.h"
+#include "pkutils.h"
+#include "pkerror.h"
+#include "pkhooks.h"
+#include "pkconn.h"
+#include "pkstate.h"
+#include "pkstats.h"
+#include "pkproto.h"
+#include "pkblocker.h"
+#include "pkmanager.h"
+#include "pklogging.h"
+#include "pkcapture.h"
+#include "bench.h"
+
+#define BENCH_RP_MAX_KITES      64
+#define BENCH_RP_FRAME_MAX      (16 * 1024 * 1024)
+#define BENCH_RP_FRAME_HDR_MAX  20
+#define BENCH_RP_QUIET_NS       (200 * 1000000ULL)
+#define BENCH_RP_TIMEOUT_S      60
+
+struct bench_rp_frame {
+  uint64_t  ts_us;
+  size_t    offset;             /* Into bench_replay.data */
+  size_t    length;
+};
+
+struct bench_rp_kite {
+  char      proto[PK_PROTOCOL_LENGTH+1];
+  char      domain[PK_DOMAIN_LENGTH+1];
+  int       port;
+};
+
+/* Reassembly of one captured tunnel's byte stream into frames. */
+struct bench_rp_tunnel {
+  char*     buf;
+  size_t    bytes;
+  size_t    max;
+};
+
+struct bench_replay {
+  /* The capture, as whole frames back to back */
+  char*                  data;
+  size_t                 data_bytes;
+  size_t                 data_max;
+  struct bench_rp_frame* frames;
+  int                    frame_count;
+  int                    frame_max;
+  int                    tunnels;
+  size_t                 dropped;
+  struct bench_rp_kite   kites[BENCH_RP_MAX_KITES];
+  int                    kite_count;
+  int                    streams;
+
+  /* Replay progress; the drive state is owned by the relay thread */
+  int                    fast;
+  uint64_t               t0_ns;
+  int                    next;
+  size_t                 next_off;
+  volatile uint64_t      sent_ns;
+  volatile uint64_t      last_reply_ns;
+  volatile uint64_t      reply_bytes;
+  volatile int           eofs;
+};
+
+
+/*** Loading *****************************************************************/
+
+static int bench_rp_need(char** buf, size_t* max, size_t bytes)
+{
+  char* nbuf;
+  size_t nmax = *max ? *max : 64 * 1024;
+  if (bytes <= *max) return 0;
+  while (nmax < bytes) nmax *= 2;
+  if (NULL == (nbuf = realloc(*buf, nmax))) return -1;
+  *buf = nbuf;
+  *max = nmax;
+  return 0;
+}
+
+static int bench_rp_add_frame(struct bench_replay* rp, uint64_t ts_us,
+                              const char* data, size_t length)
+{
+  struct bench_rp_frame* nf;
+  if (rp->frame_count >= rp->frame_max) {
+    rp->frame_max = rp->frame_max ? 2 * rp->frame_max : 1024;
+    nf = realloc(rp->frames, rp->frame_max * sizeof(struct bench_rp_frame));
+    if (NULL == nf) return -1;
+    rp->frames = nf;
+  }
+  if (0 > bench_rp_need(&(rp->data), &(rp->data_max),
+                        rp->data_bytes + length)) return -1;
+
+  nf = &(rp->frames[rp->frame_count++]);
+  nf->ts_us = ts_us;
+  nf->offset = rp->data_bytes;
+  nf->length = length;
+  memcpy(rp->data + rp->data_bytes, data, length);
+  rp->data_bytes += length;
+  return 0;
+}
+
+/* Move every complete frame ("<hex length>\r\n<data>") from the tunnel's
+ * reassembly buffer to the frame list. */
+static int bench_rp_reassemble(struct bench_replay* rp,
+                               struct bench_rp_tunnel* t, uint64_t ts_us)
+{
+  size_t used = 0, avail, hlen;
+  unsigned long length;
+  char *p, *eol;
+
+  while (used < t->bytes) {
+    p = t->buf + used;
+    avail = t->bytes - used;
+    eol = memchr(p, '\n', (avail < BENCH_RP_FRAME_HDR_MAX) ?
+                          avail : BENCH_RP_FRAME_HDR_MAX);
+    if (NULL == eol) {
+      if (avail >= BENCH_RP_FRAME_HDR_MAX) return -1;
+      break;
+    }
+    if ((1 != sscanf(p, "%lx", &length)) || (length > BENCH_RP_FRAME_MAX))
+      return -1;
+    hlen = eol - p + 1;
+    if (avail < hlen + length) break;
+    if (0 > bench_rp_add_frame(rp, ts_us, p, hlen + length)) return -1;
+    used += hlen + length;
+  }
+  memmove(t->buf, t->buf + used, t->bytes - used);
+  t->bytes -= used;
+  return 0;
+}
+
+static void bench_rp_chunk(void* data, struct pk_chunk* chunk)
+{
+  struct bench_replay* rp = (struct bench_replay*) data;
+  struct bench_rp_kite* k;
+  int i, port;
+
+  /* Oversized frames are delivered in fragments, count them once. */
+  if ((NULL == chunk->request_proto) || (NULL == chunk->request_host) ||
+      (chunk->offset != chunk->length)) return;
+  rp->streams++;
+
+  port = chunk->request_port;
+  for (i = 0; i < rp->kite_count; i++) {
+    k = &(rp->kites[i]);
+    if ((0 == strcasecmp(k->proto, chunk->request_proto)) &&
+        (0 == strcasecmp(k->domain, chunk->request_host)) &&
+        (k->port == port)) return;
+  }
+  if ((rp->kite_count >= BENCH_RP_MAX_KITES) ||
+      ((0 == strcasecmp(chunk->request_proto, "raw")) && (port < 1))) return;
+  k = &(rp->kites[rp->kite_count++]);
+  strncpyz(k->proto, chunk->request_proto, PK_PROTOCOL_LENGTH);
+  strncpyz(k->domain, chunk->request_host, PK_DOMAIN_LENGTH);
+  k->port = port;
+}
+
+static int bench_rp_load(struct bench_replay* rp, const char* path)
+{
+  struct bench_rp_tunnel tunnels[PK_CAPTURE_MAX_TUNNELS];
+  struct bench_rp_tunnel* t;
+  struct pk_capture_record rec;
+  struct pk_parser* parser;
+  char* file = NULL;
+  char* parser_buf = NULL;
+  size_t file_bytes = 0, file_max = 0, done;
+  ssize_t rv;
+  FILE* fd;
+  int i, ok = 0;
+
+  memset(tunnels, 0, sizeof(tunnels));
+  memset(&rec, 0, sizeof(rec));
+
+  if (NULL == (fd = fopen(path, "rb"))) return -1;
+  do {
+    if (0 > bench_rp_need(&file, &file_max, file_bytes + 64 * 1024)) break;
+    rv = fread(file + file_bytes, 1, file_max - file_bytes, fd);
+    file_bytes += rv;
+  } while (rv > 0);
+  fclose(fd);
+  if ((file_bytes < PK_CAPTURE_MAGIC_LEN) ||
+      (0 != memcmp(file, PK_CAPTURE_MAGIC, PK_CAPTURE_MAGIC_LEN))) {
+    fprintf(stderr, "replay: %s: Not a tunnel capture\n", path);
+    goto cleanup;
+  }
+
+  for (done = PK_CAPTURE_MAGIC_LEN; done < file_bytes; done += rv) {
+    if (0 >= (rv = pk_capture_parse(file + done, file_bytes - done, &rec)))
+      break;
+    t = &(tunnels[rec.tunnel]);
+    if (0 == rec.length) {
+      /* Discontinuity: whatever was left of the last frame is garbage. */
+      rp->dropped += t->bytes;
+      t->bytes = 0;
+      continue;
+    }
+    if ((0 > bench_rp_need(&(t->buf), &(t->max), t->bytes + rec.length)))
+      goto cleanup;
+    memcpy(t->buf + t->bytes, rec.data, rec.length);
+    t->bytes += rec.length;
+    if (0 > bench_rp_reassemble(rp, t, rec.ts_us)) {
+      fprintf(stderr, "replay: %s: Bad frame in tunnel %d\n",
+                      path, rec.tunnel);
+      goto cleanup;
+    }
+  }
+  if (done < file_bytes) {
+    fprintf(stderr, "replay: %s: Truncated at byte %zu\n", path, done);
+  }
+  for (i = 0; i < PK_CAPTURE_MAX_TUNNELS; i++) {
+    if (tunnels[i].max) rp->tunnels++;
+    rp->dropped += tunnels[i].bytes;
+  }
+
+  /* Run everything through a parser once, to find out which kites (and
+   * how many streams) we need to serve. */
+  if (NULL == (parser_buf = malloc(PARSER_BYTES_MAX))) goto cleanup;
+  parser = pk_parser_init(PARSER_BYTES_MAX, parser_buf, bench_rp_chunk, rp);
+  if ((NULL == parser) ||
+      ((rp->data_bytes > 0) &&
+       (0 > pk_parser_parse(parser, rp->data_bytes, rp->data)))) {
+    fprintf(stderr, "replay: %s: Failed to parse capture\n", path);
+    goto cleanup;
+  }
+  ok = 1;
+
+cleanup:
+  for (i = 0; i < PK_CAPTURE_MAX_TUNNELS; i++) free(tunnels[i].buf);
+  free(parser_buf);
+  free(file);
+  return ok ? 0 : -1;
+}
+
+
+/*** Replay ******************************************************************/
+
+/* Called on every relay loop iteration: send all frames which are due,
+ * for as long as the relay has room for them. Large frames are split. */
+static void bench_rp_drive(struct bench_relay* br)
+{
+  struct bench_replay* rp = (struct bench_replay*) br->data;
+  struct bench_rp_frame* f;
+  uint64_t now = bench_ns();
+  size_t room, len;
+
+  if (0 == rp->t0_ns) rp->t0_ns = now;
+  while (rp->next < rp->frame_count) {
+    f = &(rp->frames[rp->next]);
+    if (!rp->fast &&
+        (rp->t0_ns + 1000 * (f->ts_us - rp->frames[0].ts_us) > now)) return;
+
+    if (0 == (room = bench_relay_out_free(br))) return;
+    len = f->length - rp->next_off;
+    if (len > room) len = room;
+    bench_relay_send(br, rp->data + f->offset + rp->next_off, len);
+    rp->next_off += len;
+    if (rp->next_off < f->length) return;
+
+    rp->next_off = 0;
+    rp->next++;
+  }
+  if (0 == rp->sent_ns) rp->sent_ns = bench_ns();
+}
+
+/* What the connector sends back: echoed data, acks and EOFs. */
+static void bench_rp_reply(struct bench_relay* br, struct pk_chunk* chunk)
+{
+  struct bench_replay* rp = (struct bench_replay*) br->data;
+  rp->last_reply_ns = bench_ns();
+  if (NULL != chunk->eof) rp->eofs++;
+  if (chunk->length > 0) rp->reply_bytes += chunk->length;
+}
+
+static struct pk_manager* bench_rp_connector_start(struct bench_replay* rp,
+                                                   int use_tls, int be_port,
+                                                   struct bench_relay* relay)
+{
+  pagekite_mgr pkm;
+  struct bench_rp_kite* k;
+  int i, conns;
+
+  /* The capture tells us how many streams to expect, but not how many
+   * were live at once; assume the worst, within reason. */
+  conns = rp->streams + 16;
+  if (conns > 4096) conns = 4096;
+
+  /* Note: max_kites is one larger than needed, pkm_add_kite refuses to
+   *       fill the last slot. */
+  pkm = pagekite_init("bench", rp->kite_count + 2, 1, conns, NULL,
+                      PK_WITH_IPV4 | (use_tls ? PK_WITH_SSL : 0) |
+                      PK_WITHOUT_SERVICE_FRONTENDS,
+                      PK_LOG_ERRORS);
+  if (NULL == pkm) return NULL;
+  pk_state.dns_check_name = BENCH_KITE_DOMAIN;
+
+  /* The bench kite makes sure there is something to fly. */
+  if (0 > pagekite_add_kite(pkm, BENCH_KITE_PROTO, BENCH_KITE_DOMAIN,
+                            BENCH_KITE_PORT, "benchsecret",
+                            BENCH_LOOPBACK_IP, be_port)) goto fail;
+  for (i = 0; i < rp->kite_count; i++) {
+    k = &(rp->kites[i]);
+    if (0 > pagekite_add_kite(pkm, k->proto, k->domain, k->port,
+                              "benchsecret", BENCH_LOOPBACK_IP, be_port)) {
+      fprintf(stderr, "replay: Failed to add kite %s://%s:%d\n",
+                      k->proto, k->domain, k->port);
+      goto fail;
+    }
+  }
+  if ((1 > pagekite_add_frontend(pkm, relay->ip, relay->port)) ||
+      (0 > pagekite_thread_start(pkm))) goto fail;
+  return (struct pk_manager*) pkm;
+
+fail:
+  pagekite_free(pkm);
+  return NULL;
+}
+
+/* The relay considers the tunnel up as soon as it has replied to the
+ * handshake, but anything sent before the connector is done with its
+ * side of the handshake would be lost. */
+static int bench_rp_connector_wait(struct pk_manager* pkm,
+                                   struct bench_relay* relay,
+                                   uint64_t deadline)
+{
+  struct pk_tunnel* fe = pkm->tunnels;
+  while (!relay->tunnel_up || (fe->conn.sockfd < 0) ||
+         (fe->conn.status & CONN_STATUS_CHANGING)) {
+    if (bench_ns() > deadline) return -1;
+    usleep(1000);
+  }
+  return 0;
+}
+
+struct bench_rp_args {
+  const char* path;
+  int         use_tls;
+  int         fast;
+};
+
+static int bench_rp_run(void* data)
+{
+  struct bench_rp_args* args = (struct bench_rp_args*) data;
+  struct bench_replay rp;
+  struct bench_relay relay;
+  struct bench_backend backend;
+  struct pk_manager* pkm = NULL;
+  uint64_t recorded_us, deadline, end_ns;
+  double pkm_cpu0, pkm_cpu;
+  int rv = 1;
+
+  memset(&rp, 0, sizeof(rp));
+  if (0 > bench_rp_load(&rp, args->path)) goto cleanup_data;
+  if (rp.frame_count < 1) {
+    fprintf(stderr, "replay: %s: No complete frames\n", args->path);
+    goto cleanup_data;
+  }
+  rp.fast = args->fast;
+  recorded_us = rp.frames[rp.frame_count-1].ts_us - rp.frames[0].ts_us;
+
+  if ((0 > bench_backend_start(&backend, 0)) ||
+      (0 > bench_relay_start(&relay, NULL, args->use_tls, NULL, NULL, &rp))) {
+    fprintf(stderr, "replay: Failed to start relay or back-end\n");
+    goto cleanup_data;
+  }
+
+  deadline = bench_ns() + (uint64_t) BENCH_RP_TIMEOUT_S * 1000000000;
+  if (NULL == (pkm = bench_rp_connector_start(&rp, args->use_tls,
+                                              backend.port, &relay))) {
+    fprintf(stderr, "replay: Failed to start the connector\n");
+    goto cleanup;
+  }
+  if (0 > bench_rp_connector_wait(pkm, &relay, deadline)) {
+    fprintf(stderr, "replay: Tunnel never came up\n");
+    goto cleanup;
+  }
+
+  pk_stats_reset();
+  pkm_cpu0 = bench_cpu_s(&(pkm->main_thread));
+
+  /* Go! Then wait for the relay to drain and the back-ends to go quiet. */
+  deadline = bench_ns() + (uint64_t) BENCH_RP_TIMEOUT_S * 1000000000;
+  if (!rp.fast) deadline += recorded_us * 1000;
+  relay.chunk_cb = bench_rp_reply;
+  relay.drive_cb = bench_rp_drive;
+  while (bench_ns() < deadline) {
+    if (rp.sent_ns && (0 == relay.out_bytes) &&
+        (bench_ns() - ((rp.last_reply_ns > rp.sent_ns) ?
+                       rp.last_reply_ns : rp.sent_ns) > BENCH_RP_QUIET_NS))
+      break;
+    usleep(10000);
+  }
+  pkm_cpu = bench_cpu_s(&(pkm->main_thread)) - pkm_cpu0;
+  if (!rp.sent_ns) {
+    fprintf(stderr, "replay: Timed out, %d/%d frames sent\n",
+                    rp.next, rp.frame_count);
+    goto cleanup;
+  }
+  end_ns = (rp.last_reply_ns > rp.sent_ns) ? rp.last_reply_ns : rp.sent_ns;
+
+  printf("bench=replay/%s%s tunnels=%d frames=%d bytes=%zu streams=%d"
+         " kites=%d dropped_bytes=%zu"
+         " recorded_ms=%.1f replay_ms=%.1f mbit_per_s=%.1f"
+         " pkm_cpu_ms=%.1f pkm_cpu_us_per_frame=%.2f"
+         " loop_p50_us=%u loop_p99_us=%u loop_max_us=%u"
+         " be_connect_p99_us=%u reply_bytes=%llu eofs=%d\n",
+         args->use_tls ? "tls" : "plain", rp.fast ? "/fast" : "",
+         rp.tunnels, rp.frame_count, rp.data_bytes, rp.streams,
+         rp.kite_count, rp.dropped,
+         recorded_us / 1000.0, (end_ns - rp.t0_ns) / 1000000.0,
+         (rp.data_bytes * 8000.0) / (double) (1 + rp.sent_ns - rp.t0_ns),
+         pkm_cpu * 1000.0, (pkm_cpu * 1000000.0) / rp.frame_count,
+         pk_histogram_percentile(&(pk_stats.loop_busy), 500),
+         pk_histogram_percentile(&(pk_stats.loop_busy), 990),
+         pk_stats.loop_busy.max_us,
+         pk_histogram_percentile(&(pk_stats.be_connect), 990),
+         (unsigned long long) rp.reply_bytes, rp.eofs);
+  fflush(stdout);
+  rv = 0;
+
+cleanup:
+  bench_connector_stop(pkm);
+  bench_relay_stop(&relay);
+  bench_backend_stop(&backend);
+cleanup_data:
+  free(rp.data);
+  free(rp.frames);
+  return rv;
+}
+
+int bench_replay_main(int argc, char** argv)
+{
+  struct bench_rp_args args;
+  const char* mode = "plain";
+  int i;
+
+  memset(&args, 0, sizeof(args));
+  for (i = 1; i < argc; i++) {
+    if (0 == strcmp(argv[i], "-f")) {
+      args.fast = 1;
+    }
+    else if ((0 == strcmp(argv[i], "plain")) || (0 == strcmp(argv[i], "tls"))) {
+      mode = argv[i];
+    }
+    else if ((argv[i][0] != '-') && (NULL == args.path)) {
+      args.path = argv[i];
+    }
+    else {
+      args.path = NULL;
+      break;
+    }
+  }
+  if (NULL == args.path) {
+    fprintf(stderr, "Usage: benchmarks replay [-f] [plain|tls]"
+                    " <capture-file>\n");
+    return 1;
+  }
+
+  args.use_tls = (0 == strcmp(mode, "tls"));
+  return bench_fork(bench_rp_run, &args);
+}
@@ -0,0 +1,956 @@
+/******************************************************************************
+bench_sim.c - Deterministic network simulation for flow-control tuning.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************
+
+Usage: benchmarks sim [-v] [-x <seed>] [-n <streams>] [-k <KB per stream>]
+                      [-B <tunnel kbit/s>] [-r <rtt ms>] [-l <loss %>]
+                      [-q <queue KB>] [-c <client kbit/s>]
+                      [-s <slow clients>] [-S <slow kbit/s>]
+                      [-w <socket buffer KB>] [<scenario>|all]
+
+A discrete-event simulation of a tunnel over a WAN link, which runs the
+real manager code (pkm_chunk_cb, pkm_flow_control_tunnel, the window
+logic in pkm_update_io and pkc_report_progress) without needing a real
+WAN, root or `tc` (compare tools/slow).
+
+The connector is a normal pk_manager, but without blocker threads or the
+housekeeping timer; its event loop is run by the simulator, one
+non-blocking iteration at a time, on virtual time (pk_virtual_time_us).
+All of its sockets are real, but only ever hold what the simulator has
+put there: time stands still until every socket has settled, then jumps
+to the next simulated event. The same scenario and seed therefore always
+give the same result, regardless of the speed or load of the machine.
+
+The tunnel is modelled as two links (one per direction), each with a
+bottleneck queue of limited size which drains at the link bandwidth into
+a propagation delay of RTT/2. Lost segments are delivered one RTT late
+(a fast retransmit) and hold up everything behind them, as TCP would.
+This is not a TCP model: there is no congestion control, the link simply
+runs at full rate whenever it has something queued.
+
+The front-end end of the tunnel is simulated too: it opens the streams,
+hands their data to clients which drain at their own bandwidth, and
+reports progress (SKB) every CONN_REPORT_INCREMENT KB, as pagekite.py
+does. The back-end serves each stream its data as fast as the connector
+will read it.
+
+Reported are per-stream goodput (-v), Jain's fairness index, utilisation,
+bottleneck queueing delay (upstream, where the data flows), how long
+streams spent in TNL_BLOCKED, and how much virtual time the connector's
+event loop spent stalled in blocking flushes of the tunnel. Fairness is computed on goodput relative to
+each stream's max-min fair share, so a slow client does not count against
+the policy, but the streams sharing the tunnel with it do.
+
+******************************************************************************/
+
+#include "pagekite.h"
+
+#include "pkcommon.h"
+#include <sys/syscall.h>
+#include "pkutils.h"
+#include "pkerror.h"
+#include "pkhooks.h"
+#include "pkconn.h"
+#include "pkstate.h"
+#include "pkstats.h"
+#include "pkproto.h"
+#include "pkblocker.h"
+#include "pkmanager.h"
+#include "pklogging.h"
+#include "bench.h"
+
+#define BENCH_SIM_MSS           1448
+#define BENCH_SIM_SETTLE        3      /* Idle iterations before time moves */
+#define BENCH_SIM_MAX_US        (3600ULL * 1000000)
+#define BENCH_SIM_SETUP_S       10
+#define BENCH_SIM_NEVER         ((uint64_t) -1)
+#define BENCH_SIM_SOCKBUF       (16 * 1024)
+
+struct bench_sim_params {
+  const char* name;
+  int         tunnel_kbit;
+  int         rtt_ms;
+  int         loss_ppm;
+  int         queue_kb;
+  int         streams;
+  int         kb;
+  int         client_kbit;     /* 0 is unlimited */
+  int         slow;
+  int         slow_kbit;
+  int         sockbuf_kb;      /* 0 leaves the kernel default */
+};
+
+static uint64_t bench_sim_seed = 1;
+static int      bench_sim_verbose = 0;
+
+/* The built-in scenarios; command-line options override them all. */
+static const struct bench_sim_params bench_sim_scenarios[] = {
+  /*  name          kbit  rtt  loss queue  n    KB client slow kbit sockbuf */
+  {"wan",          20000, 100,     0,  256, 8, 1024,    0,   0,   0,    0},
+  {"lossy",        20000, 100, 10000,  256, 8, 1024,    0,   0,   0,    0},
+  {"slow-client",  20000,  50,     0,  256, 8, 1024,    0,   1, 512,    0},
+  {"bufferbloat",   5000,  30,     0, 2048, 4, 1024,    0,   0,   0,    0},
+  {"long-fat",    100000, 300,     0, 4096, 4, 4096,    0,   0,   0,    0},
+  {NULL,               0,   0,     0,    0, 0,    0,    0,   0,   0,    0}
+};
+
+struct bench_sim_seg {
+  uint64_t  done_us;          /* Leaves the bottleneck queue */
+  uint64_t  deliver_us;       /* Arrives at the far end      */
+  int       len;
+  int       off;
+  char      data[BENCH_SIM_MSS];
+};
+
+struct bench_sim;
+typedef ssize_t (bench_sim_sink)(struct bench_sim*, char*, size_t);
+
+/* One direction of the tunnel. Segments are kept in a ring, in order:
+ * the first `sent` have left the bottleneck queue and are in flight. */
+struct bench_sim_link {
+  double                bw;           /* Bytes per microsecond */
+  uint64_t              delay_us;
+  uint64_t              rtt_us;
+  uint32_t              loss_ppm;
+  size_t                queue_max;
+  size_t                queued;
+  double                busy_us;      /* Serializing until */
+  uint64_t              last_us;      /* Last delivery, to keep order */
+  struct bench_sim_seg* segs;
+  int                   head;
+  int                   count;
+  int                   sent;
+  int                   space;
+  bench_sim_sink*       sink;
+  uint64_t              bytes;
+  uint64_t              lost;
+  struct pk_histogram   qdelay;
+};
+
+struct bench_sim_stream {
+  char      sid[16];
+  int       be_fd;
+  uint64_t  be_sent;
+  double    client_bw;        /* Bytes per microsecond, 0 is unlimited */
+  double    credit;
+  uint64_t  last_us;
+  uint64_t  buffered;         /* At the relay, waiting for the client */
+  uint64_t  delivered;
+  int       reported_kb;
+  uint64_t  done_us;
+};
+
+struct bench_sim {
+  struct bench_sim_params* p;
+  uint64_t                 rng;
+  uint64_t                 now;
+  uint64_t                 start_us;
+  struct pk_manager*       pkm;
+  int                      tunnel_fd;   /* The relay end of the tunnel */
+  int                      listen_fd;   /* The back-end               */
+  int                      be_port;
+  int*                     pending;     /* Accepted, waiting for hello */
+  int                      pending_count;
+  struct bench_sim_link    up;          /* Connector to relay */
+  struct bench_sim_link    down;        /* Relay to connector */
+  struct pk_parser*        parser;
+  char*                    parser_buf;
+  char*                    out;         /* Relay output, unbounded */
+  size_t                   out_bytes;
+  size_t                   out_space;
+  struct bench_sim_stream* streams;
+  int                      done;
+  uint64_t                 max_buffered;
+  int                      errors;
+  pthread_t                loop_thread;
+  pid_t                    loop_tid;
+  pthread_mutex_t          lock;
+  pthread_cond_t           cond;
+  int                      go;
+  int                      blocked;
+  uint64_t                 blocked_us;
+};
+
+
+/*** Links *******************************************************************/
+
+/* xorshift64*: we want the same losses on every machine, forever. */
+static uint32_t bench_sim_random(struct bench_sim* bs)
+{
+  bs->rng ^= bs->rng >> 12;
+  bs->rng ^= bs->rng << 25;
+  bs->rng ^= bs->rng >> 27;
+  return (uint32_t) ((bs->rng * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static void bench_sim_link_init(struct bench_sim_link* link,
+                                struct bench_sim_params* p,
+                                bench_sim_sink* sink)
+{
+  memset(link, 0, sizeof(struct bench_sim_link));
+  link->bw = p->tunnel_kbit / 8000.0;
+  link->rtt_us = (uint64_t) p->rtt_ms * 1000;
+  link->delay_us = link->rtt_us / 2;
+  link->loss_ppm = p->loss_ppm;
+  link->queue_max = (size_t) p->queue_kb * 1024;
+  link->sink = sink;
+}
+
+static struct bench_sim_seg* bench_sim_seg(struct bench_sim_link* link, int i)
+{
+  return link->segs + ((link->head + i) % link->space);
+}
+
+/* Move time forward: segments whose serialization has finished leave the
+ * bottleneck queue. */
+static void bench_sim_link_tick(struct bench_sim_link* link, uint64_t now)
+{
+  struct bench_sim_seg* seg;
+  while ((link->sent < link->count) &&
+         ((seg = bench_sim_seg(link, link->sent))->done_us <= now)) {
+    link->queued -= seg->len;
+    link->sent++;
+  }
+}
+
+static size_t bench_sim_link_room(struct bench_sim_link* link)
+{
+  return (link->queued < link->queue_max) ? link->queue_max - link->queued
+                                          : 0;
+}
+
+static void bench_sim_link_send(struct bench_sim* bs,
+                                struct bench_sim_link* link,
+                                char* data, size_t bytes)
+{
+  struct bench_sim_seg* seg;
+  struct bench_sim_seg* old;
+  double ser_us;
+  int i;
+
+  while (bytes > 0) {
+    if (link->count >= link->space) {
+      old = link->segs;
+      link->segs = malloc(sizeof(struct bench_sim_seg) * 2 * (link->space+64));
+      assert(link->segs != NULL);
+      for (i = 0; i < link->count; i++)
+        link->segs[i] = old[(link->head + i) % link->space];
+      link->head = 0;
+      link->space = 2 * (link->space + 64);
+      free(old);
+    }
+    seg = bench_sim_seg(link, link->count++);
+    seg->len = (bytes > BENCH_SIM_MSS) ? BENCH_SIM_MSS : bytes;
+    seg->off = 0;
+    memcpy(seg->data, data, seg->len);
+
+    if (link->busy_us < bs->now) link->busy_us = bs->now;
+    pk_histogram_record(&(link->qdelay), link->busy_us - bs->now);
+    ser_us = seg->len / link->bw;
+    link->busy_us += ser_us;
+    seg->done_us = (uint64_t) link->busy_us + 1;
+    seg->deliver_us = seg->done_us + link->delay_us;
+    if (bench_sim_random(bs) % 1000000 < link->loss_ppm) {
+      /* Resent after about an RTT, which costs bandwidth as well. */
+      link->busy_us += ser_us;
+      seg->deliver_us += link->rtt_us + (uint64_t) ser_us + 1;
+      link->lost++;
+    }
+    if (seg->deliver_us < link->last_us) seg->deliver_us = link->last_us;
+    link->last_us = seg->deliver_us;
+
+    link->queued += seg->len;
+    link->bytes += seg->len;
+    data += seg->len;
+    bytes -= seg->len;
+  }
+}
+
+/* Hand everything which has arrived to the sink, stopping early if the
+ * sink is full. Returns the number of bytes delivered. */
+static size_t bench_sim_link_deliver(struct bench_sim* bs,
+                                     struct bench_sim_link* link)
+{
+  struct bench_sim_seg* seg;
+  size_t moved = 0;
+  ssize_t rv;
+
+  while ((link->sent > 0) &&
+         ((seg = bench_sim_seg(link, 0))->deliver_us <= bs->now)) {
+    rv = link->sink(bs, seg->data + seg->off, seg->len - seg->off);
+    if (rv <= 0) break;
+    moved += rv;
+    if ((seg->off += rv) < seg->len) break;
+    link->head = (link->head + 1) % link->space;
+    link->count--;
+    link->sent--;
+  }
+  return moved;
+}
+
+static uint64_t bench_sim_link_next(struct bench_sim_link* link, uint64_t now)
+{
+  uint64_t next = BENCH_SIM_NEVER;
+  uint64_t t;
+  if (link->sent < link->count) {
+    next = bench_sim_seg(link, link->sent)->done_us;
+  }
+  if (link->sent > 0) {
+    t = bench_sim_seg(link, 0)->deliver_us;
+    if ((t > now) && (t < next)) next = t;
+  }
+  return next;
+}
+
+
+/*** The simulated front-end *************************************************/
+
+static void bench_sim_out(struct bench_sim* bs, const char* data, size_t len)
+{
+  if (bs->out_bytes + len > bs->out_space) {
+    bs->out_space = 2 * (bs->out_bytes + len);
+    bs->out = realloc(bs->out, bs->out_space);
+    assert(bs->out != NULL);
+  }
+  memcpy(bs->out + bs->out_bytes, data, len);
+  bs->out_bytes += len;
+}
+
+static struct bench_sim_stream* bench_sim_find(struct bench_sim* bs,
+                                               const char* sid)
+{
+  unsigned int i;
+  if ((NULL == sid) || (1 != sscanf(sid, "%x", &i)) ||
+      (i >= (unsigned int) bs->p->streams)) return NULL;
+  return bs->streams + i;
+}
+
+static void bench_sim_chunk(void* data, struct pk_chunk* chunk)
+{
+  struct bench_sim* bs = (struct bench_sim*) data;
+  struct bench_sim_stream* s;
+  char pong[256];
+
+  if (chunk->ping) {
+    bench_sim_out(bs, pong, pk_format_pong(pong));
+  }
+  else if ((NULL == chunk->noop) &&
+           (chunk->length > 0) &&
+           (NULL != (s = bench_sim_find(bs, chunk->sid)))) {
+    s->buffered += chunk->length;
+    if (s->buffered > bs->max_buffered) bs->max_buffered = s->buffered;
+  }
+}
+
+static ssize_t bench_sim_to_relay(struct bench_sim* bs, char* data, size_t len)
+{
+  if (0 > pk_parser_parse(bs->parser, len, data)) {
+    fprintf(stderr, "sim: relay failed to parse tunnel data\n");
+    bs->errors++;
+  }
+  return len;
+}
+
+static ssize_t bench_sim_to_connector(struct bench_sim* bs,
+                                      char* data, size_t len)
+{
+  return write(bs->tunnel_fd, data, len);
+}
+
+/* Clients drain their relay buffers at their own pace; the relay reports
+ * progress the way pagekite.py does. */
+static size_t bench_sim_clients(struct bench_sim* bs)
+{
+  struct bench_sim_stream* s;
+  char skb[256];
+  uint64_t bytes;
+  size_t moved = 0;
+  int i;
+
+  for (i = 0; i < bs->p->streams; i++) {
+    s = bs->streams + i;
+    if (s->client_bw > 0) {
+      s->credit += s->client_bw * (bs->now - s->last_us);
+      bytes = (s->credit < s->buffered) ? (uint64_t) s->credit : s->buffered;
+      s->credit -= bytes;
+      if (s->credit > BENCH_SIM_MSS) s->credit = BENCH_SIM_MSS;
+    }
+    else {
+      bytes = s->buffered;
+    }
+    s->last_us = bs->now;
+    if (!bytes) continue;
+
+    s->buffered -= bytes;
+    s->delivered += bytes;
+    moved += bytes;
+    if (s->delivered / 1024 >= (uint64_t) s->reported_kb +
+                               CONN_REPORT_INCREMENT) {
+      s->reported_kb = s->delivered / 1024;
+      bench_sim_out(bs, skb, pk_format_skb(skb, s->sid, s->reported_kb));
+    }
+    if (!s->done_us && (s->delivered >= (uint64_t) bs->p->kb * 1024)) {
+      s->done_us = bs->now;
+      bs->done++;
+    }
+  }
+  return moved;
+}
+
+static uint64_t bench_sim_clients_next(struct bench_sim* bs)
+{
+  struct bench_sim_stream* s;
+  uint64_t next = BENCH_SIM_NEVER;
+  uint64_t need, t;
+  int i;
+
+  for (i = 0; i < bs->p->streams; i++) {
+    s = bs->streams + i;
+    if ((s->client_bw <= 0) || (0 == s->buffered)) continue;
+    need = (uint64_t) (s->reported_kb + CONN_REPORT_INCREMENT) * 1024
+         - s->delivered;
+    if (need > s->buffered) need = s->buffered;
+    t = bs->now + 1;
+    if (need > s->credit) t += (uint64_t) ((need - s->credit) / s->client_bw);
+    if (t < next) next = t;
+  }
+  return next;
+}
+
+static void bench_sim_open_streams(struct bench_sim* bs)
+{
+  struct pk_chunk chunk;
+  char frame[1024];
+  char hello[24];
+  ssize_t rv;
+  int i;
+
+  for (i = 0; i < bs->p->streams; i++) {
+    pk_chunk_reset_values(&chunk);
+    chunk.sid = bs->streams[i].sid;
+    chunk.request_proto = BENCH_KITE_PROTO;
+    chunk.request_host = BENCH_KITE_DOMAIN;
+    chunk.request_port = BENCH_KITE_PORT;
+    chunk.remote_ip = "127.0.0.1";
+    chunk.remote_port = 1024 + i;
+    /* The back-end learns which stream it is serving from this. */
+    chunk.length = sprintf(hello, "%s\n", bs->streams[i].sid);
+    chunk.data = hello;
+    if (0 < (rv = pk_format_chunk(frame, sizeof(frame), &chunk)))
+      bench_sim_out(bs, frame, rv);
+  }
+}
+
+
+/*** The simulated back-end **************************************************/
+
+static size_t bench_sim_backend(struct bench_sim* bs)
+{
+  static char payload[64 * 1024];
+  struct bench_sim_stream* s;
+  uint64_t total = (uint64_t) bs->p->kb * 1024;
+  size_t moved = 0, bytes;
+  char hello[24];
+  ssize_t rv;
+  int fd, i;
+
+  /* New connections wait here until their hello arrives. It is tiny and
+   * sent in one go, so it arrives in one piece. */
+  while ((bs->pending_count < bs->p->streams) &&
+         (0 <= (fd = accept(bs->listen_fd, NULL, NULL)))) {
+    set_non_blocking(fd);
+    bs->pending[bs->pending_count++] = fd;
+    moved++;
+  }
+  for (i = 0; i < bs->pending_count; i++) {
+    fd = bs->pending[i];
+    if ((0 > (rv = read(fd, hello, sizeof(hello) - 1))) &&
+        ((errno == EAGAIN) || (errno == EWOULDBLOCK))) continue;
+    hello[(rv > 0) ? rv : 0] = '\0';
+    if ((NULL == (s = bench_sim_find(bs, hello))) || (s->be_fd >= 0)) {
+      bs->errors++;
+      close(fd);
+    }
+    else {
+      s->be_fd = fd;
+    }
+    bs->pending[i--] = bs->pending[--bs->pending_count];
+    moved++;
+  }
+
+  for (i = 0; i < bs->p->streams; i++) {
+    s = bs->streams + i;
+    while ((s->be_fd >= 0) && (s->be_sent < total)) {
+      bytes = total - s->be_sent;
+      if (bytes > sizeof(payload)) bytes = sizeof(payload);
+      if (0 >= (rv = write(s->be_fd, payload, bytes))) break;
+      s->be_sent += rv;
+      moved += rv;
+    }
+    if ((s->be_fd >= 0) && (s->be_sent >= total)) {
+      close(s->be_fd);
+      s->be_fd = -1;
+    }
+  }
+  return moved;
+}
+
+
+/*** The simulation loop *****************************************************/
+
+static size_t bench_sim_pump(struct bench_sim* bs)
+{
+  char buffer[64 * 1024];
+  size_t moved = 0, room;
+  ssize_t rv;
+
+  bench_sim_link_tick(&(bs->up), bs->now);
+  bench_sim_link_tick(&(bs->down), bs->now);
+  moved += bench_sim_backend(bs);
+
+  /* The kernel buffers on either end of the tunnel feed the bottleneck. */
+  while (0 < (room = bench_sim_link_room(&(bs->up)))) {
+    if (room > sizeof(buffer)) room = sizeof(buffer);
+    if (0 >= (rv = read(bs->tunnel_fd, buffer, room))) break;
+    bench_sim_link_send(bs, &(bs->up), buffer, rv);
+    moved += rv;
+  }
+  moved += bench_sim_link_deliver(bs, &(bs->up));
+  moved += bench_sim_clients(bs);
+
+  if (bs->out_bytes && (0 < (room = bench_sim_link_room(&(bs->down))))) {
+    if (room > bs->out_bytes) room = bs->out_bytes;
+    bench_sim_link_send(bs, &(bs->down), bs->out, room);
+    memmove(bs->out, bs->out + room, bs->out_bytes - room);
+    bs->out_bytes -= room;
+    moved += room;
+  }
+  moved += bench_sim_link_deliver(bs, &(bs->down));
+  return moved;
+}
+
+/* The connector's event loop runs on its own thread, one non-blocking
+ * iteration at a time, whenever we ask. It would not need to, except that
+ * the manager sometimes does a blocking flush of the tunnel (notably after
+ * an EOF). Then the whole loop stalls until the link drains, so we let
+ * time pass while it waits. */
+static void* bench_sim_loop(void* data)
+{
+  struct bench_sim* bs = (struct bench_sim*) data;
+
+  pkm_select(bs->pkm);
+  pthread_mutex_lock(&(bs->pkm->loop_lock));
+  bs->pkm->main_thread = pthread_self();
+  pthread_mutex_lock(&(bs->lock));
+  bs->loop_tid = syscall(SYS_gettid);
+  pthread_cond_signal(&(bs->cond));
+  for (;;) {
+    while (!bs->go) pthread_cond_wait(&(bs->cond), &(bs->lock));
+    pthread_mutex_unlock(&(bs->lock));
+    ev_loop(bs->pkm->loop, EVLOOP_NONBLOCK);
+    pthread_mutex_lock(&(bs->lock));
+    bs->go = 0;
+  }
+  return NULL;
+}
+
+/* Is the loop thread blocked writing to a socket? The kernel tells us. */
+static int bench_sim_loop_writing(struct bench_sim* bs)
+{
+  char path[64];
+  long nr = -1;
+  FILE* fd;
+
+  sprintf(path, "/proc/self/task/%d/syscall", (int) bs->loop_tid);
+  if (NULL == (fd = fopen(path, "r"))) return 0;
+  if (1 != fscanf(fd, "%ld", &nr)) nr = -1;
+  fclose(fd);
+  return ((nr == SYS_write) || (nr == SYS_writev) ||
+          (nr == SYS_sendto) || (nr == SYS_sendmsg));
+}
+
+/* Wait for the current loop iteration to finish, or block. Returns
+ * nonzero if the loop is blocked. */
+static int bench_sim_loop_wait(struct bench_sim* bs)
+{
+  for (;;) {
+    pthread_mutex_lock(&(bs->lock));
+    if (!bs->go) {
+      pthread_mutex_unlock(&(bs->lock));
+      return 0;
+    }
+    pthread_mutex_unlock(&(bs->lock));
+    if (bench_sim_loop_writing(bs)) return 1;
+    sched_yield();
+  }
+}
+
+/* Let the connector and the simulated endpoints run until nothing more
+ * can happen without time passing. */
+static void bench_sim_settle(struct bench_sim* bs)
+{
+  int idle = 0;
+  while (idle < BENCH_SIM_SETTLE) {
+    if (!bs->blocked) {
+      pthread_mutex_lock(&(bs->lock));
+      bs->go = 1;
+      pthread_cond_signal(&(bs->cond));
+      pthread_mutex_unlock(&(bs->lock));
+    }
+    bs->blocked = bench_sim_loop_wait(bs);
+    idle = bench_sim_pump(bs) ? 0 : idle + 1;
+  }
+}
+
+/* When we stall, the connector's view of each stream usually says why. */
+static void bench_sim_dump(struct bench_sim* bs)
+{
+  struct pk_backend_conn* pkb;
+  struct bench_sim_stream* s;
+  int i;
+
+  for (i = 0; i < bs->pkm->be_conn_max; i++) {
+    pkb = bs->pkm->be_conns + i;
+    if ((pkb->conn.sockfd < 0) || (NULL == (s = bench_sim_find(bs, pkb->sid))))
+      continue;
+    fprintf(stderr, "  sid=%s status=0x%x read_kb=%u sent_kb=%u"
+                    " send_window_kb=%u be_sent=%llu delivered=%llu\n",
+                    pkb->sid, pkb->conn.status, pkb->conn.read_kb,
+                    pkb->conn.sent_kb, pkb->conn.send_window_kb,
+                    (unsigned long long) s->be_sent,
+                    (unsigned long long) s->delivered);
+  }
+}
+
+static uint64_t bench_sim_next(struct bench_sim* bs)
+{
+  uint64_t next = bench_sim_link_next(&(bs->up), bs->now);
+  uint64_t t;
+  if ((t = bench_sim_link_next(&(bs->down), bs->now)) < next) next = t;
+  if ((t = bench_sim_clients_next(bs)) < next) next = t;
+  return next;
+}
+
+
+/*** Setup and reporting *****************************************************/
+
+/* Fly a tunnel to the stub relay without starting the manager's threads,
+ * then take over the relay end of it. */
+static int bench_sim_connect(struct bench_sim* bs, struct bench_relay* br)
+{
+  struct pk_manager* pkm;
+  struct pk_tunnel* fe;
+  uint64_t deadline = bench_ns() + BENCH_SIM_SETUP_S * 1000000000ULL;
+  int pair[2], tcp_fd, bufsize, write_active;
+
+  pkm = (struct pk_manager*) pagekite_init(
+    "bench", 2, 1, bs->p->streams + 16, NULL,
+    PK_WITH_IPV4 | PK_WITHOUT_SERVICE_FRONTENDS, PK_LOG_ERRORS);
+  if ((NULL == pkm) ||
+      (0 > pagekite_add_kite((pagekite_mgr) pkm, BENCH_KITE_PROTO,
+                             BENCH_KITE_DOMAIN, BENCH_KITE_PORT,
+                             "benchsecret", BENCH_LOOPBACK_IP,
+                             bs->be_port)) ||
+      (1 > pagekite_add_frontend((pagekite_mgr) pkm, br->ip, br->port))) {
+    return -1;
+  }
+  pk_state.dns_check_name = BENCH_KITE_DOMAIN;
+  bs->pkm = pkm;
+
+  /* Pretend to be the event loop thread, so pkm_block() is a no-op. */
+  pkm->main_thread = pthread_self();
+  pkm_set_timer_enabled(pkm, 0);
+  pkm->tunnels[0].conn.status |= FE_STATUS_WANTED;
+  pkm_reconfig_start(pkm);
+  pkm_reconnect_all(pkm, 0);
+  pkm_reconfig_stop(pkm);
+
+  while (!br->tunnel_up || (pkm->tunnels[0].conn.sockfd < 0)) {
+    if (bench_ns() > deadline) return -1;
+    usleep(1000);
+  }
+  if (0 > (tcp_fd = bench_relay_detach(br))) return -1;
+  close(tcp_fd);
+
+  /* Swap the TCP tunnel for a socketpair: loopback TCP may deliver data
+   * a little later (after we have decided all is quiet), Unix sockets
+   * never do. The connector keeps its file descriptor number, but its
+   * watchers must be set again for libev to notice the change. */
+  fe = pkm->tunnels;
+  if (0 > socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) return -1;
+  set_non_blocking(pair[0]);
+  set_non_blocking(pair[1]);
+  bufsize = BENCH_SIM_SOCKBUF;
+  setsockopt(pair[1], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+  bufsize = (bs->p->sockbuf_kb > 0) ? (bs->p->sockbuf_kb * 1024) : 0;
+  if (bufsize)
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+  write_active = ev_is_active(&(fe->conn.watch_w));
+  ev_io_stop(pkm->loop, &(fe->conn.watch_r));
+  ev_io_stop(pkm->loop, &(fe->conn.watch_w));
+  if (0 > dup2(pair[0], fe->conn.sockfd)) return -1;
+  close(pair[0]);
+  ev_io_set(&(fe->conn.watch_r), fe->conn.sockfd, EV_READ);
+  ev_io_set(&(fe->conn.watch_w), fe->conn.sockfd, EV_WRITE);
+  ev_io_start(pkm->loop, &(fe->conn.watch_r));
+  if (write_active) ev_io_start(pkm->loop, &(fe->conn.watch_w));
+  bs->tunnel_fd = pair[1];
+  return 0;
+}
+
+/* Max-min fair shares: the tunnel is split evenly, except that clients
+ * slower than their share donate the difference to everyone else. */
+static void bench_sim_fair_shares(struct bench_sim* bs, double* share)
+{
+  double left = bs->up.bw;
+  int i, unfixed = bs->p->streams, changed = 1;
+
+  for (i = 0; i < bs->p->streams; i++) share[i] = -1;
+  while (changed && unfixed) {
+    changed = 0;
+    for (i = 0; i < bs->p->streams; i++) {
+      if ((share[i] < 0) && (bs->streams[i].client_bw > 0) &&
+          (bs->streams[i].client_bw < left / unfixed)) {
+        share[i] = bs->streams[i].client_bw;
+        left -= share[i];
+        unfixed--;
+        changed = 1;
+      }
+    }
+  }
+  for (i = 0; i < bs->p->streams; i++) {
+    if (share[i] < 0) share[i] = left / unfixed;
+  }
+}
+
+static void bench_sim_report(struct bench_sim* bs)
+{
+  struct bench_sim_params* p = bs->p;
+  struct bench_sim_stream* s;
+  double* share = malloc(sizeof(double) * p->streams);
+  double goodput, x, sum = 0, sum2 = 0, gmin = -1, gmax = 0, total_us;
+  uint64_t last = bs->start_us;
+  int i;
+
+  bench_sim_fair_shares(bs, share);
+  for (i = 0; i < p->streams; i++) {
+    s = bs->streams + i;
+    if (!s->done_us) s->done_us = bs->now;
+    if (s->done_us > last) last = s->done_us;
+    /* Bits per microsecond are also megabits per second. */
+    goodput = (s->delivered * 8.0) / (1 + s->done_us - bs->start_us);
+    x = (s->delivered / (1.0 + s->done_us - bs->start_us)) / share[i];
+    sum += x;
+    sum2 += x * x;
+    if ((gmin < 0) || (goodput < gmin)) gmin = goodput;
+    if (goodput > gmax) gmax = goodput;
+    if (bench_sim_verbose) {
+      printf("bench=sim/%s stream=%d client_kbit=%.0f bytes=%llu"
+             " done_ms=%.1f mbit_per_s=%.3f of_fair_share=%.3f\n",
+             p->name, i, s->client_bw * 8000,
+             (unsigned long long) s->delivered,
+             (s->done_us - bs->start_us) / 1000.0, goodput,
+             x);
+    }
+  }
+  total_us = 1 + last - bs->start_us;
+
+  printf("bench=sim/%s seed=%llu streams=%d kb_per_stream=%d"
+         " tunnel_kbit=%d rtt_ms=%d loss_ppm=%d queue_kb=%d errors=%d"
+         " done=%d sim_ms=%.1f utilisation=%.3f"
+         " goodput_min_mbit=%.3f goodput_max_mbit=%.3f jain=%.4f"
+         " qdelay_p50_us=%u qdelay_p99_us=%u qdelay_max_us=%u"
+         " lost=%llu relay_buffered_max_kb=%llu"
+         " tnl_blocked=%llu tnl_blocked_p99_us=%u loop_blocked_ms=%.1f\n",
+         p->name, (unsigned long long) bench_sim_seed, p->streams, p->kb,
+         p->tunnel_kbit, p->rtt_ms, p->loss_ppm, p->queue_kb, bs->errors,
+         bs->done, total_us / 1000.0,
+         (8000.0 * p->kb * 1024 * bs->done / total_us) / p->tunnel_kbit,
+         gmin, gmax, sum2 ? (sum * sum) / (p->streams * sum2) : 0.0,
+         pk_histogram_percentile(&(bs->up.qdelay), 500),
+         pk_histogram_percentile(&(bs->up.qdelay), 990),
+         bs->up.qdelay.max_us,
+         (unsigned long long) (bs->up.lost + bs->down.lost),
+         (unsigned long long) bs->max_buffered / 1024,
+         (unsigned long long) pk_stats.tnl_blocked.count,
+         pk_histogram_percentile(&(pk_stats.tnl_blocked), 990),
+         bs->blocked_us / 1000.0);
+  fflush(stdout);
+  free(share);
+}
+
+static int bench_sim_run(void* data)
+{
+  struct bench_sim bs;
+  struct bench_relay relay;
+  struct bench_sim_stream* s;
+  int i, port = 0;
+  uint64_t next;
+
+  memset(&bs, 0, sizeof(bs));
+  bs.p = (struct bench_sim_params*) data;
+  bs.rng = bench_sim_seed ? bench_sim_seed : 1;
+  bs.tunnel_fd = -1;
+  bench_sim_link_init(&(bs.up), bs.p, bench_sim_to_relay);
+  bench_sim_link_init(&(bs.down), bs.p, bench_sim_to_connector);
+  bs.parser_buf = malloc(PARSER_BYTES_MAX);
+  bs.parser = pk_parser_init(PARSER_BYTES_MAX, bs.parser_buf,
+                             bench_sim_chunk, &bs);
+  bs.streams = calloc(bs.p->streams, sizeof(struct bench_sim_stream));
+  bs.pending = calloc(bs.p->streams, sizeof(int));
+  for (i = 0; i < bs.p->streams; i++) {
+    s = bs.streams + i;
+    sprintf(s->sid, "%x", i);
+    s->be_fd = -1;
+    s->client_bw = ((i < bs.p->slow) ? bs.p->slow_kbit
+                                     : bs.p->client_kbit) / 8000.0;
+  }
+
+  if ((0 > (bs.listen_fd = bench_listen(BENCH_LOOPBACK_IP, &port))) ||
+      (0 > bench_relay_start(&relay, NULL, 0, NULL, NULL, NULL))) {
+    fprintf(stderr, "sim: Failed to start relay or back-end\n");
+    return 1;
+  }
+  bs.be_port = port;
+  if (0 > bench_sim_connect(&bs, &relay)) {
+    fprintf(stderr, "sim: Failed to connect tunnel\n");
+    return 1;
+  }
+
+  /* From here on the clock is ours. */
+  pk_stats_reset();
+  bs.now = bs.start_us = pk_time_us();
+  pk_virtual_time_us = bs.now;
+  for (i = 0; i < bs.p->streams; i++) bs.streams[i].last_us = bs.now;
+
+  pthread_mutex_init(&(bs.lock), NULL);
+  pthread_cond_init(&(bs.cond), NULL);
+  pthread_mutex_lock(&(bs.lock));
+  if (0 != pthread_create(&(bs.loop_thread), NULL, bench_sim_loop, &bs)) {
+    fprintf(stderr, "sim: Failed to start loop thread\n");
+    return 1;
+  }
+  while (!bs.loop_tid) pthread_cond_wait(&(bs.cond), &(bs.lock));
+  pthread_mutex_unlock(&(bs.lock));
+
+  bench_sim_open_streams(&bs);
+  while (bs.done < bs.p->streams) {
+    bench_sim_settle(&bs);
+    if (bs.done >= bs.p->streams) break;
+    next = bench_sim_next(&bs);
+    if ((next == BENCH_SIM_NEVER) ||
+        (next - bs.start_us > BENCH_SIM_MAX_US)) {
+      fprintf(stderr, "sim/%s: stalled at %.3fs with %d/%d streams done\n",
+                      bs.p->name, (bs.now - bs.start_us) / 1000000.0,
+                      bs.done, bs.p->streams);
+      bench_sim_dump(&bs);
+      bs.errors++;
+      break;
+    }
+    if (bs.blocked) bs.blocked_us += next - bs.now;
+    bs.now = pk_virtual_time_us = next;
+  }
+
+  bench_sim_report(&bs);
+  return (bs.errors > 0);
+}
+
+int bench_sim_main(int argc, char** argv)
+{
+  struct bench_sim_params over, run;
+  const struct bench_sim_params* sc;
+  const char* which = "all";
+  int i, rv = 0, found = 0, bad = 0;
+
+  /* -1 means "as the scenario says" */
+  memset(&over, 0xff, sizeof(over));
+  over.name = NULL;
+
+  for (i = 1; (i < argc) && !bad; i++) {
+    if ((argv[i][0] != '-') || (argv[i][1] == '\0')) {
+      which = argv[i];
+    }
+    else if (0 == strcmp(argv[i], "-v")) {
+      bench_sim_verbose = 1;
+    }
+    else if ((i + 1 < argc) && (argv[i][2] == '\0')) {
+      const char* arg = argv[++i];
+      switch (argv[i-1][1]) {
+        case 'x': bench_sim_seed = strtoull(arg, NULL, 0); break;
+        case 'n': over.streams = atoi(arg); break;
+        case 'k': over.kb = atoi(arg); break;
+        case 'B': over.tunnel_kbit = atoi(arg); break;
+        case 'r': over.rtt_ms = atoi(arg); break;
+        case 'l': over.loss_ppm = (int) (atof(arg) * 10000); break;
+        case 'q': over.queue_kb = atoi(arg); break;
+        case 'c': over.client_kbit = atoi(arg); break;
+        case 's': over.slow = atoi(arg); break;
+        case 'S': over.slow_kbit = atoi(arg); break;
+        case 'w': over.sockbuf_kb = atoi(arg); break;
+        default: bad = 1;
+      }
+    }
+    else bad = 1;
+  }
+  if (bad) {
+    fprintf(stderr, "Usage: benchmarks sim [-v] [-x <seed>] [-n <streams>]"
+                    " [-k <KB per stream>]\n"
+                    "                      [-B <tunnel kbit/s>] [-r <rtt ms>]"
+                    " [-l <loss %%>]\n"
+                    "                      [-q <queue KB>]"
+                    " [-c <client kbit/s>]\n"
+                    "                      [-s <slow clients>]"
+                    " [-S <slow kbit/s>]\n"
+                    "                      [-w <socket buffer KB>]"
+                    " [<scenario>|all]\n");
+    return 1;
+  }
+
+  #define BENCH_SIM_OVERRIDE(field) if (over.field >= 0) run.field = over.field
+  for (sc = bench_sim_scenarios; sc->name != NULL; sc++) {
+    if (strcmp(which, "all") && strcmp(which, sc->name)) continue;
+    found++;
+    run = *sc;
+    BENCH_SIM_OVERRIDE(streams);
+    BENCH_SIM_OVERRIDE(kb);
+    BENCH_SIM_OVERRIDE(tunnel_kbit);
+    BENCH_SIM_OVERRIDE(rtt_ms);
+    BENCH_SIM_OVERRIDE(loss_ppm);
+    BENCH_SIM_OVERRIDE(queue_kb);
+    BENCH_SIM_OVERRIDE(client_kbit);
+    BENCH_SIM_OVERRIDE(slow);
+    BENCH_SIM_OVERRIDE(slow_kbit);
+    BENCH_SIM_OVERRIDE(sockbuf_kb);
+    if (run.sockbuf_kb < 0) run.sockbuf_kb = 0;
+    if ((run.streams < 1) || (run.kb < 1) || (run.tunnel_kbit < 1) ||
+        (run.rtt_ms < 0) || (run.queue_kb < 2) || (run.slow > run.streams) ||
+        ((run.slow > 0) && (run.slow_kbit < 1))) {
+      fprintf(stderr, "sim/%s: Invalid parameters\n", run.name);
+      rv = 1;
+      continue;
+    }
+    rv |= bench_fork(bench_sim_run, &run);
+  }
+  #undef BENCH_SIM_OVERRIDE
+  if (!found) {
+    fprintf(stderr, "sim: Unknown scenario: %s\n", which);
+    return 1;
+  }
+  return rv;
+}
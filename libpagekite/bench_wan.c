@@ -0,0 +1,500 @@
+/******************************************************************************
+bench_wan.c - A WAN-emulating TCP proxy for benchmarks.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************
+
+Usage: benchmarks wan [-p <port>] <spec> <target-ip>:<port>
+
+Loopback has no latency and practically infinite bandwidth, so the
+flow-control pathologies of real links never show up in benchmarks run
+over it. tools/slow fixes that with `tc`, but needs root and a real NIC.
+
+This proxy sits between the connector and a relay instead (see the -W
+option of `benchmarks loopback`), or between any two programs when run
+on its own. It forwards each direction of each connection through:
+
+  1. a bottleneck queue of limited size (when full we stop reading, so
+     the sender sees back-pressure just as it would from a real link),
+  2. a token bucket, which lets data out at the configured rate,
+  3. a delay line of RTT/2 plus random jitter. Lost packets are modelled
+     as arriving one RTT late, holding up everything behind them, which
+     is what TCP makes of loss from the point of view of the application.
+
+A spec is a comma separated list of: rtt=<ms>, jitter=<ms>, kbit=<rate>,
+loss=<percent>, queue=<KB> and burst=<KB>. A bare number is the RTT, so
+"100" and "rtt=100,kbit=20000,loss=0.1" are both valid specs.
+
+The proxy runs its own libev loop on its own thread, with timer
+resolution of about a millisecond, which is plenty for 50-300ms RTTs.
+
+******************************************************************************/
+
+#define PAGEKITE_CONSTANTS_ONLY
+#include "pagekite.h"
+
+#include "pkcommon.h"
+#include <netinet/tcp.h>
+
+#include "pkutils.h"
+#include "pkerror.h"
+#include "pkconn.h"
+#include "pkproto.h"
+#include "bench.h"
+
+#define BENCH_WAN_MSS           1448
+#define BENCH_WAN_READ_MAX      (16 * 1024)
+#define BENCH_WAN_QUEUE_KB      256
+#define BENCH_WAN_BURST_KB      16
+#define BENCH_WAN_NEVER         ((uint64_t) -1)
+
+struct bench_wan_seg {
+  struct bench_wan_seg* next;
+  uint64_t              release_us;   /* 0 while in the bottleneck queue */
+  size_t                len;
+  size_t                off;
+  char                  data[1];
+};
+
+struct bench_wan_dir {
+  struct bench_wan_conn* conn;
+  int                    from;
+  int                    to;
+  ev_io                  watch_r;
+  ev_io                  watch_w;
+  struct bench_wan_seg*  head;
+  struct bench_wan_seg*  tail;
+  struct bench_wan_seg*  queue;       /* First segment not yet released */
+  size_t                 queued;
+  double                 tokens;
+  uint64_t               refill_us;
+  uint64_t               last_us;     /* Latest release, to keep order */
+  int                    eof;
+  int                    shut;
+};
+
+struct bench_wan_conn {
+  struct bench_wan*      wan;
+  struct bench_wan_conn* next;
+  struct bench_wan_dir   dir[2];      /* Client to target, and back */
+  int                    broken;
+};
+
+
+/*** Helpers *****************************************************************/
+
+static uint64_t bench_wan_now(void)
+{
+  return bench_ns() / 1000;
+}
+
+/* xorshift64*, as in bench_sim.c */
+static uint32_t bench_wan_random(struct bench_wan* bw)
+{
+  bw->rng ^= bw->rng >> 12;
+  bw->rng ^= bw->rng << 25;
+  bw->rng ^= bw->rng >> 27;
+  return (uint32_t) ((bw->rng * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/* Parse a spec (see above). Returns 0 on success, -1 if invalid. */
+int bench_wan_parse(struct bench_wan_params* p, const char* spec)
+{
+  char copy[256];
+  char *tok, *val, *end, *saveptr = NULL;
+  double num;
+
+  memset(p, 0, sizeof(struct bench_wan_params));
+  p->queue_kb = BENCH_WAN_QUEUE_KB;
+  p->burst_kb = BENCH_WAN_BURST_KB;
+  if (strlen(spec) >= sizeof(copy)) return -1;
+  strcpy(copy, spec);
+
+  for (tok = strtok_r(copy, ",", &saveptr);
+       tok != NULL;
+       tok = strtok_r(NULL, ",", &saveptr)) {
+    if (NULL == (val = strchr(tok, '='))) {
+      val = tok;
+      tok = "rtt";
+    }
+    else *val++ = '\0';
+    num = strtod(val, &end);
+    if ((end == val) || (*end != '\0') || (num < 0)) return -1;
+
+    if (0 == strcmp(tok, "rtt"))         p->rtt_ms = num;
+    else if (0 == strcmp(tok, "jitter")) p->jitter_ms = num;
+    else if (0 == strcmp(tok, "kbit"))   p->kbit = num;
+    else if (0 == strcmp(tok, "loss"))   p->loss_ppm = num * 10000;
+    else if (0 == strcmp(tok, "queue"))  p->queue_kb = num;
+    else if (0 == strcmp(tok, "burst"))  p->burst_kb = num;
+    else return -1;
+  }
+  if ((p->queue_kb < 1) || (p->burst_kb < 1) || (p->loss_ppm >= 1000000))
+    return -1;
+  return 0;
+}
+
+static int bench_wan_connect(const char* ip, int port)
+{
+  struct sockaddr_in addr;
+  int fd, one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if ((1 != inet_pton(AF_INET, ip, &(addr.sin_addr))) ||
+      (0 > (fd = socket(AF_INET, SOCK_STREAM, 0)))) return -1;
+  if (0 > connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+  set_non_blocking(fd);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+
+/*** Forwarding **************************************************************/
+
+static void bench_wan_service(struct bench_wan*);
+
+static void bench_wan_io_cb(EV_P_ ev_io* w, int revents)
+{
+  struct bench_wan_dir* dir = (struct bench_wan_dir*) w->data;
+  bench_wan_service(dir->conn->wan);
+  (void) revents;
+}
+
+/* Let whatever the token bucket allows out of the bottleneck queue and
+ * into the delay line. */
+static void bench_wan_release(struct bench_wan* bw, struct bench_wan_dir* dir,
+                              uint64_t now)
+{
+  struct bench_wan_params* p = &(bw->params);
+  double rate = p->kbit / 8000.0;              /* Bytes per microsecond */
+  double burst = p->burst_kb * 1024.0;
+  struct bench_wan_seg* seg;
+  uint64_t release;
+  size_t need, i;
+
+  if (rate > 0) {
+    dir->tokens += rate * (now - dir->refill_us);
+    if (dir->tokens > burst) dir->tokens = burst;
+  }
+  dir->refill_us = now;
+
+  while (NULL != (seg = dir->queue)) {
+    if (rate > 0) {
+      need = (seg->len < burst) ? seg->len : burst;
+      if (dir->tokens < need) break;
+      dir->tokens -= seg->len;
+    }
+    release = now + (p->rtt_ms * 1000 / 2);
+    if (p->jitter_ms)
+      release += bench_wan_random(bw) % (p->jitter_ms * 1000 + 1);
+    for (i = 0; i < seg->len; i += BENCH_WAN_MSS) {
+      if (bench_wan_random(bw) % 1000000 < (uint32_t) p->loss_ppm) {
+        release += p->rtt_ms * 1000;
+        bw->lost++;
+        break;
+      }
+    }
+    if (release < dir->last_us) release = dir->last_us;
+    seg->release_us = dir->last_us = release;
+    dir->queued -= seg->len;
+    dir->queue = seg->next;
+  }
+}
+
+/* Move data along in one direction. Returns when something next needs
+ * doing, or BENCH_WAN_NEVER. */
+static uint64_t bench_wan_pump(struct bench_wan* bw, struct bench_wan_dir* dir,
+                               uint64_t now)
+{
+  struct ev_loop* loop = bw->loop;
+  struct bench_wan_params* p = &(bw->params);
+  size_t queue_max = p->queue_kb * 1024;
+  struct bench_wan_seg* seg;
+  uint64_t next = BENCH_WAN_NEVER;
+  size_t want;
+  ssize_t rv;
+  int blocked = 0;
+
+  while (!dir->eof && (dir->queued < queue_max)) {
+    want = queue_max - dir->queued;
+    if (want > BENCH_WAN_READ_MAX) want = BENCH_WAN_READ_MAX;
+    if (NULL == (seg = malloc(sizeof(struct bench_wan_seg) + want))) break;
+    rv = read(dir->from, seg->data, want);
+    if (rv <= 0) {
+      free(seg);
+      if ((rv == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+        dir->eof = 1;
+      break;
+    }
+    seg->next = NULL;
+    seg->release_us = 0;
+    seg->len = rv;
+    seg->off = 0;
+    if (dir->tail) dir->tail->next = seg;
+    else dir->head = seg;
+    dir->tail = seg;
+    if (NULL == dir->queue) dir->queue = seg;
+    dir->queued += rv;
+    bw->bytes += rv;
+  }
+
+  bench_wan_release(bw, dir, now);
+  if ((NULL != dir->queue) && (p->kbit > 0)) {
+    want = dir->queue->len;
+    if (want > (size_t) p->burst_kb * 1024) want = p->burst_kb * 1024;
+    next = now + 1 + (uint64_t) ((want - dir->tokens) / (p->kbit / 8000.0));
+  }
+
+  while ((NULL != (seg = dir->head)) && seg->release_us) {
+    if (seg->release_us > now) {
+      if (seg->release_us < next) next = seg->release_us;
+      break;
+    }
+    rv = send(dir->to, seg->data + seg->off, seg->len - seg->off,
+              MSG_NOSIGNAL);
+    if (rv <= 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) blocked = 1;
+      else dir->conn->broken = 1;
+      break;
+    }
+    if ((seg->off += rv) < seg->len) {
+      blocked = 1;
+      break;
+    }
+    if (NULL == (dir->head = seg->next)) dir->tail = NULL;
+    free(seg);
+  }
+
+  if (dir->eof && (NULL == dir->head) && !dir->shut) {
+    shutdown(dir->to, SHUT_WR);
+    dir->shut = 1;
+  }
+
+  ev_io_stop(loop, &(dir->watch_r));
+  ev_io_stop(loop, &(dir->watch_w));
+  if (!dir->eof && (dir->queued < queue_max))
+    ev_io_start(loop, &(dir->watch_r));
+  if (blocked) ev_io_start(loop, &(dir->watch_w));
+  return next;
+}
+
+static void bench_wan_free(struct bench_wan* bw, struct bench_wan_conn* bc)
+{
+  struct bench_wan_seg* seg;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    ev_io_stop(bw->loop, &(bc->dir[i].watch_r));
+    ev_io_stop(bw->loop, &(bc->dir[i].watch_w));
+    while (NULL != (seg = bc->dir[i].head)) {
+      bc->dir[i].head = seg->next;
+      free(seg);
+    }
+  }
+  close(bc->dir[0].from);
+  close(bc->dir[1].from);
+  free(bc);
+}
+
+/* Service every connection, then arm the timer for the next deadline.
+ * We only ever juggle a handful of connections, so this is cheap. */
+static void bench_wan_service(struct bench_wan* bw)
+{
+  struct bench_wan_conn** bcp;
+  struct bench_wan_conn* bc;
+  uint64_t now = bench_wan_now();
+  uint64_t next = BENCH_WAN_NEVER;
+  uint64_t t;
+  int i;
+
+  for (bcp = &(bw->conns); NULL != (bc = *bcp); ) {
+    for (i = 0; i < 2; i++) {
+      if ((t = bench_wan_pump(bw, &(bc->dir[i]), now)) < next) next = t;
+    }
+    if (bc->broken || (bc->dir[0].shut && bc->dir[1].shut)) {
+      *bcp = bc->next;
+      bench_wan_free(bw, bc);
+    }
+    else bcp = &(bc->next);
+  }
+
+  ev_timer_stop(bw->loop, &(bw->timer));
+  if (next != BENCH_WAN_NEVER) {
+    ev_timer_set(&(bw->timer), (next > now) ? (next - now) / 1000000.0 : 0, 0);
+    ev_timer_start(bw->loop, &(bw->timer));
+  }
+}
+
+static void bench_wan_timer_cb(EV_P_ ev_timer* w, int revents)
+{
+  bench_wan_service((struct bench_wan*) w->data);
+  (void) revents;
+}
+
+static void bench_wan_accept_cb(EV_P_ ev_io* w, int revents)
+{
+  struct bench_wan* bw = (struct bench_wan*) w->data;
+  struct bench_wan_conn* bc;
+  struct bench_wan_dir* dir;
+  uint64_t now = bench_wan_now();
+  int fd, target, i, one = 1;
+
+  while (0 <= (fd = accept(w->fd, NULL, NULL))) {
+    /* The connect is blocking, but it is to a local server. */
+    if ((0 > (target = bench_wan_connect(bw->target_ip, bw->target_port))) ||
+        (NULL == (bc = calloc(1, sizeof(struct bench_wan_conn))))) {
+      if (target >= 0) close(target);
+      close(fd);
+      continue;
+    }
+    set_non_blocking(fd);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    bc->wan = bw;
+    bc->dir[0].from = bc->dir[1].to = fd;
+    bc->dir[0].to = bc->dir[1].from = target;
+    for (i = 0; i < 2; i++) {
+      dir = &(bc->dir[i]);
+      dir->conn = bc;
+      dir->refill_us = now;
+      dir->tokens = bw->params.burst_kb * 1024.0;
+      ev_io_init(&(dir->watch_r), bench_wan_io_cb, dir->from, EV_READ);
+      ev_io_init(&(dir->watch_w), bench_wan_io_cb, dir->to, EV_WRITE);
+      dir->watch_r.data = dir->watch_w.data = dir;
+    }
+    bc->next = bw->conns;
+    bw->conns = bc;
+  }
+  bench_wan_service(bw);
+  (void) revents;
+}
+
+static void bench_wan_quit_cb(EV_P_ ev_async* w, int revents)
+{
+  ev_unloop(EV_A_ EVUNLOOP_ALL);
+  (void) w;
+  (void) revents;
+}
+
+static void* bench_wan_run(void* data)
+{
+  struct bench_wan* bw = (struct bench_wan*) data;
+  ev_loop(bw->loop, 0);
+  return NULL;
+}
+
+
+/*** Public interface ********************************************************/
+
+/* Start a proxy on an ephemeral port of the given loopback IP (default
+ * 127.0.0.1, or a fixed port if bw->port was nonzero), forwarding to
+ * the target. Returns the port number, or -1 on failure. */
+int bench_wan_start(struct bench_wan* bw, const char* ip,
+                    const char* target_ip, int target_port,
+                    struct bench_wan_params* params)
+{
+  int port = bw->port;
+
+  memset(bw, 0, sizeof(struct bench_wan));
+  strncpy(bw->ip, ip ? ip : BENCH_LOOPBACK_IP, sizeof(bw->ip) - 1);
+  strncpy(bw->target_ip, target_ip, sizeof(bw->target_ip) - 1);
+  bw->target_port = target_port;
+  bw->params = *params;
+  bw->rng = 0x5eed ^ ((uint64_t) target_port << 17);
+  bw->port = port;
+
+  if (0 > (bw->listen_fd = bench_listen(bw->ip, &(bw->port)))) return -1;
+  if (NULL == (bw->loop = ev_loop_new(0))) return -1;
+
+  ev_io_init(&(bw->listener), bench_wan_accept_cb, bw->listen_fd, EV_READ);
+  bw->listener.data = bw;
+  ev_io_start(bw->loop, &(bw->listener));
+  ev_timer_init(&(bw->timer), bench_wan_timer_cb, 0, 0);
+  bw->timer.data = bw;
+  ev_async_init(&(bw->quit), bench_wan_quit_cb);
+  ev_async_start(bw->loop, &(bw->quit));
+
+  bw->running = 1;
+  if (0 != pthread_create(&(bw->thread), NULL, bench_wan_run, bw)) {
+    bw->running = 0;
+    return -1;
+  }
+  return bw->port;
+}
+
+void bench_wan_stop(struct bench_wan* bw)
+{
+  struct bench_wan_conn* bc;
+
+  if (bw->running) {
+    ev_async_send(bw->loop, &(bw->quit));
+    pthread_join(bw->thread, NULL);
+    bw->running = 0;
+  }
+  while (NULL != (bc = bw->conns)) {
+    bw->conns = bc->next;
+    bench_wan_free(bw, bc);
+  }
+  if (bw->loop) ev_loop_destroy(bw->loop);
+  if (bw->listen_fd >= 0) close(bw->listen_fd);
+  bw->loop = NULL;
+  bw->listen_fd = -1;
+}
+
+/* Run the proxy on its own, until killed. */
+int bench_wan_main(int argc, char** argv)
+{
+  struct bench_wan_params params;
+  struct bench_wan bw;
+  char target[64];
+  char* colon;
+  int i = 1, port = 0;
+
+  if ((i + 1 < argc) && (0 == strcmp(argv[i], "-p"))) {
+    port = atoi(argv[i + 1]);
+    i += 2;
+  }
+  if ((i + 2 != argc) ||
+      (0 > bench_wan_parse(&params, argv[i])) ||
+      (strlen(argv[i + 1]) >= sizeof(target)) ||
+      (NULL == (colon = strrchr(strcpy(target, argv[i + 1]), ':')))) {
+    fprintf(stderr, "Usage: benchmarks wan [-p <port>] <spec>"
+                    " <target-ip>:<port>\n"
+                    "Spec: rtt=<ms>,jitter=<ms>,kbit=<rate>,loss=<%%>,"
+                    "queue=<KB>,burst=<KB>\n");
+    return 1;
+  }
+  *colon++ = '\0';
+
+  memset(&bw, 0, sizeof(bw));
+  bw.port = port;
+  if (0 > bench_wan_start(&bw, NULL, target, atoi(colon), &params)) {
+    fprintf(stderr, "wan: Failed to start proxy\n");
+    return 1;
+  }
+  printf("wan: %s:%d -> %s:%s, rtt=%dms jitter=%dms kbit=%d loss_ppm=%d"
+         " queue=%dKB burst=%dKB\n",
+         bw.ip, bw.port, target, colon, params.rtt_ms, params.jitter_ms,
+         params.kbit, params.loss_ppm, params.queue_kb, params.burst_kb);
+  fflush(stdout);
+  pthread_join(bw.thread, NULL);
+  return 0;
+}
@@ -315,6 +315,77 @@ jint Java_net_pagekite_lib_PageKiteAPI_enableWatchdog(
   return rv;
 }
 
+jint Java_net_pagekite_lib_PageKiteAPI_setStallThresholdMs(
+  JNIEnv* env, jclass unused_class
+, jint jms
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  int ms = jms;
+
+  jint rv = pagekite_set_stall_threshold_ms(pagekite_manager_global, ms);
+
+  return rv;
+}
+
+jint Java_net_pagekite_lib_PageKiteAPI_setDdnsParallelism(
+  JNIEnv* env, jclass unused_class
+, jint jparallelism
+, jint jbatch
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  int parallelism = jparallelism;
+  int batch = jbatch;
+
+  jint rv = pagekite_set_ddns_parallelism(pagekite_manager_global, parallelism, batch);
+
+  return rv;
+}
+
+jint Java_net_pagekite_lib_PageKiteAPI_setDrainTimeout(
+  JNIEnv* env, jclass unused_class
+, jint jseconds
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  int seconds = jseconds;
+
+  jint rv = pagekite_set_drain_timeout(pagekite_manager_global, seconds);
+
+  return rv;
+}
+
+jint Java_net_pagekite_lib_PageKiteAPI_setConnectorId(
+  JNIEnv* env, jclass unused_class
+, jstring jid
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  const jbyte* id = NULL;
+  if (jid != NULL) id = (*env)->GetStringUTFChars(env, jid, NULL);
+
+  jint rv = pagekite_set_connector_id(pagekite_manager_global, id);
+
+  if (jid != NULL) (*env)->ReleaseStringUTFChars(env, jid, id);
+  return rv;
+}
+
+jint Java_net_pagekite_lib_PageKiteAPI_setTunnelCapture(
+  JNIEnv* env, jclass unused_class
+, jstring jfilename
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  const jbyte* filename = NULL;
+  if (jfilename != NULL) filename = (*env)->GetStringUTFChars(env, jfilename, NULL);
+
+  jint rv = pagekite_set_tunnel_capture(pagekite_manager_global, filename);
+
+  if (jfilename != NULL) (*env)->ReleaseStringUTFChars(env, jfilename, filename);
+  return rv;
+}
+
 jint Java_net_pagekite_lib_PageKiteAPI_enableTickTimer(
   JNIEnv* env, jclass unused_class
 , jint jenable
@@ -328,6 +399,19 @@ jint Java_net_pagekite_lib_PageKiteAPI_enableTickTimer(
   return rv;
 }
 
+jint Java_net_pagekite_lib_PageKiteAPI_enablePowerSaving(
+  JNIEnv* env, jclass unused_class
+, jint jenable
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  int enable = jenable;
+
+  jint rv = pagekite_enable_power_saving(pagekite_manager_global, enable);
+
+  return rv;
+}
+
 jint Java_net_pagekite_lib_PageKiteAPI_setConnEvictionIdleS(
   JNIEnv* env, jclass unused_class
 , jint jseconds
@@ -466,6 +550,30 @@ jstring Java_net_pagekite_lib_PageKiteAPI_getEventStr(
   return rv;
 }
 
+jint Java_net_pagekite_lib_PageKiteAPI_drainEvents(
+  JNIEnv* env, jclass unused_class
+, jobject jbuffer
+, jint jlength
+, jint jtimeout
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  void* buffer = NULL;
+  jlong buffer_capacity = 0;
+  if (jbuffer != NULL) {
+    buffer = (*env)->GetDirectBufferAddress(env, jbuffer);
+    buffer_capacity = (*env)->GetDirectBufferCapacity(env, jbuffer);
+  }
+  if (buffer == NULL) return -1;
+  int length = jlength;
+  if (length > buffer_capacity) length = buffer_capacity;
+  int timeout = jtimeout;
+
+  jint rv = pagekite_drain_events(pagekite_manager_global, buffer, length, timeout);
+
+  return rv;
+}
+
 jint Java_net_pagekite_lib_PageKiteAPI_eventRespond(
   JNIEnv* env, jclass unused_class
 , jint jevent_code
@@ -524,6 +632,65 @@ jstring Java_net_pagekite_lib_PageKiteAPI_getLog(
   return rv;
 }
 
+jint Java_net_pagekite_lib_PageKiteAPI_drainLog(
+  JNIEnv* env, jclass unused_class
+, jobject jbuffer
+, jint jlength
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  void* buffer = NULL;
+  jlong buffer_capacity = 0;
+  if (jbuffer != NULL) {
+    buffer = (*env)->GetDirectBufferAddress(env, jbuffer);
+    buffer_capacity = (*env)->GetDirectBufferCapacity(env, jbuffer);
+  }
+  if (buffer == NULL) return -1;
+  int length = jlength;
+  if (length > buffer_capacity) length = buffer_capacity;
+
+  jint rv = pagekite_drain_log(pagekite_manager_global, buffer, length);
+
+  return rv;
+}
+
+jstring Java_net_pagekite_lib_PageKiteAPI_getStats(
+  JNIEnv* env, jclass unused_class
+, jint jreset
+){
+  if (pagekite_manager_global == NULL) return NULL;
+
+  int reset = jreset;
+
+  jstring rv = (*env)->NewStringUTF(env, pagekite_get_stats(pagekite_manager_global, reset));
+
+  return rv;
+}
+
+jint Java_net_pagekite_lib_PageKiteAPI_drainStats(
+  JNIEnv* env, jclass unused_class
+, jobject jbuffer
+, jint jlength
+, jint jreset
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  void* buffer = NULL;
+  jlong buffer_capacity = 0;
+  if (jbuffer != NULL) {
+    buffer = (*env)->GetDirectBufferAddress(env, jbuffer);
+    buffer_capacity = (*env)->GetDirectBufferCapacity(env, jbuffer);
+  }
+  if (buffer == NULL) return -1;
+  int length = jlength;
+  if (length > buffer_capacity) length = buffer_capacity;
+  int reset = jreset;
+
+  jint rv = pagekite_drain_stats(pagekite_manager_global, buffer, length, reset);
+
+  return rv;
+}
+
 jint Java_net_pagekite_lib_PageKiteAPI_dumpStateToLog(
   JNIEnv* env, jclass unused_class
 ){
@@ -559,6 +726,19 @@ jint Java_net_pagekite_lib_PageKiteAPI_tick(
   return rv;
 }
 
+jint Java_net_pagekite_lib_PageKiteAPI_setDoze(
+  JNIEnv* env, jclass unused_class
+, jint jdozing
+){
+  if (pagekite_manager_global == NULL) return -1;
+
+  int dozing = jdozing;
+
+  jint rv = pagekite_set_doze(pagekite_manager_global, dozing);
+
+  return rv;
+}
+
 jint Java_net_pagekite_lib_PageKiteAPI_setBailOnErrors(
   JNIEnv* env, jclass unused_class
 , jint jerrors
@@ -25,6 +25,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pkcommon.h"
 #include "pkutils.h"
 #include "pkstate.h"
+#include "pkstats.h"
 #include "pkerror.h"
 #include "pkhooks.h"
 #include "pkconn.h"
@@ -32,6 +33,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pkblocker.h"
 #include "pkmanager.h"
 #include "pklogging.h"
+#include "pkcapture.h"
 #if HAVE_RELAY
 #include "pkrelay.h"
 #endif
@@ -40,8 +42,10 @@ Note: For alternate license terms, see the file COPYING.md.
                           PK_WITH_DYNAMIC_FE_LIST | PK_WITH_SRAND_RESEED)
 
 
+/* Any use of a manager through the API also selects it for the calling
+ * thread, so the state and logs touched are that manager's own. */
 static struct pk_manager* PK_MANAGER(pagekite_mgr pkm) {
-  return (struct pk_manager*) pkm;
+  return pkm_select((struct pk_manager*) pkm);
 }
 
 
@@ -70,6 +74,8 @@ pagekite_mgr pagekite_init(
   }
 #endif
 
+  /* Settings go to the defaults, the new manager starts with a copy. */
+  pkm_select(NULL);
   pks_global_init(PK_LOG_NORMAL);
   if (verbosity < 0x100) {
     pk_state.log_mask = ((verbosity < 0) ? PK_LOG_ERRORS :
@@ -112,6 +118,9 @@ pagekite_mgr pagekite_init(
                                        max_kites,
                                        max_frontends,
                                        max_conns,
+                                       (flags & PK_WITH_IDLE_STREAMS) ?
+                                         (max_conns /
+                                          PK_IDLE_STREAMS_PER_BUFFER) : 0,
                                        (dyndns_url && *dyndns_url) ? dyndns_url : NULL,
                                        ssl_ctx))) {
     return NULL;
@@ -348,8 +357,8 @@ int pagekite_free(pagekite_mgr pkm) {
 #ifdef HAVE_OPENSSL
   if (PK_MANAGER(pkm)->ssl_ctx != NULL) SSL_CTX_free(PK_MANAGER(pkm)->ssl_ctx);
 #endif
-  pkm_manager_free(PK_MANAGER(pkm));
   pks_free_ssl_cert_names();
+  pkm_manager_free(PK_MANAGER(pkm));
 #ifdef _MSC_VER
   Sleep(100); /* Give logger time to get the rest of the log for debugging */
   WSACleanup();
@@ -359,14 +368,14 @@ int pagekite_free(pagekite_mgr pkm) {
 
 int pagekite_set_log_mask(pagekite_mgr pkm, int mask)
 {
-  (void) pkm;
+  PK_MANAGER(pkm);
   pk_state.log_mask = mask;
   return 0;
 }
 
 int pagekite_set_log_destination(pagekite_mgr pkm, int log_destination)
 {
-  (void) pkm;
+  PK_MANAGER(pkm);
   if (log_destination == PK_LOG_DEST_SYSLOG) {
     pk_state.log_file = NULL;
   }
@@ -418,6 +427,49 @@ int pagekite_enable_watchdog(pagekite_mgr pkm, int enable)
   return 0;
 }
 
+int pagekite_set_stall_threshold_ms(pagekite_mgr pkm, int ms)
+{
+  if (pkm == NULL) return -1;
+  PK_MANAGER(pkm)->stall_threshold_ms = (ms > 0) ? ms : 0;
+  return 0;
+}
+
+int pagekite_set_ddns_parallelism(pagekite_mgr pkm, int parallelism,
+                                  int batch)
+{
+  if (pkm == NULL) return -1;
+  if (parallelism < 1) parallelism = 1;
+  if (parallelism > PK_DDNS_PARALLELISM_MAX)
+    parallelism = PK_DDNS_PARALLELISM_MAX;
+  PK_MANAGER(pkm)->ddns_parallelism = parallelism;
+  PK_MANAGER(pkm)->ddns_batch_max = (batch > 1) ? batch : 1;
+  return 0;
+}
+
+int pagekite_set_drain_timeout(pagekite_mgr pkm, int seconds)
+{
+  if (pkm == NULL) return -1;
+  PK_MANAGER(pkm)->drain_timeout = (seconds > 0) ? seconds : 0;
+  return 0;
+}
+
+int pagekite_set_connector_id(pagekite_mgr pkm, const char* id)
+{
+  if ((pkm == NULL) || (id == NULL)) return -1;
+  PK_MANAGER(pkm)->connector_id = murmur3_32((uint8_t*) id, strlen(id));
+  return 0;
+}
+
+int pagekite_set_tunnel_capture(pagekite_mgr pkm, const char* filename)
+{
+  PK_MANAGER(pkm);
+  if (filename == NULL) {
+    pk_capture_stop();
+    return 0;
+  }
+  return pk_capture_start(filename);
+}
+
 int pagekite_enable_http_forwarding_headers(pagekite_mgr pkm, int enable)
 {
   if (pkm == NULL) return -1;
@@ -427,28 +479,28 @@ int pagekite_enable_http_forwarding_headers(pagekite_mgr pkm, int enable)
 
 int pagekite_enable_fake_ping(pagekite_mgr pkm, int enable)
 {
-  (void) pkm;
+  PK_MANAGER(pkm);
   pk_state.fake_ping = enable;
   return 0;
 }
 
 int pagekite_set_bail_on_errors(pagekite_mgr pkm, int errors)
 {
-  (void) pkm;
+  PK_MANAGER(pkm);
   pk_state.bail_on_errors = errors;
   return 0;
 }
 
 int pagekite_set_conn_eviction_idle_s(pagekite_mgr pkm, int seconds)
 {
-  (void) pkm;
+  PK_MANAGER(pkm);
   pk_state.conn_eviction_idle_s = seconds;
   return 0;
 }
 
 int pagekite_set_openssl_ciphers(pagekite_mgr pkm, const char* ciphers)
 {
-  (void) pkm;
+  PK_MANAGER(pkm);
   if(pk_state.ssl_ciphers != NULL && pk_state.ssl_ciphers != PKS_DEFAULT_CIPHERS)
     free(pk_state.ssl_ciphers);
   pk_state.ssl_ciphers = strdup(ciphers);
@@ -508,6 +560,13 @@ int pagekite_enable_tick_timer(pagekite_mgr pkm, int enabled)
   return 0;
 }
 
+int pagekite_enable_power_saving(pagekite_mgr pkm, int enable)
+{
+  if (pkm == NULL) return -1;
+  pkm_set_power_saving(PK_MANAGER(pkm), enable);
+  return 0;
+}
+
 int pagekite_tick(pagekite_mgr pkm)
 {
   if (pkm == NULL) return -1;
@@ -515,8 +574,16 @@ int pagekite_tick(pagekite_mgr pkm)
   return 0;
 }
 
+int pagekite_set_doze(pagekite_mgr pkm, int dozing)
+{
+  if (pkm == NULL) return -1;
+  pkm_set_dozing(PK_MANAGER(pkm), dozing);
+  return 0;
+}
+
 int pagekite_poll(pagekite_mgr pkm, int timeout) {
   if (pkm == NULL) return -1;
+  PK_MANAGER(pkm);
   pthread_mutex_lock(&(pk_state.lock));
   /* FIXME: Obey the timeout */
   pthread_cond_wait(&(pk_state.cond), &(pk_state.lock));
@@ -566,6 +633,16 @@ const char* pagekite_get_event_str(pagekite_mgr pkm, unsigned int event_code)
   return (s == NULL) ? "" : s;
 }
 
+int pagekite_drain_events(pagekite_mgr pkm,
+  void* buffer,
+  int length,
+  int timeout)
+{
+  if ((pkm == NULL) || (buffer == NULL)) return -1;
+  return pke_drain_events(&(PK_MANAGER(pkm)->events),
+                          (char*) buffer, length, timeout);
+}
+
 int pagekite_event_respond(pagekite_mgr pkm,
   unsigned int event_code,
   unsigned int response_code)
@@ -606,12 +683,39 @@ char* pagekite_get_log(pagekite_mgr pkm) {
     strcpy(buffer, "Not running.");
   }
   else {
+    PK_MANAGER(pkm);
     pks_copylog(buffer);
   }
   buffer[PKS_LOG_DATA_MAX] = '\0';
   return buffer;
 }
 
+int pagekite_drain_log(pagekite_mgr pkm, void* buffer, int length) {
+  if ((pkm == NULL) || (buffer == NULL)) return -1;
+  PK_MANAGER(pkm);
+  return pks_logtail((char*) buffer, length);
+}
+
+char* pagekite_get_stats(pagekite_mgr pkm, int reset) {
+  static char buffer[PK_STATS_TEXT_MAX+1];
+  if (pkm == NULL) {
+    strcpy(buffer, "Not running.");
+  }
+  else {
+    PK_MANAGER(pkm);
+    pk_stats_format(buffer, PK_STATS_TEXT_MAX, reset);
+  }
+  buffer[PK_STATS_TEXT_MAX] = '\0';
+  return buffer;
+}
+
+int pagekite_drain_stats(pagekite_mgr pkm, void* buffer, int length,
+                         int reset) {
+  if ((pkm == NULL) || (buffer == NULL) || (length < 1)) return -1;
+  PK_MANAGER(pkm);
+  return pk_stats_format((char*) buffer, length, reset);
+}
+
 int pagekite_dump_state_to_log(pagekite_mgr pkm)
 {
   pk_dump_state(PK_MANAGER(pkm));
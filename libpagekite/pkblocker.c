@@ -25,6 +25,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pkutils.h"
 #include "pkerror.h"
 #include "pkstate.h"
+#include "pkstats.h"
 #include "pkhooks.h"
 #include "pkconn.h"
 #include "pkproto.h"
@@ -100,10 +101,41 @@ void pkb_clear_transient_flags(struct pk_manager* pkm)
   }
 }
 
+/* Rank a relay for this connector, lower is better. The measured latency
+ * is stretched by up to PK_FRONTEND_SPREAD percent, using a rendezvous
+ * hash of our connector ID and the relay's identity: relays of similar
+ * speed are ranked differently (but consistently) by each connector, so
+ * a fleet spreads out rather than piling onto whichever pinged fastest.
+ * Relays which recently said they were overloaded are penalized, less
+ * so if we are already using them so we do not flap back and forth. */
+static int pkb_tunnel_score(struct pk_manager* pkm, struct pk_tunnel* fe,
+                            time_t now)
+{
+  char key[1024];
+  int len, score;
+  uint32_t hrw;
+
+  len = snprintf(key, sizeof(key), "%x:", pkm->connector_id);
+  if (fe->fe_uuid != NULL)
+    strncpy(key + len, fe->fe_uuid, sizeof(key) - len - 1);
+  else
+    in_addr_to_str(fe->ai.ai_addr, key + len, sizeof(key) - len - 1);
+  key[sizeof(key) - 1] = '\0';
+  hrw = (uint32_t) murmur3_32((uint8_t*) key, strlen(key));
+
+  score = fe->priority * (100 + (hrw % (PK_FRONTEND_SPREAD + 1))) / 100;
+  score += 25 * fe->error_count;
+  if (fe->overloaded_until > now)
+    score += (fe->conn.sockfd >= 0) ? 50 : 250;
+
+  return score;
+}
+
 void pkb_choose_tunnels(struct pk_manager* pkm)
 {
   int wanted, wantn, highpri, prio;
   struct pk_tunnel* highpri_fe;
+  time_t now = pk_time();
 
   PK_TRACE_FUNCTION;
 
@@ -114,7 +146,7 @@ void pkb_choose_tunnels(struct pk_manager* pkm)
     }
   }
 
-  /* Choose N fastest: this is inefficient, but trivially correct. */
+  /* Choose N best: this is inefficient, but trivially correct. */
   for (wantn = 0; wantn < pkm->want_spare_frontends+1; wantn++) {
     highpri_fe = NULL;
     highpri = 1024000;
@@ -126,7 +158,7 @@ void pkb_choose_tunnels(struct pk_manager* pkm)
        * don't consider it a candidate for "fastest" in this round. */
       if (fe->conn.status & CONN_STATUS_CHANGING) continue;
 
-      prio = fe->priority + (25 * fe->error_count);
+      prio = pkb_tunnel_score(pkm, fe, now);
       if ((fe->ai.ai_addr) &&
           (fe->fe_hostname) &&
           (fe->priority) &&
@@ -376,6 +408,7 @@ void* pkb_tunnel_ping(void* void_fe) {
   int sockfd, bytes, want;
 
   PK_TRACE_FUNCTION;
+  pkm_select(fe->manager);
 
   fe->priority = 0;
   in_addr_to_str(fe->ai.ai_addr, printip, 1024);
@@ -427,13 +460,13 @@ void* pkb_tunnel_ping(void* void_fe) {
                  + ((tp2.tv_nsec - tp1.tv_nsec) / 1000000)
                  + 1;
 
+    /* Overload is sticky: one report keeps the relay penalized for a
+     * while, even if the next ping looks fine. Otherwise connectors would
+     * leave, the load would drop, they would all return, and so on. */
     if ((overload = strcasestr(buffer, PK_FRONTEND_OVERLOADED)) != NULL) {
-      if (fe->conn.status & (FE_STATUS_WANTED|FE_STATUS_IS_FAST)) {
-        fe->priority += 50;
-      }
-      else {
-        fe->priority += 250;
-      }
+      if (fe->overloaded_until <= pk_time())
+        pk_log(PK_LOG_MANAGER_INFO, "Relay %s is overloaded", printip);
+      fe->overloaded_until = pk_time() + PK_OVERLOAD_HOLD;
     }
 
     if (NULL == fe->fe_uuid) {
@@ -488,10 +521,7 @@ void* pkb_tunnel_ping(void* void_fe) {
            printip, fe->priority, fe->fe_uuid);
   }
   else {
-    /* Add artificial +/-5% jitter to ping results */
-    fe->priority *= ((rand() % 11) + 95);
-    fe->priority /= 100;
-    if (fe->priority < 1) fe->priority = 1;
+    /* No jitter here: choose_tunnels spreads the load deterministically. */
     pk_log(PK_LOG_MANAGER_DEBUG,
            "Ping %s: %dms (uuid=%s)",
            printip, fe->priority, fe->fe_uuid);
@@ -529,13 +559,132 @@ void pkb_check_tunnel_pingtimes(struct pk_manager* pkm)
   }
 }
 
+/* Dynamic DNS updates are independent HTTP requests, one per domain, so
+ * we issue them from a small pool of threads which take turns pulling
+ * the next request off a shared list. If the endpoint accepts a comma
+ * separated list of hostnames (dyndns2-style, one result per line),
+ * domains sharing a secret may also be batched into a single request. */
+#define PKB_DDNS_BATCH_BYTES 1000
+struct pkb_ddns_request {
+  char         domains[PKB_DDNS_BATCH_BYTES+1];
+  const char*  secret;
+  int          count;
+  int          ok;
+};
+struct pkb_ddns_pool {
+  pthread_mutex_t           lock;
+  struct pk_manager*        pkm;
+  struct pkb_ddns_request*  requests;
+  int                       count;
+  int                       next;
+  const char*               address_list;
+  uint32_t                  published;
+};
+
+static int pkb_ddns_has_domain(const char* list, const char* domain)
+{
+  size_t len = strlen(domain);
+  while (*list) {
+    if ((0 == strncasecmp(list, domain, len)) &&
+        ((list[len] == ',') || (list[len] == '\0'))) return 1;
+    while (*list && (*list != ',')) list++;
+    if (*list == ',') list++;
+  }
+  return 0;
+}
+
+static void pkb_ddns_request(struct pkb_ddns_pool* pool,
+                             struct pkb_ddns_request* req)
+{
+  struct pk_manager* pkm = pool->pkm;
+  char get_result[PK_HTTP_BYTES_MAX], payload[2048], signature[2048];
+  char url[PK_HTTP_BYTES_MAX];
+  char domains[PKB_DDNS_BATCH_BYTES+1], code[16];
+  char *result, *domain, *next, *eol;
+  uint64_t start_us, latency_us;
+  int rlen, ok;
+
+  snprintf(payload, sizeof(payload), "%s:%s", req->domains,
+           pool->address_list);
+  pk_sign(NULL, req->secret, 0, payload, 100, signature);
+
+  snprintf(url, sizeof(url) - 8, pkm->dynamic_dns_url,
+           req->domains, pool->address_list, signature);
+  if (pk_state.ddns_request_public_ipv4 || pk_state.ddns_request_public_ipv6) {
+    strcat(url, "&ipv=");
+    if (pk_state.ddns_request_public_ipv4) strcat(url, "4");
+    if (pk_state.ddns_request_public_ipv6) strcat(url, "6");
+  }
+
+  start_us = pk_time_us();
+  rlen = http_get(url, get_result, sizeof(get_result));
+  latency_us = pk_time_us() - start_us;
+  pk_stats_record(&(pk_stats.ddns), latency_us);
+
+  if (rlen < 1) {
+    pk_log(PK_LOG_MANAGER_ERROR, "DDNS: No response from %s", url);
+    result = NULL;
+  }
+  else {
+    result = skip_http_header(rlen, get_result);
+  }
+
+  /* Results come one line per domain, in the order requested. */
+  strcpy(domains, req->domains);
+  for (domain = domains; domain != NULL; domain = next) {
+    if (NULL != (next = strchr(domain, ','))) *next++ = '\0';
+
+    code[0] = '\0';
+    if ((result != NULL) && *result) {
+      if (NULL != (eol = strchr(result, '\n'))) *eol++ = '\0';
+      sscanf(result, "%15s", code);
+      result = eol;
+    }
+    ok = ((strncasecmp(code, "nochg", 5) == 0) ||
+          (strncasecmp(code, "good", 4) == 0));
+    pk_stats_ddns(domain, code[0] ? code : "none", latency_us, ok);
+
+    if (ok) {
+      pk_log(PK_LOG_MANAGER_INFO, "DDNS: Update OK, %s=%s (%dms)",
+                                  domain, pool->address_list,
+                                  (int) (latency_us / 1000));
+      PK_KITE_ITER(pkm, kite) {
+        if (0 == strcasecmp(kite->public_domain, domain))
+          kite->ddns_published = pool->published;
+      }
+      req->ok++;
+    }
+    else if (rlen > 0) {
+      pk_log(PK_LOG_MANAGER_ERROR, "DDNS: Update failed for %s (%s -> %s)",
+                                   domain, url, code);
+    }
+  }
+}
+
+static void* pkb_ddns_worker(void* void_pool)
+{
+  struct pkb_ddns_pool* pool = (struct pkb_ddns_pool*) void_pool;
+  int i;
+  pkm_select(pool->pkm);
+  while (1) {
+    pthread_mutex_lock(&(pool->lock));
+    i = pool->next++;
+    pthread_mutex_unlock(&(pool->lock));
+    if (i >= pool->count) return NULL;
+    pkb_ddns_request(pool, pool->requests + i);
+  }
+}
+
 int pkb_update_dns(struct pk_manager* pkm)
 {
-  int len, bogus, rlen;
+  int i, len, bogus, skipped, updated, threads;
   struct pk_tunnel* fe_list[1024]; /* Magic, bounded by address_list[] below */
   struct pk_tunnel** fes;
-  char printip[128], get_result[10240], *result, *lastup;
-  char address_list[1024], payload[2048], signature[2048], url[2048], *alp;
+  struct pkb_ddns_pool pool;
+  struct pkb_ddns_request* req;
+  pthread_t workers[PK_DDNS_PARALLELISM_MAX];
+  char printip[128];
+  char address_list[1024], *alp;
 
   PK_TRACE_FUNCTION;
 
@@ -573,47 +722,79 @@ int pkb_update_dns(struct pk_manager* pkm)
   if (!bogus) return 0;
   if (!address_list[0]) return 0;
 
-  bogus = 0;
-  lastup = "";
+  /* Plan the requests: domains already published with this exact set of
+   * front-ends are skipped, the rest deduplicated and maybe batched. */
+  memset(&pool, 0, sizeof(pool));
+  pool.pkm = pkm;
+  pool.address_list = address_list;
+  pool.published = murmur3_32((uint8_t*) address_list, strlen(address_list));
+  pool.requests = malloc(pkm->kite_max * sizeof(struct pkb_ddns_request));
+  if (pool.requests == NULL) return 1;
+
+  skipped = 0;
   PK_KITE_ITER(pkm, kite) {
-    if ((kite->protocol[0] != '\0') &&
-        (0 != strcasecmp(lastup, kite->public_domain))) {
-      PKS_STATE(pkm->status = PK_STATUS_UPDATING_DNS);
-      sprintf(payload, "%s:%s", kite->public_domain, address_list);
-      pk_sign(NULL, kite->auth_secret, 0, payload, 100, signature);
-
-      sprintf(url, pkm->dynamic_dns_url,
-              kite->public_domain, address_list, signature);
-      if (pk_state.ddns_request_public_ipv4 || pk_state.ddns_request_public_ipv6) {
-        strcat(url, "&ipv=");
-        if (pk_state.ddns_request_public_ipv4) strcat(url, "4");
-        if (pk_state.ddns_request_public_ipv6) strcat(url, "6");
-      }
-      rlen = http_get(url, get_result, 10240);
+    if (kite->protocol[0] == '\0') continue;
+    if ((kite->ddns_published == pool.published) && !pk_state.force_update) {
+      skipped++;
+      continue;
+    }
+    len = strlen(kite->public_domain);
+    for (req = NULL, i = 0; i < pool.count; i++) {
+      if (pkb_ddns_has_domain(pool.requests[i].domains, kite->public_domain))
+        break;
+      if ((req == NULL) &&
+          (pool.requests[i].count < pkm->ddns_batch_max) &&
+          (0 == strcmp(pool.requests[i].secret, kite->auth_secret)) &&
+          (strlen(pool.requests[i].domains) + 1 + len <= PKB_DDNS_BATCH_BYTES))
+        req = pool.requests + i;
+    }
+    if (i < pool.count) continue;
+    if (len > PKB_DDNS_BATCH_BYTES) continue;
 
-      if (rlen < 1) {
-        pk_log(PK_LOG_MANAGER_ERROR, "DDNS: No response from %s", url);
-        bogus++;
-      }
-      else {
-        lastup = kite->public_domain;
-        result = skip_http_header(rlen, get_result);
-        if ((strncasecmp(result, "nochg", 5) == 0) ||
-            (strncasecmp(result, "good", 4) == 0)) {
-          pk_log(PK_LOG_MANAGER_INFO, "DDNS: Update OK, %s=%s via %s",
-                                      kite->public_domain, address_list, url);
-          for (fes = fe_list; *fes; fes++) {
-            (*fes)->last_ddnsup = pk_time();
-            (*fes)->conn.status |= FE_STATUS_IN_DNS;
-          }
-        }
-        else {
-          result[7] = '\0';
-          pk_log(PK_LOG_MANAGER_ERROR, "DDNS: Update failed for %s (%s -> %s)",
-                                       kite->public_domain, url, result);
-          bogus++;
-        }
-      }
+    if (req != NULL) {
+      strcat(req->domains, ",");
+      strcat(req->domains, kite->public_domain);
+    }
+    else {
+      req = pool.requests + pool.count++;
+      strcpy(req->domains, kite->public_domain);
+      req->secret = kite->auth_secret;
+      req->count = req->ok = 0;
+    }
+    req->count++;
+  }
+
+  if (pool.count) {
+    PKS_STATE(pkm->status = PK_STATUS_UPDATING_DNS);
+    pthread_mutex_init(&(pool.lock), NULL);
+
+    threads = pkm->ddns_parallelism;
+    if (threads > pool.count) threads = pool.count;
+    if (threads > PK_DDNS_PARALLELISM_MAX) threads = PK_DDNS_PARALLELISM_MAX;
+    for (i = 0; i < threads - 1; i++) {
+      if (0 != pthread_create(&workers[i], NULL, pkb_ddns_worker, &pool))
+        break;
+    }
+    threads = i;
+    pkb_ddns_worker(&pool);
+    for (i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+
+    pthread_mutex_destroy(&(pool.lock));
+  }
+
+  bogus = updated = 0;
+  for (i = 0; i < pool.count; i++) {
+    bogus += pool.requests[i].count - pool.requests[i].ok;
+    updated += pool.requests[i].ok;
+  }
+  free(pool.requests);
+
+  pk_log(PK_LOG_MANAGER_DEBUG, "DDNS: %d updated, %d failed, %d unchanged",
+                               updated, bogus, skipped);
+  if (updated || skipped) {
+    for (fes = fe_list; *fes; fes++) {
+      (*fes)->last_ddnsup = pk_time();
+      (*fes)->conn.status |= FE_STATUS_IN_DNS;
     }
   }
 
@@ -627,6 +808,7 @@ void pkb_log_fe_status(struct pk_manager* pkm)
   int ddnsup_ago;
   char printip[128];
   char ddnsinfo[128];
+  char draininfo[128];
 
   PK_TRACE_FUNCTION;
 
@@ -638,8 +820,14 @@ void pkb_log_fe_status(struct pk_manager* pkm)
           ddnsup_ago = pk_time() - fe->last_ddnsup;
           sprintf(ddnsinfo, " (in DNS %ds ago)", ddnsup_ago);
         }
+        draininfo[0] = '\0';
+        if (fe->conn.status & FE_STATUS_DRAINING) {
+          sprintf(draininfo, " draining (%d/%d streams left, %ds)",
+                  fe->stream_count, fe->drain_streams,
+                  (int) (fe->drain_deadline - pk_time()));
+        }
         pk_log(PK_LOG_MANAGER_DEBUG,
-               "Relay; status=0x%8.8x; errors=%d; info=%s%s%s%s%s%s%s%s%s",
+               "Relay; status=0x%8.8x; errors=%d; info=%s%s%s%s%s%s%s%s%s%s%s%s",
                fe->conn.status,
                fe->error_count,
                printip,
@@ -650,6 +838,9 @@ void pkb_log_fe_status(struct pk_manager* pkm)
                (fe->conn.status & FE_STATUS_IN_DNS) ? " in-DNS": "",
                (fe->conn.status & FE_STATUS_IS_FAST) ? " fast": "",
                (fe->conn.sockfd > 0) ? " live" : "",
+               (fe->overloaded_until > pk_time()) ? " overloaded" : "",
+               (fe->retry_after > pk_time()) ? " backoff" : "",
+               draininfo,
                ddnsinfo);
       }
     }
@@ -720,6 +911,7 @@ void pkb_check_tunnels(struct pk_manager* pkm)
       pkb_check_world(pkm);
     }
     pkb_choose_tunnels(pkm);
+    pkm_drain_tunnels(pkm);
     pkb_log_fe_status(pkm);
     problems += pkm_reconnect_all(pkm, dns_is_down);
 
@@ -735,11 +927,9 @@ void pkb_check_tunnels(struct pk_manager* pkm)
 
 void* pkb_run_blocker(void *void_pkblocker)
 {
-  static time_t last_check_world = 0;
-  static time_t last_check_tunnels = 0;
   struct pk_job job;
   struct pk_blocker* this = (struct pk_blocker*) void_pkblocker;
-  struct pk_manager* pkm = this->manager;
+  struct pk_manager* pkm = pkm_select(this->manager);
 
   pk_log(PK_LOG_MANAGER_DEBUG, "Started blocking thread.");
   PK_HOOK(PK_HOOK_START_BLOCKER, 0, this, pkm);
@@ -752,27 +942,28 @@ void* pkb_run_blocker(void *void_pkblocker)
       case PK_NO_JOB:
         break;
       case PK_CHECK_WORLD:
-        if ((now >= last_check_world + pkm->housekeeping_interval_min) &&
+        if ((now >= pkm->last_check_world+pkm->housekeeping_interval_min) &&
             (0 == pkm_reconfig_start((struct pk_manager*) job.ptr_data)))
         {
           if (PK_HOOK(PK_HOOK_CHECK_WORLD, 0, this, pkm)) {
-            last_check_tunnels = now;
+            pkm->last_check_tunnels = now;
             pkb_check_world((struct pk_manager*) job.ptr_data);
             pkb_check_tunnels((struct pk_manager*) job.ptr_data);
-            last_check_world = last_check_tunnels = pk_time();
+            pkm->last_check_world = pkm->last_check_tunnels = pk_time();
             PK_HOOK(PK_HOOK_CHECK_WORLD, 1, this, pkm);
           }
           pkm_reconfig_stop((struct pk_manager*) job.ptr_data);
         }
         break;
       case PK_CHECK_FRONTENDS:
-        if ((now >= last_check_tunnels + pkm->housekeeping_interval_min) &&
+        if (((now >= pkm->last_check_tunnels+pkm->housekeeping_interval_min) ||
+             (pkm->retry_at && (now >= pkm->retry_at))) &&
             (0 == pkm_reconfig_start((struct pk_manager*) job.ptr_data)))
         {
           if (PK_HOOK(PK_HOOK_CHECK_TUNNELS, 0, this, pkm)) {
-            last_check_tunnels = now;
+            pkm->last_check_tunnels = now;
             pkb_check_tunnels((struct pk_manager*) job.ptr_data);
-            last_check_tunnels = pk_time();
+            pkm->last_check_tunnels = pk_time();
             PK_HOOK(PK_HOOK_CHECK_TUNNELS, 1, this, pkm);
           }
           pkm_reconfig_stop((struct pk_manager*) job.ptr_data);
@@ -0,0 +1,250 @@
+/******************************************************************************
+pkcapture.c - Recording raw tunnel traffic for offline replay.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************
+
+When enabled, everything read from a tunnel is appended to a capture file
+(see pkcapture.h for the format) from the PK_HOOK_DATA_INCOMING hook, just
+before it is handed to the parser. `benchmarks replay` plays such a file
+back through a real connector, which makes production traffic patterns
+available for profiling without needing production.
+
+Recording only starts (or restarts) on a frame boundary, so every stream
+in the file can be parsed from its first byte. Captures contain whatever
+the tunnels carried, so they should be handled with the same care as the
+traffic itself.
+
+******************************************************************************/
+
+#define PAGEKITE_CONSTANTS_ONLY
+#include "pagekite.h"
+
+#include "pkcommon.h"
+#include "pkutils.h"
+#include "pkerror.h"
+#include "pkhooks.h"
+#include "pkconn.h"
+#include "pkstate.h"
+#include "pkproto.h"
+#include "pkblocker.h"
+#include "pkstats.h"
+#include "pkmanager.h"
+#include "pklogging.h"
+#include "pkcapture.h"
+
+#define PK_CAPTURE_BUFSIZE  (64 * 1024)
+
+static struct {
+  pthread_mutex_t lock;
+  FILE*           fd;
+  uint64_t        last_us;
+  /* Per tunnel: are we recording, and how many bytes had the connection
+   * read in total after the last record. A mismatch means we missed
+   * something, usually because the tunnel reconnected. */
+  char            recording[PK_CAPTURE_MAX_TUNNELS];
+  uint64_t        seen[PK_CAPTURE_MAX_TUNNELS];
+} pk_capture = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, {0}, {0}};
+
+
+static size_t pk_capture_put_varint(char* buf, uint64_t value)
+{
+  size_t len = 0;
+  while (value >= 0x80) {
+    buf[len++] = (char) (0x80 | (value & 0x7f));
+    value >>= 7;
+  }
+  buf[len++] = (char) value;
+  return len;
+}
+
+static ssize_t pk_capture_get_varint(char* buf, size_t bytes, uint64_t* value)
+{
+  size_t len;
+  unsigned char c;
+  *value = 0;
+  for (len = 0; (len < bytes) && (len < 10); len++) {
+    c = (unsigned char) buf[len];
+    *value |= ((uint64_t) (c & 0x7f)) << (7 * len);
+    if (!(c & 0x80)) return len + 1;
+  }
+  return (len < 10) ? 0 : -1;
+}
+
+size_t pk_capture_format_header(char* buf, uint64_t delta_us,
+                                int tunnel, size_t length)
+{
+  size_t len = pk_capture_put_varint(buf, delta_us);
+  buf[len++] = (char) tunnel;
+  return len + pk_capture_put_varint(buf + len, length);
+}
+
+/* Parse one record from the buffer, filling in rec and advancing its
+ * timestamp. rec->data will point into the buffer. Returns the number
+ * of bytes consumed, 0 if the record is incomplete or -1 if the data is
+ * invalid. */
+ssize_t pk_capture_parse(char* buf, size_t bytes,
+                         struct pk_capture_record* rec)
+{
+  uint64_t delta_us, length;
+  ssize_t rv;
+  size_t len;
+
+  if (0 >= (rv = pk_capture_get_varint(buf, bytes, &delta_us))) return rv;
+  len = rv;
+  if (len >= bytes) return 0;
+  rec->tunnel = (unsigned char) buf[len++];
+  if (0 >= (rv = pk_capture_get_varint(buf + len, bytes - len, &length)))
+    return rv;
+  len += rv;
+  if (length > bytes - len) return 0;
+
+  rec->ts_us += delta_us;
+  rec->length = length;
+  rec->data = buf + len;
+  return len + length;
+}
+
+static void pk_capture_write(uint64_t now, int tunnel,
+                             size_t length, const char* data)
+{
+  char header[PK_CAPTURE_HEADER_MAX];
+  size_t hlen;
+
+  hlen = pk_capture_format_header(header,
+                                  pk_capture.last_us ?
+                                    now - pk_capture.last_us : 0,
+                                  tunnel, length);
+  pk_capture.last_us = now;
+  if ((hlen != fwrite(header, 1, hlen, pk_capture.fd)) ||
+      (length != fwrite(data, 1, length, pk_capture.fd))) {
+    pk_log(PK_LOG_MANAGER_ERROR, "Capture write failed, stopping capture");
+    fclose(pk_capture.fd);
+    pk_capture.fd = NULL;
+  }
+}
+
+/* PK_HOOK_DATA_INCOMING: bytes, data, pk_tunnel. Called on the event loop
+ * thread before the data is parsed, so the parser state tells us whether
+ * the data starts on a frame boundary. */
+int pk_capture_hook(int hook_id, int bytes, void* data, void* void_fe)
+{
+  struct pk_tunnel* fe = (struct pk_tunnel*) void_fe;
+  int tunnel = fe - fe->manager->tunnels;
+  uint64_t total;
+
+  pthread_mutex_lock(&(pk_capture.lock));
+  if ((NULL != pk_capture.fd) && (tunnel < PK_CAPTURE_MAX_TUNNELS)) {
+    total = (uint64_t) fe->conn.read_kb * 1024 + fe->conn.read_bytes;
+    if (!pk_capture.recording[tunnel] ||
+        (total - bytes != pk_capture.seen[tunnel])) {
+      pk_capture.recording[tunnel] =
+        (0 == fe->parser->chunk->frame.raw_length);
+      if (pk_capture.recording[tunnel])
+        pk_capture_write(pk_time_us(), tunnel, 0, NULL);
+    }
+    if ((NULL != pk_capture.fd) && pk_capture.recording[tunnel])
+      pk_capture_write(pk_time_us(), tunnel, bytes, (char*) data);
+    pk_capture.seen[tunnel] = total;
+  }
+  pthread_mutex_unlock(&(pk_capture.lock));
+
+  (void) hook_id;
+  return 1;
+}
+
+int pk_capture_start(const char* filename)
+{
+  FILE* fd;
+
+  if (NULL == (fd = fopen(filename, "wb"))) {
+    pk_log(PK_LOG_MANAGER_ERROR, "Capture: Failed to open %s", filename);
+    return -1;
+  }
+  setvbuf(fd, NULL, _IOFBF, PK_CAPTURE_BUFSIZE);
+  if (PK_CAPTURE_MAGIC_LEN != fwrite(PK_CAPTURE_MAGIC, 1,
+                                     PK_CAPTURE_MAGIC_LEN, fd)) {
+    fclose(fd);
+    return -1;
+  }
+
+  pk_capture_stop();
+  pthread_mutex_lock(&(pk_capture.lock));
+  pk_capture.fd = fd;
+  pk_capture.last_us = 0;
+  memset(pk_capture.recording, 0, sizeof(pk_capture.recording));
+  pk_hooks[PK_HOOK_DATA_INCOMING] = &pk_capture_hook;
+  pthread_mutex_unlock(&(pk_capture.lock));
+
+  pk_log(PK_LOG_MANAGER_INFO, "Capturing tunnel traffic to %s", filename);
+  return 0;
+}
+
+void pk_capture_stop(void)
+{
+  pthread_mutex_lock(&(pk_capture.lock));
+  if (pk_hooks[PK_HOOK_DATA_INCOMING] == &pk_capture_hook)
+    pk_hooks[PK_HOOK_DATA_INCOMING] = NULL;
+  if (NULL != pk_capture.fd) {
+    fclose(pk_capture.fd);
+    pk_capture.fd = NULL;
+    pk_log(PK_LOG_MANAGER_INFO, "Stopped capturing tunnel traffic");
+  }
+  pthread_mutex_unlock(&(pk_capture.lock));
+}
+
+
+/* *** Tests *************************************************************** */
+
+int pkcapture_test(void)
+{
+#if PK_TESTS
+  char buffer[64];
+  struct pk_capture_record rec;
+  size_t len;
+
+  /* Records round-trip, including multi-byte varints */
+  len = pk_capture_format_header(buffer, 300, 7, 5);
+  assert(len == 2 + 1 + 1);
+  memcpy(buffer + len, "hello", 5);
+  len += 5;
+  len += pk_capture_format_header(buffer + len, 1, 255, 0);
+
+  memset(&rec, 0, sizeof(rec));
+  rec.ts_us = 1000;
+  assert(9 == pk_capture_parse(buffer, len, &rec));
+  assert(1300 == rec.ts_us);
+  assert(7 == rec.tunnel);
+  assert(5 == rec.length);
+  assert(0 == strncmp(rec.data, "hello", 5));
+
+  assert(3 == pk_capture_parse(buffer + 9, len - 9, &rec));
+  assert(1301 == rec.ts_us);
+  assert(255 == rec.tunnel);
+  assert(0 == rec.length);
+
+  /* Truncated records are incomplete, not errors */
+  assert(0 == pk_capture_parse(buffer, 8, &rec));
+  assert(0 == pk_capture_parse(buffer, 1, &rec));
+  assert(1301 == rec.ts_us);
+
+  /* Overlong varints are errors */
+  memset(buffer, 0xff, 12);
+  assert(-1 == pk_capture_parse(buffer, 12, &rec));
+#endif
+  return 1;
+}
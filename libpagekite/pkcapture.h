@@ -0,0 +1,50 @@
+/******************************************************************************
+pkcapture.h - Recording raw tunnel traffic for offline replay.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************/
+
+/* A capture file is PK_CAPTURE_MAGIC followed by records of:
+ *
+ *    varint   Microseconds since the previous record
+ *    byte     Tunnel number (index into pk_manager.tunnels)
+ *    varint   Length
+ *    ...      Length bytes of data, exactly as read from the tunnel
+ *
+ * Varints are little-endian base 128: 7 bits per byte, the high bit set
+ * on all but the last byte. A zero-length record marks a discontinuity:
+ * the tunnel reconnected (or data was missed) and recording resumed on a
+ * frame boundary, so any partial frame before it should be discarded. */
+#define PK_CAPTURE_MAGIC        "PKCAP1\r\n"
+#define PK_CAPTURE_MAGIC_LEN    8
+#define PK_CAPTURE_MAX_TUNNELS  256
+#define PK_CAPTURE_HEADER_MAX   (10 + 1 + 10)
+
+struct pk_capture_record {
+  uint64_t  ts_us;        /* Running total of the time deltas */
+  int       tunnel;
+  size_t    length;
+  char*     data;
+};
+
+int     pk_capture_start(const char*);
+void    pk_capture_stop(void);
+int     pk_capture_hook(int, int, void*, void*);
+size_t  pk_capture_format_header(char*, uint64_t, int, size_t);
+ssize_t pk_capture_parse(char*, size_t, struct pk_capture_record*);
+
+int pkcapture_test(void);
@@ -176,9 +176,97 @@ typedef struct {
   pthread_mutex_t lock_lock;
 } pk_rlock_t;
 
-#define PARSER_BYTES_MIN   1 * 1024
-#define PARSER_BYTES_AVG   4 * 1024
-#define PARSER_BYTES_MAX  16 * 1024  /* <= CONN_IO_BUFFER_SIZE */
+/* Fixed size limits. The defaults suit anything with RAM to spare, the
+ * tiny footprint profile (configure --with-footprint=tiny) suits routers
+ * with a few MB. Any single limit can also be overridden from CPPFLAGS,
+ * the checks below reject values the code cannot work with. */
+#ifndef PK_FOOTPRINT_TINY
+#define PK_FOOTPRINT_TINY 0
+#endif
+#if PK_FOOTPRINT_TINY
+#  ifndef PARSER_BYTES_AVG
+#    define PARSER_BYTES_AVG      (2 * 1024)
+#  endif
+#  ifndef PARSER_BYTES_MAX
+#    define PARSER_BYTES_MAX      (4 * 1024)
+#  endif
+#  ifndef PKS_LOG_DATA_MAX
+#    define PKS_LOG_DATA_MAX      (8 * 1024)
+#  endif
+#  ifndef PK_DOMAIN_LENGTH
+#    define PK_DOMAIN_LENGTH      255
+#  endif
+#  ifndef PK_SECRET_LENGTH
+#    define PK_SECRET_LENGTH      64
+#  endif
+#  ifndef PK_MAX_CHUNK_HEADERS
+#    define PK_MAX_CHUNK_HEADERS  8
+#  endif
+#  ifndef PK_HANDSHAKE_BYTES_MAX
+#    define PK_HANDSHAKE_BYTES_MAX (4 * 1024)
+#  endif
+#  ifndef PK_HTTP_BYTES_MAX
+#    define PK_HTTP_BYTES_MAX     (4 * 1024)
+#  endif
+#endif
+
+#define PARSER_BYTES_MIN          (1 * 1024)
+#ifndef PARSER_BYTES_AVG
+#define PARSER_BYTES_AVG          (4 * 1024)
+#endif
+#ifndef PARSER_BYTES_MAX
+#define PARSER_BYTES_MAX          (16 * 1024)
+#endif
+#ifndef CONN_IO_BUFFER_SIZE
+#define CONN_IO_BUFFER_SIZE       PARSER_BYTES_MAX
+#endif
+#ifndef PKS_LOG_DATA_MAX
+#define PKS_LOG_DATA_MAX          (64 * 1024)
+#endif
+#ifndef PK_DOMAIN_LENGTH
+#define PK_DOMAIN_LENGTH          1024
+#endif
+#ifndef PK_SECRET_LENGTH
+#define PK_SECRET_LENGTH          256
+#endif
+#ifndef PK_MAX_CHUNK_HEADERS
+#define PK_MAX_CHUNK_HEADERS      64
+#endif
+#ifndef PK_HANDSHAKE_BYTES_MAX    /* Tunnel handshake requests, responses */
+#define PK_HANDSHAKE_BYTES_MAX    (16 * 1024)
+#endif
+#ifndef PK_HTTP_BYTES_MAX         /* DDNS update requests and responses  */
+#define PK_HTTP_BYTES_MAX         (10 * 1024)
+#endif
+#ifndef PK_IDLE_STREAMS_PER_BUFFER /* See PK_WITH_IDLE_STREAMS           */
+#define PK_IDLE_STREAMS_PER_BUFFER 64
+#endif
+
+#if (PARSER_BYTES_AVG < PARSER_BYTES_MIN) || \
+    (PARSER_BYTES_MAX < PARSER_BYTES_AVG)
+#  error "Need PARSER_BYTES_MIN <= PARSER_BYTES_AVG <= PARSER_BYTES_MAX"
+#endif
+#if CONN_IO_BUFFER_SIZE < PARSER_BYTES_MAX
+#  error "CONN_IO_BUFFER_SIZE must be at least PARSER_BYTES_MAX"
+#endif
+#if PKS_LOG_DATA_MAX < 4096
+#  error "PKS_LOG_DATA_MAX must be at least 4096 (one log line)"
+#endif
+#if (PK_DOMAIN_LENGTH < 253) || (PK_SECRET_LENGTH < 32)
+#  error "PK_DOMAIN_LENGTH must fit a DNS name, PK_SECRET_LENGTH 32 bytes"
+#endif
+#if PK_MAX_CHUNK_HEADERS < 1
+#  error "PK_MAX_CHUNK_HEADERS must be at least 1"
+#endif
+#if PK_HANDSHAKE_BYTES_MAX < (PK_DOMAIN_LENGTH + 1024)
+#  error "PK_HANDSHAKE_BYTES_MAX must fit a kite request and a peer address"
+#endif
+#if PK_HTTP_BYTES_MAX < 4096
+#  error "PK_HTTP_BYTES_MAX must fit a DDNS update URL and its reply"
+#endif
+#if PK_IDLE_STREAMS_PER_BUFFER < 1
+#  error "PK_IDLE_STREAMS_PER_BUFFER must be at least 1"
+#endif
 
 #ifndef HAVE_RELAY
 #define HAVE_RELAY 0
@@ -186,6 +274,12 @@ typedef struct {
 #ifndef PK_MEMORY_CANARIES
 #define PK_MEMORY_CANARIES 0
 #endif
+#ifndef PK_MEMORY_CANARIES_SAMPLED
+#define PK_MEMORY_CANARIES_SAMPLED 0
+#endif
+#ifndef PK_MEMORY_CANARY_SAMPLES  /* Canaries checked per loop iteration */
+#define PK_MEMORY_CANARY_SAMPLES 32
+#endif
 #ifndef PK_TRACE
 #define PK_TRACE 0
 #endif
@@ -28,6 +28,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pkconn.h"
 #include "pkproto.h"
 #include "pkstate.h"
+#include "pkstats.h"
 #include "pkblocker.h"
 #include "pkmanager.h"
 #include "pklogging.h"
@@ -65,6 +66,26 @@ void pkc_reset_conn(struct pk_conn* pkc, unsigned int status)
 #endif
 }
 
+/* Attach a pair of I/O buffers, or detach them with NULL. Without buffers
+ * pkc_read and pkc_write fail with ENOBUFS, so a hibernating stream is
+ * never mistaken for one that hit EOF or silently written blocking. */
+void pkc_set_buffers(struct pk_conn* pkc, struct pk_conn_buffers* buffers)
+{
+  if (buffers != NULL) {
+    pkc->in_buffer = buffers->in_buffer;
+    pkc->out_buffer = buffers->out_buffer;
+  }
+  else {
+    pkc->in_buffer = pkc->out_buffer = NULL;
+  }
+}
+
+struct pk_conn_buffers* pkc_get_buffers(struct pk_conn* pkc)
+{
+  /* in_buffer is the first member, so this is where the pair starts. */
+  return (struct pk_conn_buffers*) pkc->in_buffer;
+}
+
 
 int pkc_connect(struct pk_conn* pkc, struct addrinfo* ai)
 {
@@ -264,6 +285,13 @@ ssize_t pkc_read(struct pk_conn* pkc)
   ssize_t bytes, delta;
   int ssl_errno = SSL_ERROR_NONE;
 
+  if (pkc->in_buffer == NULL) {
+    pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA|PK_LOG_ERROR,
+           "%d: BUG! pkc_read() without buffers", pkc->sockfd);
+    errno = ENOBUFS;
+    return -1;
+  }
+
   switch (pkc->state) {
 #ifdef HAVE_OPENSSL
     case CONN_SSL_DATA:
@@ -420,6 +448,7 @@ ssize_t pkc_flush(struct pk_conn* pkc, char *data, ssize_t length, int mode,
   ssize_t flushed, wrote, bytes;
   flushed = wrote = errno = bytes = 0;
   int loops_left = 1000;
+  uint64_t started_us = pk_time_us();
 
   if (pkc->sockfd < 0) {
     pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA|PK_LOG_ERROR,
@@ -509,6 +538,7 @@ ssize_t pkc_flush(struct pk_conn* pkc, char *data, ssize_t length, int mode,
     pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA,
            "%d[%s]: Blocking flush complete.", pkc->sockfd, where);
   }
+  pk_stats_record(&(pk_stats.flush), pk_time_us() - started_us);
   return flushed;
 }
 
@@ -517,6 +547,13 @@ ssize_t pkc_write(struct pk_conn* pkc, char* data, ssize_t length)
   ssize_t wleft;
   ssize_t wrote = 0;
 
+  if (pkc->out_buffer == NULL) {
+    pk_log(PK_LOG_BE_DATA|PK_LOG_TUNNEL_DATA|PK_LOG_ERROR,
+           "%d: BUG! pkc_write() without buffers", pkc->sockfd);
+    errno = ENOBUFS;
+    return -1;
+  }
+
   /* 1. Try to flush already buffered data. */
   if (pkc->out_buffer_pos)
     pkc_flush(pkc, NULL, 0, NON_BLOCKING_FLUSH, "pkc_write/1");
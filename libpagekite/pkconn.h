@@ -46,7 +46,6 @@ typedef enum {
 #endif
 } io_state_t;
 
-#define CONN_IO_BUFFER_SIZE     PARSER_BYTES_MAX
 #define CONN_STATUS_BITS        0x0000FFFF
 #define CONN_STATUS_UNKNOWN     0x00000000
 #define CONN_STATUS_END_READ    0x00000001 /* Don't want more data     */
@@ -63,27 +62,38 @@ typedef enum {
 #define CONN_STATUS_LISTENING   0x00000400 /* Listening socket */
 #define CONN_STATUS_CHANGING    0x00000800 /* This conn is being changed */
 #define PKC_OUT(c)      ((c).out_buffer + (c).out_buffer_pos)
-#define PKC_OUT_FREE(c) (CONN_IO_BUFFER_SIZE - (c).out_buffer_pos)
+#define PKC_OUT_FREE(c) ((c).out_buffer ? \
+                         (CONN_IO_BUFFER_SIZE - (c).out_buffer_pos) : 0)
 #define PKC_IN(c)       ((c).in_buffer + (c).in_buffer_pos)
-#define PKC_IN_FREE(c)  (CONN_IO_BUFFER_SIZE - (c).in_buffer_pos)
+#define PKC_IN_FREE(c)  ((c).in_buffer ? \
+                         (CONN_IO_BUFFER_SIZE - (c).in_buffer_pos) : 0)
+
+/* The I/O buffers of a connection. Tunnels own a pair each, back-end
+ * streams borrow one from the manager only while they have data in
+ * flight (see pkm_wake_stream). */
+struct pk_conn_buffers {
+  char       in_buffer[CONN_IO_BUFFER_SIZE];
+  char       out_buffer[CONN_IO_BUFFER_SIZE];
+};
+
 struct pk_conn {
   PK_MEMORY_CANARY
   int        status;
   int        sockfd;
   time_t     activity;
   /* Data we have read, vs. what has been sent to remote end. */
-  size_t     read_bytes;
-  size_t     read_kb;
-  size_t     sent_kb;
-  size_t     send_window_kb;
+  uint32_t   read_bytes;
+  uint32_t   read_kb;
+  uint32_t   sent_kb;
+  uint32_t   send_window_kb;
   /* Data we have written locally, what we've reported to tunnel. */
-  size_t     wrote_bytes;
-  size_t     reported_kb;
-  /* Buffers, events */
+  uint32_t   wrote_bytes;
+  uint32_t   reported_kb;
+  /* Buffers (NULL if none are attached), events */
   int        in_buffer_pos;
-  char       in_buffer[CONN_IO_BUFFER_SIZE];
   int        out_buffer_pos;
-  char       out_buffer[CONN_IO_BUFFER_SIZE];
+  char*      in_buffer;
+  char*      out_buffer;
   ev_io      watch_r;
   ev_io      watch_w;
   io_state_t state;
@@ -94,6 +104,8 @@ struct pk_conn {
 };
 
 void    pkc_reset_conn(struct pk_conn*, unsigned int);
+void    pkc_set_buffers(struct pk_conn*, struct pk_conn_buffers*);
+struct pk_conn_buffers* pkc_get_buffers(struct pk_conn*);
 int     pkc_connect(struct pk_conn*, struct addrinfo*);
 int     pkc_listen(struct pk_conn*, struct addrinfo*, int);
 #ifdef HAVE_OPENSSL
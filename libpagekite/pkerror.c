@@ -28,6 +28,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pkconn.h"
 #include "pkproto.h"
 #include "pkstate.h"
+#include "pkstats.h"
 #include "pkblocker.h"
 #include "pkmanager.h"
 #include "pklogging.h"
@@ -90,6 +91,10 @@ void pk_perror(const char* prefix) {
     case ERR_NO_KITE:
       pk_log(PK_LOG_ERROR, "%s: No kites configured!", prefix);
       break;
+    case ERR_KITE_TOO_LONG:
+      pk_log(PK_LOG_ERROR, "%s: Kite name or secret too long for this build",
+                           prefix);
+      break;
     case ERR_NO_FRONTENDS:
       pk_log(PK_LOG_ERROR, "%s: No frontends configured!", prefix);
       break;
@@ -48,6 +48,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #define ERR_NO_KITE           -50003
 #define ERR_RAW_NEEDS_PUBPORT -50004
 #define ERR_NO_IPVX           -50005
+#define ERR_KITE_TOO_LONG     -50006
 
 #define ERR_TOOBIG_MANAGER    -60000
 #define ERR_TOOBIG_KITES      -60001
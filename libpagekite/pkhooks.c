@@ -71,6 +71,7 @@ outward facing public API methods described above are defined in pagekite.c.
 #include "pkerror.h"
 #include "pkconn.h"
 #include "pkstate.h"
+#include "pkstats.h"
 #include "pkhooks.h"
 #include "pkutils.h"
 #include "pkproto.h"
@@ -81,7 +82,13 @@ outward facing public API methods described above are defined in pagekite.c.
 #define _EV(pke, event_code) \
   (pke->events + ((event_code & PK_EV_SLOT_MASK) >> PK_EV_SLOT_SHIFT))
 
+/* Events posted without a queue go to the one selected by this thread's
+ * manager, or failing that to whichever queue was initialized last. */
 struct pke_events* _pke_default_pke = NULL;
+__thread struct pke_events* _pke_thread_pke = NULL;
+#define _PKE(pke) ((pke != NULL) ? pke : \
+                   (_pke_thread_pke != NULL) ? _pke_thread_pke : \
+                                               _pke_default_pke)
 
 
 void pke_init_events(struct pke_events* pke, unsigned int threads) {
@@ -129,6 +136,8 @@ void _pke_unlocked_free_event(struct pke_events* pke, unsigned int event_code)
   ev->response_code = 0;
   ev->response_str = NULL;
   ev->response_int = NULL;
+  ev->continuation = NULL;
+  ev->continuation_data = NULL;
   ev->posted = 0;
 }
 
@@ -178,6 +187,8 @@ struct pke_event* _pke_unlocked_post_event(
   ev->response_code = 0;
   ev->response_int = response_int;
   ev->response_str = response_str;
+  ev->continuation = NULL;
+  ev->continuation_data = NULL;
   return ev;
 }
 
@@ -185,7 +196,7 @@ void pke_free_event(struct pke_events* pke, unsigned int event_code)
 {
   PK_TRACE_FUNCTION;
 
-  pke = (pke != NULL) ? pke : _pke_default_pke;
+  pke = _PKE(pke);
   if (pke == NULL) return;
 
   pthread_mutex_lock(&(pke->lock));
@@ -202,7 +213,7 @@ void pke_post_event(
 {
   PK_TRACE_FUNCTION;
 
-  pke = (pke != NULL) ? pke : _pke_default_pke;
+  pke = _PKE(pke);
   if (pke == NULL) return;
 
   if ((pke->event_mask != PK_EV_ALL) &&
@@ -240,7 +251,7 @@ struct pke_event* pke_post_blocking_event(
   if (response_int != NULL) *response_int = 0;
   if (response_str != NULL) *response_str = NULL;
 
-  pke = (pke != NULL) ? pke : _pke_default_pke;
+  pke = _PKE(pke);
   if (pke == NULL) return PK_EV_RESPOND_DEFAULT;
 
   if ((pke->event_mask != PK_EV_ALL) &&
@@ -265,11 +276,60 @@ struct pke_event* pke_post_blocking_event(
   return ev;
 }
 
+/* Asynchronous: post an event which takes a response, without waiting.
+ *
+ * Whenever the response is posted, by whichever thread, the continuation
+ * is called with the response code, integer and string (which is only
+ * valid during the call) and the event is freed. This lets the poster
+ * get on with other work, instead of parking a thread per event.
+ *
+ * Returns the event code, which is the token the application uses to
+ * respond, or PK_EV_NONE if the event was masked or every slot is taken
+ * by unanswered events. The continuation is not called in that case.
+ */
+unsigned int pke_post_async_event(
+  struct pke_events* pke,
+  unsigned int event_type, int event_int, const char* event_str,
+  pke_continuation_t* continuation, void* continuation_data)
+{
+  PK_TRACE_FUNCTION;
+
+  struct pke_event* ev;
+  unsigned int event_code;
+
+  pke = _PKE(pke);
+  if (pke == NULL) return PK_EV_NONE;
+
+  if ((pke->event_mask != PK_EV_ALL) &&
+      (0 == (event_type & pke->event_mask))) return PK_EV_NONE;
+
+  pthread_mutex_lock(&(pke->lock));
+
+  /* Unlike the others, we never steal a slot from a pending event. */
+  if (NULL == _pke_get_oldest_event(pke, 0,
+                                    PK_EV_IS_BLOCKING | PK_EV_PROCESSING)) {
+    pthread_mutex_unlock(&(pke->lock));
+    return PK_EV_NONE;
+  }
+
+  ev = _pke_unlocked_post_event(
+    pke,
+    event_type | PK_EV_IS_BLOCKING, event_int, event_str, NULL, NULL);
+  ev->continuation = continuation;
+  ev->continuation_data = continuation_data;
+  event_code = ev->event_code;
+
+  pthread_cond_signal(&(pke->trigger));
+  pthread_mutex_unlock(&(pke->lock));
+
+  return event_code;
+}
+
 struct pke_event* pke_await_event(struct pke_events* pke, int timeout)
 {
   PK_TRACE_FUNCTION;
 
-  pke = (pke != NULL) ? pke : _pke_default_pke;
+  pke = _PKE(pke);
   struct pke_event* oldest = NULL;
 
   struct timespec deadline;
@@ -300,8 +360,72 @@ struct pke_event* pke_await_event(struct pke_events* pke, int timeout)
   } while (1);
 }
 
+/* Batched delivery, for callers where each round trip is costly (JNI):
+ * wait for an event like pke_await_event, then copy it and any others
+ * already pending into buf until it is full. Each record is three
+ * native-endian 32-bit words (event code, event int and string length)
+ * followed by the NUL terminated string, padded to a multiple of 4.
+ * Non-blocking events are marked handled as they are copied, blocking
+ * events still need a response.
+ *
+ * Returns the number of bytes used, 0 on timeout, -1 on error. */
+#define PKE_RECORD_BYTES(slen) (3*sizeof(uint32_t) + (((slen) + 4) & ~3))
+static int _pke_put_record(char* buf, struct pke_event* ev, size_t slen)
+{
+  uint32_t hdr[3];
+  size_t bytes = PKE_RECORD_BYTES(slen);
+  hdr[0] = ev->event_code;
+  hdr[1] = (uint32_t) ev->event_int;
+  hdr[2] = slen;
+  memcpy(buf, hdr, sizeof(hdr));
+  if (slen) memcpy(buf + sizeof(hdr), ev->event_str, slen);
+  memset(buf + sizeof(hdr) + slen, 0, bytes - sizeof(hdr) - slen);
+  return bytes;
+}
+
+int pke_drain_events(struct pke_events* pke, char* buf, int length,
+                     int timeout)
+{
+  PK_TRACE_FUNCTION;
+
+  struct pke_event* ev;
+  unsigned int event_code;
+  size_t slen, bytes = 0;
+
+  pke = _PKE(pke);
+  if ((pke == NULL) || (length < (int) PKE_RECORD_BYTES(0))) return -1;
+
+  ev = pke_await_event(pke, timeout);
+  if (ev->event_code == PK_EV_NONE) return 0;
+
+  /* The first event is always delivered, truncated if need be. */
+  slen = (ev->event_str != NULL) ? strlen(ev->event_str) : 0;
+  if (PKE_RECORD_BYTES(slen) > (size_t) length)
+    slen = ((length - 3*sizeof(uint32_t)) & ~3) - 1;
+
+  while (ev != NULL) {
+    event_code = ev->event_code;
+    bytes += _pke_put_record(buf + bytes, ev, slen);
+    if (0 == (event_code & PK_EV_IS_BLOCKING))
+      pke_post_response(pke, event_code, PK_EV_RESPOND_DEFAULT, 0, NULL);
+
+    pthread_mutex_lock(&(pke->lock));
+    ev = _pke_get_oldest_event(pke, 1, PK_EV_PROCESSING);
+    if ((ev != NULL) && (0 < ev->posted)) {
+      slen = (ev->event_str != NULL) ? strlen(ev->event_str) : 0;
+      if (bytes + PKE_RECORD_BYTES(slen) <= (size_t) length)
+        ev->event_code |= PK_EV_PROCESSING;
+      else
+        ev = NULL;
+    }
+    else ev = NULL;
+    pthread_mutex_unlock(&(pke->lock));
+  }
+  return bytes;
+}
+
 struct pke_event* pke_get_event(struct pke_events* pke, unsigned int event_code) {
-  pke = (pke != NULL) ? pke : _pke_default_pke;
+  pke = _PKE(pke);
   return _EV(pke, event_code);
 }
 
@@ -310,7 +434,7 @@ void pke_post_response(struct pke_events* pke, unsigned int event_code,
                        int response_int, const char* response_str) {
   PK_TRACE_FUNCTION;
 
-  pke = (pke != NULL) ? pke : _pke_default_pke;
+  pke = _PKE(pke);
 
   struct pke_event* ev = _EV(pke, event_code);
   if (ev->event_code == PK_EV_NONE) return;
@@ -327,6 +451,16 @@ void pke_post_response(struct pke_events* pke, unsigned int event_code,
     return;
   }
 
+  /* Asynchronous events hand the response straight to the poster. The
+   * slot is freed first, so the continuation may post another. */
+  if (NULL != ev->continuation) {
+    pke_continuation_t* continuation = ev->continuation;
+    void* continuation_data = ev->continuation_data;
+    pke_free_event(pke, event_code);
+    continuation(continuation_data, rcode, response_int, response_str);
+    return;
+  }
+
   /* If response data is provided, and the event poster provided a
    * place for accepting responses, copy the data over. */
   if (NULL != ev->response_int) *(ev->response_int) = response_int;
@@ -347,7 +481,7 @@ void pke_post_response(struct pke_events* pke, unsigned int event_code,
 void pke_cancel_all_events(struct pke_events* pke) {
   PK_TRACE_FUNCTION;
 
-  pke = (pke != NULL) ? pke : _pke_default_pke;
+  pke = _PKE(pke);
 
   struct pke_event* ev = &(pke->events[1]);
   for (int i = 1; i < pke->event_max; i++, ev++) {
@@ -385,6 +519,12 @@ void* pke_event_test_poster(void* void_pke) {
   return void_pke;
 }
 
+static void pke_event_test_continuation(void* data, unsigned int rcode,
+                                        int response_int,
+                                        const char* response_str) {
+  sprintf((char*) data, "%x/%d/%s", rcode, response_int, response_str);
+}
+
 int pke_events_test() {
   struct pke_events pke;
   struct pke_event* ev = NULL;
@@ -428,6 +568,44 @@ int pke_events_test() {
   pthread_join(poster, NULL);
   fprintf(stderr, "\n");
 
+  /* Batched delivery: everything pending in one go, in order, and
+   * events that do not fit are left for the next call. */
+  char buf[64];
+  uint32_t* rec = (uint32_t*) buf;
+  pke_post_event(&pke, 111, 1, NULL);
+  pke_post_event(&pke, 222, 2, "hello");
+  pke_post_event(&pke, 333, 3, "this will not fit, it is too long");
+  assert(36 == pke_drain_events(&pke, buf, sizeof(buf), 1));
+  assert((111 == (rec[0] & PK_EV_TYPE_MASK)) && (1 == rec[1]) && !rec[2]);
+  assert((222 == (rec[4] & PK_EV_TYPE_MASK)) && (2 == rec[5]));
+  assert((5 == rec[6]) && (0 == strcmp(buf + 28, "hello")));
+  assert(48 == pke_drain_events(&pke, buf, sizeof(buf), 1));
+  assert((333 == (rec[0] & PK_EV_TYPE_MASK)) && (33 == rec[2]));
+  assert(0 == pke_drain_events(&pke, buf, sizeof(buf), 0));
+  fprintf(stderr, "pke_drain_events tests passed\n");
+
+  /* Asynchronous events: nobody waits, the response goes to the
+   * continuation and the slot is released. */
+  char result[64];
+  unsigned int token;
+  result[0] = '\0';
+  token = pke_post_async_event(&pke, 444, 4, "async",
+                               &pke_event_test_continuation, result);
+  assert(0 != (token & PK_EV_IS_BLOCKING));
+  ev = pke_await_event(&pke, 1);
+  assert((ev->event_code & ~PK_EV_PROCESSING) == token);
+  assert(0 == strcmp(ev->event_str, "async"));
+  assert('\0' == result[0]);
+  pke_post_response(&pke, token, PK_EV_RESPOND_ACCEPT, 7, "ok");
+  assert(0 == strcmp(result, "2/7/ok"));
+  assert(0 == pke_get_event(&pke, token)->posted);
+  assert(NULL == pke_get_event(&pke, token)->continuation);
+  pke.event_mask = PK_EV_MASK_LOGGING;
+  assert(PK_EV_NONE == pke_post_async_event(&pke, PK_EV_TUNNEL_REQUEST, 0,
+                                            NULL, NULL, NULL));
+  pke.event_mask = PK_EV_ALL;
+  fprintf(stderr, "pke_post_async_event tests passed\n");
+
   /* Avoid breaking subsequent tests. */
   _pke_default_pke = NULL;
   return 1;
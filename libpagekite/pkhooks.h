@@ -38,23 +38,28 @@ typedef enum {
   PK_HOOK_FE_CONN_OPENED  = 18,
   PK_HOOK_FE_CONN_CLOSED  = 19,
   PK_HOOK_FE_DISCONNECT   = 20,
+  PK_HOOK_STREAM_CLOSED   = 21, /* 0, pk_access_record, pk_backend_conn => log? */
 
   PK_HOOK_CHUNK_INCOMING  = 28, /* 0, pk_chunk, pk_backend_conn => (ignored) */
   PK_HOOK_CHUNK_OUTGOING  = 29,
-  PK_HOOK_DATA_INCOMING   = 30,
+  PK_HOOK_DATA_INCOMING   = 30, /* bytes, data, pk_tunnel      => (ignored) */
   PK_HOOK_DATA_OUTGOING   = 31, /* 0, pk_chunk, pk_backend_conn => pkc_write? */
 } pk_hook_t;
 #define PK_HOOK_MAX         32
 
+/* Like pk_state, each manager has its own table of hooks and pk_hooks
+ * points at the one the current thread selected. */
 #ifndef __IN_PKHOOKS_C__
-extern pagekite_callback2_t* pk_hooks[];
+extern pagekite_callback2_t* pk_hooks_default[];
+extern __thread pagekite_callback2_t** pk_hooks;
 #else
-pagekite_callback2_t* pk_hooks[PK_HOOK_MAX] = {
+pagekite_callback2_t* pk_hooks_default[PK_HOOK_MAX] = {
   NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
   NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
   NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
   NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
 };
+__thread pagekite_callback2_t** pk_hooks = pk_hooks_default;
 #endif
 
 /* This macro will return -1 (a true value) if the hook is undefined,
@@ -63,6 +68,10 @@ pagekite_callback2_t* pk_hooks[PK_HOOK_MAX] = {
         ((pk_hooks[n] == NULL) ? -1 : (pk_hooks[n])(n, i, p1, p2))
 
 
+/* Called with the response to an asynchronous event, see
+ * pke_post_async_event: data, response code, int and string. */
+typedef void (pke_continuation_t)(void*, unsigned int, int, const char*);
+
 struct pke_event {
   time_t          posted;
   unsigned int    event_code;
@@ -71,6 +80,8 @@ struct pke_event {
   unsigned int    response_code;
   int*            response_int;
   char**          response_str;
+  pke_continuation_t* continuation;
+  void*           continuation_data;
   pthread_cond_t  trigger;
 };
 
@@ -84,6 +95,8 @@ struct pke_events {
 };
 
 
+extern __thread struct pke_events* _pke_thread_pke;
+
 void pke_init_events             (struct pke_events*, unsigned int);
 void pke_free_event              (struct pke_events*, unsigned int);
 void pke_post_event              (struct pke_events*, unsigned int,
@@ -91,7 +104,11 @@ void pke_post_event              (struct pke_events*, unsigned int,
 struct pke_event* pke_post_blocking_event(
                                   struct pke_events*, unsigned int,
                                   int, const char*, int*, char**);
+unsigned int pke_post_async_event(struct pke_events*, unsigned int,
+                                  int, const char*,
+                                  pke_continuation_t*, void*);
 struct pke_event* pke_await_event(struct pke_events*, int);
+int pke_drain_events             (struct pke_events*, char*, int, int);
 struct pke_event* pke_get_event  (struct pke_events*, unsigned int);
 void pke_post_response           (struct pke_events*, unsigned int,
                                   unsigned int, int, const char*);
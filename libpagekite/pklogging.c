@@ -29,6 +29,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pkutils.h"
 #include "pkhooks.h"
 #include "pkstate.h"
+#include "pkstats.h"
 #include "pkerror.h"
 #include "pkconn.h"
 #include "pkproto.h"
@@ -135,6 +136,18 @@ void pk_log_raw_data(int level, char* prefix, int fd, void* data, size_t bytes)
   }
 }
 
+/* Report memory canaries found dead. Sampled mode is meant for production,
+ * so there we keep running; checking them all is a debugging aid. */
+void pk_log_dead_canaries(int dead) {
+  if (dead > 0) {
+    pk_log(PK_LOG_ERROR, "BUG! %d memory canaries died", dead);
+    pk_stats_canaries(dead);
+#if PK_MEMORY_CANARIES && !PK_MEMORY_CANARIES_SAMPLED
+    abort();
+#endif
+  }
+}
+
 int pk_log_chunk(struct pk_tunnel* fe, struct pk_chunk* chnk) {
   int i;
   int r = 0;
@@ -184,6 +197,57 @@ int pk_log_chunk(struct pk_tunnel* fe, struct pk_chunk* chnk) {
   return r;
 }
 
+static const char* pk_close_reasons[] = {
+  "unknown", "remote_eof", "backend_eof", "backend_error", "tunnel_lost",
+  "connect_failed", "evicted", "drained", "no_buffers"
+};
+
+/* Copy a string which came from the network into the access log, dropping
+ * anything which might break the JSON quoting. */
+static void pk_json_safe_copy(char* dst, const char* src, int len)
+{
+  for (; (src != NULL) && (*src != '\0') && (len > 1); src++) {
+    if ((*src >= ' ') && (*src != '"') && (*src != '\\') && (*src < 127)) {
+      *dst++ = *src;
+      len--;
+    }
+  }
+  *dst = '\0';
+}
+
+/* Render the access record of a closed stream as a single JSON object. */
+int pk_format_access(char* buf, size_t len, struct pk_backend_conn* pkb)
+{
+  struct pk_access_record* ar = &(pkb->access);
+  char sid[BE_MAX_SID_SIZE+1];
+  char rip[PK_ACCESS_RIP_MAX+1];
+  const char* proto = (pkb->kite != NULL) ? pkb->kite->protocol : "";
+  const char* domain = (pkb->kite != NULL) ? pkb->kite->public_domain : "";
+  int port = (pkb->kite != NULL) ? pkb->kite->public_port : 0;
+
+  pk_json_safe_copy(sid, pkb->sid, sizeof(sid));
+  pk_json_safe_copy(rip, ar->remote_ip, sizeof(rip));
+  return snprintf(buf, len,
+    "{\"sid\":\"%s\",\"kite\":\"%s:%d\",\"proto\":\"%s\","
+    "\"rip\":\"%s\",\"rport\":%d,"
+    "\"bytes_in\":%llu,\"bytes_out\":%llu,"
+    "\"connect_us\":%llu,\"ttfb_us\":%llu,\"duration_us\":%llu,"
+    "\"blocked_us\":%llu,\"close\":\"%s\"}",
+    sid, domain, port, proto, rip, ar->remote_port,
+    (unsigned long long) ar->bytes_in, (unsigned long long) ar->bytes_out,
+    (unsigned long long) ar->connect_us, (unsigned long long) ar->ttfb_us,
+    (unsigned long long) ar->duration_us, (unsigned long long) ar->blocked_us,
+    pk_close_reasons[ar->close_reason]);
+}
+
+int pk_log_access(struct pk_backend_conn* pkb)
+{
+  char buffer[PK_ACCESS_TEXT_MAX];
+  if (!(pk_state.log_mask & PK_LOG_ACCESS)) return 0;
+  pk_format_access(buffer, PK_ACCESS_TEXT_MAX, pkb);
+  return pk_log(PK_LOG_ACCESS, "access: %s", buffer);
+}
+
 
 void pk_dump_parser(char* prefix, struct pk_parser* p)
 {
@@ -232,6 +296,11 @@ void pk_dump_tunnel(char* prefix, struct pk_tunnel* fe)
   if (0 <= fe->conn.sockfd) {
     pk_log(PK_LOG_MANAGER_DEBUG, "%s/fe_session: %s", prefix, fe->fe_session);
     pk_log(PK_LOG_MANAGER_DEBUG, "%s/request_count: %d", prefix, fe->request_count);
+    pk_log(PK_LOG_MANAGER_DEBUG, "%s/stream_count: %d", prefix, fe->stream_count);
+    if (fe->last_traffic)
+      pk_log(PK_LOG_MANAGER_DEBUG, "%s/last_traffic: %x (%ds ago)", prefix,
+                                   fe->last_traffic,
+                                   pk_time(0) - fe->last_traffic);
     in_addr_to_str(fe->ai.ai_addr, tmp, 1024);
     pk_log(PK_LOG_MANAGER_DEBUG, "%s/fe_ai: %s", prefix, tmp);
     sprintf(tmp, "%s/conn", prefix);
@@ -263,6 +332,8 @@ void pk_dump_state(struct pk_manager* pkm)
 {
   int i;
   char prefix[1024];
+  char stats[PK_STATS_TEXT_MAX];
+  char *p, *eol;
   struct pk_tunnel* fe;
   struct pk_backend_conn* bec;
 
@@ -281,6 +352,8 @@ void pk_dump_state(struct pk_manager* pkm)
   pk_log(LL, "pk_manager/kite_max: %d", pkm->kite_max);
   pk_log(LL, "pk_manager/tunnel_max: %d", pkm->tunnel_max);
   pk_log(LL, "pk_manager/be_conn_max: %d", pkm->be_conn_max);
+  pk_log(LL, "pk_manager/conn_buffers: %d/%d free",
+             pkm->conn_buffers_avail, pkm->conn_buffers_max);
   pk_log(LL, "pk_manager/last_world_update: %x", pkm->last_world_update);
   pk_log(LL, "pk_manager/next_tick: %d", pkm->next_tick);
   pk_log(LL, "pk_manager/enable_timer: %d", 0 < pkm->enable_timer);
@@ -288,6 +361,12 @@ void pk_dump_state(struct pk_manager* pkm)
   pk_log(LL, "pk_manager/want_spare_frontends: %d", pkm->want_spare_frontends);
   pk_log(LL, "pk_manager/dynamic_dns_url: %s", pkm->dynamic_dns_url);
 
+  pk_stats_format(stats, PK_STATS_TEXT_MAX, 0);
+  for (p = stats; NULL != (eol = strchr(p, '\n')); p = eol + 1) {
+    *eol = '\0';
+    pk_log(LL, "pk_stats/%s", p);
+  }
+
   for (i = 0, fe = pkm->tunnels; i < pkm->tunnel_max; i++, fe++) {
     sprintf(prefix, "fe_%d", i);
     pk_dump_tunnel(prefix, fe);
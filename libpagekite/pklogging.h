@@ -30,7 +30,10 @@ extern FILE* PK_DISABLE_LOGGING;
 
 int pk_log(int, const char *fmt, ...);
 int pk_log_chunk(struct pk_tunnel*, struct pk_chunk*);
+int pk_format_access(char*, size_t, struct pk_backend_conn*);
+int pk_log_access(struct pk_backend_conn*);
 void pk_log_raw_data(int, char*, int, void*, size_t);
+void pk_log_dead_canaries(int);
 void pk_dump_parser(char*, struct pk_parser*);
 void pk_dump_conn(char*, struct pk_conn*);
 void pk_dump_tunnel(char*, struct pk_tunnel*);
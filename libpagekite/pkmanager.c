@@ -28,6 +28,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pkerror.h"
 #include "pkconn.h"
 #include "pkstate.h"
+#include "pkstats.h"
 #include "pkhooks.h"
 #include "pkproto.h"
 #include "pkblocker.h"
@@ -35,6 +36,9 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pklogging.h"
 #include "pkwatchdog.h"
 #include "opensslthreadlock.h"
+#if HAVE_RELAY
+#include "pkrelay.h"
+#endif
 
 #ifdef __MINGW32__
 #include <mxe/evwrap.c>
@@ -54,6 +58,7 @@ static struct pk_backend_conn* pkm_connect_be(struct pk_tunnel*,
 static ssize_t pkm_write_chunked(struct pk_tunnel*, struct pk_backend_conn*,
                                  ssize_t, char*);
 static int pkm_update_io(struct pk_tunnel*, struct pk_backend_conn*, int);
+static void pkm_stream_closed(struct pk_backend_conn*);
 static void pkm_flow_control_tunnel(struct pk_tunnel*, flow_op, int);
 static void pkm_flow_control_conn(struct pk_conn*, flow_op);
 static void pkm_parse_eof(struct pk_backend_conn* pkb, char *eof);
@@ -64,8 +69,13 @@ static void pkm_be_conn_writable_cb(EV_P_ ev_io*, int);
 static void pkm_listener_cb(EV_P_ ev_io*, int);
 static void pkm_tick_cb(EV_P_ ev_async*, int);
 static void pkm_timer_cb(EV_P_ ev_timer*, int);
+static void pkm_loop_check_cb(EV_P_ ev_check*, int);
+static void pkm_loop_prepare_cb(EV_P_ ev_prepare*, int);
 static void pkm_reset_timer(struct pk_manager*);
 static void pkm_reset_manager(struct pk_manager*);
+static void pkm_reset_conn_buffers(struct pk_manager*);
+static void pkm_hibernate_stream(struct pk_manager*, struct pk_backend_conn*);
+static void pkm_unlink_stream(struct pk_backend_conn*);
 static struct pk_pagekite* pkm_find_kite(struct pk_manager*,
                                          const char*, const char*, int);
 static unsigned int pkm_sid_shift(char *);
@@ -101,6 +111,7 @@ static void pkm_yield(struct pk_manager *pkm)
 static void pkm_interrupt_cb(EV_P_ ev_async *w, int revents)
 {
   struct pk_manager* pkm = (struct pk_manager*) w->data;
+  pkm_loop_cb_start(pkm, "pkm_interrupt_cb", -1);
 
   /* This interleaving of locks guarantees that the event loop will be idle
      and the caller of pkm_interrupt() will be holding the loop_lock when
@@ -111,6 +122,8 @@ static void pkm_interrupt_cb(EV_P_ ev_async *w, int revents)
   pkm_yield_stop(pkm);
   pthread_mutex_unlock(&(pkm->intr_lock));
 
+  pkm_loop_cb_stop(pkm, PK_STALL_INTERRUPT, NULL);
+
   /* -Wall dislikes unused arguments */
   (void) loop;
   (void) (revents);
@@ -163,6 +176,25 @@ static void pkm_quit(struct pk_manager* pkm)
 }
 
 
+/* Check the canaries of the objects a callback just worked on. Unlike
+ * PK_CHECK_MEMORY_CANARIES this is cheap, so sampled builds do it too. */
+static void pkm_check_canaries(struct pk_tunnel* fe,
+                               struct pk_backend_conn* pkb)
+{
+  if (fe != NULL) {
+    PK_CHECK_MEMORY_CANARY(fe);
+    PK_CHECK_MEMORY_CANARY(&(fe->conn));
+    PK_CHECK_MEMORY_CANARY(fe->parser);
+  }
+  if (pkb != NULL) {
+    PK_CHECK_MEMORY_CANARY(pkb);
+    PK_CHECK_MEMORY_CANARY(&(pkb->conn));
+  }
+  /* -Wall dislikes unused arguments */
+  (void) fe;
+  (void) pkb;
+}
+
 static void pkm_chunk_cb(struct pk_tunnel* fe, struct pk_chunk *chunk)
 {
   struct pk_backend_conn* pkb; /* FIXME: What if we are a front-end? */
@@ -214,11 +246,18 @@ static void pkm_chunk_cb(struct pk_tunnel* fe, struct pk_chunk *chunk)
     pkm_yield_start(fe->manager);
 
   if (fe->manager->enable_http_forwarding_headers) {
-    pk_http_forwarding_headers_hook(chunk, pkb);
+    pk_http_forwarding_headers_hook(chunk, fe->manager->rewrite_space);
   }
 
   PK_HOOK(PK_HOOK_CHUNK_INCOMING, 0, chunk, pkb);
 
+  /* Anything arriving after a keepalive ping proves the tunnel survived
+   * being idle that long. */
+  if (fe->keepalive_idle) {
+    pkm_keepalive_learn(fe->manager, fe->keepalive_idle, 1);
+    fe->keepalive_idle = 0;
+  }
+
   if (NULL != chunk->noop) {
     if (NULL != chunk->ping) {
       bytes = pk_format_pong(reply);
@@ -233,14 +272,30 @@ static void pkm_chunk_cb(struct pk_tunnel* fe, struct pk_chunk *chunk)
   else if (NULL != pkb) {
     if (NULL == chunk->eof) {
       if (PK_HOOK(PK_HOOK_DATA_OUTGOING, chunk->length, chunk->data, pkb)) {
-        pkc_write(&(pkb->conn), chunk->data, chunk->length);
+        if (0 <= pkm_wake_stream(fe->manager, pkb)) {
+          pkc_write(&(pkb->conn), chunk->data, chunk->length);
+        }
+        else {
+          /* Writing without a buffer might block the whole event loop,
+           * so we give up on this one stream instead. */
+          pk_log(PK_LOG_BE_CONNS|PK_LOG_ERROR,
+                 "%d: No I/O buffers free, closing stream %s",
+                 pkb->conn.sockfd, pkb->sid);
+          pkb->access.close_reason = PK_CLOSE_NO_BUFFERS;
+          pkb->conn.status |= (CONN_STATUS_CLS_WRITE|CONN_STATUS_CLS_READ);
+        }
       }
+      pkb->access.bytes_in += chunk->length;
+      /* Chunks come from the tunnel read which just updated activity. */
+      fe->last_traffic = fe->conn.activity;
     }
     else {
       pkm_parse_eof(pkb, chunk->eof);
     }
   }
 
+  PK_CHECK_MEMORY_CANARY(chunk);
+  pkm_check_canaries(fe, pkb);
   pkm_yield_stop(fe->manager);
   if (NULL != pkb) {
     /* Flow control: we have recieved a chunk telling us how much has
@@ -286,6 +341,7 @@ struct pk_backend_conn* pkm_connect_be(struct pk_tunnel* fe,
   struct hostent *backend;
   struct pk_backend_conn* pkb;
   struct pk_pagekite *kite;
+  uint64_t started_us = pk_time_us();
 
   PK_TRACE_FUNCTION;
 
@@ -315,6 +371,11 @@ struct pk_backend_conn* pkm_connect_be(struct pk_tunnel* fe,
            chunk->request_proto, chunk->request_host, chunk->request_port);
     return NULL;
   }
+  pkb->kite = kite;
+  pkb->access.opened_us = started_us;
+  pkb->access.remote_port = chunk->remote_port;
+  if (NULL != chunk->remote_ip)
+    strncpyz(pkb->access.remote_ip, chunk->remote_ip, PK_ACCESS_RIP_MAX);
   pkm_yield_start(fe->manager);
 
   /* Look up the back-end... */
@@ -354,7 +415,9 @@ struct pk_backend_conn* pkm_connect_be(struct pk_tunnel* fe,
         PKS_close(sockfd);
 
       pkm_yield_stop(fe->manager);
-      pkm_free_be_conn(pkb);
+      pkb->access.close_reason = PK_CLOSE_CONNECT_FAILED;
+      pkm_stream_closed(pkb);
+      pkm_free_be_conn(fe->manager, pkb);
       pk_log(PK_LOG_TUNNEL_CONNS, "pkm_connect_be: Failed to connect %s:%d",
                                   kite->local_domain, kite->local_port);
       return NULL;
@@ -368,10 +431,12 @@ struct pk_backend_conn* pkm_connect_be(struct pk_tunnel* fe,
    *        See also: http://developerweb.net/viewtopic.php?id=3196 */
 
   pkm_yield_stop(fe->manager);
+  pkb->access.connect_us = pk_time_us() - started_us;
+  pk_stats_record(&(pk_stats.be_connect), pkb->access.connect_us);
 
   chunk->first_chunk = 1;
-  pkb->kite = kite;
   pkb->conn.sockfd = sockfd;
+  pkb->first_chunk_us = started_us;
 
   int ev_sock = PKS_EV_FD(sockfd);
   ev_io_init(&(pkb->conn.watch_r), pkm_be_conn_readable_cb, ev_sock, EV_READ);
@@ -410,12 +475,20 @@ static ssize_t pkm_write_chunked(struct pk_tunnel* fe,
   return pkc_write(pkc, data, length);
 }
 
+/* Complete the access record of a stream which is going away, and hand it
+ * to the PK_HOOK_STREAM_CLOSED callback and/or the access log. */
+static void pkm_stream_closed(struct pk_backend_conn* pkb)
+{
+  struct pk_access_record* ar = &(pkb->access);
+  if (ar->opened_us) ar->duration_us = pk_time_us() - ar->opened_us;
+  if (PK_HOOK(PK_HOOK_STREAM_CLOSED, 0, ar, pkb)) pk_log_access(pkb);
+}
+
 static int pkm_update_io(
   struct pk_tunnel* fe,
   struct pk_backend_conn* pkb,
   int recursion)
 {
-  int i;
   int bytes;
   int loglevel, loglevelclose;
   char buffer[1024];
@@ -530,12 +603,15 @@ static int pkm_update_io(
       pk_log(loglevel, "%d: Sent and flushed EOF (0x%x)", pkc->sockfd, eof);
     }
     else {
-      /* This is a tunnel, send EOF to all backends, mark for reconnection. */
-      /* FIXME: This is O(n), but rare.  Maybe OK? */
+      /* This is a tunnel, send EOF to all backends, mark for reconnection.
+       * Closing a stream unlinks it, so grab the next one first. */
+      struct pk_backend_conn* next;
       pk_log(loglevel, "%d: Shutting down tunnel.", pkc->sockfd);
-      for (i = 0; i < pkm->be_conn_max; i++) {
-        pkb = (pkm->be_conns+i);
-        if ((pkb->tunnel == fe) && (pkb->conn.status != CONN_STATUS_UNKNOWN)) {
+      for (pkb = fe->streams; pkb != NULL; pkb = next) {
+        next = pkb->tnl_next;
+        if (pkb->conn.status != CONN_STATUS_UNKNOWN) {
+          if (!pkb->access.close_reason)
+            pkb->access.close_reason = PK_CLOSE_TUNNEL_LOST;
           pkb->conn.status |= (CONN_STATUS_END_WRITE|CONN_STATUS_END_READ);
           pkm_update_io(fe, pkb, recursion);
         }
@@ -552,15 +628,31 @@ static int pkm_update_io(
       PKS_close(pkc->sockfd);
     }
     if (pkb != NULL) {
-      pkm_free_be_conn(pkb);
+      if (pkb->tnl_blocked_us) {
+        pkb->access.blocked_us += pk_time_us() - pkb->tnl_blocked_us;
+        pk_stats_record(&(pk_stats.tnl_blocked),
+                        pk_time_us() - pkb->tnl_blocked_us);
+      }
+      pkm_stream_closed(pkb);
+      pkm_free_be_conn(pkm, pkb);
       PKS_STATE(pk_state.live_streams -= 1);
     }
     else {
       /* FIXME: Is this the right way to clean up dead tunnels? */
       PKS_STATE(pk_state.live_tunnels -= 1;
-                pkm->status = PK_STATUS_PROBLEMS);
+                if (!(fe->conn.status & FE_STATUS_DRAINING))
+                  pkm->status = PK_STATUS_PROBLEMS);
       pkc_reset_conn(&(fe->conn), CONN_STATUS_ALLOCATED);
       fe->request_count = 0;
+      if (fe->keepalive_idle && !(fe->conn.status & FE_STATUS_DRAINING)) {
+        /* Our keepalive went unanswered: idle this long is too long. */
+        pkm_keepalive_learn(pkm, fe->keepalive_idle, 0);
+        fe->keepalive_idle = 0;
+      }
+      if (!(fe->conn.status & FE_STATUS_DRAINING)) {
+        /* If the relay restarted, all its connectors noticed at once. */
+        pkm_reconnect_backoff(fe);
+      }
       if (pk_state.live_tunnels < 1) {
         pkm->next_tick = 1 + pkm->housekeeping_interval_min;
       }
@@ -571,6 +663,9 @@ static int pkm_update_io(
   else if (tunnel_flow_op != FLOW_OP_NONE) {
     pkm_flow_control_tunnel(fe, tunnel_flow_op, recursion);
   }
+  else if (pkb != NULL) {
+    pkm_hibernate_stream(pkm, pkb);
+  }
 
   pkm_yield(pkm);
   return flows;
@@ -578,30 +673,35 @@ static int pkm_update_io(
 
 static void pkm_flow_control_tunnel(struct pk_tunnel* fe, flow_op op, int rec)
 {
-  int i;
   struct pk_backend_conn* pkb;
-  struct pk_manager* pkm = fe->manager;
+  struct pk_backend_conn* next;
 
   PK_TRACE_FUNCTION;
 
-  /* FIXME: This is inefficient.
-   *   1) we should only evaluate tunnels that are blocked / not blocked
-   *   2) we should only evaluate backends linked to this tunnel
+  /* FIXME: This is inefficient,
+   *        we should only evaluate tunnels that are blocked / not blocked.
    */
 
-  for (i = 0; i < pkm->be_conn_max; i++) {
-    pkb = (pkm->be_conns + i);
+  for (pkb = fe->streams; pkb != NULL; pkb = next) {
+    next = pkb->tnl_next;
     unsigned int old_status = pkb->conn.status;
-    if ((pkb->tunnel == fe) && (pkb->conn.sockfd >= 0)) {
+    if (pkb->conn.sockfd >= 0) {
       if (pkb->conn.status & CONN_STATUS_TNL_BLOCKED) {
         if (op == CONN_TUNNEL_UNBLOCKED) {
           pk_log(PK_LOG_TUNNEL_DATA, "%d: Tunnel unblocked.", pkb->conn.sockfd);
           pkb->conn.status &= ~CONN_STATUS_TNL_BLOCKED;
+          if (pkb->tnl_blocked_us) {
+            pkb->access.blocked_us += pk_time_us() - pkb->tnl_blocked_us;
+            pk_stats_record(&(pk_stats.tnl_blocked),
+                            pk_time_us() - pkb->tnl_blocked_us);
+            pkb->tnl_blocked_us = 0;
+          }
         }
       }
       else if (op == CONN_TUNNEL_BLOCKED) {
         pk_log(PK_LOG_TUNNEL_DATA, "%d: Tunnel blocked.", pkb->conn.sockfd);
         pkb->conn.status |= CONN_STATUS_TNL_BLOCKED;
+        pkb->tnl_blocked_us = pk_time_us();
       }
     }
     if (old_status != pkb->conn.status) {
@@ -652,6 +752,8 @@ static void pkm_parse_eof(struct pk_backend_conn* pkb, char *eof)
   }
   if (!eof_write && !eof_read) /* Legacy EOF support */
     eof_write = eof_read = 1;
+  if (!pkb->access.close_reason)
+    pkb->access.close_reason = PK_CLOSE_REMOTE_EOF;
 
   /* If we cannot write anymore, there is no point in reading. */
   if (eof_write) {
@@ -669,10 +771,13 @@ static void pkm_tunnel_readable_cb(EV_P_ ev_io *w, int revents)
   int rv, read_bytes;
   struct pk_tunnel* fe = (struct pk_tunnel*) w->data;
   PK_TRACE_FUNCTION;
+  pkm_loop_cb_start(fe->manager, "pkm_tunnel_readable_cb", fe->conn.sockfd);
 
   fe->conn.status &= ~CONN_STATUS_WANT_READ;
   do {
     if (0 < (read_bytes = pkc_read(&(fe->conn)))) {
+      PK_HOOK(PK_HOOK_DATA_INCOMING, fe->conn.in_buffer_pos,
+              fe->conn.in_buffer, fe);
       if (0 > (rv = pk_parser_parse(fe->parser,
                                     fe->conn.in_buffer_pos,
                                     (char *) fe->conn.in_buffer)))
@@ -696,7 +801,9 @@ static void pkm_tunnel_readable_cb(EV_P_ ev_io *w, int revents)
   } while ((read_bytes > 0) && (pkc_pending(&(fe->conn)) > 0));
 
   PK_CHECK_MEMORY_CANARIES;
+  pkm_check_canaries(fe, NULL);
   pkm_update_io(fe, NULL, 0);
+  pkm_loop_cb_stop(fe->manager, PK_STALL_TUNNEL_READ, NULL);
   /* -Wall dislikes unused arguments */
   (void) loop;
   (void) revents;
@@ -705,6 +812,7 @@ static void pkm_tunnel_readable_cb(EV_P_ ev_io *w, int revents)
 static void pkm_tunnel_writable_cb(EV_P_ ev_io* w, int revents)
 {
   struct pk_tunnel* fe = (struct pk_tunnel*) w->data;
+  pkm_loop_cb_start(fe->manager, "pkm_tunnel_writable_cb", fe->conn.sockfd);
 
   /* This is necessary for SSL handshakes and the like. */
   if (fe->conn.status & CONN_STATUS_WANT_WRITE) {
@@ -714,8 +822,10 @@ static void pkm_tunnel_writable_cb(EV_P_ ev_io* w, int revents)
   }
   pkc_flush(&(fe->conn), NULL, 0, NON_BLOCKING_FLUSH, "tunnel");
   PK_CHECK_MEMORY_CANARIES;
+  pkm_check_canaries(fe, NULL);
 
   pkm_update_io(fe, NULL, 0);
+  pkm_loop_cb_stop(fe->manager, PK_STALL_TUNNEL_WRITE, NULL);
   /* -Wall dislikes unused arguments */
   (void) loop;
   (void) revents;
@@ -724,16 +834,38 @@ static void pkm_tunnel_writable_cb(EV_P_ ev_io* w, int revents)
 static void pkm_be_conn_readable_cb(EV_P_ ev_io* w, int revents)
 {
   struct pk_backend_conn* pkb = (struct pk_backend_conn*) w->data;
-  size_t bytes;
+  struct pk_manager* pkm = pkb->tunnel->manager;
+  char sid[BE_MAX_SID_SIZE+1];
+  ssize_t bytes;
+  int borrowed;
 
   PK_TRACE_FUNCTION;
+  pkm_loop_cb_start(pkm, "pkm_be_conn_readable_cb", pkb->conn.sockfd);
 
   if (pkb->conn.status & CONN_STATUS_TNL_BLOCKED) {
     pk_log(PK_LOG_BE_DATA, ">%5.5s> BLOCKED: Tunnel is blocked.", pkb->sid);
   }
   else {
+    /* Whatever we read goes straight into the tunnel, so if we are out of
+     * buffers a hibernating stream can read into the spare. */
+    borrowed = (0 > pkm_wake_stream(pkm, pkb));
+    if (borrowed) pkc_set_buffers(&(pkb->conn), pkm->conn_buffer_spare);
+
     pkb->conn.status &= ~CONN_STATUS_WANT_READ;
     bytes = pkc_read(&(pkb->conn));
+    if ((0 < bytes) && pkb->first_chunk_us) {
+      pkb->access.ttfb_us = pk_time_us() - pkb->first_chunk_us;
+      pk_stats_record(&(pk_stats.be_first_byte), pkb->access.ttfb_us);
+      pkb->first_chunk_us = 0;
+    }
+    if (0 < bytes) {
+      pkb->access.bytes_out += bytes;
+      pkb->tunnel->last_traffic = pkb->conn.activity;
+    }
+    else if (!pkb->access.close_reason) {
+      pkb->access.close_reason = (bytes == 0) ? PK_CLOSE_BACKEND_EOF
+                                              : PK_CLOSE_BACKEND_ERROR;
+    }
     if ((0 < bytes) &&
         (0 <= pkm_write_chunked(pkb->tunnel, pkb,
                                 pkb->conn.in_buffer_pos,
@@ -744,10 +876,20 @@ static void pkm_be_conn_readable_cb(EV_P_ ev_io* w, int revents)
     else if (bytes == 0) {
       pk_log(PK_LOG_BE_DATA, ">%5.5s> EOF: read", pkb->sid);
     }
+
+    if (borrowed) {
+      /* Only left over if the tunnel is broken, in which case so are we. */
+      pkb->conn.in_buffer_pos = 0;
+      pkc_set_buffers(&(pkb->conn), NULL);
+    }
   }
 
   PK_CHECK_MEMORY_CANARIES;
+  pkm_check_canaries(pkb->tunnel, pkb);
+  /* The slot may be freed (and its SID cleared) by pkm_update_io. */
+  strncpyz(sid, pkb->sid, BE_MAX_SID_SIZE);
   pkm_update_io(pkb->tunnel, pkb, 0);
+  pkm_loop_cb_stop(pkm, PK_STALL_BE_READ, sid);
   /* -Wall dislikes unused arguments */
   (void) loop;
   (void) revents;
@@ -756,8 +898,11 @@ static void pkm_be_conn_readable_cb(EV_P_ ev_io* w, int revents)
 static void pkm_be_conn_writable_cb(EV_P_ ev_io* w, int revents)
 {
   struct pk_backend_conn* pkb = (struct pk_backend_conn*) w->data;
+  struct pk_manager* pkm = pkb->tunnel->manager;
+  char sid[BE_MAX_SID_SIZE+1];
 
   PK_TRACE_FUNCTION;
+  pkm_loop_cb_start(pkm, "pkm_be_conn_writable_cb", pkb->conn.sockfd);
 
   /* This is necessary for SSL handshakes and the like. */
   if (pkb->conn.status & CONN_STATUS_WANT_WRITE) {
@@ -777,7 +922,10 @@ static void pkm_be_conn_writable_cb(EV_P_ ev_io* w, int revents)
            pkb->kite->local_domain, pkb->kite->local_port);
   }
   PK_CHECK_MEMORY_CANARIES;
+  pkm_check_canaries(pkb->tunnel, pkb);
+  strncpyz(sid, pkb->sid, BE_MAX_SID_SIZE);
   pkm_update_io(pkb->tunnel, pkb, 0);
+  pkm_loop_cb_stop(pkm, PK_STALL_BE_WRITE, sid);
   /* -Wall dislikes unused arguments */
   (void) loop;
   (void) revents;
@@ -789,7 +937,9 @@ static void pkm_listener_cb(EV_P_ ev_io* w, int revents)
   socklen_t client_len = sizeof(client_addr);
   int client_fd;
   struct pk_backend_conn* pkl = (struct pk_backend_conn*) w->data;
+  struct pk_manager* pkm = (struct pk_manager*) pkl->conn.watch_w.data;
 
+  pkm_loop_cb_start(pkm, "pkm_listener_cb", pkl->conn.sockfd);
   ev_io_stop(EV_A_ w);
   while (0 <= (client_fd = PKS_accept(pkl->conn.sockfd,
                                       (struct sockaddr*) &client_addr,
@@ -802,6 +952,7 @@ static void pkm_listener_cb(EV_P_ ev_io* w, int revents)
     }
   }
   ev_io_start(EV_A_ w);
+  pkm_loop_cb_stop(pkm, PK_STALL_ACCEPT, NULL);
 
   (void) loop;
   (void) revents;
@@ -810,10 +961,11 @@ static void pkm_listener_cb(EV_P_ ev_io* w, int revents)
 int pkm_reconnect_all(struct pk_manager* pkm, int ignore_errors) {
   struct pk_kite_request *kite_r;
   unsigned int status;
-  int i, j, reconnect, tried, connected;
+  int i, j, reconnect, tried, connected, deferred;
+  time_t now = pk_time();
 
   PK_TRACE_FUNCTION;
-  tried = connected = 0;
+  tried = connected = deferred = 0;
 
   /* The lock must already be held, or we may have nasty bugs. */
   assert(0 != pkm_reconfig_start(pkm));
@@ -827,6 +979,7 @@ int pkm_reconnect_all(struct pk_manager* pkm, int ignore_errors) {
 
     if (fe->fe_hostname == NULL || fe->ai.ai_addr == NULL) continue;
     if (!(fe->conn.status & (FE_STATUS_WANTED|FE_STATUS_IN_DNS))) continue;
+    if (fe->conn.status & FE_STATUS_DRAINING) continue;
 
     /* Ignore tunnels that are changing state, but log that we did so since
      * tunnels stuck in a long-running change may indicate other problems. */
@@ -837,6 +990,15 @@ int pkm_reconnect_all(struct pk_manager* pkm, int ignore_errors) {
       continue;
     }
 
+    /* Backing off after a failure or a lost tunnel, see below. */
+    if ((fe->conn.sockfd < 0) && (fe->retry_after > now)) {
+      pk_log(PK_LOG_MANAGER_DEBUG,
+             "Reconnect to %s deferred for %ds (retry %d)",
+             fe->fe_hostname, (int) (fe->retry_after - now), fe->retry_count);
+      deferred++;
+      continue;
+    }
+
     /* Ignore this relay if we already have a live connection to the same
      * one using a different IP (recognized by identical UUIDs).
      */
@@ -921,6 +1083,9 @@ int pkm_reconnect_all(struct pk_manager* pkm, int ignore_errors) {
         PKS_STATE(pk_state.live_tunnels += 1);
         fe->conn.status &= ~CONN_STATUS_CHANGING;  /* Change complete */
         fe->error_count = 0;
+        fe->keepalive_idle = 0;
+        fe->retry_count = 0;
+        fe->retry_after = 0;
         connected++;
       }
       else {
@@ -935,6 +1100,7 @@ int pkm_reconnect_all(struct pk_manager* pkm, int ignore_errors) {
 
         if (!ignore_errors && fe->error_count < 999)
           fe->error_count += 1;
+        pkm_reconnect_backoff(fe);
 
         status = fe->conn.status;
         if (pk_error == ERR_CONNECT_REJECTED) {
@@ -953,16 +1119,78 @@ int pkm_reconnect_all(struct pk_manager* pkm, int ignore_errors) {
       }
     }
   }
+
+  /* Wake up when the first deferred reconnect is due, rather than on the
+   * next tick: ticks of connectors which lost the same relay are in step,
+   * the jittered deadlines are not. */
+  pkm->retry_at = 0;
+  PK_TUNNEL_ITER(pkm, fe) {
+    if ((fe->conn.sockfd < 0) && (fe->retry_after > now) &&
+        (fe->conn.status & (FE_STATUS_WANTED|FE_STATUS_IN_DNS)) &&
+        ((pkm->retry_at == 0) || (fe->retry_after < pkm->retry_at)))
+      pkm->retry_at = fe->retry_after;
+  }
+  ev_timer_stop(pkm->loop, &(pkm->retry_timer));
+  if (pkm->retry_at && !pkm->dozing) {
+    ev_timer_set(&(pkm->retry_timer), pkm->retry_at - pk_time(), 0.0);
+    ev_timer_start(pkm->loop, &(pkm->retry_timer));
+  }
+
   PK_CHECK_MEMORY_CANARIES;
   pkm_unblock(pkm);
-  return (tried - connected);
+  return (tried - connected + deferred);
 }
 
-int pkm_disconnect_unused(struct pk_manager* pkm) {
-  struct pk_backend_conn* pkb;
+/* Capped exponential backoff with full jitter: the window doubles with
+ * each consecutive failure, and the actual delay is anywhere within it.
+ * Connectors which lost the same relay at the same moment thus come back
+ * spread out, instead of all at once on their next tick. */
+time_t pkm_reconnect_backoff(struct pk_tunnel* fe)
+{
+  time_t window = PK_RECONNECT_BACKOFF_MIN;
+  time_t delay;
+  int i;
+
+  for (i = 0; (i < fe->retry_count) && (window < PK_RECONNECT_BACKOFF_MAX); i++)
+    window *= 2;
+  if (window > PK_RECONNECT_BACKOFF_MAX) window = PK_RECONNECT_BACKOFF_MAX;
+  if (fe->retry_count < 999) fe->retry_count += 1;
+
+  delay = rand() % (window + 1);
+  fe->retry_after = pk_time() + delay;
+  return delay;
+}
+
+int pkm_tunnel_unused(struct pk_tunnel* fe)
+{
+  /* O(1): the stream count is kept up to date as streams come and go,
+   * so the tick may ask this as often as it likes. Recent traffic
+   * (last_traffic) is for diagnostics only and does not count. */
+  return (0 == fe->stream_count);
+}
+
+static void pkm_disconnect_tunnel(struct pk_manager* pkm,
+                                  struct pk_tunnel* fe)
+{
   char buffer[1025];
   unsigned int status;
-  int i, j, pass, disconnect, disconnected, live, ping_window;
+
+  pk_log(PK_LOG_MANAGER_INFO, "Disconnecting: %s",
+                              in_addr_to_str(fe->ai.ai_addr, buffer, 1024));
+
+  ev_io_stop(pkm->loop, &(fe->conn.watch_r));
+  ev_io_stop(pkm->loop, &(fe->conn.watch_w));
+  PKS_close(fe->conn.sockfd);
+  fe->conn.sockfd = -1;
+
+  status = fe->conn.status;
+  pkc_reset_conn(&(fe->conn), 0);
+  fe->conn.status = (CONN_STATUS_ALLOCATED | (status & FE_STATUS_BITS));
+  fe->request_count = 0;
+}
+
+int pkm_disconnect_unused(struct pk_manager* pkm) {
+  int i, pass, disconnect, disconnected, live, ping_window;
 
   PK_TRACE_FUNCTION;
   ping_window = pk_time() - 4*pkm->housekeeping_interval_min;
@@ -1003,30 +1231,11 @@ int pkm_disconnect_unused(struct pk_manager* pkm) {
       }
 
       /* Check if there are any live streams... */
-      disconnect++;
-      for (j = 0; j < pkm->be_conn_max; j++) {
-        pkb = (pkm->be_conns + j);
-        if (pkb->conn.sockfd > 0 && pkb->tunnel == fe) {
-          disconnect--;
-          break;
-        }
-      }
+      if (pkm_tunnel_unused(fe)) disconnect++;
 
       if ((2 == pass) && disconnect) {
-        pk_log(PK_LOG_MANAGER_INFO, "Disconnecting: %s",
-                                    in_addr_to_str(fe->ai.ai_addr, buffer, 1024));
-
-        ev_io_stop(pkm->loop, &(fe->conn.watch_r));
-        ev_io_stop(pkm->loop, &(fe->conn.watch_w));
-        PKS_close(fe->conn.sockfd);
-        fe->conn.sockfd = -1;
+        pkm_disconnect_tunnel(pkm, fe);
         disconnected += 1;
-
-        status = fe->conn.status;
-        pkc_reset_conn(&(fe->conn), 0);
-        fe->conn.status = (CONN_STATUS_ALLOCATED | (status & FE_STATUS_BITS));
-        fe->request_count = 0;
-
         disconnect = 0; /* Reset, to prevent cascading. */
       }
     }
@@ -1041,13 +1250,91 @@ int pkm_disconnect_unused(struct pk_manager* pkm) {
 }
 
 
+/* Tunnels the front-end selection no longer wants are drained, not cut:
+ * they are already left out of dynamic DNS, so we wait for the streams
+ * they carry to finish and for DNS to forget them, or for the deadline.
+ * Nothing is closed until some other wanted tunnel is live. */
+int pkm_drain_tunnels(struct pk_manager* pkm)
+{
+  struct pk_backend_conn* pkb;
+  int live, tunnels, streams, started, finished, expired, cut;
+  time_t now = pk_time();
+
+  PK_TRACE_FUNCTION;
+
+  /* The lock must already be held, or we may have nasty bugs. */
+  assert(0 != pkm_reconfig_start(pkm));
+
+  pkm_block(pkm);
+  live = tunnels = streams = started = finished = expired = cut = 0;
+  PK_TUNNEL_ITER(pkm, fe) {
+    if ((fe->fe_hostname == NULL) || (fe->ai.ai_addr == NULL)) continue;
+    if (!(fe->conn.status & (FE_STATUS_WANTED|FE_STATUS_NAILED_UP))) continue;
+    if (fe->conn.status & FE_STATUS_DRAINING) {
+      pk_log(PK_LOG_MANAGER_INFO, "Wanted again, not draining: %s",
+                                  fe->fe_hostname);
+      fe->conn.status &= ~FE_STATUS_DRAINING;
+    }
+    if ((fe->conn.sockfd > 0) && !(fe->conn.status & CONN_STATUS_CHANGING))
+      live++;
+  }
+
+  PK_TUNNEL_ITER(pkm, fe) {
+    if ((fe->fe_hostname == NULL) || (fe->ai.ai_addr == NULL)) continue;
+    if (fe->conn.status & (FE_STATUS_WANTED|FE_STATUS_NAILED_UP)) continue;
+    if (fe->conn.status & CONN_STATUS_CHANGING) continue;
+    if (fe->conn.sockfd <= 0) continue;
+
+    if (!(fe->conn.status & FE_STATUS_DRAINING)) {
+      fe->conn.status |= FE_STATUS_DRAINING;
+      fe->drain_deadline = now + pkm->drain_timeout;
+      fe->drain_streams = fe->stream_count;
+      started++;
+      pk_log(PK_LOG_MANAGER_INFO, "Draining: %s (%d streams, %ds)",
+                                  fe->fe_hostname, fe->stream_count,
+                                  (int) pkm->drain_timeout);
+    }
+
+    if (live && (0 == fe->stream_count) &&
+                !(fe->conn.status & FE_STATUS_IN_DNS)) {
+      pk_log(PK_LOG_MANAGER_INFO, "Drained: %s", fe->fe_hostname);
+      pkm_disconnect_tunnel(pkm, fe);
+      PKS_STATE(pk_state.live_tunnels -= 1);
+      finished++;
+    }
+    else if (live && (fe->drain_deadline <= now)) {
+      /* Let the event loop tear down the tunnel and whatever is left on
+       * it, as it would if the connection had been lost. */
+      pk_log(PK_LOG_MANAGER_INFO, "Drain deadline passed: %s (%d streams)",
+                                  fe->fe_hostname, fe->stream_count);
+      for (pkb = fe->streams; pkb != NULL; pkb = pkb->tnl_next) {
+        if (!pkb->access.close_reason)
+          pkb->access.close_reason = PK_CLOSE_DRAINED;
+      }
+      PKS_shutdown(fe->conn.sockfd, SHUT_RDWR);
+      expired++;
+      cut += fe->stream_count;
+    }
+    else {
+      tunnels++;
+      streams += fe->stream_count;
+    }
+  }
+  pk_stats_drain(tunnels, streams, started, finished, expired, cut);
+
+  PK_CHECK_MEMORY_CANARIES;
+  pkm_unblock(pkm);
+  return (finished + expired);
+}
+
+
 void pkm_tick(struct pk_manager* pkm)
 {
   ev_async_send(pkm->loop, &(pkm->tick));
 }
 static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
 {
-  int i, pingsize;
+  int i, pingsize, pings_due;
   char ping[PK_REJECT_MAXSIZE];
   struct pk_manager* pkm = (struct pk_manager*) w->data;
   time_t next_tick = pkm->next_tick;
@@ -1055,8 +1342,10 @@ static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
   time_t now = pk_time();
   time_t increment = (next_tick / 3);
   time_t inactive = now - PK_HOUSEKEEPING_INTERVAL_MAX_MIN;
+  time_t due, world_slack = 0;
 
   PK_TRACE_FUNCTION;
+  pkm_loop_cb_start(pkm, "pkm_tick_cb", -1);
   pkw_pet_watchdog();
 
   PK_HOOK(PK_HOOK_TICK, now, pkm, NULL);
@@ -1067,8 +1356,12 @@ static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
                             pkm->status != PK_STATUS_REJECTED &&
                             pkm->status != PK_STATUS_FLYING))
   {
-    pkm->timer.repeat = pkm->next_tick;
-    ev_timer_again(pkm->loop, &(pkm->timer));
+    /* While dozing, only the app wakes us up. */
+    if (!pkm->dozing) {
+      pkm->timer.repeat = pkm->next_tick;
+      ev_timer_again(pkm->loop, &(pkm->timer));
+    }
+    else ev_timer_stop(pkm->loop, &(pkm->timer));
     pk_log(PK_LOG_MANAGER_INFO,
            "Tick!  [repeating=%s, next=%d, status=%d, tunnels=%d, v=%s]",
            pkm->enable_timer ? "yes" : "no", pkm->next_tick,
@@ -1103,6 +1396,20 @@ static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
     next_tick = 1 + pkm->housekeeping_interval_min;
   }
 
+  /* In power saving mode, pings are batched: once any tunnel has been
+   * idle for the learned keepalive interval, every tunnel that is at all
+   * idle gets pinged, so they all stay in phase and share one wakeup. */
+  if (pkm->power_saving) {
+    inactive = now - pkm->housekeeping_interval_min;
+    pings_due = 0;
+    PK_TUNNEL_ITER(pkm, fe) {
+      if ((fe->conn.sockfd >= 0) && !fe->keepalive_idle &&
+          (fe->conn.activity <= now - pkm->keepalive_interval)) pings_due++;
+    }
+    if (!pings_due) inactive = 0;
+    world_slack = pkm->keepalive_interval;
+  }
+
   /* Loop through all configured tunnels, unless another reconfiguration
    * process is already running. */
   pingsize = 0;
@@ -1110,15 +1417,19 @@ static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
     PK_TUNNEL_ITER(pkm, fe) {
       if ((fe->conn.sockfd >= 0) && !(fe->conn.status & CONN_STATUS_CHANGING)) {
         /* If dead, shut 'em down. */
-        if (fe->conn.activity < fe->last_ping - 4*pkm->housekeeping_interval_min)
+        if ((fe->conn.activity <
+               fe->last_ping - 4*pkm->housekeeping_interval_min) ||
+            (fe->keepalive_idle &&
+               (fe->last_ping + pkm->housekeeping_interval_min <= now)))
         {
           pk_log(PK_LOG_TUNNEL_DATA, "%d: Idle, shutting down.", fe->conn.sockfd);
           fe->conn.status |= CONN_STATUS_BROKEN;
           pkm_update_io(fe, NULL, 0);
         }
         /* If idle, send a ping. */
-        else if (fe->conn.activity < inactive) {
+        else if ((fe->conn.activity < inactive) && !fe->keepalive_idle) {
           if (pingsize == 0) pingsize = pk_format_ping(ping);
+          if (pkm->power_saving) fe->keepalive_idle = now - fe->conn.activity;
           fe->last_ping = now;
           pkc_write(&(fe->conn), ping, pingsize);
           pk_log(PK_LOG_TUNNEL_DATA,
@@ -1132,8 +1443,10 @@ static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
   }
   pkm_yield_start(pkm);
 
-  /* Finally, trigger the tunnel check on the blocking thread. */
-  if (pkm->last_world_update + pkm->check_world_interval < pk_time()) {
+  /* Finally, trigger the tunnel check on the blocking thread. In power
+   * saving mode, world checks due before our next wakeup happen now. */
+  if (pkm->last_world_update + pkm->check_world_interval
+        < pk_time() + world_slack) {
     pkb_add_job(&(pkm->blocking_jobs), PK_CHECK_WORLD, 0, pkm);
     /* After checking the state of the world, we are a bit more aggressive
      * about following up on things, reset the fallback. */
@@ -1145,18 +1458,106 @@ static void pkm_tick_cb(EV_P_ ev_async* w, int revents)
 
   PK_CHECK_MEMORY_CANARIES;
 
+  /* When all is well, power saving sleeps until the first tunnel needs
+   * a keepalive (or an answer to one), rather than on a fixed schedule. */
+  if (pkm->power_saving && (pkm->status == PK_STATUS_FLYING)) {
+    due = now + PK_KEEPALIVE_MAX;
+    PK_TUNNEL_ITER(pkm, fe) {
+      if (fe->conn.sockfd < 0) continue;
+      if (fe->keepalive_idle) {
+        if (fe->last_ping + pkm->housekeeping_interval_min < due)
+          due = fe->last_ping + pkm->housekeeping_interval_min;
+      }
+      else if (fe->conn.activity + pkm->keepalive_interval < due) {
+        due = fe->conn.activity + pkm->keepalive_interval;
+      }
+    }
+    next_tick = due - now;
+    if (next_tick <= pkm->housekeeping_interval_min)
+      next_tick = 1 + pkm->housekeeping_interval_min;
+    if (ev_is_active(&(pkm->timer))) {
+      pkm->timer.repeat = next_tick;
+      ev_timer_again(pkm->loop, &(pkm->timer));
+    }
+  }
+
   pkm->next_tick = next_tick;
   pkm_yield_stop(pkm);
+  pkm_loop_cb_stop(pkm, PK_STALL_TICK, NULL);
+
+  /* -Wall dislikes unused arguments */
+  (void) loop;
+  (void) revents;
+}
 
+/* Stall detection: the check watcher runs when the loop wakes up, the
+ * prepare watcher when it is about to sleep again; the time between the
+ * two is spent in callbacks. Individual callbacks are bracketed with
+ * pkm_loop_cb_start/stop, so slow ones can be named and counted. */
+static void pkm_loop_check_cb(EV_P_ ev_check* w, int revents)
+{
+  struct pk_manager* pkm = (struct pk_manager*) w->data;
+  uint64_t now_us = pk_time_us();
+  pthread_mutex_lock(&(pkm->stall_lock));
+  pkm->loop_woke_us = now_us;
+  pthread_mutex_unlock(&(pkm->stall_lock));
+  /* -Wall dislikes unused arguments */
+  (void) loop;
+  (void) revents;
+}
+static void pkm_loop_prepare_cb(EV_P_ ev_prepare* w, int revents)
+{
+  struct pk_manager* pkm = (struct pk_manager*) w->data;
+  uint64_t busy_us;
+  if (pkm->loop_woke_us) {
+    busy_us = pk_time_us() - pkm->loop_woke_us;
+    pthread_mutex_lock(&(pkm->stall_lock));
+    pkm->loop_woke_us = 0;
+    pthread_mutex_unlock(&(pkm->stall_lock));
+    pkm->loop_busy_us += busy_us;
+    pk_stats_record(&(pk_stats.loop_busy), busy_us);
+    if (pkm->stall_threshold_ms &&
+        (busy_us >= 1000 * (uint64_t) pkm->stall_threshold_ms)) {
+      pk_stats_stalled(PK_STALL_LOOP);
+      pk_log(PK_LOG_MANAGER_INFO, "Stall: Loop iteration took %dms",
+                                  (int) (busy_us / 1000));
+    }
+  }
+  PK_SAMPLE_MEMORY_CANARIES;
   /* -Wall dislikes unused arguments */
   (void) loop;
   (void) revents;
 }
+void pkm_loop_cb_start(struct pk_manager* pkm, const char* name, int fd)
+{
+  pthread_mutex_lock(&(pkm->stall_lock));
+  pkm->loop_cb_name = name;
+  pkm->loop_cb_fd = fd;
+  pthread_mutex_unlock(&(pkm->stall_lock));
+  pkm->loop_cb_started_us = pk_time_us();
+}
+void pkm_loop_cb_stop(struct pk_manager* pkm, int cause, const char* sid)
+{
+  uint64_t elapsed_us = pk_time_us() - pkm->loop_cb_started_us;
+  if (pkm->stall_threshold_ms &&
+      (elapsed_us >= 1000 * (uint64_t) pkm->stall_threshold_ms)) {
+    pk_stats_stalled(cause);
+    pk_log(PK_LOG_MANAGER_ERROR, "Stall: %s took %dms (fd=%d, sid=%s)",
+                                 pkm->loop_cb_name, (int) (elapsed_us / 1000),
+                                 pkm->loop_cb_fd, sid ? sid : "none");
+  }
+  pkm->loop_cb_started_us = 0;
+  pthread_mutex_lock(&(pkm->stall_lock));
+  pkm->loop_cb_name = NULL;
+  pthread_mutex_unlock(&(pkm->stall_lock));
+}
 
 static void pkm_timer_cb(EV_P_ ev_timer* w, int revents)
 {
   struct pk_manager* pkm = (struct pk_manager*) w->data;
+  pkm_loop_cb_start(pkm, "pkm_timer_cb", -1);
   pkm_tick(pkm);
+  pkm_loop_cb_stop(pkm, PK_STALL_TICK, NULL);
   /* -Wall dislikes unused arguments */
   (void) loop;
   (void) revents;
@@ -1176,6 +1577,65 @@ void pkm_set_timer_enabled(struct pk_manager* pkm, int enabled) {
   pkm_unblock(pkm);
 }
 
+/* Power saving for mobile devices, see pkm_tick_cb for the scheduling.
+ * Dozing stops the timer altogether; waking up again does everything
+ * we put off in a single tick. */
+void pkm_set_power_saving(struct pk_manager* pkm, int enabled) {
+  pkm_block(pkm);
+  pkm->power_saving = (enabled > 0);
+  pkm_unblock(pkm);
+  pkm_tick(pkm);
+}
+void pkm_set_dozing(struct pk_manager* pkm, int dozing) {
+  pkm_block(pkm);
+  pkm->dozing = (dozing > 0);
+  if (pkm->dozing) ev_timer_stop(pkm->loop, &(pkm->timer));
+  pkm_unblock(pkm);
+  if (!dozing) pkm_tick(pkm);
+}
+
+/* Learn how long the NATs between us and the relay keep idle tunnels
+ * alive. A keepalive answered after `idle` seconds proves the mapping
+ * lasts at least that long, one that went unanswered bounds it from
+ * above. We probe a quarter beyond what is known to work, staying
+ * clear of what is known to fail. */
+void pkm_keepalive_learn(struct pk_manager* pkm, time_t idle, int survived)
+{
+  time_t interval;
+  if (idle <= 0) return;
+
+  if (survived) {
+    if (idle > pkm->keepalive_nat_ok) pkm->keepalive_nat_ok = idle;
+    /* Survived past our upper bound? The network must have changed. */
+    if (idle >= pkm->keepalive_nat_dead) pkm->keepalive_nat_dead = 0;
+  }
+  else {
+    if (!pkm->keepalive_nat_dead || (idle < pkm->keepalive_nat_dead))
+      pkm->keepalive_nat_dead = idle;
+    if (pkm->keepalive_nat_ok >= idle) pkm->keepalive_nat_ok = 0;
+  }
+
+  if (pkm->keepalive_nat_ok)
+    interval = pkm->keepalive_nat_ok + pkm->keepalive_nat_ok / 4;
+  else if (pkm->keepalive_nat_dead)
+    interval = pkm->keepalive_nat_dead / 2;
+  else
+    interval = pkm->keepalive_interval;
+  if (pkm->keepalive_nat_dead &&
+      (interval > pkm->keepalive_nat_dead - pkm->keepalive_nat_dead / 8))
+    interval = pkm->keepalive_nat_dead - pkm->keepalive_nat_dead / 8;
+  if (interval < PK_KEEPALIVE_MIN) interval = PK_KEEPALIVE_MIN;
+  if (interval > PK_KEEPALIVE_MAX) interval = PK_KEEPALIVE_MAX;
+
+  if (interval != pkm->keepalive_interval) {
+    pk_log(PK_LOG_MANAGER_DEBUG,
+           "Keepalive interval: %ds (NAT ok at %ds, dead at %ds)",
+           (int) interval, (int) pkm->keepalive_nat_ok,
+           (int) pkm->keepalive_nat_dead);
+    pkm->keepalive_interval = interval;
+  }
+}
+
 static void pkm_reset_manager(struct pk_manager* pkm) {
   struct pk_conn* pkc;
 
@@ -1192,8 +1652,12 @@ static void pkm_reset_manager(struct pk_manager* pkm) {
       pkc->status = CONN_STATUS_ALLOCATED;
       pkc_reset_conn(pkc, CONN_STATUS_ALLOCATED);
     }
+    fe->streams = NULL;
+    fe->stream_count = 0;
+    fe->last_traffic = 0;
   }
   for (int i = 0; i < pkm->be_conn_max; i++) {
+    pkm->be_conns[i].tnl_next = pkm->be_conns[i].tnl_prev = NULL;
     pkc = &((pkm->be_conns+i)->conn);
     if (pkc->status != CONN_STATUS_UNKNOWN) {
       ev_io_stop(pkm->loop, &(pkc->watch_r));
@@ -1202,6 +1666,9 @@ static void pkm_reset_manager(struct pk_manager* pkm) {
       pkc_reset_conn(pkc, 0);
     }
   }
+  pkm_reset_conn_buffers(pkm);
+  ev_prepare_stop(pkm->loop, &(pkm->loop_prepare));
+  ev_check_stop(pkm->loop, &(pkm->loop_check));
   ev_async_stop(pkm->loop, &(pkm->quit));
 }
 
@@ -1246,6 +1713,13 @@ struct pk_pagekite* pkm_add_kite(struct pk_manager* pkm,
   if ((strcasecmp(protocol, "raw") == 0) && (public_port < 1))
     return pk_err_null(ERR_RAW_NEEDS_PUBPORT);
 
+  /* Truncating these would only get us rejected by the front-end. */
+  if ((strlen(protocol) > PK_PROTOCOL_LENGTH) ||
+      (strlen(public_domain) > PK_DOMAIN_LENGTH) ||
+      (strlen(auth_secret) > PK_SECRET_LENGTH) ||
+      ((local_domain != NULL) && (strlen(local_domain) > PK_DOMAIN_LENGTH)))
+    return pk_err_null(ERR_KITE_TOO_LONG);
+
   /* FIXME: This is O(N), we'll need a nicer data structure for tunnels */
   PK_KITE_ITER(pkm, k) {
     which++;
@@ -1330,6 +1804,9 @@ int pkm_add_listener(struct pk_manager* pkm,
         int ev_sock = PKS_EV_FD(pkl->conn.sockfd);
         ev_io_init(&(pkl->conn.watch_r), pkm_listener_cb, ev_sock, EV_READ);
         pkl->conn.watch_r.data = (void *) pkl;
+        /* Listeners never write, so the write watcher carries the manager
+         * (for pkm_listener_cb), which listeners otherwise lack. */
+        pkl->conn.watch_w.data = (void *) pkm;
         pkl->callback_func = callback_func;
         pkl->callback_data = callback_data;
         ev_io_start(pkm->loop, &(pkl->conn.watch_r));
@@ -1447,6 +1924,8 @@ struct pk_tunnel* pkm_add_frontend_ai(struct pk_manager* pkm,
   adding->error_count = 0;
   adding->request_count = 0;
   adding->priority = 0;
+  adding->overloaded_until = adding->retry_after = 0;
+  adding->retry_count = 0;
   adding->last_configured = pk_time();
 
   return adding;
@@ -1457,6 +1936,35 @@ static unsigned int pkm_sid_shift(char *sid)
   return murmur3_32(sid, strlen(sid));
 }
 
+/* Each tunnel keeps a list of the streams it carries, so per-tunnel
+ * housekeeping need not scan every back-end slot. */
+static void pkm_link_stream(struct pk_backend_conn* pkb, struct pk_tunnel* fe)
+{
+  pkb->tunnel = fe;
+  pkb->tnl_prev = NULL;
+  pkb->tnl_next = NULL;
+  if (NULL == fe) return;
+
+  if (NULL != (pkb->tnl_next = fe->streams)) fe->streams->tnl_prev = pkb;
+  fe->streams = pkb;
+  fe->stream_count++;
+}
+
+static void pkm_unlink_stream(struct pk_backend_conn* pkb)
+{
+  struct pk_tunnel* fe = pkb->tunnel;
+
+  /* Only the list head has no predecessor, so this is safe to repeat. */
+  if ((NULL == fe) || ((NULL == pkb->tnl_prev) && (fe->streams != pkb)))
+    return;
+
+  if (NULL != pkb->tnl_prev) pkb->tnl_prev->tnl_next = pkb->tnl_next;
+  else fe->streams = pkb->tnl_next;
+  if (NULL != pkb->tnl_next) pkb->tnl_next->tnl_prev = pkb->tnl_prev;
+  pkb->tnl_prev = pkb->tnl_next = NULL;
+  fe->stream_count--;
+}
+
 struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager* pkm,
                                           struct pk_tunnel* fe, char *sid)
 {
@@ -1481,11 +1989,13 @@ struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager* pkm,
     pkb = (pkm->be_conns + ((i + shift) % pkm->be_conn_max));
     if (!(pkb->conn.status & CONN_STATUS_ALLOCATED)) {
       pkc_reset_conn(&(pkb->conn), CONN_STATUS_ALLOCATED);
-      pkb->tunnel = fe;
+      pkm_link_stream(pkb, fe);
       /* Note: Do not merge this into the pkc_reset_conn call, as that
        *       could suppress errors. We expect whatever allocated this
        *       conn to reset the changing flag whan it's done working. */
       pkb->conn.status |= CONN_STATUS_CHANGING;
+      pkb->first_chunk_us = pkb->tnl_blocked_us = 0;
+      memset(&(pkb->access), 0, sizeof(struct pk_access_record));
       strncpyz(pkb->sid, sid, BE_MAX_SID_SIZE);
       return pkb;
     }
@@ -1511,10 +2021,14 @@ struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager* pkm,
     pk_dump_be_conn("be", pkb);
 
     if (evicting) {
+      pkb->access.close_reason = PK_CLOSE_EVICTED;
       pkb->conn.status |= (CONN_STATUS_CLS_WRITE|CONN_STATUS_CLS_READ);
       pkm_update_io(pkb->tunnel, pkb, 0);
+      pkm_unlink_stream(pkb);
       pkc_reset_conn(&(pkb->conn), CONN_STATUS_ALLOCATED);
-      pkb->tunnel = fe;
+      pkm_link_stream(pkb, fe);
+      pkb->first_chunk_us = pkb->tnl_blocked_us = 0;
+      memset(&(pkb->access), 0, sizeof(struct pk_access_record));
       strncpyz(pkb->sid, sid, BE_MAX_SID_SIZE);
       return pkb;
     }
@@ -1524,9 +2038,62 @@ struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager* pkm,
   return NULL;
 }
 
-void pkm_free_be_conn(struct pk_backend_conn* pkb)
+void pkm_free_be_conn(struct pk_manager* pkm, struct pk_backend_conn* pkb)
 {
+  struct pk_conn_buffers* buffers = pkc_get_buffers(&(pkb->conn));
+
+  pkm_unlink_stream(pkb);
   pkb->conn.status = CONN_STATUS_UNKNOWN;
+  if ((NULL != buffers) && (buffers != pkm->conn_buffer_spare)) {
+    pkm->conn_buffers_free[pkm->conn_buffers_avail++] = buffers;
+  }
+  pkc_set_buffers(&(pkb->conn), NULL);
+}
+
+/* Back-end slots start out without I/O buffers, and hibernate (give them
+ * back) whenever nothing is buffered either way, so only streams with
+ * data in flight tie any up. This lets a manager keep far more mostly
+ * idle streams than it has buffers for, see PK_WITH_IDLE_STREAMS. */
+int pkm_wake_stream(struct pk_manager* pkm, struct pk_backend_conn* pkb)
+{
+  if (NULL != pkb->conn.in_buffer) return 0;
+  if (pkm->conn_buffers_avail < 1) {
+    pk_log(PK_LOG_BE_DATA, "%d: No I/O buffers free, cannot wake %s",
+                           pkb->conn.sockfd, pkb->sid);
+    return -1;
+  }
+  pkc_set_buffers(&(pkb->conn),
+                  pkm->conn_buffers_free[--pkm->conn_buffers_avail]);
+  return 0;
+}
+
+static void pkm_hibernate_stream(struct pk_manager* pkm,
+                                 struct pk_backend_conn* pkb)
+{
+  struct pk_conn* pkc = &(pkb->conn);
+
+  if ((NULL == pkc->in_buffer) ||
+      (0 < pkc->in_buffer_pos) || (0 < pkc->out_buffer_pos) ||
+      (pkc->status & (CONN_STATUS_CHANGING | CONN_STATUS_WANT_READ |
+                      CONN_STATUS_WANT_WRITE)))
+    return;
+
+  /* With nothing to flush, only the read watcher should be armed. */
+  ev_io_stop(pkm->loop, &(pkc->watch_w));
+  pkm->conn_buffers_free[pkm->conn_buffers_avail++] = pkc_get_buffers(pkc);
+  pkc_set_buffers(pkc, NULL);
+}
+
+static void pkm_reset_conn_buffers(struct pk_manager* pkm)
+{
+  int i;
+  for (i = 0; i < pkm->be_conn_max; i++) {
+    pkc_set_buffers(&((pkm->be_conns+i)->conn), NULL);
+  }
+  for (i = 0; i < pkm->conn_buffers_max; i++) {
+    pkm->conn_buffers_free[i] = pkm->conn_buffers + i;
+  }
+  pkm->conn_buffers_avail = pkm->conn_buffers_max;
 }
 
 struct pk_backend_conn* pkm_find_be_conn(struct pk_manager* pkm,
@@ -1553,9 +2120,31 @@ struct pk_backend_conn* pkm_find_be_conn(struct pk_manager* pkm,
 
 /*** High level API stuff ****************************************************/
 
+/* Make this thread log to, and keep its state, hooks and events in, the
+ * given manager. Every thread working for a manager should do this first,
+ * so managers do not contend on (or pollute) each other's state. NULL
+ * selects the process-wide defaults again. */
+struct pk_manager* pkm_select(struct pk_manager* pkm)
+{
+  if (pkm == NULL) {
+    pk_state_current = &pk_state_default;
+    pk_stats_current = &pk_stats_default;
+    pk_hooks = pk_hooks_default;
+    _pke_thread_pke = NULL;
+  }
+  else {
+    pk_state_current = &(pkm->state);
+    pk_stats_current = &(pkm->stats);
+    pk_hooks = pkm->hooks;
+    _pke_thread_pke = &(pkm->events);
+  }
+  return pkm;
+}
+
 struct pk_manager* pkm_manager_init(struct ev_loop* loop,
                                     int buffer_size, char* buffer,
                                     int kites, int tunnels, int conns,
+                                    int conn_buffers,
                                     const char* dynamic_dns_url, SSL_CTX* ctx)
 {
   struct pk_manager* pkm;
@@ -1584,14 +2173,18 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   if (kites < MIN_KITE_ALLOC) kites = MIN_KITE_ALLOC;
   if (tunnels < MIN_FE_ALLOC) tunnels = MIN_FE_ALLOC;
   if (conns < MIN_CONN_ALLOC) conns = MIN_CONN_ALLOC;
+  if ((conn_buffers < 1) || (conn_buffers > conns)) conn_buffers = conns;
+  if (conn_buffers < MIN_CONN_ALLOC) conn_buffers = MIN_CONN_ALLOC;
 
   if (buffer == NULL) {
-    buffer_size = PK_MANAGER_BUFSIZE(kites, tunnels, conns, PARSER_BYTES_AVG);
+    buffer_size = PK_MANAGER_BUFSIZE(kites, tunnels, conns, conn_buffers,
+                                     PARSER_BYTES_AVG);
     buffer = malloc(buffer_size);
     malloced = 1;
   }
   else {
-    i = PK_MANAGER_BUFSIZE(kites, tunnels, conns, PARSER_BYTES_MIN);
+    i = PK_MANAGER_BUFSIZE(kites, tunnels, conns, conn_buffers,
+                           PARSER_BYTES_MIN);
     if (buffer_size < i) {
       pk_log(PK_LOG_MANAGER_ERROR,
              "pkm_manager_init: Buffer (%d bytes) too small, need %d.",
@@ -1605,6 +2198,7 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
     return NULL;
   }
 
+  remove_memory_canaries(buffer, buffer + buffer_size);
   memset(buffer, 0, buffer_size);
 
   pkm = (struct pk_manager*) buffer;
@@ -1620,6 +2214,9 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   }
   pkm->loop = loop;
   pke_init_events(&(pkm->events), 3);  /* FIXME: Magic number */
+  pks_state_init(&(pkm->state), &pk_state);
+  pk_stats_init(&(pkm->stats));
+  memcpy(pkm->hooks, pk_hooks, sizeof(pkm->hooks));
 
   PK_ADD_MEMORY_CANARY(pkm);
 
@@ -1659,6 +2256,7 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   pkm->be_conns = (struct pk_backend_conn *) pkm->buffer;
   pkm->be_conn_max = conns;
   for (i = 0; i < conns; i++) {
+    PK_ADD_MEMORY_CANARY(pkm->be_conns+i);
     (pkm->be_conns+i)->conn.sockfd = -1;
 #ifdef HAVE_OPENSSL
     (pkm->be_conns+i)->conn.ssl = NULL;
@@ -1668,6 +2266,12 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   }
   pkm->buffer += sizeof(struct pk_backend_conn) * conns;
 
+  /* Allocate space for the stack of unused stream I/O buffers */
+  pkm->buffer_bytes_free -= sizeof(struct pk_conn_buffers*) * conn_buffers;
+  if (pkm->buffer_bytes_free < 0) return pk_err_null(ERR_TOOBIG_BE_CONNS);
+  pkm->conn_buffers_free = (struct pk_conn_buffers **) pkm->buffer;
+  pkm->buffer += sizeof(struct pk_conn_buffers*) * conn_buffers;
+
   /* Allocate space for the blocking job queue */
   pkm->buffer_bytes_free -= sizeof(struct pk_job) * (conns+tunnels);
   if (pkm->buffer_bytes_free < 0) return pk_err_null(ERR_TOOBIG_BE_CONNS);
@@ -1678,6 +2282,15 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   }
   pkm->buffer += sizeof(struct pk_job) * (conns+tunnels);
 
+  /* Allocate the stream I/O buffers themselves, and one spare */
+  pkm->buffer_bytes_free -= sizeof(struct pk_conn_buffers) * (conn_buffers+1);
+  if (pkm->buffer_bytes_free < 0) return pk_err_null(ERR_TOOBIG_BE_CONNS);
+  pkm->conn_buffers = (struct pk_conn_buffers *) pkm->buffer;
+  pkm->conn_buffers_max = conn_buffers;
+  pkm->conn_buffer_spare = pkm->conn_buffers + conn_buffers;
+  pkm->buffer += sizeof(struct pk_conn_buffers) * (conn_buffers+1);
+  pkm_reset_conn_buffers(pkm);
+
   /* Whatever is left, we divide evenly between the protocol parsers... */
   parse_buffer_bytes = (pkm->buffer_bytes_free-1) / tunnels;
   /* ... within reason. */
@@ -1688,11 +2301,15 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
 
   /* Initialize the tunnel structs... */
   for (i = 0; i < tunnels; i++) {
+    PK_ADD_MEMORY_CANARY(pkm->tunnels+i);
+    PK_ADD_MEMORY_CANARY(&((pkm->tunnels+i)->conn));
     (pkm->tunnels+i)->manager = pkm;
     (pkm->tunnels+i)->conn.sockfd = -1;
 #ifdef HAVE_OPENSSL
     (pkm->tunnels+i)->conn.ssl = NULL;
 #endif
+    pkc_set_buffers(&((pkm->tunnels+i)->conn),
+                    &((pkm->tunnels+i)->conn_buffers));
     (pkm->tunnels+i)->parser = pk_parser_init(parse_buffer_bytes,
                                                 (char *) pkm->buffer,
                                                (pkChunkCallback*) &pkm_chunk_cb,
@@ -1707,12 +2324,23 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   pkm->housekeeping_interval_min = PK_HOUSEKEEPING_INTERVAL_MIN;
   pkm->housekeeping_interval_max = PK_HOUSEKEEPING_INTERVAL_MAX_DEF;
   pkm->check_world_interval = PK_CHECK_WORLD_INTERVAL;
+  pkm->keepalive_interval = PK_HOUSEKEEPING_INTERVAL_MAX_MIN;
   pkm->interval_fudge_factor = 2 * (rand() % PK_HOUSEKEEPING_INTERVAL_MIN);
+  pkm->stall_threshold_ms = PK_STALL_THRESHOLD_MS_DEF;
+  pkm->ddns_parallelism = PK_DDNS_PARALLELISM_DEF;
+  pkm->ddns_batch_max = 1;
+  pkm->drain_timeout = PK_DRAIN_TIMEOUT_DEF;
+  pkm->connector_id = (uint32_t) rand();
+  pkm->retry_at = 0;
+  pkm->load_warn_level = PK_RELAY_LOAD_WARN_DEF;
+  pkm->load_refuse_level = 0;
+  pkm->load_accept_max = 0;
 
   pkm->last_world_update = (time_t) 0;
   pkm->last_dns_update = (time_t) 0;
   pkm->dynamic_dns_url = dynamic_dns_url ? strdup(dynamic_dns_url) : NULL;
   pkm->ssl_ctx = ctx;
+  pkm_select(pkm);
   PKS_STATE(pk_state.have_ssl = (ctx != NULL);
             pk_state.force_update = 1)
 
@@ -1721,11 +2349,21 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   pkm->timer.data = (void *) pkm;
   pkm_reset_timer(pkm);
   pkm->enable_timer = 1;
+  ev_timer_init(&(pkm->retry_timer), pkm_timer_cb, 0, 0);
+  pkm->retry_timer.data = (void *) pkm;
 
   /* Let external threads shut us down */
   ev_async_init(&(pkm->quit), pkm_quit_cb);
   ev_async_start(loop, &(pkm->quit));
 
+  /* Measure how long we spend in callbacks, to detect stalls */
+  ev_check_init(&(pkm->loop_check), pkm_loop_check_cb);
+  pkm->loop_check.data = (void *) pkm;
+  ev_check_start(loop, &(pkm->loop_check));
+  ev_prepare_init(&(pkm->loop_prepare), pkm_loop_prepare_cb);
+  pkm->loop_prepare.data = (void *) pkm;
+  ev_prepare_start(loop, &(pkm->loop_prepare));
+
   /* Let external threads control our "periodic housekeeping" */
   ev_async_init(&(pkm->tick), pkm_tick_cb);
   pkm->tick.data = (void *) pkm;
@@ -1734,7 +2372,9 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
   /* Prepare blocking thread structures. */
   pthread_mutex_init(&(pkm->config_lock), NULL);
   pthread_mutex_init(&(pkm->intr_lock), NULL);
+  pthread_mutex_init(&(pkm->relay_lock), NULL);
   pthread_mutex_init(&(pkm->loop_lock), NULL);
+  pthread_mutex_init(&(pkm->stall_lock), NULL);
   pthread_mutex_init(&(pkm->blocking_jobs.mutex), NULL);
   pthread_cond_init(&(pkm->blocking_jobs.cond), NULL);
   pkm->blocking_jobs.count = 0;
@@ -1758,6 +2398,7 @@ struct pk_manager* pkm_manager_init(struct ev_loop* loop,
 void pkm_manager_free(struct pk_manager* pkm)
 {
   pk_ssl_thread_cleanup();
+  if (pk_state_current == &(pkm->state)) pkm_select(NULL);
 
   if (pkm->ev_loop_malloced) {
     ev_loop_destroy(pkm->loop);
@@ -1774,6 +2415,10 @@ void pkm_manager_free(struct pk_manager* pkm)
     fe->fe_uuid = fe->fe_hostname = NULL;
   }
 
+  pks_state_free(&(pkm->state));
+  pk_stats_free(&(pkm->stats));
+
+  remove_memory_canaries(pkm, pkm->buffer + pkm->buffer_bytes_free);
   if (pkm->was_malloced) {
     free(pkm);
   }
@@ -1781,7 +2426,7 @@ void pkm_manager_free(struct pk_manager* pkm)
 
 void* pkm_run(void *void_pkm)
 {
-  struct pk_manager* pkm = (struct pk_manager*) void_pkm;
+  struct pk_manager* pkm = pkm_select((struct pk_manager*) void_pkm);
 
   if (pkm->enable_watchdog) pkw_start_watchdog(pkm);
 
@@ -1796,6 +2441,9 @@ void* pkm_run(void *void_pkm)
   pke_cancel_all_events(&(pkm->events));
   pkb_stop_blockers(pkm);
   if (pkm->enable_watchdog) pkw_stop_watchdog(pkm);
+#if HAVE_RELAY
+  pkr_relay_stop(pkm);
+#endif
   pk_log(PK_LOG_MANAGER_DEBUG, "Event loop and workers stopped.");
 
   PK_HOOK(PK_HOOK_STOPPED, 0, pkm, NULL);
@@ -1829,28 +2477,31 @@ int pkmanager_test(void)
 #if PK_TESTS
   void *N = NULL;
   char buffer[PK_MANAGER_MINSIZE];
+  char secret[PK_SECRET_LENGTH + 2];
   struct pk_manager* m;
   struct pk_backend_conn* c;
+  struct pk_backend_conn* c2;
+  struct pk_tunnel* fe;
   struct pk_job j;
   struct addrinfo ai;
   int i;
 
   /* Are too-small buffers handled correctly? */
-  assert(NULL == pkm_manager_init(N, 1000, buffer, 1000, -1, -1, N, N));
-  assert(NULL == pkm_manager_init(N, 1000, buffer, -1, 1000, -1, N, N));
-  assert(NULL == pkm_manager_init(N, 1000, buffer, -1, -1, 1000, N, N));
+  assert(NULL == pkm_manager_init(N, 1000, buffer, 1000, -1, -1, -1, N, N));
+  assert(NULL == pkm_manager_init(N, 1000, buffer, -1, 1000, -1, -1, N, N));
+  assert(NULL == pkm_manager_init(N, 1000, buffer, -1, -1, 1000, -1, N, N));
   fprintf(stderr, "pkm_manager_init tests passed (1/3)\n");
 
   /* Create a real one */
   reset_memory_canaries();
-  m = pkm_manager_init(N, PK_MANAGER_MINSIZE, buffer, -1, -1, -1, N, N);
+  m = pkm_manager_init(N, PK_MANAGER_MINSIZE, buffer, -1, -1, -1, -1, N, N);
   if (m == NULL) pk_perror("pkmanager.c");
   assert(NULL != m);
   fprintf(stderr, "pkm_manager_init tests passed (2/3)\n");
 
   /* Create a real one from heap */
   reset_memory_canaries();
-  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, -1, NULL, NULL);
   assert(NULL != m);
 
   /* Ensure the right defaults are used. */
@@ -1871,7 +2522,7 @@ int pkmanager_test(void)
   reset_memory_canaries();
 
   /* Recreate, because those memsets broke things. */
-  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, NULL, NULL);
+  m = pkm_manager_init(NULL, 0, NULL, -1, -1, -1, -1, NULL, NULL);
   assert(NULL != m);
 
   /* Test pk_add_job and pk_get_job */
@@ -1883,6 +2534,24 @@ int pkmanager_test(void)
   assert(j.job == PK_QUIT);
   fprintf(stderr, "pk_add_job and pk_get_job tests passed\n");
 
+  /* Test keepalive learning */
+  assert(PK_HOUSEKEEPING_INTERVAL_MAX_MIN == m->keepalive_interval);
+  pkm_keepalive_learn(m, 120, 1);
+  assert(150 == m->keepalive_interval);
+  pkm_keepalive_learn(m, 90, 1);
+  assert(150 == m->keepalive_interval);
+  pkm_keepalive_learn(m, 160, 0);
+  assert(140 == m->keepalive_interval);
+  pkm_keepalive_learn(m, 140, 1);
+  assert(140 == m->keepalive_interval);
+  pkm_keepalive_learn(m, 100, 0);
+  assert((0 == m->keepalive_nat_ok) && (50 == m->keepalive_interval));
+  pkm_keepalive_learn(m, 10, 0);
+  assert(PK_KEEPALIVE_MIN == m->keepalive_interval);
+  pkm_keepalive_learn(m, 2000, 1);
+  assert(PK_KEEPALIVE_MAX == m->keepalive_interval);
+  fprintf(stderr, "pkm_keepalive_learn tests passed\n");
+
   /* Test pk_add_frontend_ai */
   memset(&ai, 0, sizeof(struct addrinfo));
   for (i = 0; i < MIN_FE_ALLOC; i++)
@@ -1891,6 +2560,73 @@ int pkmanager_test(void)
   assert(ERR_NO_MORE_FRONTENDS == pk_error);
   fprintf(stderr, "pk_add_frontend_ai tests passed\n");
 
+  /* Test per-tunnel stream tracking */
+  fe = m->tunnels;
+  assert(0 == fe->stream_count);
+  assert(pkm_tunnel_unused(fe));
+  assert(NULL != (c = pkm_alloc_be_conn(m, fe, "s1")));
+  assert(NULL != (c2 = pkm_alloc_be_conn(m, fe, "s2")));
+  assert(NULL != pkm_alloc_be_conn(m, fe, "s3"));
+  assert((3 == fe->stream_count) && (fe->streams->tnl_next == c2));
+  assert(!pkm_tunnel_unused(fe));
+  pkm_free_be_conn(m, c2);
+  pkm_free_be_conn(m, c2);
+  assert((2 == fe->stream_count) && (fe->streams->tnl_next == c));
+  assert(c->tnl_prev == fe->streams);
+  pkm_free_be_conn(m, fe->streams);
+  pkm_free_be_conn(m, c);
+  assert((0 == fe->stream_count) && (NULL == fe->streams));
+  fe->last_traffic = pk_time();
+  assert(pkm_tunnel_unused(fe));
+  fprintf(stderr, "pkm_tunnel_unused tests passed\n");
+
+  /* Test stream hibernation: buffers are only held while needed */
+  assert(MIN_CONN_ALLOC == m->conn_buffers_avail);
+  assert(NULL != (c = pkm_alloc_be_conn(m, fe, "h1")));
+  assert(0 == PKC_IN_FREE(c->conn));
+  assert(0 == pkm_wake_stream(m, c));
+  assert(0 == pkm_wake_stream(m, c));
+  assert(MIN_CONN_ALLOC - 1 == m->conn_buffers_avail);
+  assert(CONN_IO_BUFFER_SIZE == PKC_IN_FREE(c->conn));
+  assert(CONN_IO_BUFFER_SIZE == PKC_OUT_FREE(c->conn));
+  c->conn.out_buffer_pos = 1;
+  c->conn.status &= ~CONN_STATUS_CHANGING;
+  pkm_hibernate_stream(m, c);
+  assert(NULL != c->conn.out_buffer);
+  c->conn.out_buffer_pos = 0;
+  pkm_hibernate_stream(m, c);
+  assert((NULL == c->conn.out_buffer) && (NULL == c->conn.in_buffer));
+  assert((0 > pkc_read(&(c->conn))) && (ENOBUFS == errno));
+  assert((0 > pkc_write(&(c->conn), "x", 1)) && (ENOBUFS == errno));
+  assert(MIN_CONN_ALLOC == m->conn_buffers_avail);
+  m->conn_buffers_avail = 0;
+  assert(0 > pkm_wake_stream(m, c));
+  pkm_reset_conn_buffers(m);
+  assert(0 == pkm_wake_stream(m, c));
+  pkm_free_be_conn(m, c);
+  assert((NULL == c->conn.in_buffer) &&
+         (MIN_CONN_ALLOC == m->conn_buffers_avail));
+  fprintf(stderr, "pkm_*_stream hibernation tests passed\n");
+
+  /* Test reconnect backoff: full jitter within a doubling, capped window */
+  fe->retry_count = 0;
+  for (i = 0; i < 20; i++) {
+    time_t window = PK_RECONNECT_BACKOFF_MIN << (i < 10 ? i : 10);
+    if (window > PK_RECONNECT_BACKOFF_MAX) window = PK_RECONNECT_BACKOFF_MAX;
+    assert(window >= pkm_reconnect_backoff(fe));
+    assert(fe->retry_after <= pk_time() + window);
+  }
+  assert(20 == fe->retry_count);
+  fprintf(stderr, "pkm_reconnect_backoff tests passed\n");
+
+  /* Test pk_add_kite length limits */
+  memset(secret, 'x', PK_SECRET_LENGTH + 1);
+  secret[PK_SECRET_LENGTH + 1] = '\0';
+  assert(NULL == pkm_add_kite(m, "http", "foo", 80, secret, "localhost", 80));
+  assert(ERR_KITE_TOO_LONG == pk_error);
+  assert(NULL == pkm_find_kite(m, "http", "foo", 80));
+  fprintf(stderr, "pk_add_kite length tests passed\n");
+
   /* Test pk_add_kite */
   for (i = 0; i < MIN_KITE_ALLOC; i++)
     assert(NULL != pkm_add_kite(m, "http", "foo", 80, "sec", "localhost", 80));
@@ -1909,9 +2645,10 @@ int pkmanager_test(void)
   assert(0 == strcmp(c->sid, "abc"));
   assert(0 == c->conn.read_kb);
   assert(0 == c->conn.read_bytes);
+  assert(0 == pkm_wake_stream(m, c));
   assert(CONN_IO_BUFFER_SIZE == PKC_IN_FREE(c->conn));
   assert(CONN_IO_BUFFER_SIZE == PKC_OUT_FREE(c->conn));
-  pkm_free_be_conn(c);
+  pkm_free_be_conn(m, c);
   assert(NULL == pkm_find_be_conn(m, NULL, "abc"));
   fprintf(stderr, "pk_*_be_conn tests passed\n");
 
@@ -22,8 +22,20 @@ Note: For alternate license terms, see the file COPYING.md.
 #define PK_HOUSEKEEPING_INTERVAL_MAX_MIN  120 /* 2 minutes: lower is bad! */
 #define PK_HOUSEKEEPING_INTERVAL_MAX_DEF  300 /* 5 minutes */
 #define PK_CHECK_WORLD_INTERVAL          3600 /* 1 hour */
+#define PK_KEEPALIVE_MIN                   25 /* Seconds, see power saving */
+#define PK_KEEPALIVE_MAX                 1680 /* 28 minutes */
 #define PK_DDNS_UPDATE_INTERVAL_MIN       360 /* Less than 300 makes no sense,
                                                  due to DNS caching TTLs. */
+#define PK_DDNS_PARALLELISM_DEF             4 /* Concurrent DDNS requests */
+#define PK_DDNS_PARALLELISM_MAX            32
+#define PK_STALL_THRESHOLD_MS_DEF         250 /* Report slower callbacks */
+#define PK_DRAIN_TIMEOUT_DEF              900 /* Seconds, see draining */
+#define PK_RECONNECT_BACKOFF_MIN            5 /* Seconds, doubled per failure,
+                                                 then fully jittered */
+#define PK_RECONNECT_BACKOFF_MAX          300
+#define PK_FRONTEND_SPREAD                 50 /* Percent, see choose_tunnels */
+#define PK_OVERLOAD_HOLD                  300 /* Seconds to avoid a relay */
+#define PK_RELAY_LOAD_WARN_DEF             75 /* Percent, see pkrelay.c */
 
 struct pk_tunnel;
 struct pk_backend_conn;
@@ -40,6 +52,7 @@ struct pk_job_pile;
 #define FE_STATUS_REJECTED  0x08000000  /* Front-end rejected connection   */
 #define FE_STATUS_LAME      0x10000000  /* Front-end is going offline      */
 #define FE_STATUS_IS_FAST   0x20000000  /* This is a fast front-end        */
+#define FE_STATUS_DRAINING  0x40000000  /* Unwanted, waiting for streams   */
 struct pk_tunnel {
   PK_MEMORY_CANARY
   /* These apply to frontend connections only (on the backend) */
@@ -48,17 +61,28 @@ struct pk_tunnel {
   time_t                  last_ddnsup;
   int                     priority;
   char*                   fe_uuid;
+  time_t                  overloaded_until;
+  time_t                  retry_after;     /* Reconnect backoff */
+  int                     retry_count;
   /* These apply to all tunnels (frontend or backend) */
   struct addrinfo         ai;
   struct pk_conn          conn;
+  struct pk_conn_buffers  conn_buffers;
   int                     error_count;
   char                    fe_session[PK_HANDSHAKE_SESSIONID_MAX+1];
   time_t                  last_ping;
+  time_t                  keepalive_idle;  /* Idle at ping, until answered */
   time_t                  last_configured;
   struct pk_manager*      manager;
   struct pk_parser*       parser;
   int                     request_count;
   struct pk_kite_request* requests;
+  /* Streams carried by this tunnel, maintained on alloc/free */
+  struct pk_backend_conn* streams;
+  int                     stream_count;
+  time_t                  last_traffic;    /* Last stream data either way */
+  time_t                  drain_deadline;
+  int                     drain_streams;   /* Stream count when draining */
   pagekite_callback_t*    callback_func;
   void*                   callback_data;
 };
@@ -69,30 +93,72 @@ struct pk_tunnel {
 #define BE_STATUS_EOF_WRITE      0x00020000
 #define BE_STATUS_EOF_THROTTLED  0x00040000
 #define BE_MAX_SID_SIZE          8
+
+/* Why a stream was closed, as reported in the access log. */
+typedef enum {
+  PK_CLOSE_UNKNOWN = 0,
+  PK_CLOSE_REMOTE_EOF,      /* EOF chunk received over the tunnel */
+  PK_CLOSE_BACKEND_EOF,     /* Back-end closed the connection */
+  PK_CLOSE_BACKEND_ERROR,   /* Error reading from the back-end */
+  PK_CLOSE_TUNNEL_LOST,     /* The tunnel carrying the stream went away */
+  PK_CLOSE_CONNECT_FAILED,  /* Back-end connection could not be made */
+  PK_CLOSE_EVICTED,         /* Idle stream evicted to make room */
+  PK_CLOSE_DRAINED,         /* Draining tunnel reached its deadline */
+  PK_CLOSE_NO_BUFFERS       /* Data arrived, but no I/O buffers were free */
+} pk_close_t;
+
+/* Per-stream access record, completed and emitted when the stream closes.
+ * Byte counts are from the back-end's point of view: bytes_in were
+ * written to it, bytes_out were read from it. Times are in microseconds,
+ * zero if the stream never got that far. */
+#define PK_ACCESS_RIP_MAX       46
+#define PK_ACCESS_TEXT_MAX    1024
+struct pk_access_record {
+  char                 remote_ip[PK_ACCESS_RIP_MAX+1];
+  int                  remote_port;
+  uint64_t             opened_us;
+  uint64_t             bytes_in;
+  uint64_t             bytes_out;
+  uint64_t             connect_us;
+  uint64_t             ttfb_us;
+  uint64_t             duration_us;
+  uint64_t             blocked_us;
+  pk_close_t           close_reason;
+};
+
 struct pk_backend_conn {
   PK_MEMORY_CANARY
   char                 sid[BE_MAX_SID_SIZE+1];
   struct pk_tunnel*    tunnel;
+  struct pk_backend_conn* tnl_next;        /* Siblings on tunnel->streams */
+  struct pk_backend_conn* tnl_prev;
   struct pk_pagekite*  kite;
   struct pk_conn       conn;
   pagekite_callback_t* callback_func;
   void*                callback_data;
+  /* Timestamps (pk_time_us) for the latency histograms, 0 if unset */
+  uint64_t             first_chunk_us;
+  uint64_t             tnl_blocked_us;
+  struct pk_access_record access;
 };
 
 #define MIN_KITE_ALLOC        4
 #define MIN_FE_ALLOC          2
 #define MIN_CONN_ALLOC       16
 #define MAX_BLOCKING_THREADS 16
-#define PK_MANAGER_BUFSIZE(k, f, c, ps) \
+#define PK_MANAGER_BUFSIZE(k, f, c, b, ps) \
                            (1 + sizeof(struct pk_manager) \
                             + sizeof(struct pk_pagekite) * k \
                             + sizeof(struct pk_tunnel) * f \
                             + sizeof(struct pk_kite_request) * f * k \
                             + ps * f \
                             + sizeof(struct pk_backend_conn) * c \
+                            + sizeof(struct pk_conn_buffers) * (b+1) \
+                            + sizeof(struct pk_conn_buffers*) * b \
                             + sizeof(struct pk_job) * (c+f))
 #define PK_MANAGER_MINSIZE PK_MANAGER_BUFSIZE(MIN_KITE_ALLOC, MIN_FE_ALLOC, \
-                                              MIN_CONN_ALLOC, PARSER_BYTES_MIN)
+                                              MIN_CONN_ALLOC, MIN_CONN_ALLOC, \
+                                              PARSER_BYTES_MIN)
 #define PK_TUNNEL_ITER(pkm, fe) for (struct pk_tunnel* fe = pkm->tunnels; fe < (pkm->tunnels + pkm->tunnel_max); fe++)
 #define PK_KITE_ITER(pkm, kite) for (struct pk_pagekite* kite = pkm->kites; kite < (pkm->kites + pkm->kite_max); kite++)
 
@@ -106,6 +172,12 @@ struct pk_manager {
   struct pk_tunnel*        tunnels;
   struct pk_backend_conn*  be_conns;
 
+  /* I/O buffers lent to streams with data in flight, see pkm_wake_stream */
+  struct pk_conn_buffers*  conn_buffers;
+  struct pk_conn_buffers** conn_buffers_free;   /* Stack of unused ones */
+  struct pk_conn_buffers*  conn_buffer_spare;   /* For reads if none left */
+  int                      conn_buffers_avail;
+
   PK_MEMORY_CANARY
 
   pthread_t                main_thread;
@@ -117,22 +189,66 @@ struct pk_manager {
   ev_async                 quit;
   ev_async                 tick;
   ev_timer                 timer;
+  ev_timer                 retry_timer;
+  ev_prepare               loop_prepare;
+  ev_check                 loop_check;
+
+  /* Stall detection: written by the event loop, read by the watchdog.
+   * Whatever the watchdog reads is changed under stall_lock. */
+  pthread_mutex_t          stall_lock;
+  uint64_t                 loop_woke_us;
+  uint64_t                 loop_cb_started_us;
+  const char*              loop_cb_name;
+  int                      loop_cb_fd;
+  uint64_t                 loop_busy_us;        /* Running total */
+
+  /* Relay self-load, sampled by pkr_relay_load() */
+  uint64_t                 load_sampled_us;
+  uint64_t                 load_busy_us;        /* loop_busy_us at sample */
+  int                      load_accepts;        /* Since the last sample */
+  int                      load_accept_rate;    /* Per second, smoothed */
+  int                      load_utilisation;    /* Percent, smoothed */
+  int                      load_level;          /* Percent, worst resource */
+  int                      load_warn_level;     /* Advertise overload */
+  int                      load_refuse_level;   /* Refuse new tunnels */
+  int                      load_accept_max;     /* Per second, 0 = no limit */
+
+  /* Relay connections with answered tunnel requests, see pkrelay.c */
+  ev_async                 relay_resume;
+  pthread_mutex_t          relay_lock;
+  void*                    relay_resumed;
 
   time_t                   last_world_update;
   time_t                   next_tick;
   unsigned int             enable_timer:1;
   time_t                   last_dns_update;
 
+  /* Mobile power saving: batched wakeups, keepalives learned from NAT */
+  unsigned int             power_saving:1;
+  unsigned int             dozing:1;
+  time_t                   keepalive_interval;
+  time_t                   keepalive_nat_ok;    /* Longest idle survived   */
+  time_t                   keepalive_nat_dead;  /* Shortest idle that died */
+
   SSL_CTX*                 ssl_ctx;
   pthread_t                watchdog_thread;
   struct pk_blocker*       blocking_threads[MAX_BLOCKING_THREADS];
   struct pk_job_pile       blocking_jobs;
   struct pke_events        events;
+  time_t                   last_check_world;    /* Shared by the blockers */
+  time_t                   last_check_tunnels;
+
+  /* Per-manager copies of what used to be process-wide, see pkm_select */
+  struct pk_global_state   state;
+  struct pk_global_stats   stats;
+  pagekite_callback2_t*    hooks[PK_HOOK_MAX];
+  char                     rewrite_space[PARSER_BYTES_MAX + 256];
 
   /* Settings */
   int                      kite_max;
   int                      tunnel_max;
   int                      be_conn_max;
+  int                      conn_buffers_max;
   unsigned int             was_malloced:1;
   unsigned int             ev_loop_malloced:1;
   unsigned int             enable_watchdog:1;
@@ -144,11 +260,17 @@ struct pk_manager {
   time_t                   housekeeping_interval_min;
   time_t                   housekeeping_interval_max;
   time_t                   check_world_interval;
+  unsigned int             stall_threshold_ms;
+  int                      ddns_parallelism;
+  int                      ddns_batch_max;
+  time_t                   drain_timeout;
+  uint32_t                 connector_id;        /* Rendezvous hash salt */
+  time_t                   retry_at;            /* Earliest backoff expiry */
 };
 
 
 struct pk_manager*   pkm_manager_init(struct ev_loop*,
-                                      int, char*, int, int, int,
+                                      int, char*, int, int, int, int,
                                       const char*, SSL_CTX*);
 void pkm_manager_free(struct pk_manager*);
 
@@ -168,11 +290,14 @@ int                 pkm_add_listener(struct pk_manager*, const char*, int,
 
 struct pk_backend_conn* pkm_alloc_be_conn(struct pk_manager*,
                                           struct pk_tunnel*, char *);
-void pkm_free_be_conn(struct pk_backend_conn* pkb);
+void pkm_free_be_conn(struct pk_manager*, struct pk_backend_conn*);
+int pkm_wake_stream(struct pk_manager*, struct pk_backend_conn*);
 struct pk_backend_conn* pkm_find_be_conn(struct pk_manager*,
                                          struct pk_tunnel*, char*);
 
 
+struct pk_manager* pkm_select      (struct pk_manager*);
+
 void* pkm_run                       (void *);
 int pkm_run_in_thread               (struct pk_manager*);
 int pkm_wait_thread                 (struct pk_manager*);
@@ -182,8 +307,17 @@ void pkm_reconfig_stop              (struct pk_manager*);
 
 int pkm_reconnect_all               (struct pk_manager*, int);
 int pkm_disconnect_unused           (struct pk_manager*);
+int pkm_tunnel_unused               (struct pk_tunnel*);
+int pkm_drain_tunnels               (struct pk_manager*);
+time_t pkm_reconnect_backoff        (struct pk_tunnel*);
 
 void pkm_set_timer_enabled          (struct pk_manager*, int);
 void pkm_tick                       (struct pk_manager*);
+void pkm_set_power_saving           (struct pk_manager*, int);
+void pkm_set_dozing                 (struct pk_manager*, int);
+void pkm_keepalive_learn            (struct pk_manager*, time_t, int);
+
+void pkm_loop_cb_start              (struct pk_manager*, const char*, int);
+void pkm_loop_cb_stop               (struct pk_manager*, int, const char*);
 
 int pkmanager_test(void);
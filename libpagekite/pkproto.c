@@ -27,6 +27,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pkhooks.h"
 #include "pkproto.h"
 #include "pkstate.h"
+#include "pkstats.h"
 #include "pkblocker.h"
 #include "pkmanager.h"
 #include "pklogging.h"
@@ -47,11 +48,13 @@ void pk_reset_pagekite(struct pk_pagekite* kite)
   kite->local_domain[0] = '\0';
   kite->local_port = 0;
   kite->auth_secret[0] = '\0';
+  kite->ddns_published = 0;
 }
 
+/* The _values variants are also used on scratch structs on the stack, so
+ * only the full resets register canaries. */
 void frame_reset_values(struct pk_frame* frame)
 {
-  PK_ADD_MEMORY_CANARY(frame);
   frame->data = NULL;
   frame->length = -1;
   frame->hdr_length = -1;
@@ -60,13 +63,13 @@ void frame_reset_values(struct pk_frame* frame)
 
 void frame_reset(struct pk_frame* frame)
 {
+  PK_ADD_MEMORY_CANARY(frame);
   frame_reset_values(frame);
   frame->raw_frame = NULL;
 }
 
 void pk_chunk_reset_values(struct pk_chunk* chunk)
 {
-  PK_ADD_MEMORY_CANARY(chunk);
   chunk->sid = NULL;
   chunk->eof = NULL;
   chunk->noop = NULL;
@@ -91,6 +94,7 @@ void pk_chunk_reset_values(struct pk_chunk* chunk)
 
 void pk_chunk_reset(struct pk_chunk* chunk)
 {
+  PK_ADD_MEMORY_CANARY(chunk);
   pk_chunk_reset_values(chunk);
   frame_reset(&(chunk->frame));
 }
@@ -577,7 +581,7 @@ int pk_make_salt(char* salt) {
 char* pk_sign(const char* token, const char* secret, time_t ts,
               const char* payload, int length, char *buffer)
 {
-  char tbuffer[128], tsbuf[16], scratch[10240];
+  char tbuffer[128], tsbuf[16], scratch[64];
 
   PK_TRACE_FUNCTION;
 
@@ -665,9 +669,9 @@ char *pk_prepare_kite_challenge(char* buffer, struct pk_kite_request* kite_r,
 }
 
 int pk_sign_kite_request(char *buffer, struct pk_kite_request* kite_r, int salt) {
-  char request[1024];
-  char request_sign[1024];
-  char request_salt[1024];
+  char request[PK_DOMAIN_LENGTH + 256];
+  char request_sign[128];
+  char request_salt[16];
   struct pk_pagekite* kite;
 
   PK_TRACE_FUNCTION;
@@ -901,7 +905,7 @@ int pk_connect_ai(struct pk_conn* pkc, struct addrinfo* ai, int reconnecting,
                   char *session_id, SSL_CTX *ctx, const char* hostname)
 {
   unsigned int i, j, bytes;
-  char buffer[16*1024], *p;
+  char buffer[PK_HANDSHAKE_BYTES_MAX], *p;
   struct pk_pagekite tkite;
   struct pk_kite_request tkite_r;
 
@@ -926,7 +930,7 @@ int pk_connect_ai(struct pk_conn* pkc, struct addrinfo* ai, int reconnecting,
     return (pk_error = ERR_CONNECT_TLS);
 #endif
 
-  memset(&buffer, 0, 16*1024);
+  memset(&buffer, 0, sizeof(buffer));
   pkc_write(pkc, PK_HANDSHAKE_CONNECT, strlen(PK_HANDSHAKE_CONNECT));
   pkc_write(pkc, PK_HANDSHAKE_FEATURES, strlen(PK_HANDSHAKE_FEATURES));
   if (session_id && *session_id) {
@@ -964,6 +968,12 @@ int pk_connect_ai(struct pk_conn* pkc, struct addrinfo* ai, int reconnecting,
     pk_log(PK_LOG_TUNNEL_DATA, " - Have data ...");
     pkc_read(pkc);
     if (pkc->in_buffer_pos > 0) {
+      if ((size_t) pkc->in_buffer_pos > sizeof(buffer)-1 - i) {
+        pk_log(PK_LOG_TUNNEL_DATA, " - Response too large (%d bytes max)",
+                                   (int) sizeof(buffer)-1);
+        pkc_reset_conn(pkc, CONN_STATUS_CHANGING|CONN_STATUS_ALLOCATED);
+        return (pk_error = ERR_CONNECT_REQUEST);
+      }
       memcpy(buffer+i, pkc->in_buffer, pkc->in_buffer_pos);
 
       i += pkc->in_buffer_pos;
@@ -1079,10 +1089,12 @@ int pk_connect(struct pk_conn* pkc, char *frontend, int port,
   return (pk_error = ERR_CONNECT_CONNECT);
 }
 
+/* If the chunk is rewritten, the new data is written to rewrite_space,
+ * which must have room for PARSER_BYTES_MAX + 256 bytes and outlive the
+ * chunk. Each manager has its own. */
 int pk_http_forwarding_headers_hook(struct pk_chunk* chunk,
-                                    struct pk_backend_conn* pkb)
+                                    char* rewrite_space)
 {
-  static unsigned char rewrite_space[PARSER_BYTES_MAX + 256];
   char forwarding_headers[1024];
 
   PK_TRACE_FUNCTION;
@@ -1211,8 +1223,9 @@ static void pkproto_test_callback(int *data, struct pk_chunk *chunk) {
     assert(0 == strncmp(chunk->data, "54321", chunk->length));
   }
   else if (*data == 2) {
+    static char rewrite_space[PARSER_BYTES_MAX + 256];
     chunk->first_chunk = 1;
-    pk_http_forwarding_headers_hook(chunk, NULL);
+    pk_http_forwarding_headers_hook(chunk, rewrite_space);
     assert(NULL != memmem(chunk->data, chunk->length, "X-Forward", 9));
   }
   else {
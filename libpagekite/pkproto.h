@@ -27,7 +27,9 @@ Note: For alternate license terms, see the file COPYING.md.
  */
 #define PROTO_OVERHEAD_PER_KB  64
 
-#define PK_FRONTEND_PING "GET /ping HTTP/1.1\r\nHost: ping.pagekite\r\n\r\n"
+#define PK_FRONTEND_PING_HOST "ping.pagekite"
+#define PK_FRONTEND_PING "GET /ping HTTP/1.1\r\nHost: " PK_FRONTEND_PING_HOST \
+                         "\r\n\r\n"
 #define PK_FRONTEND_PONG "HTTP/1.1 503 Unavailable"
 #define PK_FRONTEND_UUID "X-PageKite-UUID:"
 #define PK_FRONTEND_OVERLOADED "X-PageKite-Overloaded:"
@@ -76,9 +78,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #define PK_EOF       (PK_EOF_READ | PK_EOF_WRITE)
 
 /* Data structure describing a kite */
-#define PK_PROTOCOL_LENGTH   24
-#define PK_DOMAIN_LENGTH   1024
-#define PK_SECRET_LENGTH    256
+#define PK_PROTOCOL_LENGTH   24  /* See pkcommon.h for the other limits */
 struct  pk_pagekite {
   PK_MEMORY_CANARY
   char  protocol[PK_PROTOCOL_LENGTH+1];
@@ -87,6 +87,7 @@ struct  pk_pagekite {
   char  local_domain[PK_DOMAIN_LENGTH+1];
   int   local_port;
   char  auth_secret[PK_SECRET_LENGTH+1];
+  uint32_t ddns_published;  /* Hash of the front-ends last put in DNS */
 };
 
 /* Data structure describing a kite request */
@@ -117,7 +118,6 @@ struct pk_frame {
 };
 
 /* Data structure describing a parsed chunk */
-#define PK_MAX_CHUNK_HEADERS 64
 struct pk_chunk {
   PK_MEMORY_CANARY
   int             header_count;    /* Raw header data, number of headers.    */
@@ -192,7 +192,6 @@ int               pk_connect_ai(struct pk_conn*, struct addrinfo*, int,
 int               pk_connect(struct pk_conn*, char*, int,
                              unsigned int, struct pk_kite_request*, char*,
                              SSL_CTX*);
-int               pk_http_forwarding_headers_hook(struct pk_chunk*,
-                                                  struct pk_backend_conn*);
+int               pk_http_forwarding_headers_hook(struct pk_chunk*, char*);
 
 int pkproto_test(void);
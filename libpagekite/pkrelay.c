@@ -56,6 +56,7 @@ Connections are accepted and identified like so:
 #include "pkconn.h"
 #include "pkproto.h"
 #include "pkblocker.h"
+#include "pkstats.h"
 #include "pkmanager.h"
 #include "pkrelay.h"
 #include "pklogging.h"
@@ -72,15 +73,19 @@ Connections are accepted and identified like so:
 #define PROTO_HTTP_CONNECT    3
 #define PROTO_TLS_WITH_SNI    4
 #define PROTO_LEGACY_SSL      5
+#define PROTO_PING            6
 static const char* known_protos[] = {
   "(unknown)",
   "PageKite",
   "HTTP",
   "HTTP CONNECT",
   "TLS+SNI",
-  "SSL/TLS"};
+  "SSL/TLS",
+  "Ping"};
 
 #define PEEK_BYTES 512
+#define LOAD_SAMPLE_US 1000000
+#define OVERLOADED_MAX 64
 #define SSL_CLIENTHELLO 0x80
 #define TLS_CLIENTHELLO 0x16
 
@@ -95,9 +100,114 @@ struct incoming_conn_state {
   int parsed_as;
   int parse_state;
   time_t created;
+  unsigned int response_code;
+  char* response;
+  struct incoming_conn_state* next;
 };
 
 
+/* Relay self-load: each resource we might run out of is expressed as a
+ * percentage of what we can handle, and the load level is the worst of
+ * them. We sample at most once a second, when connections are accepted,
+ * as that is also when the answer is needed. Utilisation and the accept
+ * rate are smoothed, so a single burst does not flip the overload flag.
+ */
+int pkr_relay_load(struct pk_manager* pkm)
+{
+  struct pk_backend_conn* pkb;
+  uint64_t now_us = pk_time_us();
+  uint64_t elapsed_us = now_us - pkm->load_sampled_us;
+  int i, level, tunnels, streams, buffered, buffers;
+
+  if (pkm->load_sampled_us && (elapsed_us < LOAD_SAMPLE_US))
+    return pkm->load_level;
+
+  if (pkm->load_sampled_us) {
+    pkm->load_utilisation = (pkm->load_utilisation +
+      (int) ((100 * (pkm->loop_busy_us - pkm->load_busy_us)) / elapsed_us)
+    ) / 2;
+    pkm->load_accept_rate = (pkm->load_accept_rate +
+      (int) ((1000000 * (uint64_t) pkm->load_accepts) / elapsed_us)
+    ) / 2;
+  }
+  pkm->load_sampled_us = now_us;
+  pkm->load_busy_us = pkm->loop_busy_us;
+  pkm->load_accepts = 0;
+
+  tunnels = streams = buffered = 0;
+  PK_TUNNEL_ITER(pkm, fe) {
+    if (fe->conn.sockfd < 0) continue;
+    buffered += fe->conn.in_buffer_pos + fe->conn.out_buffer_pos;
+    tunnels++;
+  }
+  for (i = 0; i < pkm->be_conn_max; i++) {
+    pkb = (pkm->be_conns + i);
+    if (!(pkb->conn.status & CONN_STATUS_ALLOCATED)) continue;
+    buffered += pkb->conn.in_buffer_pos + pkb->conn.out_buffer_pos;
+    streams++;
+  }
+  buffers = 2 * CONN_IO_BUFFER_SIZE * (tunnels + streams);
+
+  level = pkm->load_utilisation;
+  if (pkm->tunnel_max && (level < 100 * tunnels / pkm->tunnel_max))
+    level = 100 * tunnels / pkm->tunnel_max;
+  if (pkm->be_conn_max && (level < 100 * streams / pkm->be_conn_max))
+    level = 100 * streams / pkm->be_conn_max;
+  if (buffers && (level < (int) ((100 * (uint64_t) buffered) / buffers)))
+    level = (int) ((100 * (uint64_t) buffered) / buffers);
+  if (pkm->load_accept_max &&
+      (level < 100 * pkm->load_accept_rate / pkm->load_accept_max))
+    level = 100 * pkm->load_accept_rate / pkm->load_accept_max;
+
+  if (pkm->load_warn_level &&
+      ((level >= pkm->load_warn_level) !=
+       (pkm->load_level >= pkm->load_warn_level))) {
+    pk_log(PK_LOG_MANAGER_INFO,
+           "Relay load %d%% (%s): loop=%d%%, tunnels=%d/%d, streams=%d/%d, "
+           "accepts=%d/s, buffered=%dKB",
+           level,
+           (level >= pkm->load_warn_level) ? "overloaded" : "ok",
+           pkm->load_utilisation,
+           tunnels, pkm->tunnel_max,
+           streams, pkm->be_conn_max,
+           pkm->load_accept_rate,
+           buffered / 1024);
+  }
+  return (pkm->load_level = level);
+}
+
+/* Format the X-PageKite-Overloaded header, if we are overloaded. */
+static int _pkr_format_overloaded(struct pk_manager* pkm, char* buf)
+{
+  buf[0] = '\0';
+  if (!pkm->load_warn_level || (pkm->load_level < pkm->load_warn_level))
+    return 0;
+  return sprintf(buf, "%s %d\r\n", PK_FRONTEND_OVERLOADED, pkm->load_level);
+}
+
+/* Insert the header (if any) into a handshake response, just before the
+ * blank line which ends it. Returns the new response, or NULL if it could
+ * not be reallocated (the old one is freed). */
+static char* _pkr_add_overloaded(struct pk_manager* pkm, char* response)
+{
+  char header[OVERLOADED_MAX], *end, *bigger;
+  int hlen, offset;
+
+  hlen = _pkr_format_overloaded(pkm, header);
+  if ((hlen == 0) || (NULL == (end = strstr(response, "\r\n\r\n"))))
+    return response;
+
+  offset = end + 2 - response;
+  if (NULL == (bigger = realloc(response, strlen(response) + hlen + 1))) {
+    free(response);
+    return NULL;
+  }
+  memmove(bigger + offset + hlen, bigger + offset, strlen(bigger + offset) + 1);
+  memcpy(bigger + offset, header, hlen);
+  return bigger;
+}
+
+
 static int _find_tunnel(struct incoming_conn_state* ics)
 {
   /* FIXME: This is where scalability is important; we need this to
@@ -275,6 +385,15 @@ static int _pkr_parse_http(char* peeked,
       }
     }
 
+    /* - Is it a ping? Connectors use these to choose relays. Only the
+     *   Host: header tells it apart from a request for a kite's /ping. */
+    if ((host != NULL) && (strcasecmp(host, PK_FRONTEND_PING_HOST) == 0) &&
+        (strncasecmp(peeked, PK_FRONTEND_PING,
+                     strcspn(PK_FRONTEND_PING, "\r\n")) == 0)) {
+      ics->parsed_as = PROTO_PING;
+      return PARSE_MATCH_FAST;
+    }
+
     if ((host == NULL)
              && ((*(nl-1) == '\r') ? (strstr(peeked, "\r\n\r\n") == NULL)
                                    : (strstr(peeked, "\n\n") == NULL))
@@ -314,14 +433,138 @@ static void _pkr_close(struct incoming_conn_state* ics,
 
   if (ics->pkb) {
     pkc_reset_conn(&(ics->pkb->conn), 0);
-    pkm_free_be_conn(ics->pkb);
+    pkm_free_be_conn(ics->pkm, ics->pkb);
   }
   ics->parse_state = PARSE_FAILED; /* A horrible hack */
 
   if (ics->unparsed_data != NULL) free(ics->unparsed_data);
+  if (ics->response != NULL) free(ics->response);
   free(ics);
 }
 
+/* The application has answered a tunnel request. This runs on whatever
+ * thread it answered from, so we just stash the answer and wake up the
+ * event loop, which calls _pkr_tunnel_request_resume. */
+static void _pkr_tunnel_request_answered(void* void_ics,
+                                         unsigned int response_code,
+                                         int response_int,
+                                         const char* response)
+{
+  struct incoming_conn_state* ics = (struct incoming_conn_state*) void_ics;
+  struct pk_manager* pkm = ics->pkm;
+
+  ics->response_code = response_code;
+  ics->response = (response && *response) ? strdup(response) : NULL;
+
+  pthread_mutex_lock(&(pkm->relay_lock));
+  ics->next = (struct incoming_conn_state*) pkm->relay_resumed;
+  pkm->relay_resumed = ics;
+  pthread_mutex_unlock(&(pkm->relay_lock));
+  ev_async_send(pkm->loop, &(pkm->relay_resume));
+
+  /* -Wall dislikes unused arguments */
+  (void) response_int;
+}
+
+static void _pkr_tunnel_request_resume(struct incoming_conn_state* ics)
+{
+  char* response = ics->response;
+  int rlen = 0;
+
+  PK_TRACE_FUNCTION;
+
+  ics->response = NULL;
+  if (response && *response) response = _pkr_add_overloaded(ics->pkm,
+                                                             response);
+  if (response && *response) {
+    rlen = strlen(response);
+    pkc_write(&(ics->pkb->conn), response, rlen);
+  }
+
+  int result_ok = rlen && (ics->response_code & PK_EV_RESPOND_TRUE);
+  if (result_ok) {
+    /* FIXME: Upgrade this connection to a tunnel */
+
+    int flying = 0;
+    struct pk_kite_request* pkr = pk_parse_pagekite_response(
+      response, rlen + 1, NULL, NULL);
+    if (pkr != NULL) {
+      struct pk_kite_request* p;
+      for (p = pkr; p->status != PK_KITE_UNKNOWN; p++) {
+        if (p->status == PK_KITE_FLYING) {
+          /* FIXME: Record kite->tunnel mapping */
+          pk_log(PK_LOG_MANAGER_DEBUG, "Accepted kite: %s://%s:%d",
+                                       p->kite->protocol,
+                                       p->kite->public_domain,
+                                       p->kite->public_port);
+          flying++;
+        }
+        else {
+          pk_log(PK_LOG_MANAGER_DEBUG, "Rejected kite: %s://%s:%d (%d)",
+                                       p->kite->protocol,
+                                       p->kite->public_domain,
+                                       p->kite->public_port,
+                                       p->status);
+        }
+      }
+      free(pkr);
+
+      /* FIXME: Add to event loop */
+    }
+
+    if (!flying) result_ok = 0;
+  }
+
+  if (response) free(response);
+  if (!result_ok) _pkr_close(ics, 0, "Rejected");
+}
+
+static struct incoming_conn_state* _pkr_take_resumed(struct pk_manager* pkm)
+{
+  struct incoming_conn_state* ics;
+
+  pthread_mutex_lock(&(pkm->relay_lock));
+  ics = (struct incoming_conn_state*) pkm->relay_resumed;
+  pkm->relay_resumed = NULL;
+  pthread_mutex_unlock(&(pkm->relay_lock));
+  return ics;
+}
+
+void pkr_relay_resume_cb(EV_P_ ev_async* w, int revents)
+{
+  struct pk_manager* pkm = (struct pk_manager*) w->data;
+  struct incoming_conn_state* ics;
+  struct incoming_conn_state* next;
+
+  PK_TRACE_FUNCTION;
+  pkm_loop_cb_start(pkm, "pkr_relay_resume_cb", -1);
+
+  for (ics = _pkr_take_resumed(pkm); ics != NULL; ics = next) {
+    next = ics->next;
+    _pkr_tunnel_request_resume(ics);
+  }
+
+  pkm_loop_cb_stop(pkm, PK_STALL_RELAY, NULL);
+
+  /* -Wall dislikes unused arguments */
+  (void) loop;
+  (void) revents;
+}
+
+/* Once the event loop has stopped, nothing will resume the requests which
+ * were answered (or cancelled) since, so close them here. Call this after
+ * the workers are gone, so no more can arrive. */
+void pkr_relay_stop(struct pk_manager* pkm)
+{
+  struct incoming_conn_state* ics;
+  struct incoming_conn_state* next;
+
+  for (ics = _pkr_take_resumed(pkm); ics != NULL; ics = next) {
+    next = ics->next;
+    _pkr_close(ics, 0, "Shutting down");
+  }
+}
+
 static int _pkr_process_readable(struct incoming_conn_state* ics)
 {
   char peeked[PEEK_BYTES+1];
@@ -417,54 +660,38 @@ void pkr_relay_incoming(int result, void* void_data) {
      * in ics details about what needs to be done. So we do it! :)
      */
 
-    if (ics->parsed_as == PROTO_PAGEKITE) {
-      char* response = NULL;
-      struct pke_event* ev = pke_post_blocking_event(NULL,
-        PK_EV_TUNNEL_REQUEST, 0, ics->unparsed_data, NULL, &response);
-
-      int rlen = 0;
-      if (response && *response) {
-        rlen = strlen(response);
-        pkc_write(&(ics->pkb->conn), response, rlen);
-      }
-
-      int result_ok = rlen && ev && (ev->response_code & PK_EV_RESPOND_TRUE);
-      if (result_ok) {
-        /* FIXME: Upgrade this connection to a tunnel */
-
-        int flying = 0;
-        struct pk_kite_request* pkr = pk_parse_pagekite_response(
-          response, rlen + 1, NULL, NULL);
-        if (pkr != NULL) {
-          struct pk_kite_request* p;
-          for (p = pkr; p->status != PK_KITE_UNKNOWN; p++) {
-            if (p->status == PK_KITE_FLYING) {
-              /* FIXME: Record kite->tunnel mapping */
-              pk_log(PK_LOG_MANAGER_DEBUG, "Accepted kite: %s://%s:%d",
-                                           p->kite->protocol,
-                                           p->kite->public_domain,
-                                           p->kite->public_port);
-              flying++;
-            }
-            else {
-              pk_log(PK_LOG_MANAGER_DEBUG, "Rejected kite: %s://%s:%d (%d)",
-                                           p->kite->protocol,
-                                           p->kite->public_domain,
-                                           p->kite->public_port,
-                                           p->status);
-            }
-          }
-          free(pkr);
-
-          /* FIXME: Add to event loop */
-        }
-
-        if (!flying) result_ok = 0;
+    if (ics->parsed_as == PROTO_PING) {
+      /* Answer with our load, so connectors steer clear before we are
+       * actually saturated. */
+      char pong[128], overloaded[OVERLOADED_MAX];
+      _pkr_format_overloaded(ics->pkm, overloaded);
+      pkc_write(&(ics->pkb->conn), pong,
+                sprintf(pong, "%s\r\n%sContent-Type: text/plain\r\n\r\n",
+                              PK_FRONTEND_PONG, overloaded));
+      _pkr_close(ics, 0, "Pong");
+    }
+    else if ((ics->parsed_as == PROTO_PAGEKITE) &&
+             ics->pkm->load_refuse_level &&
+             (ics->pkm->load_level >= ics->pkm->load_refuse_level)) {
+      /* Too busy for more tunnels: refuse, saying why. */
+      char refusal[128];
+      pkc_write(&(ics->pkb->conn), refusal,
+                sprintf(refusal, "%s\r\n%s %d\r\n\r\n",
+                                 PK_FRONTEND_PONG, PK_FRONTEND_OVERLOADED,
+                                 ics->pkm->load_level));
+      _pkr_close(ics, 0, "Overloaded");
+    }
+    else if (ics->parsed_as == PROTO_PAGEKITE) {
+      /* Ask the application, without holding this thread while it makes
+       * up its mind: the answer is acted on by the event loop, see
+       * _pkr_tunnel_request_answered below. */
+      if (PK_EV_NONE == pke_post_async_event(&(ics->pkm->events),
+                                             PK_EV_TUNNEL_REQUEST, 0,
+                                             ics->unparsed_data,
+                                             &_pkr_tunnel_request_answered,
+                                             ics)) {
+        _pkr_close(ics, 0, "Rejected");
       }
-
-      if (ev) pke_free_event(NULL, ev->event_code);
-      if (response) free(response);
-      if (!result_ok) _pkr_close(ics, 0, "Rejected");
     }
     else {
       _pkr_close(ics, 0, "FIXME");
@@ -475,12 +702,16 @@ void pkr_relay_incoming(int result, void* void_data) {
 void pkr_new_conn_readable_cb(EV_P_ ev_io* w, int revents)
 {
   struct incoming_conn_state* ics = (struct incoming_conn_state*) w->data;
+  struct pk_manager* pkm = ics->pkm;  /* ics may be freed below */
 
   PK_TRACE_FUNCTION;
+  pkm_loop_cb_start(pkm, "pkr_new_conn_readable_cb", w->fd);
 
   ev_io_stop(EV_A_ w);
   _pkr_process_readable(ics);
 
+  pkm_loop_cb_stop(pkm, PK_STALL_RELAY, NULL);
+
   /* -Wall dislikes unused arguments */
   (void) loop;
   (void) revents;
@@ -497,6 +728,9 @@ int pkr_conn_accepted_cb(int sockfd, void* void_pkm)
 
   PK_TRACE_FUNCTION;
 
+  pkm->load_accepts++;
+  pkr_relay_load(pkm);
+
   ics = malloc(sizeof(struct incoming_conn_state));
   ics->pkm = pkm;
   ics->pkb = NULL;
@@ -506,6 +740,9 @@ int pkr_conn_accepted_cb(int sockfd, void* void_pkm)
   ics->parse_state = PARSE_UNDECIDED;
   ics->created = pk_time();
   ics->unparsed_data = NULL;
+  ics->response_code = 0;
+  ics->response = NULL;
+  ics->next = NULL;
 
   slen = sizeof(ics->local_addr);
   getsockname(sockfd, (struct sockaddr*) &(ics->local_addr), &slen);
@@ -530,6 +767,11 @@ int pkr_conn_accepted_cb(int sockfd, void* void_pkm)
   pkb->kite = NULL;
   pkb->conn.sockfd = sockfd;
   ics->pkb = pkb;
+  if (0 > pkm_wake_stream(pkm, pkb)) {
+    /* We could not even answer without buffers, so give up right away. */
+    _pkr_close(ics, PK_LOG_ERROR, "No I/O buffers free");
+    return -1;
+  }
 
   set_non_blocking(sockfd);
 
@@ -555,6 +797,12 @@ int pagekite_add_relay_listener(pagekite_mgr pkm, int port, int flags)
 
   if (flags & PK_WITH_DEFAULTS) flags |= (PK_WITH_IPV6 | PK_WITH_IPV4);
 
+  if (!ev_is_active(&(m->relay_resume))) {
+    ev_async_init(&(m->relay_resume), pkr_relay_resume_cb);
+    m->relay_resume.data = (void *) m;
+    ev_async_start(m->loop, &(m->relay_resume));
+  }
+
 #ifdef HAVE_IPV6
   if (flags & PK_WITH_IPV6) {
     return pkm_add_listener(m, "::", port,
@@ -570,6 +818,19 @@ int pagekite_add_relay_listener(pagekite_mgr pkm, int port, int flags)
   return (pk_error = ERR_NO_IPVX);
 }
 
+int pagekite_set_relay_overload(pagekite_mgr pkm,
+                                int warn_level, int refuse_level,
+                                int accepts_per_second)
+{
+  if (pkm == NULL) return -1;
+  struct pk_manager* m = (struct pk_manager*) pkm;
+
+  m->load_warn_level = (warn_level > 0) ? warn_level : 0;
+  m->load_refuse_level = (refuse_level > 0) ? refuse_level : 0;
+  m->load_accept_max = (accepts_per_second > 0) ? accepts_per_second : 0;
+  return 0;
+}
+
 
 /****************************************************************************
  * Unit tests...
@@ -615,6 +876,40 @@ int pkrelay_test(void)
   /* FIXME: Test more corruption. */
   fprintf(stderr, "TLS SNI parsing tests passed\n");
 
+  /* Only our own pings are pings, not requests for a kite's /ping. */
+  struct incoming_conn_state ics;
+  char test_ping[] = PK_FRONTEND_PING;
+  char test_kite_ping[] = "GET /ping HTTP/1.1\r\nHost: foo.bar\r\n\r\n";
+  memset(&ics, 0, sizeof(ics));
+  assert(PARSE_MATCH_FAST == _pkr_parse_http(test_ping, strlen(test_ping),
+                                             &ics));
+  assert(PROTO_PING == ics.parsed_as);
+  memset(&ics, 0, sizeof(ics));
+  _pkr_parse_http(test_kite_ping, strlen(test_kite_ping), &ics);
+  assert(PROTO_HTTP == ics.parsed_as);
+  assert(0 == strcmp("foo.bar", (char*) ics.hostname));
+  fprintf(stderr, "Relay ping parsing tests passed\n");
+
+  /* Overload headers are only added when overloaded, and go at the end
+   * of the handshake response headers. */
+  static struct pk_manager pkm;
+  char header[OVERLOADED_MAX];
+  char* response;
+  pkm.load_warn_level = 75;
+  pkm.load_level = 50;
+  response = strdup("HTTP/1.1 200 OK\r\nX-PageKite-OK: a\r\n\r\nMOTD");
+  response = _pkr_add_overloaded(&pkm, response);
+  assert(NULL == strstr(response, PK_FRONTEND_OVERLOADED));
+  pkm.load_level = 80;
+  response = _pkr_add_overloaded(&pkm, response);
+  assert(0 == strcmp(response, "HTTP/1.1 200 OK\r\nX-PageKite-OK: a\r\n"
+                               PK_FRONTEND_OVERLOADED " 80\r\n\r\nMOTD"));
+  free(response);
+  pkm.load_warn_level = 0;
+  assert(0 == _pkr_format_overloaded(&pkm, header));
+  assert('\0' == header[0]);
+  fprintf(stderr, "Relay overload header tests passed\n");
+
   /* Cases to test:
    *   - Incoming authorized tunnel request
    *   - Incoming unauthorized tunnel request
@@ -25,4 +25,6 @@ struct pk_listener {
 };
 
 void pkr_relay_incoming(int, void*);
+int pkr_relay_load(struct pk_manager*);
+void pkr_relay_stop(struct pk_manager*);
 int pkrelay_test(void);
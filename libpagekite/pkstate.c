@@ -55,6 +55,51 @@ void pks_global_init(unsigned int log_mask) {
   pk_state.quota_mb = -1;
 }
 
+/* Give a manager a state of its own, starting with the settings (but not
+ * the log or counters) of another. Strings which may later be freed are
+ * copied, so neither can pull them out from under the other. */
+void pks_state_init(struct pk_global_state* state,
+                    struct pk_global_state* settings)
+{
+  struct pk_global_state* selected = pk_state_current;
+
+  memcpy(state, settings, sizeof(struct pk_global_state));
+  pthread_mutex_init(&(state->lock), NULL);
+  pthread_cond_init(&(state->cond), NULL);
+  state->log_ring_buffer[0] = '\0';
+  state->log_ring_start = state->log_ring_end = state->log_ring_buffer;
+  state->log_ring_written = state->log_tail_read = 0;
+  state->live_streams = state->live_tunnels = state->live_listeners = 0;
+
+  if (settings->ssl_ciphers != NULL)
+    state->ssl_ciphers = strdup(settings->ssl_ciphers);
+
+  if ((settings->ssl_cert_names != NULL) &&
+      (*settings->ssl_cert_names != *PAGEKITE_NET_CERT_NAMES)) {
+    pk_state_current = state;
+    state->ssl_cert_names = NULL;
+    pks_add_ssl_cert_names(settings->ssl_cert_names);
+    pk_state_current = selected;
+  }
+}
+
+/* Release what pks_state_init allocated for a manager's state. Unlike
+ * the default, a manager's ciphers are always its own copy. */
+void pks_state_free(struct pk_global_state* state)
+{
+  struct pk_global_state* selected = pk_state_current;
+
+  if (state->ssl_ciphers != NULL) free(state->ssl_ciphers);
+  state->ssl_ciphers = NULL;
+
+  pk_state_current = state;
+  pks_free_ssl_cert_names();
+  pk_state_current = (selected == state) ? &pk_state_default : selected;
+
+  pthread_cond_destroy(&(state->cond));
+  pthread_mutex_destroy(&(state->lock));
+}
+
 #define WRAP(p) if (p >= pk_state.log_ring_buffer+PKS_LOG_DATA_MAX) \
                     p -= PKS_LOG_DATA_MAX;
 
@@ -109,6 +154,7 @@ int pks_logcopy(const char *src, size_t len)
 
   WRAP(pk_state.log_ring_end); *pk_state.log_ring_end++ = '\n';
   WRAP(pk_state.log_ring_end); *pk_state.log_ring_end   = '\0';
+  pk_state.log_ring_written += len + 1;
 
   pthread_cond_broadcast(&(pk_state.cond));
   pthread_mutex_unlock(&(pk_state.lock));
@@ -125,6 +171,41 @@ void pks_copylog(char *dest)
   pthread_mutex_unlock(&(pk_state.lock));
 }
 
+/* Copy whatever was logged since the previous call, as much as fits in
+ * dest (which is NUL terminated). If the ring has wrapped past where we
+ * left off, we skip ahead to the oldest data still available. */
+int pks_logtail(char *dest, int length)
+{
+  unsigned int avail, behind, bytes, first;
+  char* p;
+
+  if (length < 1) return -1;
+  pthread_mutex_lock(&(pk_state.lock));
+
+  if (pk_state.log_ring_end >= pk_state.log_ring_start)
+    avail = pk_state.log_ring_end - pk_state.log_ring_start;
+  else
+    avail = PKS_LOG_DATA_MAX - (pk_state.log_ring_start -
+                                pk_state.log_ring_end);
+  behind = pk_state.log_ring_written - pk_state.log_tail_read;
+  if (behind > avail) behind = avail;
+
+  p = pk_state.log_ring_end - behind;
+  if (p < pk_state.log_ring_buffer) p += PKS_LOG_DATA_MAX;
+  bytes = behind;
+  if (bytes > (unsigned int) length - 1) bytes = length - 1;
+
+  first = (pk_state.log_ring_buffer + PKS_LOG_DATA_MAX) - p;
+  if (first > bytes) first = bytes;
+  memcpy(dest, p, first);
+  memcpy(dest + first, pk_state.log_ring_buffer, bytes - first);
+  dest[bytes] = '\0';
+  pk_state.log_tail_read = pk_state.log_ring_written - behind + bytes;
+
+  pthread_mutex_unlock(&(pk_state.lock));
+  return bytes;
+}
+
 void pks_printlog(FILE* dest)
 {
   pthread_mutex_lock(&(pk_state.lock));
@@ -18,8 +18,6 @@ Note: For alternate license terms, see the file COPYING.md.
 
 ******************************************************************************/
 
-#define PKS_LOG_DATA_MAX     64*1024
-
 typedef enum {
   PK_ENUM_STATUS_STARTUP      = PK_STATUS_STARTUP,
   PK_ENUM_STATUS_CONNECTING   = PK_STATUS_CONNECTING,
@@ -41,6 +39,8 @@ struct pk_global_state {
   char            log_ring_buffer[PKS_LOG_DATA_MAX+1];
   char*           log_ring_start;
   char*           log_ring_end;
+  unsigned int    log_ring_written;  /* Total bytes logged, wraps      */
+  unsigned int    log_tail_read;     /* ... as of the last pks_logtail */
 
   /* Settings */
   unsigned int    bail_on_errors;
@@ -72,11 +72,16 @@ struct pk_global_state {
   int             quota_mb;
 };
 
+/* Each manager has its own state, selected per thread by pkm_select().
+ * Threads which have not selected one share the process-wide default. */
 #ifndef __IN_PKSTATE_C__
-extern struct pk_global_state pk_state;
+extern struct pk_global_state pk_state_default;
+extern __thread struct pk_global_state* pk_state_current;
 #else
-struct pk_global_state pk_state;
+struct pk_global_state pk_state_default;
+__thread struct pk_global_state* pk_state_current = &pk_state_default;
 #endif
+#define pk_state (*pk_state_current)
 
 #define PKS_STATE(change) { pthread_mutex_lock(&(pk_state.lock)); \
                             change; \
@@ -87,8 +92,11 @@ struct pk_global_state pk_state;
 #define PKS_STATE_UNLOCK  } pthread_mutex_unlock(&(pk_state.lock));
 
 void pks_global_init(unsigned int log_level);
+void pks_state_init(struct pk_global_state*, struct pk_global_state*);
+void pks_state_free(struct pk_global_state*);
 int pks_logcopy(const char*, size_t len);
 void pks_copylog(char*);
+int pks_logtail(char*, int);
 void pks_printlog(FILE *dest);
 void pks_free_ssl_cert_names();
 void pks_add_ssl_cert_names(char**);
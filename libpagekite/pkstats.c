@@ -0,0 +1,374 @@
+/******************************************************************************
+pkstats.c - Latency histograms and other run-time statistics.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************/
+
+#define PAGEKITE_CONSTANTS_ONLY
+#include "pagekite.h"
+
+#include "pkcommon.h"
+#include "pkutils.h"
+#include "pkstats.h"
+
+
+struct pk_global_stats pk_stats_default = {
+  .lock = PTHREAD_MUTEX_INITIALIZER
+};
+__thread struct pk_global_stats* pk_stats_current = &pk_stats_default;
+
+static const char* pk_stall_names[PK_STALL_CAUSES] = {
+  "loop", "tunnel_read", "tunnel_write", "be_read", "be_write",
+  "relay", "tick", "interrupt", "accept"
+};
+
+
+/*** Histograms **************************************************************/
+
+static int pk_histogram_msb(uint32_t v)
+{
+#ifdef __GNUC__
+  return 31 - __builtin_clz(v);
+#else
+  int msb = 0;
+  while (v >>= 1) msb++;
+  return msb;
+#endif
+}
+
+static int pk_histogram_index(uint32_t v)
+{
+  int shift;
+  if (v < PK_HIST_SUB_COUNT) return v;
+  shift = pk_histogram_msb(v) - (PK_HIST_SUB_BITS - 1);
+  return (PK_HIST_SUB_COUNT
+          + (shift - 1) * PK_HIST_HALF_COUNT
+          + (v >> shift) - PK_HIST_HALF_COUNT);
+}
+
+/* Returns the highest value which would be counted in a given bucket. */
+static uint32_t pk_histogram_bucket_max(int idx)
+{
+  int shift, sub;
+  if (idx < PK_HIST_SUB_COUNT) return idx;
+  idx -= PK_HIST_SUB_COUNT;
+  shift = 1 + (idx / PK_HIST_HALF_COUNT);
+  sub = PK_HIST_HALF_COUNT + (idx % PK_HIST_HALF_COUNT);
+  return (uint32_t) ((((uint64_t) sub + 1) << shift) - 1);
+}
+
+void pk_histogram_reset(struct pk_histogram* h)
+{
+  memset(h, 0, sizeof(struct pk_histogram));
+}
+
+void pk_histogram_record(struct pk_histogram* h, uint64_t us)
+{
+  uint32_t v = (us > 0xffffffff) ? 0xffffffff : (uint32_t) us;
+  h->buckets[pk_histogram_index(v)]++;
+  h->count++;
+  h->sum_us += v;
+  if (v > h->max_us) h->max_us = v;
+}
+
+/* Percentiles are given in permille: 500 is the median, 999 is p99.9 */
+uint32_t pk_histogram_percentile(struct pk_histogram* h, int permille)
+{
+  uint64_t seen, wanted;
+  uint32_t value;
+  int i;
+
+  if (h->count < 1) return 0;
+  wanted = (h->count * permille + 999) / 1000;
+  if (wanted < 1) wanted = 1;
+
+  for (seen = i = 0; i < PK_HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= wanted) {
+      value = pk_histogram_bucket_max(i);
+      return (value > h->max_us) ? h->max_us : value;
+    }
+  }
+  return h->max_us;
+}
+
+
+/*** Global statistics *******************************************************/
+
+/* Set up a manager's own statistics. The process-wide default is
+ * initialised statically and never reset behind anyone's back. */
+void pk_stats_init(struct pk_global_stats* stats)
+{
+  memset(stats, 0, sizeof(struct pk_global_stats));
+  pthread_mutex_init(&(stats->lock), NULL);
+  stats->since = pk_time();
+}
+
+void pk_stats_free(struct pk_global_stats* stats)
+{
+  if (pk_stats_current == stats) pk_stats_current = &pk_stats_default;
+  pthread_mutex_destroy(&(stats->lock));
+}
+
+static void _pk_stats_reset()
+{
+  int i;
+  pk_histogram_reset(&(pk_stats.be_connect));
+  pk_histogram_reset(&(pk_stats.be_first_byte));
+  pk_histogram_reset(&(pk_stats.flush));
+  pk_histogram_reset(&(pk_stats.tnl_blocked));
+  pk_histogram_reset(&(pk_stats.loop_busy));
+  pk_histogram_reset(&(pk_stats.ddns));
+  memset(pk_stats.stalls, 0, sizeof(pk_stats.stalls));
+  /* The last DDNS result per domain is state, not a counter: keep it. */
+  for (i = 0; i < PK_STATS_DDNS_MAX; i++) {
+    pk_stats.ddns_domains[i].ok = pk_stats.ddns_domains[i].failed = 0;
+  }
+  pk_stats.drain.started = pk_stats.drain.finished = 0;
+  pk_stats.drain.expired = pk_stats.drain.streams_cut = 0;
+  pk_stats.canaries_dead = 0;
+  pk_stats.since = pk_time();
+}
+
+void pk_stats_reset()
+{
+  pthread_mutex_lock(&(pk_stats.lock));
+  _pk_stats_reset();
+  pthread_mutex_unlock(&(pk_stats.lock));
+}
+
+void pk_stats_record(struct pk_histogram* h, uint64_t us)
+{
+  pthread_mutex_lock(&(pk_stats.lock));
+  pk_histogram_record(h, us);
+  pthread_mutex_unlock(&(pk_stats.lock));
+}
+
+void pk_stats_stalled(pk_stall_t cause)
+{
+  pthread_mutex_lock(&(pk_stats.lock));
+  pk_stats.stalls[cause]++;
+  pthread_mutex_unlock(&(pk_stats.lock));
+}
+
+void pk_stats_ddns(const char* domain, const char* result,
+                   uint64_t us, int ok)
+{
+  struct pk_ddns_stat* ds = NULL;
+  struct pk_ddns_stat* oldest = pk_stats.ddns_domains;
+  int i;
+
+  pthread_mutex_lock(&(pk_stats.lock));
+  for (i = 0; i < PK_STATS_DDNS_MAX; i++) {
+    if (0 == strncasecmp(pk_stats.ddns_domains[i].domain, domain,
+                         PK_STATS_DDNS_DOMAIN)) {
+      ds = pk_stats.ddns_domains + i;
+      break;
+    }
+    if (pk_stats.ddns_domains[i].updated < oldest->updated)
+      oldest = pk_stats.ddns_domains + i;
+  }
+  if (ds == NULL) {
+    ds = oldest;
+    memset(ds, 0, sizeof(struct pk_ddns_stat));
+    strncpyz(ds->domain, domain, PK_STATS_DDNS_DOMAIN);
+  }
+  strncpyz(ds->result, result, sizeof(ds->result) - 1);
+  ds->updated = pk_time();
+  ds->latency_us = (us > 0xffffffff) ? 0xffffffff : (uint32_t) us;
+  if (ok) ds->ok++; else ds->failed++;
+  pthread_mutex_unlock(&(pk_stats.lock));
+}
+
+void pk_stats_drain(int tunnels, int streams,
+                    int started, int finished, int expired, int cut)
+{
+  pthread_mutex_lock(&(pk_stats.lock));
+  pk_stats.drain.tunnels = tunnels;
+  pk_stats.drain.streams = streams;
+  pk_stats.drain.started += started;
+  pk_stats.drain.finished += finished;
+  pk_stats.drain.expired += expired;
+  pk_stats.drain.streams_cut += cut;
+  pthread_mutex_unlock(&(pk_stats.lock));
+}
+
+void pk_stats_canaries(int dead)
+{
+  pthread_mutex_lock(&(pk_stats.lock));
+  pk_stats.canaries_dead += dead;
+  pthread_mutex_unlock(&(pk_stats.lock));
+}
+
+static int pk_stats_format_histogram(char* buf, size_t len,
+                                     const char* name,
+                                     struct pk_histogram* h)
+{
+  return snprintf(buf, len,
+                  "%s_us: n=%llu avg=%llu p50=%u p99=%u p999=%u max=%u\n",
+                  name,
+                  (unsigned long long) h->count,
+                  (unsigned long long) (h->count ? h->sum_us / h->count : 0),
+                  pk_histogram_percentile(h, 500),
+                  pk_histogram_percentile(h, 990),
+                  pk_histogram_percentile(h, 999),
+                  h->max_us);
+}
+
+/* Render a text snapshot of the statistics. If reset is nonzero, the
+ * counters are cleared in the same critical section, so consecutive
+ * snapshots cover adjacent, non-overlapping intervals. */
+int pk_stats_format(char* buf, size_t len, int reset)
+{
+  size_t bytes = 0;
+  int i;
+  #define _add_hist(n, h) if (bytes < len) \
+                bytes += pk_stats_format_histogram(buf + bytes, len - bytes, \
+                                                   n, &(pk_stats.h));
+
+  pthread_mutex_lock(&(pk_stats.lock));
+  bytes += snprintf(buf, len, "stats_interval_s: %ld\n",
+                              (long) (pk_time() - pk_stats.since));
+  _add_hist("be_connect",    be_connect);
+  _add_hist("be_first_byte", be_first_byte);
+  _add_hist("flush",         flush);
+  _add_hist("tnl_blocked",   tnl_blocked);
+  _add_hist("loop_busy",     loop_busy);
+  _add_hist("ddns",          ddns);
+  if (bytes < len) bytes += snprintf(buf + bytes, len - bytes, "stalls:");
+  for (i = 0; i < PK_STALL_CAUSES; i++) {
+    if (bytes < len)
+      bytes += snprintf(buf + bytes, len - bytes, " %s=%u",
+                        pk_stall_names[i], pk_stats.stalls[i]);
+  }
+  if (bytes < len) bytes += snprintf(buf + bytes, len - bytes, "\n");
+  for (i = 0; i < PK_STATS_DDNS_MAX; i++) {
+    struct pk_ddns_stat* ds = pk_stats.ddns_domains + i;
+    if (ds->domain[0] && (bytes < len))
+      bytes += snprintf(buf + bytes, len - bytes,
+                        "ddns: %s result=%s latency_us=%u ok=%u failed=%u"
+                        " age_s=%ld\n",
+                        ds->domain, ds->result, ds->latency_us,
+                        ds->ok, ds->failed, (long) (pk_time() - ds->updated));
+  }
+  if (bytes < len)
+    bytes += snprintf(buf + bytes, len - bytes,
+                      "draining: tunnels=%u streams=%u started=%u"
+                      " finished=%u expired=%u streams_cut=%u\n",
+                      pk_stats.drain.tunnels, pk_stats.drain.streams,
+                      pk_stats.drain.started, pk_stats.drain.finished,
+                      pk_stats.drain.expired, pk_stats.drain.streams_cut);
+  if (bytes < len)
+    bytes += snprintf(buf + bytes, len - bytes, "canaries_dead: %u\n",
+                      pk_stats.canaries_dead);
+  if (reset) _pk_stats_reset();
+  pthread_mutex_unlock(&(pk_stats.lock));
+
+  if (bytes >= len) bytes = len - 1;
+  return bytes;
+}
+
+
+/* *** Tests *************************************************************** */
+
+int pkstats_test(void)
+{
+#if PK_TESTS
+  struct pk_histogram h;
+  char buffer[PK_STATS_TEXT_MAX];
+  int i;
+
+  /* Buckets must be contiguous and cover the full range */
+  assert(0 == pk_histogram_index(0));
+  assert(PK_HIST_BUCKETS - 1 == pk_histogram_index(0xffffffff));
+  for (i = 0; i < PK_HIST_BUCKETS - 1; i++) {
+    assert(i == pk_histogram_index(pk_histogram_bucket_max(i)));
+    assert(i + 1 == pk_histogram_index(pk_histogram_bucket_max(i) + 1));
+  }
+
+  /* Small values are exact */
+  pk_histogram_reset(&h);
+  for (i = 1; i <= 10; i++) pk_histogram_record(&h, i);
+  assert(10 == h.count);
+  assert(5 == pk_histogram_percentile(&h, 500));
+  assert(10 == pk_histogram_percentile(&h, 999));
+
+  /* Large values are within the advertised precision */
+  pk_histogram_reset(&h);
+  for (i = 1; i <= 1000; i++) pk_histogram_record(&h, 1000 * i);
+  assert(500000 <= pk_histogram_percentile(&h, 500));
+  assert(500000 + 500000/16 >= pk_histogram_percentile(&h, 500));
+  assert(999000 <= pk_histogram_percentile(&h, 999));
+  assert(1000000 >= pk_histogram_percentile(&h, 999));
+  assert(1000000 == h.max_us);
+
+  /* Rotation returns the old data and clears it */
+  struct pk_global_stats stats;
+  struct pk_global_stats* selected = pk_stats_current;
+  uint64_t default_flushes = pk_stats_default.flush.count;
+  pk_stats_init(&stats);
+  pk_stats_current = &stats;
+  pk_stats_record(&(pk_stats.flush), 123);
+  assert(0 < pk_stats_format(buffer, PK_STATS_TEXT_MAX, 1));
+  assert(NULL != strstr(buffer, "flush_us: n=1 avg=123 p50=123"));
+  pk_stats_format(buffer, PK_STATS_TEXT_MAX, 0);
+  assert(NULL != strstr(buffer, "flush_us: n=0 "));
+  assert(0 == pk_stats.flush.count);
+
+  pk_stats_stalled(PK_STALL_BE_READ);
+  pk_stats_format(buffer, PK_STATS_TEXT_MAX, 0);
+  assert(NULL != strstr(buffer, "stalls: loop=0 tunnel_read=0 "
+                                "tunnel_write=0 be_read=1 "));
+
+  /* DDNS results are per domain, and survive a reset */
+  pk_stats_ddns("a.example.com", "good", 1000, 1);
+  pk_stats_ddns("b.example.com", "badauth", 2000, 0);
+  pk_stats_ddns("a.example.com", "nochg", 3000, 1);
+  pk_stats_format(buffer, PK_STATS_TEXT_MAX, 1);
+  assert(NULL != strstr(buffer, "ddns: a.example.com result=nochg "
+                                "latency_us=3000 ok=2 failed=0"));
+  assert(NULL != strstr(buffer, "ddns: b.example.com result=badauth "
+                                "latency_us=2000 ok=0 failed=1"));
+  pk_stats_format(buffer, PK_STATS_TEXT_MAX, 0);
+  assert(NULL != strstr(buffer, "ddns: a.example.com result=nochg "
+                                "latency_us=3000 ok=0 failed=0"));
+
+  /* Draining progress is state, the drain outcomes are counters */
+  pk_stats_drain(2, 7, 2, 0, 0, 0);
+  pk_stats_drain(1, 3, 0, 0, 1, 3);
+  pk_stats_format(buffer, PK_STATS_TEXT_MAX, 1);
+  assert(NULL != strstr(buffer, "draining: tunnels=1 streams=3 started=2"
+                                " finished=0 expired=1 streams_cut=3\n"));
+  pk_stats_format(buffer, PK_STATS_TEXT_MAX, 0);
+  assert(NULL != strstr(buffer, "draining: tunnels=1 streams=3 started=0"
+                                " finished=0 expired=0 streams_cut=0\n"));
+
+  /* Dead canaries are counted, not fatal */
+  pk_stats_canaries(2);
+  pk_stats_format(buffer, PK_STATS_TEXT_MAX, 1);
+  assert(NULL != strstr(buffer, "canaries_dead: 2\n"));
+  pk_stats_format(buffer, PK_STATS_TEXT_MAX, 0);
+  assert(NULL != strstr(buffer, "canaries_dead: 0\n"));
+
+  /* None of the above touched anyone else's statistics */
+  pk_stats_free(&stats);
+  assert(pk_stats_current == &pk_stats_default);
+  pk_stats_current = selected;
+  assert(default_flushes == pk_stats_default.flush.count);
+#endif
+  return 1;
+}
@@ -0,0 +1,123 @@
+/******************************************************************************
+pkstats.h - Latency histograms and other run-time statistics.
+
+This file is Copyright 2011-2020, The Beanstalks Project ehf.
+
+This program is free software: you can redistribute it and/or modify it under
+the terms  of the  Apache  License 2.0  as published by the  Apache  Software
+Foundation.
+
+This program is distributed in the hope that it will be useful,  but  WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the Apache License for more details.
+
+You should have received a copy of the Apache License along with this program.
+If not, see: <http://www.apache.org/licenses/>
+
+Note: For alternate license terms, see the file COPYING.md.
+
+******************************************************************************/
+
+/* Histograms are log-linear (HDR-style): values below 2^SUB_BITS get a
+ * bucket each, above that every power-of-two range is split into
+ * 2^(SUB_BITS-1) equal buckets. With SUB_BITS=5 this keeps percentiles
+ * within ~6% over the full 32-bit range of microseconds (71 minutes) in
+ * 464 buckets, so recording is O(1) and needs no allocation. */
+#define PK_HIST_SUB_BITS      5
+#define PK_HIST_SUB_COUNT     (1 << PK_HIST_SUB_BITS)
+#define PK_HIST_HALF_COUNT    (1 << (PK_HIST_SUB_BITS - 1))
+#define PK_HIST_BUCKETS       (PK_HIST_SUB_COUNT + \
+                               (32 - PK_HIST_SUB_BITS) * PK_HIST_HALF_COUNT)
+#define PK_STATS_TEXT_MAX     8192
+#define PK_STATS_DDNS_MAX       16
+#define PK_STATS_DDNS_DOMAIN    64
+
+/* Event-loop stalls are counted by the callback (or phase) responsible. */
+typedef enum {
+  PK_STALL_LOOP,           /* Whole loop iteration, regardless of cause */
+  PK_STALL_TUNNEL_READ,
+  PK_STALL_TUNNEL_WRITE,
+  PK_STALL_BE_READ,
+  PK_STALL_BE_WRITE,
+  PK_STALL_RELAY,
+  PK_STALL_TICK,
+  PK_STALL_INTERRUPT,
+  PK_STALL_ACCEPT,
+  PK_STALL_CAUSES
+} pk_stall_t;
+
+struct pk_histogram {
+  uint64_t  count;
+  uint64_t  sum_us;
+  uint32_t  max_us;
+  uint32_t  buckets[PK_HIST_BUCKETS];
+};
+
+/* The outcome of the most recent dynamic DNS update, per domain. */
+struct pk_ddns_stat {
+  char      domain[PK_STATS_DDNS_DOMAIN+1];
+  char      result[16];
+  time_t    updated;
+  uint32_t  latency_us;
+  uint32_t  ok;
+  uint32_t  failed;
+};
+
+/* Tunnels being drained, see pkm_drain_tunnels. The first two are the
+ * current state, the rest count events. */
+struct pk_drain_stat {
+  uint32_t  tunnels;
+  uint32_t  streams;
+  uint32_t  started;
+  uint32_t  finished;
+  uint32_t  expired;
+  uint32_t  streams_cut;
+};
+
+struct pk_global_stats {
+  pthread_mutex_t      lock;
+  time_t               since;
+
+  /* Latencies, in microseconds */
+  struct pk_histogram  be_connect;     /* pkm_connect_be lookup+connect    */
+  struct pk_histogram  be_first_byte;  /* First chunk to first BE reply    */
+  struct pk_histogram  flush;          /* Time spent in pkc_flush          */
+  struct pk_histogram  tnl_blocked;    /* Stream time in TNL_BLOCKED state */
+  struct pk_histogram  loop_busy;      /* Loop time spent in callbacks    */
+  struct pk_histogram  ddns;           /* Dynamic DNS update requests     */
+
+  /* Event-loop stall counters */
+  unsigned int         stalls[PK_STALL_CAUSES];
+
+  /* Dynamic DNS, least recently updated domains are forgotten first */
+  struct pk_ddns_stat  ddns_domains[PK_STATS_DDNS_MAX];
+
+  /* Front-end rebalancing */
+  struct pk_drain_stat drain;
+
+  /* Memory canaries found overwritten, see PK_CHECK_MEMORY_CANARY */
+  unsigned int         canaries_dead;
+};
+
+/* Each manager keeps statistics of its own, selected per thread along
+ * with its state by pkm_select(), so managers never contend on one lock.
+ * Threads which have not selected a manager share the default. */
+extern struct pk_global_stats pk_stats_default;
+extern __thread struct pk_global_stats* pk_stats_current;
+#define pk_stats (*pk_stats_current)
+
+void     pk_histogram_reset(struct pk_histogram*);
+void     pk_histogram_record(struct pk_histogram*, uint64_t);
+uint32_t pk_histogram_percentile(struct pk_histogram*, int);
+
+void     pk_stats_init(struct pk_global_stats*);
+void     pk_stats_free(struct pk_global_stats*);
+void     pk_stats_reset();
+void     pk_stats_record(struct pk_histogram*, uint64_t);
+void     pk_stats_stalled(pk_stall_t);
+void     pk_stats_ddns(const char*, const char*, uint64_t, int);
+void     pk_stats_drain(int, int, int, int, int, int);
+void     pk_stats_canaries(int);
+int      pk_stats_format(char*, size_t, int);
+
+int pkstats_test(void);
@@ -47,6 +47,12 @@ char random_junk[32] = {
 static int use_clock_gettime = 1;
 #endif
 
+/* When nonzero, pk_time() and pk_time_us() report this instead of reading
+ * the clock, so a simulation (see bench_sim.c) can run the manager on
+ * virtual time. Condition variable timeouts (pk_gettime) are unaffected.
+ */
+uint64_t pk_virtual_time_us = 0;
+
 void better_srand(int allow_updates)
 {
   static int allow_srand = 0;
@@ -345,6 +351,7 @@ void pk_pthread_condattr_setclock(pthread_condattr_t* cond_attr) {
 
 time_t pk_time()
 {
+  if (pk_virtual_time_us) return (pk_virtual_time_us / 1000000) + 1;
 #if defined(HAVE_CLOCK_MONOTONIC) && defined(HAVE_PTHREAD_CONDATTR_SETCLOCK)
   struct timespec tp;
   if (use_clock_gettime) {
@@ -358,6 +365,14 @@ time_t pk_time()
   return time(0);
 }
 
+uint64_t pk_time_us()
+{
+  struct timespec tp;
+  if (pk_virtual_time_us) return pk_virtual_time_us;
+  pk_gettime(&tp);
+  return ((uint64_t) tp.tv_sec * 1000000) + (tp.tv_nsec / 1000);
+}
+
 int wait_fd(int fd, int timeout_ms)
 {
 #ifdef HAVE_POLL
@@ -498,13 +513,18 @@ int addrcmp(const struct sockaddr *a, const struct sockaddr *b)
   return 2;
 }
 
+#define HTTP_GET_REQUEST "GET /%s HTTP/1.1\r\nHost: %s\r\n\r\n"
 int http_get(const char* url, char* result_buffer, size_t maxlen)
 {
   char *urlparse, *hostname, *port, *path;
   struct addrinfo hints, *result, *rp;
-  char request[10240], *bp;
+  char *request, *bp;
   int sockfd, rlen, bytes, total_bytes;
 
+  /* The path and hostname come from the URL, so this always fits. */
+  rlen = strlen(url) + sizeof(HTTP_GET_REQUEST);
+  if (NULL == (request = malloc(rlen))) return -1;
+
   /* http://hostname:port/foo */
   urlparse = strdup(url);
   hostname = urlparse+7;
@@ -523,13 +543,7 @@ int http_get(const char* url, char* result_buffer, size_t maxlen)
     *path++ = '\0';
   }
 
-  rlen = snprintf(request, 10240,
-                  "GET /%s HTTP/1.1\r\nHost: %s\r\n\r\n", path, hostname);
-  if (10240 == rlen)
-  {
-    free(urlparse);
-    return -1;
-  }
+  rlen = snprintf(request, rlen, HTTP_GET_REQUEST, path, hostname);
 
   total_bytes = 0;
   memset(&hints, 0, sizeof(struct addrinfo));
@@ -561,6 +575,7 @@ int http_get(const char* url, char* result_buffer, size_t maxlen)
     }
     freeaddrinfo(result);
   }
+  free(request);
   free(urlparse);
   return total_bytes;
 }
@@ -669,7 +684,8 @@ void pk_rlock_unlock(pk_rlock_t* rlock)
 #define MAX_CANARIES 102400
 void** canaries[MAX_CANARIES];
 int canary_max = 0;
-pthread_mutex_t canary_lock;
+int canary_next = 0;
+pthread_mutex_t canary_lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 void remove_memory_canary(void** canary) {
@@ -691,6 +707,24 @@ void remove_memory_canary(void** canary) {
     (void) canary;
 }
 
+/* Forget all canaries within [start, end), before that memory is freed. */
+void remove_memory_canaries(void* start, void* end) {
+#if PK_MEMORY_CANARIES
+    pthread_mutex_lock(&canary_lock);
+    for (int i = 0; i < canary_max; ) {
+        if (((void*) canaries[i] >= start) && ((void*) canaries[i] < end)) {
+            canaries[i] = canaries[--canary_max];
+        }
+        else {
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&canary_lock);
+#endif
+    (void) start;
+    (void) end;
+}
+
 void add_memory_canary(void** canary) {
 #if PK_MEMORY_CANARIES
     if (*canary && (*canary == canary)) {
@@ -705,6 +739,36 @@ void add_memory_canary(void** canary) {
     (void) canary;
 }
 
+int check_memory_canary(void** canary) {
+#if PK_MEMORY_CANARIES
+    if (canary != *canary) {
+        fprintf(stderr, "%p != %p\n", (void *) canary, *canary);
+        return 1;
+    }
+#endif
+    (void) canary;
+    return 0;
+}
+
+/* Check the next few canaries, picking up where the last call left off,
+ * so the whole set gets covered over a number of loop iterations. */
+int sample_memory_canaries(int count) {
+#if PK_MEMORY_CANARIES
+    int bad = 0;
+    pthread_mutex_lock(&canary_lock);
+    if (count > canary_max) count = canary_max;
+    while (count-- > 0) {
+        if (canary_next >= canary_max) canary_next = 0;
+        bad += check_memory_canary(canaries[canary_next++]);
+    }
+    pthread_mutex_unlock(&canary_lock);
+    return bad;
+#else
+    (void) count;
+    return 0;
+#endif
+}
+
 int check_memory_canaries() {
 #if PK_MEMORY_CANARIES
     int i, bad;
@@ -732,9 +796,8 @@ void reset_memory_canaries() {
 }
 
 void init_memory_canaries() {
-#if PK_MEMORY_CANARIES
-    pthread_mutex_init(&canary_lock, NULL);
-#endif
+    /* Every manager calls this, but there is only the one set, and its
+     * lock is statically initialized. */
 }
 
 
@@ -781,11 +844,15 @@ int utils_test(void)
 
 #if PK_MEMORY_CANARIES
   add_memory_canary(&canary);
-  PK_CHECK_MEMORY_CANARIES;
+  assert(check_memory_canaries() == 0);
   canary = (void*) 0;
   assert(check_memory_canaries() == 1);
+  assert(check_memory_canary(&canary) == 1);
+  assert(sample_memory_canaries(canary_max) == 1);
   canary = &canary;
-  remove_memory_canary(&canary);
+  assert(sample_memory_canaries(canary_max + 1) == 0);
+  remove_memory_canaries(&canary, &canary + 1);
+  assert(check_memory_canaries() == 0);
 #endif
 #endif
   return 1;
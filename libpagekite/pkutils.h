@@ -29,6 +29,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #define PK_RANDOM_RESEED_SRAND  1
 
 extern char random_junk[];
+extern uint64_t pk_virtual_time_us;
 
 void better_srand(int);
 int32_t murmur3_32(const uint8_t* key, size_t len);
@@ -44,6 +45,7 @@ int set_non_blocking(int);
 int set_blocking(int);
 void sleep_ms(int);
 time_t pk_time();
+uint64_t pk_time_us();
 void pk_gettime(struct timespec*);
 void pk_pthread_condattr_setclock(pthread_condattr_t*);
 int wait_fd(int, int);
@@ -60,22 +62,44 @@ void pk_rlock_init(pk_rlock_t*);
 void pk_rlock_lock(pk_rlock_t*);
 void pk_rlock_unlock(pk_rlock_t*);
 
+/* Memory canaries: PK_CHECK_MEMORY_CANARIES checks every canary there is,
+ * which is too slow for production. In sampled mode it does nothing, and
+ * instead each loop iteration checks a few (PK_SAMPLE_MEMORY_CANARIES, in
+ * round-robin order), and callbacks check the objects they just touched
+ * (PK_CHECK_MEMORY_CANARY). Dead canaries are logged and counted by
+ * pk_log_dead_canaries (see pklogging.h), which only aborts in full mode. */
 #if PK_MEMORY_CANARIES
 # define PK_MEMORY_CANARY           void* canary;
 # define PK_INIT_MEMORY_CANARIES    init_memory_canaries();
 # define PK_RESET_MEMORY_CANARIES   reset_memory_canaries();
-# define PK_CHECK_MEMORY_CANARIES   assert(0 == check_memory_canaries());
 # define PK_ADD_MEMORY_CANARY(s)    add_memory_canary(&((s)->canary));
+# define PK_CHECK_MEMORY_CANARY(s)  \
+           pk_log_dead_canaries(check_memory_canary(&((s)->canary)));
+# if PK_MEMORY_CANARIES_SAMPLED
+#  define PK_CHECK_MEMORY_CANARIES  /* Sampled instead */
+#  define PK_SAMPLE_MEMORY_CANARIES \
+           pk_log_dead_canaries(sample_memory_canaries( \
+                                  PK_MEMORY_CANARY_SAMPLES));
+# else
+#  define PK_CHECK_MEMORY_CANARIES  \
+           pk_log_dead_canaries(check_memory_canaries());
+#  define PK_SAMPLE_MEMORY_CANARIES /* Checking them all anyway */
+# endif
 #else
-# define PK_MEMORY_CANARY         /* No canaries */
-# define PK_INIT_MEMORY_CANARIES  /* No canaries */
-# define PK_RESET_MEMORY_CANARIES /* No canaries */
-# define PK_CHECK_MEMORY_CANARIES /* No canaries */
-# define PK_ADD_MEMORY_CANARY(s)  /* No canaries */
+# define PK_MEMORY_CANARY          /* No canaries */
+# define PK_INIT_MEMORY_CANARIES   /* No canaries */
+# define PK_RESET_MEMORY_CANARIES  /* No canaries */
+# define PK_ADD_MEMORY_CANARY(s)   /* No canaries */
+# define PK_CHECK_MEMORY_CANARY(s) /* No canaries */
+# define PK_CHECK_MEMORY_CANARIES  /* No canaries */
+# define PK_SAMPLE_MEMORY_CANARIES /* No canaries */
 #endif
 void add_memory_canary(void**);
 void remove_memory_canary(void**);
+void remove_memory_canaries(void*, void*);
+int check_memory_canary(void**);
 int check_memory_canaries();
+int sample_memory_canaries(int);
 void reset_memory_canaries();
 void init_memory_canaries();
 
@@ -29,6 +29,7 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pkstate.h"
 #include "pkproto.h"
 #include "pkblocker.h"
+#include "pkstats.h"
 #include "pkmanager.h"
 #include "pklogging.h"
 
@@ -42,12 +43,44 @@ void pkw_pet_watchdog()
      pk_global_watchdog_ticker = pk_time();
 }
 
+/* Report (once) if the event loop has been stuck in a single iteration
+ * for longer than the stall threshold, while it is still stuck. This
+ * catches stalls which never return, and so are never reported by the
+ * loop itself. */
+static int pkw_check_stall(struct pk_manager* pkm, int reported)
+{
+  uint64_t woke_us;
+  uint64_t limit_us = 1000 * (uint64_t) pkm->stall_threshold_ms;
+  const char* cb_name;
+  int cb_fd;
+
+  /* A 64-bit read may tear on 32-bit CPUs, so take the lock. */
+  pthread_mutex_lock(&(pkm->stall_lock));
+  woke_us = pkm->loop_woke_us;
+  cb_name = pkm->loop_cb_name;
+  cb_fd = pkm->loop_cb_fd;
+  pthread_mutex_unlock(&(pkm->stall_lock));
+
+  if (!woke_us || !pkm->stall_threshold_ms) return 0;
+  if (limit_us < 1000000) limit_us = 1000000;
+  if (pk_time_us() - woke_us < limit_us) return 0;
+
+  if (!reported) {
+    pk_log(PK_LOG_MANAGER_ERROR,
+           "Watchdog: Event loop stalled in %s (fd=%d) for %dms",
+           cb_name ? cb_name : "(unknown)", cb_fd,
+           (int) ((pk_time_us() - woke_us) / 1000));
+  }
+  return 1;
+}
+
 void* pkw_run_watchdog(void *void_pkm)
 {
   int i;
+  int stalled = 0;
   int *segfaulter;
   time_t last_ticker = 0xDEADBEEF;
-  struct pk_manager* pkm = (struct pk_manager*) void_pkm;
+  struct pk_manager* pkm = pkm_select((struct pk_manager*) void_pkm);
   pk_log(PK_LOG_MANAGER_DEBUG, "Started watchdog thread.");
 
   segfaulter = (int*) 1;
@@ -61,6 +94,7 @@ void* pkw_run_watchdog(void *void_pkm)
     last_ticker = pk_global_watchdog_ticker;
     for (i = 0; i < (pkm->housekeeping_interval_max * 2); i++) {
       if (pk_global_watchdog_ticker < 0) return NULL;
+      stalled = pkw_check_stall(pkm, stalled);
       sleep(1);
     }
   }
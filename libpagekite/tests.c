@@ -28,20 +28,21 @@ Note: For alternate license terms, see the file COPYING.md.
 #include "pkhooks.h"
 #include "pkconn.h"
 #include "pkstate.h"
+#include "pkstats.h"
 #include "pkproto.h"
 #include "pkblocker.h"
 #include "pkmanager.h"
 #include "pklogging.h"
 #include "pkwatchdog.h"
+#include "pkcapture.h"
 #if HAVE_RELAY
 #include "pkrelay.h"
 #endif
 
-struct pk_global_state pk_state;
-
 int utils_test();
 int pke_events_test();
 int pkproto_test();
+int pkstats_test();
 int pkmanager_test();
 
 int main(void) {
@@ -62,7 +63,9 @@ int main(void) {
   assert(utils_test());      fprintf(stderr, "utils test passed\n");
   assert(pke_events_test()); fprintf(stderr, "events test passed\n");
   assert(pkproto_test());    fprintf(stderr, "pkproto test passed\n");
+  assert(pkstats_test());    fprintf(stderr, "pkstats test passed\n");
   assert(pkmanager_test());  fprintf(stderr, "pkmanager test passed\n");
+  assert(pkcapture_test());  fprintf(stderr, "pkcapture test passed\n");
 # if HAVE_RELAY
   assert(pkrelay_test());    fprintf(stderr, "pkrelay test passed\n");
 # endif
@@ -73,6 +73,10 @@ def java_ret_type(ret_type):
         raise ValueError('Unknown return value type: %s' % ret_type)
 
 
+def is_buffer(var_type):
+    return var_type.replace(' ', '') == 'void*'
+
+
 def java_name(func_name):
     return re.sub('_([a-z])',
                   lambda s: s.group(0)[1].upper(),
@@ -81,6 +85,8 @@ def java_name(func_name):
 
 def java_arg(arg):
     var_type, var_name = uncomment(arg).rsplit(' ', 1)
+    if is_buffer(var_type):
+        return 'java.nio.ByteBuffer %s' % var_name
     return '%s %s' % (java_ret_type(var_type), var_name)
 
 
@@ -134,6 +140,8 @@ def jni_ret_type(ret_type):
 
 def jni_arg(arg):
     var_type, var_name = uncomment(arg).rsplit(' ', 1)
+    if is_buffer(var_type):
+        return 'jobject j%s' % var_name
     return '%s j%s' % (jni_ret_type(var_type), var_name)
 
 
@@ -167,12 +175,32 @@ def jni_func(ret_type, func_name, args):
                  % jni_fail(ret_type)]
     func += ['']
 
-    clnp = []
+    # Buffers must be direct ByteBuffers, so Java and C share the memory
+    # and nothing is copied or allocated per call. A `length` following
+    # a buffer is clamped to its capacity.
+    clnp, buf = [], None
     for arg in args:
         lspec = arg.replace('const ', '')
         lvar = lspec.split()[-1];
         jvar = jni_arg(arg).split()[-1]
-        if lspec.replace(' ', '').startswith('char*'):
+        if is_buffer(lspec.rsplit(' ', 1)[0]):
+            buf = lvar
+            func += ['  void* %s = NULL;' % lvar,
+                     '  jlong %s_capacity = 0;' % lvar,
+                     '  if (%s != NULL) {' % jvar,
+                     '    %s = (*env)->GetDirectBufferAddress(env, %s);'
+                     % (lvar, jvar),
+                     '    %s_capacity ='
+                     ' (*env)->GetDirectBufferCapacity(env, %s);'
+                     % (lvar, jvar),
+                     '  }',
+                     '  if (%s == NULL) return %s;'
+                     % (lvar, jni_fail(ret_type))]
+        elif buf and lvar == 'length':
+            func += ['  %s = %s;' % (lspec, jvar),
+                     '  if (%s > %s_capacity) %s = %s_capacity;'
+                     % (lvar, buf, lvar, buf)]
+        elif lspec.replace(' ', '').startswith('char*'):
             func += ['  const jbyte* %s = NULL;' % lvar,
                      '  if (%s != NULL)'
                      ' %s = (*env)->GetStringUTFChars(env, %s, NULL);'
@@ -293,6 +321,8 @@ def python_name(func_name):
 def python_arg_type(arg):
     if ' ' in arg:
         arg = arg.rsplit(' ', 1)[0]
+    if is_buffer(arg):
+        return 'c_void_p'
     return python_ret_type(arg)
 
 
@@ -334,7 +364,10 @@ def python_code(constants, functions):
             arg_types = [python_arg_type(a) for a in (args or [])]
             arg_names = [a.split()[-1] for a in (args or [])]
             def _arg(i):
-                if arg_types[i] == 'c_char_p':
+                if is_buffer(args[i].rsplit(' ', 1)[0]):
+                    # ctypes passes create_string_buffer() arrays as-is
+                    return arg_names[i]
+                elif arg_types[i] == 'c_char_p':
                     return 'c_char_p(%s.encode("utf-8"))' % arg_names[i]
                 else:
                     return '%s(%s)' % (arg_types[i], arg_names[i])